@@ -0,0 +1,88 @@
+/**
+ * @file bytescan_bench.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Throughput benchmark of the byte scanner
+ *
+ * Scans a synthetic response stream for line ends, and a list heavy stream (FLAGS, ENVELOPE)
+ * for the structural bytes of the parser, and prints bytes per second of every implementation
+ * the CPU supports next to memchr. Their correctness is checked by the unit tests.
+ *
+ * Usage: bytescan [total_MB]
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "../src/bytescan.hpp"
+
+
+/**
+ * @brief Counts occurrences of the set in the stream, the whole stream is scanned until total bytes are done
+ */
+template <typename F>
+static void run(const std::string &name, const std::string &stream, unsigned long long total, F find) {
+    unsigned long long hits = 0;
+    unsigned long long done = 0;
+    auto begin = std::chrono::steady_clock::now();
+
+    while (done < total) {
+        const char *p = stream.data();
+        const char *end = stream.data() + stream.size();
+        while ((p = find(p, end)) != end) {
+            hits++;
+            p++;
+        }
+        done += stream.size();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "  " << name << ": " << done / secs / (1024 * 1024 * 1024) << " GB/s (" << hits << " hits)" << std::endl;
+}
+
+
+int main(int argc, char *argv[]) {
+    unsigned long long total = (argc > 1 ? std::stoull(argv[1]) : 4096) * 1024 * 1024;
+
+    std::cout << "CPU supports " << ByteScan::levelName(ByteScan::supported()) << std::endl;
+
+    // message text with lines of typical length
+    std::string text;
+    while (text.size() < 1024 * 1024) {
+        text += "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.\r\n";
+    }
+
+    // flag updates and envelopes, short runs between structural bytes
+    std::string lists;
+    while (lists.size() < 1024 * 1024) {
+        lists += "* 12 FETCH (UID 40 FLAGS (\\Seen \\Answered $Label1) ENVELOPE (\"Mon, 1 Jan 2024 10:00:00 +0000\" "
+                 "\"Subject of the message\" ((\"Jane Doe\" NIL \"jane\" \"example.com\")) NIL NIL NIL NIL NIL NIL "
+                 "\"<40@example.com>\"))\r\n";
+    }
+
+    std::cout << "Line ends in message text:" << std::endl;
+    run("memchr", text, total, [](const char *p, const char *end) {
+        const char *lf = static_cast<const char *>(memchr(p, '\n', end - p));
+        return lf != nullptr ? lf : end;
+    });
+    for (auto level : {ByteScan::Level::SCALAR, ByteScan::Level::SSE2, ByteScan::Level::AVX2}) {
+        if (level <= ByteScan::supported()) {
+            run(ByteScan::levelName(level), text, total, [level](const char *p, const char *end) {
+                return ByteScan::findAny(level, p, end, "\n");
+            });
+        }
+    }
+
+    std::cout << "Structural bytes of lists:" << std::endl;
+    for (auto level : {ByteScan::Level::SCALAR, ByteScan::Level::SSE2, ByteScan::Level::AVX2}) {
+        if (level <= ByteScan::supported()) {
+            run(ByteScan::levelName(level), lists, total / 4, [level](const char *p, const char *end) {
+                return ByteScan::findAny(level, p, end, "\"{()\r\n");
+            });
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,725 @@
+/**
+ * @file imap_bench.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief End-to-end benchmark of imapcl against a local IMAP server
+ *
+ * Serves a synthetic mailbox on 127.0.0.1, plain or with TLS and a self-signed certificate
+ * generated at start, runs imapcl against it into a temporary directory and prints messages
+ * and megabytes per second, peak RSS of the client and time spent in each phase of the session.
+ *
+ * Responses are held back by the injected latency counted from the arrival of the command,
+ * so commands sent without waiting for the previous ones overlap like on a real link.
+ *
+ * Usage: imap [--messages N] [--size BYTES] [--dist fixed|uniform|lognormal] [--latency MS]
+ *             [--tls] [--client PATH] [--serve PORT] [--compare] [-- client options]
+ *
+ * With --serve the server runs until killed and the client is not started, user and password
+ * are not checked. With --compare the client runs a second time with -j 1 added and the
+ * throughput and the time to the first message are compared with that single stream.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "openssl/ssl.h"
+#include "openssl/x509v3.h"
+
+#define QUEUE_LIMIT (64 * 1024 * 1024)  // bytes of responses held back before commands are not read
+#define READ_CHUNK 65536
+
+using Clock = std::chrono::steady_clock;
+
+
+/**
+ * @brief Parameters of the benchmark
+ */
+struct BenchConfig {
+    unsigned long messages = 1000;
+    std::size_t size = 16384;           // mean message size in bytes
+    std::string dist = "fixed";
+    unsigned int latency = 0;           // milliseconds added to every response
+    bool tls = false;
+    std::string client = "./imapcl";
+    int serve = -1;                     // port of the standalone server, -1 to run the client
+    bool compare = false;               // run the client again over a single connection
+    std::vector<std::string> client_args;
+};
+
+
+enum Phase { CONNECT, LOGIN, SELECT, SEARCH, FETCH, LOGOUT, OTHER, PHASES };
+static const char *phase_names[PHASES] = {"connect", "login", "select", "search", "fetch", "logout", "other"};
+
+
+/**
+ * @brief Commands of one phase over all connections
+ */
+struct PhaseStats {
+    Clock::time_point first = Clock::time_point::max();    // arrival of the first command
+    Clock::time_point last = Clock::time_point::min();     // completion of the last command
+    unsigned long commands = 0;
+    double total_ms = 0;    // sum of arrival to completion of the commands
+};
+
+
+/**
+ * @brief Synthetic mailbox and counters shared by all connections
+ */
+struct Server {
+    std::vector<std::size_t> sizes;     // message sizes, UID is the index + 1
+    std::string filler;                 // text the message bodies are cut from
+    unsigned int latency;
+    SSL_CTX *ctx = nullptr;
+
+    std::mutex mutex;
+    PhaseStats phases[PHASES];
+    std::atomic<unsigned long long> messages{0};    // message literals sent
+    std::atomic<unsigned long long> bytes{0};       // bytes of the literals
+    Clock::time_point first_message = Clock::time_point::max(); // first message literal sent
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (PhaseStats &p : this->phases) {
+            p = PhaseStats{};
+        }
+        this->messages = 0;
+        this->bytes = 0;
+        this->first_message = Clock::time_point::max();
+    }
+
+    void record(Phase phase, Clock::time_point arrival, Clock::time_point done) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        PhaseStats &p = this->phases[phase];
+        p.first = std::min(p.first, arrival);
+        p.last = std::max(p.last, done);
+        p.commands++;
+        p.total_ms += std::chrono::duration<double, std::milli>(done - arrival).count();
+    }
+};
+
+
+/**
+ * @brief Response data waiting for its time
+ */
+struct Pending {
+    Clock::time_point due;
+    std::string data;
+    Phase phase;
+    Clock::time_point arrival;
+    bool last;          // completes the command, its latency is recorded when sent
+    bool message;       // carries the start of a message literal
+};
+
+
+/**
+ * @brief One client connection, served by its own thread
+ */
+class Connection {
+public:
+    Connection(Server &server, int fd) : server{server}, fd{fd} {}
+
+    ~Connection() {
+        if (this->ssl != nullptr) {
+            SSL_free(this->ssl);
+        }
+        close(this->fd);
+    }
+
+    void serve() {
+        Clock::time_point accepted = Clock::now();
+        if (this->server.ctx != nullptr) {
+            this->ssl = SSL_new(this->server.ctx);
+            SSL_set_fd(this->ssl, this->fd);
+            if (SSL_accept(this->ssl) <= 0) {
+                return;
+            }
+        }
+        this->queue(accepted, CONNECT, "* OK IMAP4rev1 benchmark server ready\r\n", true);
+
+        std::string line;
+        while (true) {
+            while (this->queued < QUEUE_LIMIT && this->nextLine(line)) {
+                this->handle(line);
+            }
+            if (!this->flush()) {
+                return;
+            }
+            if (this->closing && this->responses.empty()) {
+                return;
+            }
+
+            int timeout = -1;
+            if (!this->responses.empty()) {
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(this->responses.front().due - Clock::now());
+                timeout = std::max<int>(0, wait.count());
+            }
+
+            // too much is held back, only sending continues
+            if (this->queued >= QUEUE_LIMIT) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+                continue;
+            }
+
+            bool readable = this->ssl != nullptr && SSL_pending(this->ssl) > 0;
+            if (!readable) {
+                pollfd pfd{this->fd, POLLIN, 0};
+                readable = poll(&pfd, 1, timeout) > 0;
+            }
+            if (readable && !this->fill()) {
+                return;
+            }
+        }
+    }
+
+private:
+    Server &server;
+    int fd;
+    SSL *ssl = nullptr;
+    std::string in;                 // received data not processed yet
+    std::deque<Pending> responses;  // responses not sent yet, in order
+    std::size_t queued = 0;         // bytes in responses
+    std::string idle_tag;           // tag of the running IDLE command
+    Clock::time_point idle_arrival;
+    bool closing = false;
+
+
+    bool fill() {
+        char buf[READ_CHUNK];
+        int n = this->ssl != nullptr ? SSL_read(this->ssl, buf, sizeof(buf)) : read(this->fd, buf, sizeof(buf));
+        if (n <= 0) {
+            return false;
+        }
+        this->in.append(buf, n);
+        return true;
+    }
+
+    bool nextLine(std::string &line) {
+        std::size_t end = this->in.find("\r\n");
+        if (end == std::string::npos) {
+            return false;
+        }
+        line = this->in.substr(0, end);
+        this->in.erase(0, end + 2);
+        return true;
+    }
+
+    bool send(const std::string &data) {
+        std::size_t done = 0;
+        while (done < data.size()) {
+            int n = this->ssl != nullptr ? SSL_write(this->ssl, data.data() + done, data.size() - done)
+                                         : write(this->fd, data.data() + done, data.size() - done);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    // sends the responses whose time has come
+    bool flush() {
+        while (!this->responses.empty() && this->responses.front().due <= Clock::now()) {
+            Pending &p = this->responses.front();
+            if (!this->send(p.data)) {
+                return false;
+            }
+            if (p.last) {
+                this->server.record(p.phase, p.arrival, Clock::now());
+            }
+            if (p.message) {
+                std::lock_guard<std::mutex> lock(this->server.mutex);
+                this->server.first_message = std::min(this->server.first_message, Clock::now());
+            }
+            this->queued -= p.data.size();
+            this->responses.pop_front();
+        }
+        return true;
+    }
+
+    void queue(Clock::time_point arrival, Phase phase, std::string data, bool last, bool message = false) {
+        this->queued += data.size();
+        this->responses.push_back(Pending{arrival + std::chrono::milliseconds(this->server.latency),
+                                          std::move(data), phase, arrival, last, message});
+    }
+
+    // UIDs of a sequence-set within the mailbox, '*' is the highest UID
+    std::vector<unsigned long> parseSet(const std::string &set) const {
+        unsigned long max = this->server.sizes.size();
+        auto value = [max](const std::string &s) { return s == "*" ? max : std::stoul(s); };
+
+        std::vector<unsigned long> uids;
+        std::istringstream iss{set};
+        std::string part;
+        while (std::getline(iss, part, ',')) {
+            std::size_t colon = part.find(':');
+            unsigned long a = value(part.substr(0, colon));
+            unsigned long b = colon == std::string::npos ? a : value(part.substr(colon + 1));
+            if (a > b) {
+                std::swap(a, b);
+            }
+            for (unsigned long uid = std::max(a, 1UL); uid <= std::min(b, max); uid++) {
+                uids.push_back(uid);
+            }
+        }
+        return uids;
+    }
+
+    static std::string headers(unsigned long uid) {
+        return "From: Benchmark <bench@localhost>\r\nTo: Client <client@localhost>\r\n"
+               "Subject: Message " + std::to_string(uid) + "\r\nMessage-ID: <" + std::to_string(uid)
+               + "@localhost>\r\nDate: Mon, 1 Jan 2024 00:00:00 +0000\r\n\r\n";
+    }
+
+    // RFC822.SIZE without building the message
+    std::size_t messageSize(unsigned long uid) const {
+        return std::max(this->server.sizes[uid - 1], headers(uid).size());
+    }
+
+    std::string message(unsigned long uid, bool headers_only) const {
+        std::string headers = this->headers(uid);
+        if (headers_only) {
+            return headers;
+        }
+        std::size_t size = this->messageSize(uid);
+        std::size_t offset = (uid * 7919) % (this->server.filler.size() / 2);
+        return headers + this->server.filler.substr(offset, size - headers.size());
+    }
+
+    void handle(const std::string &line) {
+        Clock::time_point arrival = Clock::now();
+
+        if (!this->idle_tag.empty()) {
+            if (line == "DONE") {
+                this->queue(this->idle_arrival, OTHER, this->idle_tag + " OK IDLE terminated\r\n", true);
+                this->idle_tag.clear();
+            }
+            return;
+        }
+
+        std::istringstream iss{line};
+        std::string tag, command;
+        iss >> tag >> command;
+        std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+        if (command == "UID") {
+            iss >> command;
+            std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+            command = "UID " + command;
+        }
+        std::string rest;
+        std::getline(iss >> std::ws, rest);
+
+        if (command == "LOGIN") {
+            this->queue(arrival, LOGIN, tag + " OK LOGIN completed\r\n", true);
+        }
+        else if (command == "CAPABILITY") {
+            this->queue(arrival, LOGIN, "* CAPABILITY IMAP4rev1 IDLE ESEARCH\r\n" + tag + " OK CAPABILITY completed\r\n", true);
+        }
+        else if (command == "ENABLE") {
+            this->queue(arrival, LOGIN, "* ENABLED\r\n" + tag + " OK ENABLE completed\r\n", true);
+        }
+        else if (command == "SELECT" || command == "EXAMINE") {
+            std::size_t n = this->server.sizes.size();
+            this->queue(arrival, SELECT, "* " + std::to_string(n) + " EXISTS\r\n* 0 RECENT\r\n"
+                        "* OK [UIDVALIDITY 1] UIDs valid\r\n* OK [UIDNEXT " + std::to_string(n + 1) + "] Predicted next UID\r\n"
+                        "* FLAGS (\\Seen \\Answered \\Flagged \\Deleted \\Draft)\r\n"
+                        + tag + " OK [READ-WRITE] " + command + " completed\r\n", true);
+        }
+        else if (command == "LIST") {
+            this->queue(arrival, OTHER, "* LIST () \"/\" \"INBOX\"\r\n" + tag + " OK LIST completed\r\n", true);
+        }
+        else if (command == "UID SEARCH") {
+            // every message counts as new, UID limits the result to the given set
+            std::istringstream args{rest};
+            std::string key, set = "1:*";
+            bool extended = false;
+            while (args >> key) {
+                std::transform(key.begin(), key.end(), key.begin(), ::toupper);
+                if (key == "UID") {
+                    args >> set;
+                }
+                else if (key == "RETURN") {
+                    extended = true;
+                }
+            }
+            std::vector<unsigned long> uids = this->parseSet(set);
+
+            // RETURN (ALL) of ESEARCH (RFC 4731) gives the result as a sequence-set
+            std::string result = extended ? "* ESEARCH (TAG \"" + tag + "\") UID" : "* SEARCH";
+            for (std::size_t i = 0; i < uids.size(); i++) {
+                if (!extended) {
+                    result += " " + std::to_string(uids[i]);
+                    continue;
+                }
+                std::size_t j = i;
+                while (j + 1 < uids.size() && uids[j + 1] == uids[j] + 1) {
+                    j++;
+                }
+                result += (i == 0 ? " ALL " : ",") + std::to_string(uids[i]) + (j > i ? ":" + std::to_string(uids[j]) : "");
+                i = j;
+            }
+            this->queue(arrival, SEARCH, result + "\r\n" + tag + " OK SEARCH completed\r\n", true);
+        }
+        else if (command == "UID FETCH") {
+            std::string set = rest.substr(0, rest.find(' '));
+            std::string items = rest.substr(set.size());
+            std::transform(items.begin(), items.end(), items.begin(), ::toupper);
+            bool body = items.find("BODY") != std::string::npos;
+            bool headers_only = items.find("[HEADER]") != std::string::npos;
+            bool size = items.find("RFC822.SIZE") != std::string::npos;
+
+            // partial fetch BODY[]<origin.length> of a message fetched in parts
+            std::size_t origin = 0, length = std::string::npos;
+            std::size_t partial = items.find("]<");
+            if (partial != std::string::npos) {
+                std::istringstream range{items.substr(partial + 2)};
+                char dot;
+                range >> origin >> dot >> length;
+            }
+
+            for (unsigned long uid : this->parseSet(set)) {
+                std::string id = std::to_string(uid);
+                if (!body) {
+                    std::string item = size ? " RFC822.SIZE " + std::to_string(this->messageSize(uid)) : " FLAGS (\\Seen)";
+                    this->queue(arrival, FETCH, "* " + id + " FETCH (UID " + id + item + ")\r\n", false);
+                    continue;
+                }
+                std::string data = this->message(uid, headers_only);
+                std::string head = "* " + id + " FETCH (UID " + id;
+                if (size) {
+                    head += " RFC822.SIZE " + std::to_string(data.size());
+                }
+                head += headers_only ? " BODY[HEADER]" : " BODY[]";
+                if (partial != std::string::npos) {
+                    head += "<" + std::to_string(origin) + ">";
+                    data = origin < data.size() ? data.substr(origin, length) : "";
+                }
+                if (origin == 0) {
+                    this->server.messages++;
+                }
+                this->server.bytes += data.size();
+                this->queue(arrival, FETCH, head + " {" + std::to_string(data.size()) + "}\r\n" + data + ")\r\n", false, origin == 0);
+            }
+            this->queue(arrival, FETCH, tag + " OK FETCH completed\r\n", true);
+        }
+        else if (command == "IDLE") {
+            this->idle_tag = tag;
+            this->idle_arrival = arrival;
+            this->queue(arrival, OTHER, "+ idling\r\n", false);
+        }
+        else if (command == "NOOP" || command == "CHECK") {
+            this->queue(arrival, OTHER, tag + " OK " + command + " completed\r\n", true);
+        }
+        else if (command == "LOGOUT") {
+            this->queue(arrival, LOGOUT, "* BYE logging out\r\n" + tag + " OK LOGOUT completed\r\n", true);
+            this->closing = true;
+        }
+        else {
+            this->queue(arrival, OTHER, tag + " BAD " + command + " is not supported\r\n", true);
+        }
+    }
+};
+
+
+/**
+ * @brief Generates a self-signed certificate and returns the server context using it
+ *
+ * @param certdir directory the certificate is written to, named by its hash for -C of imapcl
+ */
+static SSL_CTX *createServerContext(const std::string &certdir) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    X509V3_CTX v3;
+    X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &v3, NID_basic_constraints, "critical,CA:TRUE");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    X509_sign(cert, key, EVP_sha256());
+
+    char hash[16];
+    std::snprintf(hash, sizeof(hash), "%08lx.0", X509_subject_name_hash(cert));
+    FILE *f = fopen((certdir + "/" + hash).c_str(), "w");
+    if (f != nullptr) {
+        PEM_write_X509(f, cert);
+        fclose(f);
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(ctx, cert);
+    SSL_CTX_use_PrivateKey(ctx, key);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+}
+
+
+/**
+ * @brief Draws message sizes of the given distribution with a fixed seed, so runs are comparable
+ */
+static std::vector<std::size_t> makeSizes(const BenchConfig &config) {
+    std::mt19937_64 rng{42};
+    std::uniform_int_distribution<std::size_t> uniform(config.size / 10, config.size * 19 / 10);
+    // log-normal with a long tail of large messages, scaled to the requested mean
+    double sigma = 1.0;
+    std::lognormal_distribution<double> lognormal(std::log(static_cast<double>(config.size)) - sigma * sigma / 2, sigma);
+
+    std::vector<std::size_t> sizes;
+    for (unsigned long i = 0; i < config.messages; i++) {
+        if (config.dist == "uniform") {
+            sizes.push_back(uniform(rng));
+        }
+        else if (config.dist == "lognormal") {
+            sizes.push_back(static_cast<std::size_t>(lognormal(rng)));
+        }
+        else {
+            sizes.push_back(config.size);
+        }
+    }
+    return sizes;
+}
+
+
+/**
+ * @brief Accepts connections until the listening socket is shut down
+ */
+static void acceptLoop(Server &server, int listen_fd) {
+    std::vector<std::thread> threads;
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            break;
+        }
+        threads.emplace_back([&server, fd]() {
+            Connection conn(server, fd);
+            conn.serve();
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+
+/**
+ * @brief Runs the client and waits for it
+ *
+ * @return exit status, peak RSS in kB is stored to maxrss
+ */
+static int runClient(const std::vector<std::string> &args, long &maxrss) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<char *> argv;
+        for (const std::string &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        std::perror("Cannot run the client");
+        _exit(127);
+    }
+
+    int status = 0;
+    rusage usage{};
+    wait4(pid, &status, 0, &usage);
+    maxrss = usage.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+
+/**
+ * @brief Result of one run of the client
+ */
+struct RunResult {
+    double secs = 0;
+    double first_ms = -1;   // from the start of the client to the first message literal, -1 when none was sent
+    double mb = 0;
+};
+
+
+static RunResult report(Server &server, const BenchConfig &config, Clock::time_point start, double secs, long maxrss) {
+    RunResult result;
+    result.secs = secs;
+    result.mb = server.bytes / (1024.0 * 1024.0);
+    if (server.first_message != Clock::time_point::max()) {
+        result.first_ms = std::chrono::duration<double, std::milli>(server.first_message - start).count();
+    }
+
+    double mb = result.mb;
+    std::cout << std::fixed << std::setprecision(1)
+              << "\n" << server.messages << " messages, " << mb << " MB in " << secs << " s ("
+              << config.dist << " sizes, mean " << config.size << " B, latency " << config.latency << " ms"
+              << (config.tls ? ", TLS" : "") << ")\n"
+              << "  " << server.messages / secs << " messages/s, " << mb / secs << " MB/s, first message after "
+              << result.first_ms << " ms, peak RSS " << maxrss / 1024.0 << " MB\n\n"
+              << "  phase      commands   span ms   mean ms\n";
+
+    for (int i = 0; i < PHASES; i++) {
+        const PhaseStats &p = server.phases[i];
+        if (p.commands == 0) {
+            continue;
+        }
+        double span = std::chrono::duration<double, std::milli>(p.last - p.first).count();
+        std::cout << "  " << std::left << std::setw(10) << phase_names[i] << std::right
+                  << std::setw(9) << p.commands << std::setw(10) << span << std::setw(10) << p.total_ms / p.commands << "\n";
+    }
+    std::cout << std::flush;
+    return result;
+}
+
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    std::vector<std::string> args(argv + 1, argv + argc);
+    try {
+        for (auto it = args.begin(); it != args.end(); it++) {
+            auto value = [&]() -> std::string {
+                if (std::next(it) == args.end()) {
+                    throw std::invalid_argument(*it + " needs a value");
+                }
+                return *++it;
+            };
+
+            if (*it == "--messages") config.messages = std::stoul(value());
+            else if (*it == "--size") config.size = std::stoul(value());
+            else if (*it == "--dist") config.dist = value();
+            else if (*it == "--latency") config.latency = std::stoul(value());
+            else if (*it == "--tls") config.tls = true;
+            else if (*it == "--client") config.client = value();
+            else if (*it == "--serve") config.serve = std::stoi(value());
+            else if (*it == "--compare") config.compare = true;
+            else if (*it == "--") {
+                config.client_args.assign(std::next(it), args.end());
+                break;
+            }
+            else throw std::invalid_argument("unknown option " + *it);
+        }
+        if (config.dist != "fixed" && config.dist != "uniform" && config.dist != "lognormal") {
+            throw std::invalid_argument("--dist must be fixed, uniform or lognormal");
+        }
+    }
+    catch (std::logic_error &e) {
+        std::cerr << "imap: " << e.what() << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    char tmpl[] = "/tmp/imapbench.XXXXXX";
+    std::string workdir = mkdtemp(tmpl);
+    std::filesystem::create_directories(workdir + "/certs");
+    std::filesystem::create_directories(workdir + "/mail");
+    std::ofstream(workdir + "/auth") << "bench\nbench\n";
+
+    Server server;
+    server.sizes = makeSizes(config);
+    server.latency = config.latency;
+    for (std::size_t i = 0; server.filler.size() < 2 * *std::max_element(server.sizes.begin(), server.sizes.end()) + 1024; i++) {
+        server.filler += "Line " + std::to_string(i) + " of the synthetic message body, some text to fill it.\r\n";
+    }
+    if (config.tls) {
+        server.ctx = createServerContext(workdir + "/certs");
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(config.serve > 0 ? config.serve : 0);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 128) != 0
+        || getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+        std::cerr << "imap: cannot listen: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::string port = std::to_string(ntohs(addr.sin_port));
+
+    if (config.serve >= 0) {
+        std::cout << "Serving " << config.messages << " messages on 127.0.0.1:" << port
+                  << (config.tls ? ", certificate in " + workdir + "/certs" : "") << std::endl;
+        acceptLoop(server, listen_fd);
+        return 0;
+    }
+
+    std::thread acceptor(acceptLoop, std::ref(server), listen_fd);
+
+    std::vector<std::string> client{config.client, "localhost", "-p", port, "-a", workdir + "/auth", "-o", workdir + "/mail"};
+    if (config.tls) {
+        client.insert(client.end(), {"-T", "-C", workdir + "/certs"});
+    }
+    client.insert(client.end(), config.client_args.begin(), config.client_args.end());
+
+    // the later -j wins, the baseline is the same download over one connection into an empty directory
+    std::vector<std::vector<std::string>> runs{client};
+    if (config.compare) {
+        runs.push_back(client);
+        runs.back().insert(runs.back().end(), {"-j", "1"});
+    }
+
+    std::vector<RunResult> results;
+    int status = 0;
+    for (const std::vector<std::string> &run : runs) {
+        std::filesystem::remove_all(workdir + "/mail");
+        std::filesystem::create_directories(workdir + "/mail");
+        server.reset();
+
+        long maxrss = 0;
+        auto start = Clock::now();
+        status = runClient(run, maxrss);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        if (status != 0) {
+            break;
+        }
+        results.push_back(report(server, config, start, secs, maxrss));
+    }
+
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    acceptor.join();
+    std::filesystem::remove_all(workdir);
+
+    if (status != 0) {
+        std::cerr << "imap: client exited with status " << status << std::endl;
+        return 1;
+    }
+    if (results.size() == 2) {
+        const RunResult &run = results[0], &single = results[1];
+        std::cout << std::fixed << std::setprecision(1) << "\nCompared with a single stream: "
+                  << run.mb / run.secs << " MB/s against " << single.mb / single.secs << " MB/s ("
+                  << std::setprecision(2) << single.secs / run.secs << "x), first message after " << std::setprecision(1)
+                  << run.first_ms << " ms against " << single.first_ms << " ms" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * @file inputbuffer_bench.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Throughput benchmark of the receive buffer
+ *
+ * Feeds a synthetic UID FETCH response stream in BUFFER_SIZE chunks through the original
+ * std::string based line extraction (append, find, substr, erase) and through InputBuffer,
+ * and prints the achieved bytes per second of both.
+ *
+ * Usage: inputbuffer [total_MB] [message_KB]
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "../src/inputbuffer.hpp"
+
+#define BUFFER_SIZE 10000
+
+
+/**
+ * @brief Builds one FETCH response with a literal of given size, followed by the tagged reply
+ */
+static std::string makeResponse(unsigned long uid, std::size_t size) {
+    std::string line = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.\r\n";
+    std::string body;
+    while (body.size() < size) {
+        body += line;
+    }
+    body.resize(size);
+
+    return "* " + std::to_string(uid) + " FETCH (UID " + std::to_string(uid) + " BODY[] {" + std::to_string(size) + "}\r\n"
+            + body + ")\r\n";
+}
+
+
+/**
+ * @brief Parser state shared by both variants, counts delivered literal bytes
+ */
+struct Sink {
+    bool getting_data = false;
+    std::size_t nbytes = 0;
+    unsigned long messages = 0;
+    unsigned long long delivered = 0;
+    unsigned long long checksum = 0;
+
+    void literal(std::string_view data) {
+        this->delivered += data.size();
+        this->checksum += static_cast<unsigned char>(data.front()) + static_cast<unsigned char>(data.back());
+        this->messages++;
+    }
+
+    void line(std::string_view line) {
+        if (line.starts_with("*")) {
+            std::size_t open = line.find('{');
+            this->nbytes = std::stoul(std::string(line.substr(open + 1, line.find('}') - open - 1)));
+            this->getting_data = true;
+        }
+    }
+};
+
+
+static void legacyProcess(std::string &buff, Sink &sink) {
+    while (!buff.empty()) {
+        if (sink.getting_data) {
+            if (buff.length() < sink.nbytes) {
+                return;
+            }
+            std::string data = buff.substr(0, sink.nbytes);
+            buff.erase(0, sink.nbytes);
+            sink.literal(data);
+            sink.getting_data = false;
+            continue;
+        }
+
+        std::size_t idx = buff.find("\r\n");
+        if (idx == std::string::npos) {
+            return;
+        }
+        std::string response = buff.substr(0, idx + 2);
+        buff = buff.erase(0, idx + 2);
+        sink.line(response);
+    }
+}
+
+
+static void bufferProcess(InputBuffer &buff, Sink &sink) {
+    std::string_view response;
+    while (!buff.empty()) {
+        if (sink.getting_data) {
+            if (buff.size() < sink.nbytes) {
+                return;
+            }
+            sink.literal(buff.peek(sink.nbytes));
+            buff.consume(sink.nbytes);
+            sink.getting_data = false;
+            continue;
+        }
+
+        if (!buff.getLine(response)) {
+            return;
+        }
+        sink.line(response);
+    }
+}
+
+
+template <typename F>
+static void run(const char *name, const std::string &stream, unsigned long long total, F feed) {
+    Sink sink;
+    auto begin = std::chrono::steady_clock::now();
+
+    unsigned long long fed = 0;
+    std::size_t pos = 0;
+    while (fed < total) {
+        std::size_t n = std::min<std::size_t>(BUFFER_SIZE, stream.size() - pos);
+        feed(stream.data() + pos, n, sink);
+        pos = (pos + n) % stream.size();
+        fed += n;
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << name << ": " << fed / secs / (1024 * 1024) << " MB/s ("
+              << sink.messages << " messages, " << secs << " s, checksum " << sink.checksum << ")" << std::endl;
+}
+
+
+int main(int argc, char *argv[]) {
+    unsigned long long total_mb = argc > 1 ? std::stoull(argv[1]) : 1024;
+    std::size_t message_kb = argc > 2 ? std::stoul(argv[2]) : 4096;
+
+    // stream of several messages, fed in a loop until total_mb is reached
+    std::string stream;
+    for (unsigned long uid = 1; uid <= 4; uid++) {
+        stream += makeResponse(uid, message_kb * 1024 + uid);
+    }
+    unsigned long long total = total_mb * 1024 * 1024;
+
+    std::cout << "Stream of " << total_mb << " MB, messages of " << message_kb << " KB" << std::endl;
+
+    std::string legacy;
+    run("std::string", stream, total, [&legacy](const char *data, std::size_t n, Sink &sink) {
+        legacy.append(data, n);
+        legacyProcess(legacy, sink);
+    });
+
+    InputBuffer buffer;
+    run("InputBuffer", stream, total, [&buffer](const char *data, std::size_t n, Sink &sink) {
+        memcpy(buffer.prepare(n), data, n);
+        buffer.commit(n);
+        bufferProcess(buffer, sink);
+    });
+
+    return 0;
+}
@@ -0,0 +1,252 @@
+/**
+ * @file parser_bench.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Throughput benchmark of the response parser
+ *
+ * Feeds a stream of responses in BUFFER_SIZE chunks through the original line based
+ * processing (getLine, starts_with, find and istringstream on every line) and through
+ * ResponseParser with each byte scanner the CPU supports, and prints the achieved bytes
+ * per second of all of them. Without a trace file
+ * the stream is synthetic: FETCH responses with message literals mixed with flag updates,
+ * SEARCH results, untagged status responses and tagged completions.
+ *
+ * Usage: parser [total_MB] [message_KB] [trace_file]
+ *
+ * The trace file holds raw server responses as they were received, e.g. captured from
+ * the mock server of the end-to-end benchmark.
+ */
+
+#include <chrono>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../src/bytescan.hpp"
+#include "../src/inputbuffer.hpp"
+#include "../src/responseparser.hpp"
+
+#define BUFFER_SIZE 10000
+
+
+/**
+ * @brief Builds a mix of responses around one FETCH response with a literal of given size
+ */
+static std::string makeResponses(unsigned long uid, std::size_t size) {
+    std::string line = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.\r\n";
+    std::string body;
+    while (body.size() < size) {
+        body += line;
+    }
+    body.resize(size);
+
+    std::string n = std::to_string(uid);
+    return "* " + n + " FETCH (UID " + n + " RFC822.SIZE " + std::to_string(size) + " BODY[] {" + std::to_string(size) + "}\r\n"
+            + body + ")\r\n"
+            + "* " + n + " FETCH (UID " + n + " FLAGS (\\Seen \\Answered $Label1) MODSEQ (" + n + "000))\r\n"
+            + "* OK [HIGHESTMODSEQ " + n + "000] Highest\r\n"
+            + "* SEARCH 1 2 3 5 8 13 21 34 55 89 144 233 377 610 987\r\n"
+            + "* " + n + " EXISTS\r\n"
+            + "A" + n + " OK UID FETCH completed\r\n";
+}
+
+
+/**
+ * @brief Results shared by both variants
+ */
+struct Sink {
+    unsigned long messages = 0;
+    unsigned long flags = 0;
+    unsigned long long uids = 0;
+    unsigned long long delivered = 0;
+    unsigned long long checksum = 0;
+};
+
+
+/**
+ * @brief Line based processing of the client before the parser
+ */
+struct LegacyParser {
+    bool getting_data = false;
+    std::size_t literal_left = 0;
+    std::string uid;
+
+    void process(InputBuffer &buff, Sink &sink) {
+        std::string_view response;
+        while (!buff.empty()) {
+            if (this->getting_data) {
+                std::string_view data = buff.peek(this->literal_left);
+                sink.delivered += data.size();
+                sink.checksum += static_cast<unsigned char>(data.front());
+                buff.consume(data.size());
+                this->literal_left -= data.size();
+                if (this->literal_left > 0) {
+                    return;
+                }
+                this->getting_data = false;
+                sink.messages++;
+                continue;
+            }
+
+            if (!buff.getLine(response)) {
+                return;
+            }
+
+            if (response.starts_with("*") && response.ends_with("}\r\n")) {
+                this->literal_left = std::stoul(std::string(response.substr(response.find("{") + 1,
+                                                                            response.find("}") - response.find("{") - 1)));
+                std::istringstream iss{std::string(response.substr(response.find("UID"), response.length() - 1))};
+                iss >> this->uid >> this->uid;
+                this->getting_data = true;
+            }
+
+            else if (response.starts_with("* ") && response.find(" FETCH (") != std::string_view::npos) {
+                if (response.find("FLAGS (") != std::string_view::npos) {
+                    sink.flags++;
+                }
+            }
+
+            else if (response.starts_with("* OK")) {
+                std::string argline{response.substr(response.find("[") + 1, response.find("]") - response.find("[") - 1)};
+                std::istringstream iss{argline};
+                std::string arg;
+                iss >> arg;
+            }
+
+            else if (response.starts_with("* SEARCH")) {
+                std::istringstream iss{std::string(response.substr(8))};
+                unsigned long uid;
+                while (iss >> uid) {
+                    sink.uids += uid;
+                }
+            }
+        }
+    }
+};
+
+
+/**
+ * @brief Handler doing the same work on the events of ResponseParser
+ */
+class Handler : public ResponseHandler {
+public:
+    // sink the results are counted to
+    void attach(Sink &sink) { this->sink = &sink; }
+
+    void response(std::string_view /*tag*/, unsigned long /*number*/, std::string_view keyword) override {
+        this->search = keyword == "SEARCH";
+    }
+
+    void text(std::string_view text) override {
+        if (!this->search) {
+            return;
+        }
+        const char *pos = text.data();
+        const char *end = text.data() + text.size();
+        while (pos < end) {
+            unsigned long uid = 0;
+            auto [next, ec] = std::from_chars(pos, end, uid);
+            if (ec == std::errc()) {
+                this->sink->uids += uid;
+            }
+            pos = next + 1;
+        }
+    }
+
+    void fetchItem(std::string_view name, std::string_view /*value*/) override {
+        if (name == "FLAGS") {
+            this->sink->flags++;
+        }
+    }
+
+    void literalData(std::string_view data) override {
+        this->sink->delivered += data.size();
+        this->sink->checksum += static_cast<unsigned char>(data.front());
+    }
+
+    void literalEnd() override {
+        this->sink->messages++;
+    }
+
+private:
+    Sink *sink = nullptr;
+    bool search = false;
+};
+
+
+template <typename F>
+static void run(const char *name, const std::string &stream, unsigned long long total, F feed) {
+    Sink sink;
+    InputBuffer buffer;
+    auto begin = std::chrono::steady_clock::now();
+
+    unsigned long long fed = 0;
+    std::size_t pos = 0;
+    while (fed < total) {
+        std::size_t n = std::min<std::size_t>(BUFFER_SIZE, stream.size() - pos);
+        memcpy(buffer.prepare(n), stream.data() + pos, n);
+        buffer.commit(n);
+        feed(buffer, sink);
+        pos = (pos + n) % stream.size();
+        fed += n;
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << name << ": " << fed / secs / (1024 * 1024 * 1024) << " GB/s (" << sink.messages << " messages, "
+              << sink.flags << " flag updates, " << secs << " s, checksum " << sink.checksum + sink.uids << ")" << std::endl;
+}
+
+
+int main(int argc, char *argv[]) {
+    unsigned long long total_mb = argc > 1 ? std::stoull(argv[1]) : 1024;
+    std::size_t message_kb = argc > 2 ? std::stoul(argv[2]) : 16;
+
+    // stream of responses, fed in a loop until total_mb is reached
+    std::string stream;
+    if (argc > 3) {
+        std::ifstream file(argv[3], std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Cannot open " << argv[3] << std::endl;
+            return 1;
+        }
+        stream.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (stream.empty()) {
+            std::cerr << "Trace " << argv[3] << " is empty" << std::endl;
+            return 1;
+        }
+        std::cout << "Stream of " << total_mb << " MB, trace " << argv[3] << std::endl;
+    }
+    else {
+        for (unsigned long uid = 1; uid <= 64; uid++) {
+            stream += makeResponses(uid, message_kb * 1024 + uid);
+        }
+        std::cout << "Stream of " << total_mb << " MB, messages of " << message_kb << " KB" << std::endl;
+    }
+    unsigned long long total = total_mb * 1024 * 1024;
+
+    LegacyParser legacy;
+    run("lines", stream, total, [&legacy](InputBuffer &buff, Sink &sink) {
+        legacy.process(buff, sink);
+    });
+
+    // parser with every byte scanner the CPU supports
+    for (auto level : {ByteScan::Level::SCALAR, ByteScan::Level::SSE2, ByteScan::Level::AVX2}) {
+        if (level > ByteScan::supported()) {
+            continue;
+        }
+        ByteScan::setLevel(level);
+
+        Handler handler;
+        ResponseParser parser{handler};
+        std::string name = std::string("ResponseParser/") + ByteScan::levelName(level);
+        run(name.c_str(), stream, total, [&handler, &parser](InputBuffer &buff, Sink &sink) {
+            handler.attach(sink);
+            while (parser.next(buff));
+        });
+    }
+
+    return 0;
+}
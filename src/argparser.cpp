@@ -17,6 +17,33 @@ ArgParser::ArgParser(): server{""},
                         only_new{false},
                         only_headers{false},
                         secured{false},
+                        pipeline_depth{4},
+                        fetch_batch{100},
+                        jobs{1},
+                        threads{1},
+                        max_sessions{1024},
+                        tls_cache{""},
+                        no_tls_cache{false},
+                        no_compress{false},
+                        idle{false},
+                        store{"files"},
+                        segment_size{PACK_SEGMENT_SIZE},
+                        dedup_dir{""},
+                        writers{0},
+                        write_queue{WRITE_QUEUE_SIZE},
+                        chunk_size{FETCH_CHUNK_SIZE},
+                        retries{RECONNECT_RETRIES},
+                        reconcile{false},
+                        catalog{false},
+                        fulltext{false},
+                        stats_file{""},
+                        stats_format{"json"},
+                        command{""},
+                        uid{""},
+                        filter{},
+                        since{""},
+                        before{""},
+                        query{},
                         display_help{false}
 { /* empty constructor body */ }
 
@@ -24,8 +51,13 @@ ArgParser::ArgParser(): server{""},
 void ArgParser::parse(char *argv[], int argc) {
     // Convert array of const char* into a vector of strings for easier comparison
     std::vector<std::string> args(argv, argv + argc);
+    auto first = args.begin() + 1;
 
-    for (auto it = args.begin() + 1; it != args.end(); it++) {
+    if (first != args.end() && (*first == "extract" || *first == "query" || *first == "search")) {
+        this->command = *first++;
+    }
+
+    for (auto it = first; it != args.end(); it++) {
         
         if (*it == "-a") {
             getOptionValue(args, it, this->auth_file);
@@ -68,11 +100,160 @@ void ArgParser::parse(char *argv[], int argc) {
             getOptionValue(args, it, this->certaddr);
         }
 
+        else if (*it == "--pipeline-depth") {
+            getOptionValue(args, it, this->pipeline_depth);
+        }
+
+        else if (*it == "--batch-size") {
+            getOptionValue(args, it, this->fetch_batch);
+        }
+
+        else if (*it == "-j") {
+            getOptionValue(args, it, this->jobs);
+        }
+
+        else if (*it == "--all") {
+            this->include.push_back("*");
+        }
+
+        else if (*it == "--include") {
+            std::string pattern;
+            getOptionValue(args, it, pattern);
+            this->include.push_back(pattern);
+        }
+
+        else if (*it == "--exclude") {
+            std::string pattern;
+            getOptionValue(args, it, pattern);
+            this->exclude.push_back(pattern);
+        }
+
+        else if (*it == "--batch") {
+            getOptionValue(args, it, this->batch_file);
+        }
+
+        else if (*it == "--threads") {
+            getOptionValue(args, it, this->threads);
+        }
+
+        else if (*it == "--max-sessions") {
+            getOptionValue(args, it, this->max_sessions);
+        }
+
+        else if (*it == "--tls-cache") {
+            getOptionValue(args, it, this->tls_cache);
+        }
+
+        else if (*it == "--no-tls-cache") {
+            no_tls_cache = true;
+        }
+
+        else if (*it == "--no-compress") {
+            no_compress = true;
+        }
+
+        else if (*it == "--idle") {
+            idle = true;
+        }
+
+        else if (*it == "--store") {
+            getOptionValue(args, it, this->store);
+        }
+
+        else if (*it == "--segment-size") {
+            getOptionValue(args, it, this->segment_size);
+        }
+
+        else if (*it == "--dedup") {
+            getOptionValue(args, it, this->dedup_dir);
+        }
+
+        else if (*it == "--writers") {
+            getOptionValue(args, it, this->writers);
+        }
+
+        else if (*it == "--write-queue") {
+            getOptionValue(args, it, this->write_queue);
+        }
+
+        else if (*it == "--chunk-size") {
+            getOptionValue(args, it, this->chunk_size);
+        }
+
+        else if (*it == "--retries") {
+            getOptionValue(args, it, this->retries);
+        }
+
+        else if (*it == "--reconcile") {
+            this->reconcile = true;
+        }
+
+        else if (*it == "--catalog") {
+            this->catalog = true;
+        }
+
+        else if (*it == "--fulltext") {
+            this->fulltext = true;
+        }
+
+        else if (*it == "--from") {
+            getOptionValue(args, it, this->filter.from);
+        }
+
+        else if (*it == "--to") {
+            getOptionValue(args, it, this->filter.to);
+        }
+
+        else if (*it == "--subject") {
+            getOptionValue(args, it, this->filter.subject);
+        }
+
+        else if (*it == "--since") {
+            getOptionValue(args, it, this->since);
+        }
+
+        else if (*it == "--before") {
+            getOptionValue(args, it, this->before);
+        }
+
+        else if (*it == "--larger" || *it == "--smaller") {
+            int size = 0;
+            getOptionValue(args, it, size);
+            if (size < 0) {
+                throw std::invalid_argument(*std::prev(it) + " cannot be negative.");
+            }
+            (*std::prev(it) == "--larger" ? this->filter.larger : this->filter.smaller) = size;
+        }
+
+        else if (*it == "--flag" || *it == "--unflag") {
+            std::string flag;
+            getOptionValue(args, it, flag);
+            (*std::prev(it) == "--flag" ? this->filter.flagged : this->filter.unflagged) |= Catalog::flagBit(flag);
+        }
+
+        else if (*it == "--stats") {
+            getOptionValue(args, it, this->stats_file);
+        }
+
+        else if (*it == "--stats-format") {
+            getOptionValue(args, it, this->stats_format);
+        }
+
         else if (*it == "--help") {
             this->printHelp();
             this->display_help = true;
         }
 
+        // message to extract follows the server
+        else if (this->command == "extract" && !this->server.empty()) {
+            uid = *it;
+        }
+
+        // words and phrases follow the server
+        else if (this->command == "search" && !this->server.empty()) {
+            this->query.push_back(*it);
+        }
+
         else server = *it;
     }
 }
@@ -84,7 +265,7 @@ void ArgParser::getOptionValue(const std::vector<std::string> &args, std::vector
             val = std::stoi(*++it);
         }
         catch(std::invalid_argument&) {
-            throw std::invalid_argument("port must be a number");
+            throw std::invalid_argument(*std::prev(it) + " must be a number");
         }
     }
 }
@@ -100,6 +281,10 @@ void ArgParser::getOptionValue(const std::vector<std::string> &args, std::vector
 void ArgParser::printHelp() {
     std::cout << 
 R"(Usage: imapcl server -a auth_file -o out_dir [OPTIONS]
+       imapcl --batch jobfile [OPTIONS]
+       imapcl extract -o out_dir [-b MAILBOX] server UID
+       imapcl query -o out_dir [-b MAILBOX] server [CONDITIONS]
+       imapcl search -o out_dir [-b MAILBOX] server QUERY...
     -a auth_file    File with username and password
     -o out_dir      Folder to store downloaded emails
 
@@ -111,7 +296,52 @@ R"(Usage: imapcl server -a auth_file -o out_dir [OPTIONS]
     -T              Use secured communication
     -c certfile     Specifies the file with certificates for verifying the server ceritficate
     -C certdir      Specifies the directory with certificate files, defaults to /etc/ssl/certs
-    --help          Shows this help)"
+    --tls-cache FILE    File storing TLS sessions for resumption, defaults to out_dir/.tlscache
+    --no-tls-cache  Always do a full TLS handshake
+    --no-compress   Do not compress the connection even when the server supports it
+    --idle          Keep running after the download and fetch new mail as soon as it arrives (IDLE)
+    --store MODE    How messages are stored: files (one file per message, default) or pack
+                    (append-only segment files with an index by UID)
+    --segment-size MB   Size of a pack segment after which a new one is started, defaults to 1024
+    --dedup DIR     Store equal messages once in DIR, message files become hard links to them
+    --writers N     Number of threads writing messages to the disk, defaults to one per connection
+    --write-queue MB    Data queued for one writer thread before receiving waits, defaults to 64
+    --chunk-size MB     Messages larger than this are fetched in parts of this size, and an interrupted
+                    download continues with the next part, defaults to 32, 0 fetches whole messages
+    --retries N     Reconnect with growing pauses when the connection is lost, at most N times in
+                    a row without a downloaded message, defaults to 5, 0 fails at once
+    --reconcile     Compare all UIDs on the server with the stored ones and download every missing
+                    message, also those left out below the stored UIDNEXT
+    --catalog       Fetch only size, flags, INTERNALDATE and the From, To, Subject, Date and Message-ID
+                    fields into the catalog of the mailbox in out_dir, searched with query
+    --fulltext      Add the words of the headers and text parts of the stored messages to the
+                    full-text index of the mailbox in out_dir, searched with search
+    --stats FILE    Write phase timings, byte counts and message sizes of the run to FILE at exit
+    --stats-format FORMAT   json (default) or prometheus text format
+    --pipeline-depth N  Number of FETCH commands in flight at once, defaults to 4
+    --batch-size N      Maximal number of messages requested by one FETCH, defaults to 100
+    -j N            Number of connections downloading in parallel, defaults to 1
+    --all           Synchronize all mailboxes, each into its own subdirectory of out_dir
+    --include PATTERN   Synchronize mailboxes matching the wildcard pattern, can be repeated
+    --exclude PATTERN   Leave out mailboxes matching the wildcard pattern, can be repeated
+                    With --all or --include, -j sets the number of pooled connections
+    --batch FILE    Run download jobs from FILE, one per line in format
+                    server port auth_file mailbox out_dir [-T] [-c certfile] [-C certdir] [-n] [-h]
+    --threads N     Number of event loop threads for --batch, defaults to 1
+    --max-sessions N    Maximal number of --batch sessions running at once, defaults to 1024
+    --help          Shows this help
+
+ extract writes message UID of a pack store in out_dir to the standard output
+
+ query writes the catalogued messages matching all CONDITIONS, one per line with tab separated
+ UID, INTERNALDATE, size, flags, From, To, Subject and Message-ID, without connecting to the server
+    --from TEXT, --to TEXT, --subject TEXT  The field contains TEXT, case insensitive
+    --since DATE, --before DATE     INTERNALDATE at or after, or before DATE in YYYY-MM-DD, UTC
+    --larger N, --smaller N         Size in bytes above or below N
+    --flag FLAG, --unflag FLAG      Has or has not the flag seen, answered, flagged, deleted or draft
+
+ search writes the message files in out_dir containing every word of QUERY, an argument of several
+ words is a phrase whose words have to follow each other)"
     << std::endl;
 }
 
@@ -128,15 +358,132 @@ Config ArgParser::getConfig() {
     config.only_new = this->only_new;
     config.only_headers = this->only_headers;
     config.secured = this->secured;
+    config.pipeline_depth = this->pipeline_depth;
+    config.fetch_batch = this->fetch_batch;
+    config.jobs = this->jobs;
+    config.include = this->include;
+    config.exclude = this->exclude;
+    config.batch_file = this->batch_file;
+    config.threads = this->threads;
+    config.max_sessions = this->max_sessions;
+    config.tls_cache = this->tls_cache;
+    config.no_tls_cache = this->no_tls_cache;
+    config.no_compress = this->no_compress;
+    config.idle = this->idle;
+    config.pack_store = this->store == "pack";
+    config.segment_size = static_cast<unsigned long>(this->segment_size) * 1024 * 1024;
+    config.dedup_dir = this->dedup_dir;
+    config.writers = this->writers;
+    config.write_queue = static_cast<unsigned long>(this->write_queue) * 1024 * 1024;
+    config.chunk_size = static_cast<unsigned long>(this->chunk_size) * 1024 * 1024;
+    config.retries = this->retries;
+    config.reconcile = this->reconcile;
+    config.catalog = this->catalog;
+    config.fulltext = this->fulltext;
+    config.stats_file = this->stats_file;
+    config.stats_format = this->stats_format;
+    config.command = this->command;
+    config.uid = this->uid.empty() ? 0 : std::stoul(this->uid);
+    config.filter = this->filter;
+    config.query = this->query;
 
     return config;   
 }
 
 void ArgParser::check() {
+    if (this->command == "extract") {
+        if (this->server.empty() || this->out_dir.empty() || this->uid.empty()) {
+            throw std::invalid_argument("extract needs -o out_dir, server and UID.");
+        }
+        if (this->uid.find_first_not_of("0123456789") != std::string::npos || this->uid.size() > 10) {
+            throw std::invalid_argument("UID must be a number.");
+        }
+        return;
+    }
+
+    if (this->command == "query") {
+        if (this->server.empty() || this->out_dir.empty()) {
+            throw std::invalid_argument("query needs -o out_dir and server.");
+        }
+        this->filter.since = this->since.empty() ? 0 : Catalog::parseDay(this->since);
+        this->filter.before = this->before.empty() ? 0 : Catalog::parseDay(this->before);
+        return;
+    }
+
+    if (this->command == "search") {
+        if (this->server.empty() || this->out_dir.empty() || this->query.empty()) {
+            throw std::invalid_argument("search needs -o out_dir, server and at least one word.");
+        }
+        return;
+    }
+
+    if (this->store != "files" && this->store != "pack") {
+        throw std::invalid_argument("--store must be files or pack.");
+    }
+
+    if (this->segment_size < 1) {
+        throw std::invalid_argument("--segment-size must be positive.");
+    }
+
+    if (this->writers < 0 || this->write_queue < 1) {
+        throw std::invalid_argument("--writers cannot be negative and --write-queue must be positive.");
+    }
+
+    if (this->chunk_size < 0) {
+        throw std::invalid_argument("--chunk-size cannot be negative.");
+    }
+
+    if (this->retries < 0) {
+        throw std::invalid_argument("--retries cannot be negative.");
+    }
+
+    if (this->reconcile && (this->only_new || this->only_headers || !this->batch_file.empty())) {
+        throw std::invalid_argument("--reconcile compares complete messages, it cannot be combined with -n, -h or --batch.");
+    }
+
+    if (this->catalog && (this->only_new || this->only_headers || this->reconcile || this->store == "pack"
+                          || !this->dedup_dir.empty() || !this->batch_file.empty())) {
+        throw std::invalid_argument("--catalog stores no messages, it cannot be combined with -n, -h, --reconcile, --store pack, --dedup or --batch.");
+    }
+
+    if (this->fulltext && (this->only_headers || this->catalog || this->store == "pack" || !this->batch_file.empty())) {
+        throw std::invalid_argument("--fulltext indexes message files, it cannot be combined with -h, --catalog, --store pack or --batch.");
+    }
+
+    if (!this->dedup_dir.empty() && this->store == "pack") {
+        throw std::invalid_argument("--dedup works with a file per message, it cannot be combined with --store pack.");
+    }
+
+    if (this->stats_format != "json" && this->stats_format != "prometheus") {
+        throw std::invalid_argument("--stats-format must be json or prometheus.");
+    }
+
+    if (this->threads < 1 || this->max_sessions < 1) {
+        throw std::invalid_argument("--threads and --max-sessions must be positive.");
+    }
+
+    if (this->idle && (!this->batch_file.empty() || !this->include.empty() || !this->exclude.empty())) {
+        throw std::invalid_argument("--idle works with a single mailbox, it cannot be combined with --batch or --all.");
+    }
+
+    // server, auth file and output directory are given for each job in batch mode
+    if (!this->batch_file.empty()) {
+        return;
+    }
+
     if (this->server == "" || this->out_dir == "" || this->auth_file == "") {
         throw std::invalid_argument("Mandatory arguments not provided. Run with --help to show help."); 
     }
 
+    if (this->pipeline_depth < 1 || this->fetch_batch < 1 || this->jobs < 1) {
+        throw std::invalid_argument("--pipeline-depth, --batch-size and -j must be positive.");
+    }
+
+    // excluding mailboxes alone means all others are synchronized
+    if (this->include.empty() && !this->exclude.empty()) {
+        this->include.push_back("*");
+    }
+
     if (this->certaddr.empty() && this->certfile.empty() && this->secured) {
         std::cerr << "Warning: -c and -C flags without -T, ignoring them" << std::endl;
     }
@@ -23,6 +23,41 @@
  *          -T                  Use secured communication
  *              -c certfile     Specifies file with certificates for verifying the server ceritficate
  *              -C certaddr     Specifies folder with certificates
+ *          --pipeline-depth N  Number of FETCH commands sent without waiting for their completion
+ *          --batch-size N      Maximal number of UIDs fetched by one FETCH command
+ *          -j N                Number of connections downloading in parallel
+ *          --all               Synchronize all mailboxes
+ *          --include PATTERN   Synchronize mailboxes matching the pattern, can be repeated
+ *          --exclude PATTERN   Leave out mailboxes matching the pattern, can be repeated
+ *          --batch FILE        Run jobs from the job file instead of a single download
+ *              --threads N     Number of event loop threads
+ *              --max-sessions N Maximal number of sessions running at once
+ *          --tls-cache FILE    File with TLS sessions for resumption, defaults to out_dir/.tlscache
+ *          --no-tls-cache      Do not resume TLS sessions
+ *          --no-compress       Do not use COMPRESS=DEFLATE even when the server supports it
+ *          --idle              Keep running and download new mail as it arrives
+ *          --store MODE        files for a file per message, pack for append-only segment files
+ *          --segment-size MB   Size of a pack segment after which a new one is started
+ *          --dedup DIR         Keep one copy of equal messages in DIR, message files are hard links
+ *          --writers N         Number of threads writing messages to the disk
+ *          --write-queue MB    Data queued for one writer thread before the network waits
+ *          --chunk-size MB     Messages above the size are fetched in resumable parts of the size
+ *          --retries N         Reconnection attempts after the connection is lost, 0 to fail at once
+ *          --reconcile         Download every message missing locally, also below the stored UIDNEXT
+ *          --catalog           Fetch only metadata of the messages into the catalog of the mailbox
+ *          --fulltext          Add the words of stored messages to the full-text index of the mailbox
+ *          --stats FILE        Write timing and throughput of the run to FILE at exit
+ *          --stats-format FMT  json or prometheus
+ *
+ *      Subcommand extract, writes one message of a pack store to the standard output:
+ *          extract -o out_dir [-b MAILBOX] server UID
+ *
+ *      Subcommand query, writes the rows of a catalog matching all given conditions:
+ *          query -o out_dir [-b MAILBOX] server [--from S] [--to S] [--subject S] [--since DATE]
+ *                [--before DATE] [--larger N] [--smaller N] [--flag F] [--unflag F]
+ *
+ *      Subcommand search, writes the message files containing all words and phrases:
+ *          search -o out_dir [-b MAILBOX] server QUERY...
  *
  */
 
@@ -31,6 +66,11 @@
 #include <iostream>
 
 #include "config.hpp"
+#include "packstore.hpp"
+#include "asyncwriter.hpp"
+#include "resumejournal.hpp"
+#include "transporterror.hpp"
+#include "catalog.hpp"
 
 
 class ArgParser {
@@ -48,6 +88,36 @@ public:
     bool only_new;
     bool only_headers;
     bool secured;
+    int pipeline_depth;
+    int fetch_batch;
+    int jobs;
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    std::string batch_file;
+    int threads;
+    int max_sessions;
+    std::string tls_cache;
+    bool no_tls_cache;
+    bool no_compress;
+    bool idle;
+    std::string store;
+    int segment_size;
+    std::string dedup_dir;
+    int writers;
+    int write_queue;
+    int chunk_size;
+    int retries;
+    bool reconcile;
+    bool catalog;
+    bool fulltext;
+    std::string stats_file;
+    std::string stats_format;
+    std::string command;    // subcommand given as the first argument, empty for a download
+    std::string uid;        // UID of the message to extract
+    CatalogFilter filter;   // conditions of a query, dates are set by check()
+    std::string since;      // dates of a query in YYYY-MM-DD format
+    std::string before;
+    std::vector<std::string> query; // words and phrases to search for
     bool display_help;
 
 
@@ -69,7 +139,7 @@ public:
     * @param argv from main
     * @param argc from main
     * 
-    * @exception throws std::invalid_argument when option for parameter -p is not a number
+    * @exception throws std::invalid_argument when option for a numeric parameter is not a number
     * 
     * @todo fix missing paremeter argument
     */
@@ -81,7 +151,7 @@ public:
      * 
      * @exception throws std::invalid_argument when mandatory options are not given
      * 
-     * Check existence of mandatory arguments, validates -T and corresponding flagss
+     * Check existence of mandatory arguments, validates -T and corresponding flagss and numeric options
      */
     void check();
 
@@ -0,0 +1,188 @@
+/**
+ * @file asyncwriter.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of AsyncWriter class
+ */
+
+#include "asyncwriter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+
+// nanoseconds since the given point
+static unsigned long long elapsed(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+
+AsyncWriter::Group::~Group() {
+    this->drain();
+}
+
+
+void AsyncWriter::Group::wait() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->done.wait(lock, [this]() { return this->pending == 0; });
+
+    if (this->error) {
+        std::exception_ptr error = this->error;
+        this->error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+
+void AsyncWriter::Group::drain() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->done.wait(lock, [this]() { return this->pending == 0; });
+    this->error = nullptr;
+}
+
+
+bool AsyncWriter::Group::idle() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->pending == 0;
+}
+
+
+AsyncWriter::AsyncWriter(unsigned int lanes, std::size_t queue_size) :
+    lanes{},
+    queue_size{queue_size}
+{
+    for (unsigned int i = 0; i < std::max(lanes, 1U); i++) {
+        this->lanes.push_back(std::make_unique<Lane>());
+    }
+    for (std::unique_ptr<Lane> &lane : this->lanes) {
+        lane->thread = std::thread(&AsyncWriter::run, this, std::ref(*lane));
+    }
+}
+
+
+AsyncWriter::~AsyncWriter() {
+    for (std::unique_ptr<Lane> &lane : this->lanes) {
+        {
+            std::lock_guard<std::mutex> lock(lane->mutex);
+            lane->stop = true;
+        }
+        lane->ready.notify_one();
+    }
+    for (std::unique_ptr<Lane> &lane : this->lanes) {
+        lane->thread.join();
+    }
+}
+
+
+unsigned int AsyncWriter::lane() {
+    return this->next_lane++ % this->lanes.size();
+}
+
+
+void AsyncWriter::submit(Group &group, unsigned int lane, std::size_t bytes, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(group.mutex);
+        if (group.error) {
+            std::rethrow_exception(group.error);
+        }
+        group.pending++;
+    }
+
+    Lane &l = *this->lanes[lane];
+    std::unique_lock<std::mutex> lock(l.mutex);
+
+    // a task larger than the whole queue is let in alone
+    if (group.blocking && l.bytes > 0 && l.bytes + bytes > this->queue_size) {
+        auto start = std::chrono::steady_clock::now();
+        l.space.wait(lock, [&]() { return l.bytes == 0 || l.bytes + bytes <= this->queue_size; });
+        this->blocked_ns += elapsed(start);
+    }
+
+    l.tasks.push_back(Task{&group, bytes, std::move(task)});
+    l.bytes += bytes;
+    lock.unlock();
+    l.ready.notify_one();
+}
+
+
+bool AsyncWriter::full(unsigned int lane) const {
+    Lane &l = *this->lanes[lane];
+    std::lock_guard<std::mutex> lock(l.mutex);
+    return l.bytes >= this->queue_size;
+}
+
+
+void AsyncWriter::addBlocked(std::chrono::steady_clock::duration time) {
+    this->blocked_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+
+void AsyncWriter::run(Lane &lane) {
+    while (true) {
+        std::unique_lock<std::mutex> lock(lane.mutex);
+        if (lane.tasks.empty() && !lane.stop) {
+            auto start = std::chrono::steady_clock::now();
+            lane.ready.wait(lock, [&]() { return !lane.tasks.empty() || lane.stop; });
+            this->starved_ns += elapsed(start);
+        }
+        if (lane.tasks.empty()) {
+            return;
+        }
+
+        Task task = std::move(lane.tasks.front());
+        lane.tasks.pop_front();
+        lock.unlock();
+
+        // tasks of a group which already failed are not run
+        bool failed;
+        {
+            std::lock_guard<std::mutex> glock(task.group->mutex);
+            failed = task.group->error != nullptr;
+        }
+
+        std::exception_ptr error;
+        if (!failed) {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                task.run();
+                this->written += task.bytes;
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            this->busy_ns += elapsed(start);
+        }
+
+        // the task may hold the last reference to data which must be released before the group is done
+        task.run = nullptr;
+
+        lock.lock();
+        lane.bytes -= task.bytes;
+        lock.unlock();
+        lane.space.notify_all();
+
+        {
+            std::lock_guard<std::mutex> glock(task.group->mutex);
+            if (error && !task.group->error) {
+                task.group->error = error;
+            }
+            task.group->pending--;
+            // notified under the lock, the group may be destroyed as soon as it sees no pending tasks
+            task.group->done.notify_all();
+        }
+    }
+}
+
+
+void AsyncWriter::print(std::ostream &os) const {
+    if (this->written == 0) {
+        return;
+    }
+
+    std::ostringstream line;
+    line << "Writing: " << this->written << " bytes in " << this->busy_ns / 1000000 << " ms, network waited "
+         << this->blocked_ns / 1000000 << " ms for the disk, disk waited " << this->starved_ns / 1000000
+         << " ms for the network.\n";
+    os << line.str() << std::flush;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file asyncwriter.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for AsyncWriter class
+ *
+ * Moves disk writes off the threads reading the sockets. Tasks are queued on lanes, each lane
+ * has a thread of its own and runs its tasks in the order they were submitted, so all writes
+ * of one connection go to one lane and stay ordered. Every lane holds at most a given number
+ * of bytes, a connection submitting more waits until the disk catches up. A connection on an
+ * event loop must not wait, its group queues over the limit and the connection stops reading
+ * while full() is true.
+ *
+ * Tasks are submitted within a group, usually one per connection, which can wait for all
+ * its tasks to finish. The first error of a group is kept and reported to the group, later
+ * tasks of a failed group are dropped.
+ */
+
+#ifndef ASYNCWRITER_HPP
+#define ASYNCWRITER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#define WRITE_QUEUE_SIZE 64     // default MiB of data queued on one lane
+#define WRITE_CHUNK 262144      // bytes of a message collected before they are queued
+
+
+class AsyncWriter {
+public:
+    /**
+     * @brief Tasks of one connection, waited for together
+     */
+    class Group {
+    public:
+        Group() = default;
+
+        /**
+         * @brief Waits for the tasks still queued, the group has to outlive them
+         */
+        ~Group();
+
+        Group(const Group &) = delete;
+        Group &operator=(const Group &) = delete;
+
+
+        /**
+         * @brief Waits until all submitted tasks are finished
+         *
+         * @throw the first exception thrown by a task since the last wait
+         */
+        void wait();
+
+
+        /**
+         * @brief Waits until all submitted tasks are finished, errors are discarded
+         */
+        void drain();
+
+
+        /**
+         * @brief Whether all submitted tasks are finished, wait() does not block then
+         */
+        bool idle();
+
+
+        /**
+         * @brief Lets submit() queue tasks of the group on a full lane instead of waiting
+         */
+        void setBlocking(bool blocking) { this->blocking = blocking; }
+
+    private:
+        friend class AsyncWriter;
+
+        std::mutex mutex;
+        std::condition_variable done;
+        bool blocking{true};        // submit() waits for space in the lane
+        unsigned long pending{0};   // submitted tasks not finished yet
+        std::exception_ptr error;   // first error since the last wait
+    };
+
+
+    /**
+     * @brief Starts the lane threads
+     *
+     * @param lanes number of lanes, each one with a thread
+     * @param queue_size maximal number of bytes queued on one lane
+     */
+    AsyncWriter(unsigned int lanes, std::size_t queue_size);
+
+
+    /**
+     * @brief Finishes queued tasks and stops the threads
+     */
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter &) = delete;
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+
+    /**
+     * @brief Lane for a new connection, lanes are handed out in turn
+     */
+    unsigned int lane();
+
+
+    /**
+     * @brief Queues a task, waits while the lane is full unless the group is not blocking
+     *
+     * @param group group the task belongs to
+     * @param lane lane returned by lane()
+     * @param bytes amount of data the task holds, counted against the queue size
+     * @param task function run on the lane thread
+     *
+     * @throw the error of the group if one of its tasks failed, the task is not queued then
+     */
+    void submit(Group &group, unsigned int lane, std::size_t bytes, std::function<void()> task);
+
+
+    /**
+     * @brief Whether the lane holds as many bytes as it may, a task submitted now would wait
+     */
+    bool full(unsigned int lane) const;
+
+
+    /**
+     * @brief Counts time a connection did not read because its lane was full
+     */
+    void addBlocked(std::chrono::steady_clock::duration time);
+
+
+    /**
+     * @brief Prints bytes written and time each stage spent waiting for the other, nothing when nothing was written
+     */
+    void print(std::ostream &os) const;
+
+private:
+    struct Task {
+        Group *group;
+        std::size_t bytes;
+        std::function<void()> run;
+    };
+
+    struct Lane {
+        std::mutex mutex;
+        std::condition_variable ready;  // a task was queued or the lane is stopping
+        std::condition_variable space;  // queued bytes dropped
+        std::deque<Task> tasks;
+        std::size_t bytes{0};           // bytes held by the queued tasks
+        bool stop{false};
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::size_t queue_size;
+    std::atomic<unsigned int> next_lane{0};
+
+    std::atomic<unsigned long long> written{0};     // bytes of finished tasks
+    std::atomic<unsigned long long> busy_ns{0};     // time the lanes spent running tasks
+    std::atomic<unsigned long long> starved_ns{0};  // time the lanes waited for tasks
+    std::atomic<unsigned long long> blocked_ns{0};  // time connections waited for space in a lane
+
+
+    /**
+     * @brief Runs tasks of the lane until it is stopped and empty
+     */
+    void run(Lane &lane);
+};
+
+#endif
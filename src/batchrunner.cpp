@@ -0,0 +1,382 @@
+/**
+ * @file batchrunner.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of BatchRunner class
+ */
+
+#include "batchrunner.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "imapclient.hpp"
+
+
+BatchRunner::BatchRunner(const Config &defaults) :
+    defaults{defaults},
+    jobs{},
+    contexts{},
+    caches{},
+    addresses{},
+    transfer{std::make_shared<TransferStats>()},
+    dedup{defaults.dedup_dir.empty() ? nullptr : std::make_shared<DedupStore>(defaults.dedup_dir)},
+    writer{std::make_shared<AsyncWriter>(defaults.writers ? defaults.writers : defaults.threads, defaults.write_queue)},
+    stats{std::make_shared<SyncStats>()},
+    threads{static_cast<unsigned int>(defaults.threads)},
+    max_sessions{static_cast<unsigned int>(defaults.max_sessions)}
+{ /* empty body */ }
+
+
+BatchRunner::~BatchRunner() {
+    for (auto &[store, ctx] : this->contexts) {
+        SSL_CTX_free(ctx);
+    }
+}
+
+
+std::vector<std::string> BatchRunner::splitLine(const std::string &line) {
+    std::vector<std::string> fields;
+    std::string field;
+    bool quoted = false;
+    bool in_field = false;
+
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            in_field = true;
+        }
+        else if ((c == ' ' || c == '\t' || c == '\r') && !quoted) {
+            if (in_field) {
+                fields.push_back(field);
+                field.clear();
+                in_field = false;
+            }
+        }
+        else {
+            field += c;
+            in_field = true;
+        }
+    }
+
+    if (in_field) {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+
+void BatchRunner::load(const std::string &filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open job file.");
+    }
+
+    std::string line;
+    unsigned long lineno = 0;
+    while (std::getline(file, line)) {
+        lineno++;
+        std::vector<std::string> fields = splitLine(line);
+        if (fields.empty() || fields[0].starts_with("#")) {
+            continue;
+        }
+
+        std::string where = "Job file line " + std::to_string(lineno) + ": ";
+        if (fields.size() < 5) {
+            throw std::runtime_error(where + "expected server port auth_file mailbox out_dir.");
+        }
+
+        Config job = this->defaults;
+        job.server = fields[0];
+        job.auth_file = fields[2];
+        job.mailbox = fields[3];
+        job.out_dir = fields[4];
+        try {
+            job.port = std::stoi(fields[1]);
+        }
+        catch (std::logic_error &) {
+            throw std::runtime_error(where + "port must be a number.");
+        }
+
+        for (std::size_t i = 5; i < fields.size(); i++) {
+            if (fields[i] == "-T") {
+                job.secured = true;
+            }
+            else if (fields[i] == "-n") {
+                job.only_new = true;
+            }
+            else if (fields[i] == "-h") {
+                job.only_headers = true;
+            }
+            else if ((fields[i] == "-c" || fields[i] == "-C") && i + 1 < fields.size()) {
+                // trust store given for the job replaces the default one
+                job.certfile = (fields[i] == "-c") ? fields[i + 1] : "";
+                job.certaddr = (fields[i] == "-C") ? fields[i + 1] : "";
+                i++;
+            }
+            else {
+                throw std::runtime_error(where + "unknown option " + fields[i] + ".");
+            }
+        }
+        this->jobs.push_back(job);
+    }
+}
+
+
+SSL_CTX *BatchRunner::contextFor(const Config &job) {
+    if (!job.secured) {
+        return nullptr;
+    }
+
+    std::string store = job.certaddr.empty() ? "file:" + job.certfile : "dir:" + job.certaddr;
+    auto it = this->contexts.find(store);
+    if (it != this->contexts.end()) {
+        return it->second;
+    }
+
+    SSL_CTX *ctx = IMAPClient::createContext(job.certfile, job.certaddr);
+    this->contexts[store] = ctx;
+    return ctx;
+}
+
+
+std::shared_ptr<TlsSessionCache> BatchRunner::cacheFor(const Config &job) {
+    if (!job.secured || job.no_tls_cache) {
+        return nullptr;
+    }
+
+    std::string filename = job.tls_cache.empty() ? job.out_dir + "/.tlscache" : job.tls_cache;
+    auto it = this->caches.find(filename);
+    if (it != this->caches.end()) {
+        return it->second;
+    }
+
+    std::shared_ptr<TlsSessionCache> cache = std::make_shared<TlsSessionCache>(filename);
+    this->caches[filename] = cache;
+    return cache;
+}
+
+
+void BatchRunner::resolveServers() {
+    std::vector<std::pair<std::string, int>> servers;
+    for (const Config &job : this->jobs) {
+        std::string key = job.server + ":" + std::to_string(job.port);
+        if (this->addresses.emplace(key, "").second) {
+            servers.emplace_back(job.server, job.port);
+        }
+    }
+
+    // lookups are slow mostly because of waiting for the name server, they run side by side
+    std::vector<std::string> results(servers.size());
+    std::atomic<std::size_t> next{0};
+    auto resolver = [&servers, &results, &next]() {
+        for (std::size_t i = next++; i < servers.size(); i = next++) {
+            try {
+                results[i] = IMAPClient::resolve(servers[i].first, servers[i].second);
+            }
+            catch (TransportError &) {
+                results[i].clear();
+            }
+        }
+    };
+
+    std::vector<std::thread> resolvers;
+    for (std::size_t i = 0; i < std::min<std::size_t>(servers.size(), BATCH_RESOLVERS); i++) {
+        resolvers.emplace_back(resolver);
+    }
+    for (std::thread &t : resolvers) {
+        t.join();
+    }
+
+    for (std::size_t i = 0; i < servers.size(); i++) {
+        this->addresses[servers[i].first + ":" + std::to_string(servers[i].second)] = results[i];
+    }
+}
+
+
+void BatchRunner::run() {
+    // contexts, caches and addresses are created up front, the loops only share them
+    for (const Config &job : this->jobs) {
+        this->contextFor(job);
+        this->cacheFor(job);
+    }
+    this->resolveServers();
+
+    std::size_t nthreads = std::max<std::size_t>(1, std::min<std::size_t>(this->threads, this->jobs.size()));
+    std::atomic<unsigned long> failed{0};
+    std::vector<std::thread> loops;
+
+    for (std::size_t i = 1; i < nthreads; i++) {
+        loops.emplace_back(&BatchRunner::runLoop, this, i, nthreads, std::ref(failed));
+    }
+    this->runLoop(0, nthreads, failed);
+
+    for (std::thread &t : loops) {
+        t.join();
+    }
+
+    std::cout << "Finished " << this->jobs.size() << " jobs, " << failed << " failed." << std::endl;
+    this->transfer->print(std::cout);
+    if (this->dedup != nullptr) {
+        this->dedup->print(std::cout);
+    }
+    this->writer->print(std::cout);
+    if (failed > 0) {
+        throw std::runtime_error("Some of the jobs failed.");
+    }
+}
+
+
+void BatchRunner::setSyncStats(std::shared_ptr<SyncStats> stats) {
+    this->stats = stats;
+}
+
+
+void BatchRunner::runLoop(std::size_t first, std::size_t step, std::atomic<unsigned long> &failed) {
+    struct Session {
+        std::unique_ptr<IMAPClient> client;
+        std::string label;
+        int fd;
+        uint32_t events;
+        std::time_t last_event;
+        bool finished;
+    };
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        std::cerr << "Cannot create epoll instance.\n";
+        failed += (this->jobs.size() - first + step - 1) / step;
+        return;
+    }
+
+    std::size_t limit = std::max<std::size_t>(1, this->max_sessions / step);
+    std::list<Session> active;
+    std::size_t next = first;
+
+    // finishes the session, reporting the error if any
+    auto finish = [&](Session &session, const char *error) {
+        if (error != nullptr) {
+            std::cerr << session.label + ": " + error + "\n";
+            failed++;
+        }
+        if (session.fd >= 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, session.fd, nullptr);
+        }
+        session.finished = true;
+    };
+
+    // moves the session on and registers the events it waits for
+    auto drive = [&](Session &session) {
+        session.last_event = std::time(nullptr);
+        try {
+            if (session.client->handleEvent()) {
+                finish(session, nullptr);
+                return;
+            }
+        }
+        catch (std::runtime_error &e) {
+            finish(session, e.what());
+            return;
+        }
+
+        // a session waiting for the disk is continued by the loop, its socket would only wake the loop up
+        if (session.client->waitsForDisk()) {
+            if (session.fd >= 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, session.fd, nullptr);
+                session.fd = -1;
+            }
+            return;
+        }
+
+        uint32_t events = EPOLLIN | (session.client->wantsWrite() ? EPOLLOUT : 0);
+        int fd = session.client->socket();
+        if (fd != session.fd) {
+            epoll_event ev{events, {.ptr = &session}};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            session.fd = fd;
+        }
+        else if (events != session.events) {
+            epoll_event ev{events, {.ptr = &session}};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+        session.events = events;
+    };
+
+    while (true) {
+        // start new sessions while under the limit
+        while (active.size() < limit && next < this->jobs.size()) {
+            Config &job = this->jobs[next];
+            next += step;
+
+            active.push_back(Session{std::make_unique<IMAPClient>(job), job.server + " " + job.mailbox + " (" + job.out_dir + ")",
+                                     -1, 0, std::time(nullptr), false});
+            Session &session = active.back();
+            session.client->setLabel(session.label);
+            session.client->shareContext(this->contextFor(job));
+            session.client->setSessionCache(this->cacheFor(job));
+            session.client->setTransferStats(this->transfer);
+            session.client->setDedupStore(this->dedup);
+            session.client->setWriter(this->writer);
+            session.client->setSyncStats(this->stats);
+
+            const std::string &address = this->addresses.at(job.server + ":" + std::to_string(job.port));
+            if (address.empty()) {
+                finish(session, "Cannot resolve the server name.");
+                continue;
+            }
+            session.client->setAddress(address);
+
+            try {
+                session.client->startAsync();
+            }
+            catch (std::runtime_error &e) {
+                finish(session, e.what());
+                continue;
+            }
+            drive(session);
+        }
+
+        active.remove_if([](const Session &session) { return session.finished; });
+        if (active.empty() && next >= this->jobs.size()) {
+            break;
+        }
+
+        bool waiting = std::any_of(active.begin(), active.end(), [](const Session &session) {
+            return !session.finished && session.client->waitsForDisk();
+        });
+
+        epoll_event events[256];
+        int nevents = epoll_wait(epfd, events, 256, waiting ? BATCH_DISK_WAIT : 1000);
+        for (int i = 0; i < nevents; i++) {
+            Session &session = *static_cast<Session *>(events[i].data.ptr);
+            if (!session.finished) {
+                drive(session);
+            }
+        }
+
+        for (Session &session : active) {
+            if (!session.finished && session.client->waitsForDisk()) {
+                drive(session);
+            }
+        }
+
+        std::time_t now = std::time(nullptr);
+        for (Session &session : active) {
+            if (!session.finished && now - session.last_event > BATCH_IDLE_TIMEOUT) {
+                finish(session, "Connection timed out.");
+            }
+        }
+        active.remove_if([](const Session &session) { return session.finished; });
+    }
+
+    close(epfd);
+}
@@ -0,0 +1,125 @@
+/**
+ * @file batchrunner.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for BatchRunner class
+ *
+ * Runs many download jobs from one process. Every job is a non-blocking IMAPClient session,
+ * sessions are driven by a small number of threads, each with its own epoll loop.
+ * SSL contexts are created once for each trust store and shared by all sessions using it.
+ * Server names are resolved before the loops start, so no loop waits for a name lookup.
+ *
+ * Job file has one job per line, fields are separated by whitespace and can be double quoted:
+ *      server port auth_file mailbox out_dir [-T] [-c certfile] [-C certdir] [-n] [-h]
+ * Empty lines and lines starting with '#' are skipped. Options given on the command line
+ * are defaults of all jobs.
+ */
+
+#ifndef BATCHRUNNER_HPP
+#define BATCHRUNNER_HPP
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "openssl/ssl.h"
+
+#include "config.hpp"
+#include "tlscache.hpp"
+#include "deflatestream.hpp"
+#include "dedupstore.hpp"
+#include "asyncwriter.hpp"
+#include "syncstats.hpp"
+
+#define BATCH_IDLE_TIMEOUT 300  // seconds without any event after which a session is failed
+#define BATCH_DISK_WAIT 10      // milliseconds after which sessions waiting for the disk are continued
+#define BATCH_RESOLVERS 16      // maximal number of threads resolving server names
+
+
+class BatchRunner {
+public:
+    /**
+     * @brief Constructs runner, options of the configuration are used as defaults of the jobs
+     *
+     * @throw std::runtime_error if the deduplication directory cannot be created
+     */
+    explicit BatchRunner(const Config &defaults);
+
+
+    /**
+     * @brief Frees the shared SSL contexts
+     */
+    ~BatchRunner();
+
+
+    /**
+     * @brief Reads jobs from the job file
+     *
+     * @throw std::runtime_error if the file cannot be read or a line is malformed
+     */
+    void load(const std::string &filename);
+
+
+    /**
+     * @brief Runs all loaded jobs
+     *
+     * @throw std::runtime_error if any of the jobs failed
+     */
+    void run();
+
+
+    /**
+     * @brief Counts timing and throughput of all jobs into the stats
+     */
+    void setSyncStats(std::shared_ptr<SyncStats> stats);
+
+private:
+    Config defaults;            // options shared by all jobs
+    std::vector<Config> jobs;   // loaded jobs
+    std::map<std::string, SSL_CTX *> contexts; // SSL contexts by trust store
+    std::map<std::string, std::shared_ptr<TlsSessionCache>> caches; // TLS session caches by file
+    std::map<std::string, std::string> addresses; // resolved addresses by server:port, empty when the name was not found
+    std::shared_ptr<TransferStats> transfer; // byte counts of compressed connections of all jobs
+    std::shared_ptr<DedupStore> dedup;  // deduplicating store of all jobs, nullptr when disabled
+    std::shared_ptr<AsyncWriter> writer; // threads writing messages of all jobs
+    std::shared_ptr<SyncStats> stats;   // timing and throughput of all jobs
+
+    unsigned int threads;       // number of event loops
+    unsigned int max_sessions;  // maximal number of sessions running at once
+
+
+    /**
+     * @brief Runs every step-th job starting from first on one epoll loop
+     *
+     * @param failed incremented for every failed job
+     */
+    void runLoop(std::size_t first, std::size_t step, std::atomic<unsigned long> &failed);
+
+
+    /**
+     * @brief Returns shared SSL context for the trust store of the job, creates it when first needed
+     */
+    SSL_CTX *contextFor(const Config &job);
+
+
+    /**
+     * @brief Returns TLS session cache for the job, jobs using one file share one cache
+     */
+    std::shared_ptr<TlsSessionCache> cacheFor(const Config &job);
+
+
+    /**
+     * @brief Resolves the server names of all jobs, several at once
+     */
+    void resolveServers();
+
+
+    /**
+     * @brief Splits a job file line into fields, honouring double quotes
+     */
+    static std::vector<std::string> splitLine(const std::string &line);
+};
+
+#endif
@@ -0,0 +1,230 @@
+/**
+ * @file bytescan.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of ByteScan class
+ */
+
+#include "bytescan.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BYTESCAN_X86
+#endif
+
+
+static const char *scanScalar(const char *begin, const char *end, std::string_view set) {
+    for (const char *p = begin; p < end; p++) {
+        for (char c : set) {
+            if (*p == c) {
+                return p;
+            }
+        }
+    }
+    return end;
+}
+
+
+#ifdef BYTESCAN_X86
+
+/**
+ * @brief Mask of the bytes of a 16 byte chunk that are in the set of N bytes
+ *
+ * The set size is a template parameter so the comparisons are unrolled.
+ */
+template <std::size_t N>
+static inline int matchSse2(__m128i chunk, const __m128i *needles) {
+    __m128i hits = _mm_cmpeq_epi8(chunk, needles[0]);
+    for (std::size_t i = 1; i < N; i++) {
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[i]));
+    }
+    return _mm_movemask_epi8(hits);
+}
+
+
+// SSE2 is part of x86-64, so this needs no check
+template <std::size_t N>
+static const char *scanSse2(const char *begin, const char *end, std::string_view set) {
+    __m128i needles[N];
+    for (std::size_t i = 0; i < N; i++) {
+        needles[i] = _mm_set1_epi8(set[i]);
+    }
+
+    const char *p = begin;
+    for (; end - p >= 16; p += 16) {
+        int mask = matchSse2<N>(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), needles);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return scanScalar(p, end, set);
+}
+
+
+template <std::size_t N>
+__attribute__((target("avx2")))
+static inline unsigned int matchAvx2(__m256i chunk, const __m256i *needles) {
+    __m256i hits = _mm256_cmpeq_epi8(chunk, needles[0]);
+    for (std::size_t i = 1; i < N; i++) {
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, needles[i]));
+    }
+    return static_cast<unsigned int>(_mm256_movemask_epi8(hits));
+}
+
+
+template <std::size_t N>
+__attribute__((target("avx2")))
+static const char *scanAvx2(const char *begin, const char *end, std::string_view set) {
+    __m256i needles[N];
+    for (std::size_t i = 0; i < N; i++) {
+        needles[i] = _mm256_set1_epi8(set[i]);
+    }
+
+    const char *p = begin;
+
+    // two vectors per step, a line end is usually further than one vector away
+    for (; end - p >= 64; p += 64) {
+        unsigned int low = matchAvx2<N>(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)), needles);
+        unsigned int high = matchAvx2<N>(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32)), needles);
+        if ((low | high) != 0) {
+            return low != 0 ? p + __builtin_ctz(low) : p + 32 + __builtin_ctz(high);
+        }
+    }
+    if (end - p >= 32) {
+        unsigned int mask = matchAvx2<N>(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)), needles);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+
+    // rest shorter than a vector is left to SSE2
+    return scanSse2<N>(p, end, set);
+}
+
+
+// implementation for the size of the set
+template <template <std::size_t> class Scan>
+static const char *dispatch(const char *begin, const char *end, std::string_view set) {
+    switch (set.size()) {
+        // memchr of the C library is vectorized as well and handles short runs better
+        case 1: {
+            const char *found = static_cast<const char *>(memchr(begin, set[0], end - begin));
+            return found != nullptr ? found : end;
+        }
+        case 2: return Scan<2>::find(begin, end, set);
+        case 3: return Scan<3>::find(begin, end, set);
+        case 4: return Scan<4>::find(begin, end, set);
+        case 5: return Scan<5>::find(begin, end, set);
+        case 6: return Scan<6>::find(begin, end, set);
+        case 7: return Scan<7>::find(begin, end, set);
+        case 8: return Scan<8>::find(begin, end, set);
+        default: return scanScalar(begin, end, set);
+    }
+}
+
+template <std::size_t N>
+struct Sse2 {
+    static const char *find(const char *begin, const char *end, std::string_view set) { return scanSse2<N>(begin, end, set); }
+};
+
+template <std::size_t N>
+struct Avx2 {
+    static const char *find(const char *begin, const char *end, std::string_view set) { return scanAvx2<N>(begin, end, set); }
+};
+
+#endif
+
+
+static ByteScan::Level detect() {
+#ifdef BYTESCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return ByteScan::Level::AVX2;
+    }
+    return ByteScan::Level::SSE2;
+#else
+    return ByteScan::Level::SCALAR;
+#endif
+}
+
+
+static const char *(*implementation(ByteScan::Level level))(const char *, const char *, std::string_view) {
+    switch (level) {
+#ifdef BYTESCAN_X86
+        case ByteScan::Level::AVX2:
+            return dispatch<Avx2>;
+
+        case ByteScan::Level::SSE2:
+            return dispatch<Sse2>;
+#endif
+        default:
+            return scanScalar;
+    }
+}
+
+
+// constant initialization, so a search during the initialization of other statics works
+std::atomic<ByteScan::Function> ByteScan::active{ByteScan::choose};
+
+
+const char *ByteScan::choose(const char *begin, const char *end, std::string_view set) {
+    Function best = implementation(supported());
+    active.store(best, std::memory_order_relaxed);
+    return best(begin, end, set);
+}
+
+
+const char *ByteScan::findAny(Level level, const char *begin, const char *end, std::string_view set) {
+    if (level > supported()) {
+        throw std::invalid_argument("Byte scan level is not supported by the CPU.");
+    }
+    return implementation(level)(begin, end, set);
+}
+
+
+ByteScan::Level ByteScan::supported() {
+    static const Level best = detect();
+    return best;
+}
+
+
+ByteScan::Level ByteScan::level() {
+    Function current = active.load(std::memory_order_relaxed);
+    if (current == choose) {
+        return supported();
+    }
+
+    // unsupported levels fall back to the scalar loop and would match it
+    for (Level level : {Level::AVX2, Level::SSE2}) {
+        if (level <= supported() && implementation(level) == current) {
+            return level;
+        }
+    }
+    return Level::SCALAR;
+}
+
+
+void ByteScan::setLevel(Level level) {
+    if (level > supported()) {
+        throw std::invalid_argument("Byte scan level is not supported by the CPU.");
+    }
+    active.store(implementation(level), std::memory_order_relaxed);
+}
+
+
+const char *ByteScan::levelName(Level level) {
+    switch (level) {
+        case Level::AVX2:
+            return "avx2";
+
+        case Level::SSE2:
+            return "sse2";
+
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,87 @@
+/**
+ * @file bytescan.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for ByteScan class
+ *
+ * Vectorized search for the first of a few bytes, used by the response parser to jump
+ * between the bytes that matter for the structure of a response: line ends, literal
+ * announcements, quotes and parentheses. The implementation is chosen on the first search
+ * by the instructions the CPU supports, AVX2 or SSE2 on x86-64, and a scalar loop
+ * everywhere else.
+ */
+
+#ifndef BYTESCAN_HPP
+#define BYTESCAN_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <string_view>
+
+#define BYTESCAN_MAX_SET 8
+
+
+class ByteScan {
+public:
+    enum class Level {
+        SCALAR,
+        SSE2,       // 16 bytes per step
+        AVX2        // 32 bytes per step
+    };
+
+
+    /**
+     * @brief Finds the first byte in [begin, end) that is one of the bytes of the set
+     *
+     * @param set searched bytes, at most BYTESCAN_MAX_SET
+     *
+     * @return pointer to the byte, end when there is none
+     */
+    static const char *findAny(const char *begin, const char *end, std::string_view set) {
+        return active.load(std::memory_order_relaxed)(begin, end, set);
+    }
+
+
+    /**
+     * @brief Finds the first byte in [begin, end) that is one of the bytes of the set, with the given implementation
+     *
+     * Used to check the vectorized implementations against the scalar one.
+     */
+    static const char *findAny(Level level, const char *begin, const char *end, std::string_view set);
+
+
+    /**
+     * @brief Best implementation the CPU supports
+     */
+    static Level supported();
+
+
+    /**
+     * @brief Implementation used by findAny()
+     */
+    static Level level();
+
+
+    /**
+     * @brief Switches findAny() to the implementation, which has to be supported
+     *
+     * @throw std::invalid_argument if the CPU does not support the level
+     */
+    static void setLevel(Level level);
+
+
+    static const char *levelName(Level level);
+
+private:
+    using Function = const char *(*)(const char *, const char *, std::string_view);
+
+    static std::atomic<Function> active;   // chosen implementation, statically initialized to choose()
+
+
+    /**
+     * @brief First search, replaces itself by the best supported implementation
+     */
+    static const char *choose(const char *begin, const char *end, std::string_view set);
+};
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * @file catalog.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of Catalog class
+ */
+
+#include "catalog.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+#define CATALOG_TEXT_COLUMNS 5
+
+
+// writes the whole buffer at the end of the file, write() may take only a part of it
+static bool writeAll(int fd, const char *data, std::size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+static std::size_t padded(std::size_t len) {
+    return (len + 7) & ~static_cast<std::size_t>(7);
+}
+
+
+/**
+ * @brief Columns of one block, pointing into its data
+ */
+struct Columns {
+    const uint64_t *uid;
+    const uint64_t *size;
+    const int64_t *internaldate;
+    const uint32_t *flags;
+    const uint32_t *ends[CATALOG_TEXT_COLUMNS];    // end offsets of the values in the text
+    const char *text[CATALOG_TEXT_COLUMNS];
+
+    // false when the columns do not fit into the block
+    bool map(const char *data, uint32_t rows, uint64_t bytes) {
+        std::size_t pos = 0;
+        auto take = [&](std::size_t len) {
+            const char *p = data + pos;
+            pos += padded(len);
+            return p;
+        };
+
+        this->uid = reinterpret_cast<const uint64_t *>(take(rows * sizeof(uint64_t)));
+        this->size = reinterpret_cast<const uint64_t *>(take(rows * sizeof(uint64_t)));
+        this->internaldate = reinterpret_cast<const int64_t *>(take(rows * sizeof(int64_t)));
+        this->flags = reinterpret_cast<const uint32_t *>(take(rows * sizeof(uint32_t)));
+        for (int i = 0; i < CATALOG_TEXT_COLUMNS; i++) {
+            this->ends[i] = reinterpret_cast<const uint32_t *>(take(rows * sizeof(uint32_t)));
+            if (pos > bytes) {
+                return false;
+            }
+            this->text[i] = take(rows > 0 ? this->ends[i][rows - 1] : 0);
+        }
+        return pos <= bytes;
+    }
+
+    std::string_view value(int column, uint32_t row) const {
+        uint32_t begin = row > 0 ? this->ends[column][row - 1] : 0;
+        return std::string_view(this->text[column] + begin, this->ends[column][row] - begin);
+    }
+};
+
+
+Catalog::Catalog(const std::string &dir, const std::string &name) :
+    filename{dir + "/" + name + ".catalog"},
+    fd{-1},
+    size{sizeof(Header)},
+    next_uid{1},
+    stored_uidvalidity{0}
+{
+    this->fd = open(this->filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+        throw std::runtime_error("Cannot open catalog " + this->filename + ".");
+    }
+
+    Header h{};
+    ssize_t n = pread(this->fd, &h, sizeof(Header), 0);
+    if (n == 0) {
+        h = Header{CATALOG_MAGIC, CATALOG_VERSION, 0, 0};
+        n = pwrite(this->fd, &h, sizeof(Header), 0);
+    }
+    if (n != sizeof(Header) || h.magic != CATALOG_MAGIC || h.version != CATALOG_VERSION) {
+        close(this->fd);
+        throw std::runtime_error("Catalog " + this->filename + " is damaged or of another version.");
+    }
+    this->stored_uidvalidity = h.uidvalidity;
+
+    // only the block headers are read, the last one is checked against its checksum
+    struct stat st;
+    fstat(this->fd, &st);
+    uint64_t end = st.st_size;
+    uint64_t last = 0;
+    Block block{};
+    while (this->size + sizeof(Block) <= end && pread(this->fd, &block, sizeof(Block), this->size) == sizeof(Block)
+           && block.magic == CATALOG_BLOCK_MAGIC && this->size + sizeof(Block) + block.bytes <= end) {
+        last = this->size;
+        this->size += sizeof(Block) + block.bytes;
+        this->next_uid = std::max<uint64_t>(this->next_uid, block.last_uid + 1);
+    }
+
+    if (last != 0) {
+        pread(this->fd, &block, sizeof(Block), last);
+        std::string data(block.bytes, '\0');
+        if (pread(this->fd, data.data(), data.size(), last + sizeof(Block)) != static_cast<ssize_t>(data.size())
+            || crc32(0, reinterpret_cast<const Bytef *>(data.data()), data.size()) != block.checksum) {
+            this->size = last;
+
+            // rows before the torn block tell where to continue
+            this->next_uid = 1;
+            for (uint64_t pos = sizeof(Header); pos < last; pos += sizeof(Block) + block.bytes) {
+                pread(this->fd, &block, sizeof(Block), pos);
+                this->next_uid = std::max<uint64_t>(this->next_uid, block.last_uid + 1);
+            }
+        }
+    }
+
+    if (this->size < end && ftruncate(this->fd, this->size) != 0) {
+        close(this->fd);
+        throw std::runtime_error("Cannot repair catalog " + this->filename + ".");
+    }
+}
+
+
+Catalog::~Catalog() {
+    fdatasync(this->fd);
+    close(this->fd);
+}
+
+
+bool Catalog::validate(uint64_t uidvalidity) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->stored_uidvalidity == uidvalidity) {
+        return true;
+    }
+
+    // rows of another UIDVALIDITY describe other messages
+    Header h{CATALOG_MAGIC, CATALOG_VERSION, 0, uidvalidity};
+    if (ftruncate(this->fd, sizeof(Header)) != 0 || pwrite(this->fd, &h, sizeof(Header), 0) != sizeof(Header)) {
+        throw std::runtime_error("Cannot reset catalog " + this->filename + ".");
+    }
+    this->size = sizeof(Header);
+    this->next_uid = 1;
+    this->stored_uidvalidity = uidvalidity;
+    return false;
+}
+
+
+uint64_t Catalog::uidnext() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->next_uid;
+}
+
+
+std::string Catalog::encode(const std::vector<CatalogRow> &rows) {
+    std::string out;
+    auto pad = [&out]() { out.resize(padded(out.size()), '\0'); };
+    auto put = [&out](const auto &value) { out.append(reinterpret_cast<const char *>(&value), sizeof(value)); };
+
+    for (const CatalogRow &row : rows) put(row.uid);
+    for (const CatalogRow &row : rows) put(row.size);
+    for (const CatalogRow &row : rows) put(row.internaldate);
+    for (const CatalogRow &row : rows) put(row.flags);
+    pad();
+
+    std::string CatalogRow::*fields[CATALOG_TEXT_COLUMNS] = {
+        &CatalogRow::from, &CatalogRow::to, &CatalogRow::subject, &CatalogRow::date, &CatalogRow::message_id
+    };
+    for (std::string CatalogRow::*field : fields) {
+        uint32_t end = 0;
+        for (const CatalogRow &row : rows) {
+            end += (row.*field).size();
+            put(end);
+        }
+        pad();
+        for (const CatalogRow &row : rows) {
+            out += row.*field;
+        }
+        pad();
+    }
+    return out;
+}
+
+
+void Catalog::append(const std::vector<CatalogRow> &rows) {
+    if (rows.empty()) {
+        return;
+    }
+
+    std::string data = encode(rows);
+    uint64_t last_uid = 0;
+    for (const CatalogRow &row : rows) {
+        last_uid = std::max(last_uid, row.uid);
+    }
+    Block block{CATALOG_BLOCK_MAGIC, static_cast<uint32_t>(rows.size()), data.size(), last_uid,
+                static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(data.data()), data.size())), 0};
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    data.insert(0, reinterpret_cast<const char *>(&block), sizeof(Block));
+    if (lseek(this->fd, this->size, SEEK_SET) < 0 || !writeAll(this->fd, data.data(), data.size()) || fdatasync(this->fd) != 0) {
+        // a partly written block is cut off by the next open
+        throw std::runtime_error("Cannot write catalog " + this->filename + ".");
+    }
+    this->size += data.size();
+    this->next_uid = std::max(this->next_uid, last_uid + 1);
+}
+
+
+// case insensitive substring search, the needle is lower case
+static bool contains(std::string_view haystack, const std::string &needle) {
+    if (needle.empty()) {
+        return true;
+    }
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), [](char a, char b) {
+        return std::tolower(static_cast<unsigned char>(a)) == b;
+    }) != haystack.end();
+}
+
+
+static std::string lower(std::string s) {
+    for (char &c : s) {
+        c = std::tolower(static_cast<unsigned char>(c));
+    }
+    return s;
+}
+
+
+unsigned long Catalog::query(const std::string &dir, const std::string &name, const CatalogFilter &filter, std::ostream &os) {
+    std::string filename = dir + "/" + name + ".catalog";
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open catalog " + filename + ".");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(Header)) {
+        close(fd);
+        throw std::runtime_error("Catalog " + filename + " is damaged or of another version.");
+    }
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Cannot map catalog " + filename + ".");
+    }
+
+    const char *base = static_cast<const char *>(mapping);
+    uint64_t end = st.st_size;
+    const Header *h = reinterpret_cast<const Header *>(base);
+    if (h->magic != CATALOG_MAGIC || h->version != CATALOG_VERSION) {
+        munmap(mapping, end);
+        throw std::runtime_error("Catalog " + filename + " is damaged or of another version.");
+    }
+    madvise(mapping, end, MADV_SEQUENTIAL);
+
+    std::string from = lower(filter.from);
+    std::string to = lower(filter.to);
+    std::string subject = lower(filter.subject);
+    unsigned long matched = 0;
+    std::string line;
+
+    // a torn last block is left out, the writer cuts it off
+    uint64_t pos = sizeof(Header);
+    while (pos + sizeof(Block) <= end) {
+        const Block *block = reinterpret_cast<const Block *>(base + pos);
+        const char *data = base + pos + sizeof(Block);
+        Columns columns;
+        if (block->magic != CATALOG_BLOCK_MAGIC || pos + sizeof(Block) + block->bytes > end
+            || !columns.map(data, block->rows, block->bytes)) {
+            break;
+        }
+        pos += sizeof(Block) + block->bytes;
+
+        // only the last block can be torn, the others were complete when it was appended
+        if (pos + sizeof(Block) > end
+            && crc32(0, reinterpret_cast<const Bytef *>(data), block->bytes) != block->checksum) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < block->rows; i++) {
+            if ((filter.since != 0 && columns.internaldate[i] < filter.since)
+                || (filter.before != 0 && columns.internaldate[i] >= filter.before)
+                || (filter.larger != 0 && columns.size[i] <= filter.larger)
+                || (filter.smaller != 0 && columns.size[i] >= filter.smaller)
+                || (columns.flags[i] & filter.flagged) != filter.flagged
+                || (columns.flags[i] & filter.unflagged) != 0) {
+                continue;
+            }
+            if (!contains(columns.value(0, i), from) || !contains(columns.value(1, i), to)
+                || !contains(columns.value(2, i), subject)) {
+                continue;
+            }
+
+            char date[32] = "";
+            time_t t = columns.internaldate[i];
+            struct tm tm;
+            if (t != 0 && gmtime_r(&t, &tm) != nullptr) {
+                strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+            }
+
+            std::string flags;
+            const char *names[] = {"\\Seen", "\\Answered", "\\Flagged", "\\Deleted", "\\Draft"};
+            for (int bit = 0; bit < 5; bit++) {
+                if (columns.flags[i] & (1U << bit)) {
+                    flags += flags.empty() ? names[bit] : std::string(" ") + names[bit];
+                }
+            }
+
+            line = std::to_string(columns.uid[i]) + "\t" + date + "\t" + std::to_string(columns.size[i]) + "\t" + flags;
+            for (int column : {0, 1, 2, 4}) {
+                line += '\t';
+                line += columns.value(column, i);
+            }
+            line += '\n';
+            os << line;
+            matched++;
+        }
+    }
+
+    munmap(mapping, end);
+    return matched;
+}
+
+
+void Catalog::parseHeader(std::string_view header, CatalogRow &row) {
+    std::string *field = nullptr;
+
+    while (!header.empty()) {
+        std::size_t eol = header.find('\n');
+        std::string_view line = header.substr(0, eol);
+        header = (eol == std::string_view::npos) ? std::string_view() : header.substr(eol + 1);
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+
+        // folded line continues the previous field
+        if (!line.empty() && (line[0] == ' ' || line[0] == '\t')) {
+            if (field != nullptr) {
+                *field += line;
+            }
+            continue;
+        }
+
+        std::size_t colon = line.find(':');
+        field = nullptr;
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+
+        std::string name = lower(std::string(line.substr(0, colon)));
+        if (name == "from") field = &row.from;
+        else if (name == "to") field = &row.to;
+        else if (name == "subject") field = &row.subject;
+        else if (name == "date") field = &row.date;
+        else if (name == "message-id") field = &row.message_id;
+
+        // a repeated field keeps its first value
+        if (field != nullptr && !field->empty()) {
+            field = nullptr;
+        }
+        if (field != nullptr) {
+            field->assign(line.substr(colon + 1));
+        }
+    }
+
+    // values are printed as tab separated columns
+    for (std::string *value : {&row.from, &row.to, &row.subject, &row.date, &row.message_id}) {
+        std::replace(value->begin(), value->end(), '\t', ' ');
+        std::size_t first = value->find_first_not_of(' ');
+        std::size_t last = value->find_last_not_of(' ');
+        *value = (first == std::string::npos) ? std::string() : value->substr(first, last - first + 1);
+    }
+}
+
+
+uint32_t Catalog::parseFlags(std::string_view list) {
+    uint32_t flags = 0;
+    while (!list.empty()) {
+        std::size_t space = list.find(' ');
+        std::string flag = lower(std::string(list.substr(0, space)));
+        list = (space == std::string_view::npos) ? std::string_view() : list.substr(space + 1);
+
+        flag.erase(std::remove(flag.begin(), flag.end(), '('), flag.end());
+        flag.erase(std::remove(flag.begin(), flag.end(), ')'), flag.end());
+        if (flag.starts_with('\\')) {
+            try {
+                flags |= flagBit(flag.substr(1));
+            }
+            catch (std::invalid_argument &) { /* \Recent and unknown flags are not kept */ }
+        }
+    }
+    return flags;
+}
+
+
+int64_t Catalog::parseInternalDate(std::string_view value) {
+    std::string date{value};
+    std::replace(date.begin(), date.end(), '"', ' ');
+
+    // "dd-Mon-yyyy hh:mm:ss +zzzz", the day may be padded with a space
+    struct tm tm{};
+    char month[4] = "";
+    char sign = '+';
+    int zone = 0;
+    if (std::sscanf(date.c_str(), " %d-%3s-%d %d:%d:%d %c%d", &tm.tm_mday, month, &tm.tm_year,
+                    &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &sign, &zone) != 8) {
+        return 0;
+    }
+
+    const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *found = strcasestr(months, month);
+    if (found == nullptr || std::strlen(month) != 3 || (found - months) % 3 != 0) {
+        return 0;
+    }
+    tm.tm_mon = (found - months) / 3;
+    tm.tm_year -= 1900;
+
+    int64_t offset = (zone / 100) * 3600 + (zone % 100) * 60;
+    return timegm(&tm) - (sign == '-' ? -offset : offset);
+}
+
+
+uint32_t Catalog::flagBit(const std::string &name) {
+    std::string flag = lower(name);
+    if (flag == "seen") return CATALOG_SEEN;
+    if (flag == "answered") return CATALOG_ANSWERED;
+    if (flag == "flagged") return CATALOG_FLAGGED;
+    if (flag == "deleted") return CATALOG_DELETED;
+    if (flag == "draft") return CATALOG_DRAFT;
+    throw std::invalid_argument("Unknown flag " + name + ", use seen, answered, flagged, deleted or draft.");
+}
+
+
+int64_t Catalog::parseDay(const std::string &day) {
+    struct tm tm{};
+    char rest = '\0';
+    if (std::sscanf(day.c_str(), "%4d-%2d-%2d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &rest) != 3
+        || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31) {
+        throw std::invalid_argument("Date " + day + " is not in YYYY-MM-DD format.");
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
@@ -0,0 +1,197 @@
+/**
+ * @file catalog.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for Catalog class
+ *
+ * Metadata of the messages of one mailbox without their content, kept in the file
+ * <mailbox>.<server>.catalog: UID, size, INTERNALDATE, system flags and the From, To,
+ * Subject, Date and Message-ID header fields as they were at the time of the download.
+ *
+ * The file starts with a header holding UIDVALIDITY and is only ever appended to. Rows
+ * are written in blocks, each one a block header followed by its columns: the numeric
+ * ones as arrays of fixed size values and the text ones as an array of end offsets and
+ * the concatenated values. A query maps the file and compares the numeric columns first,
+ * the text of a row is looked at only when they match.
+ *
+ * A block is written with a checksum, so a block torn by a crash is found and cut off when
+ * the catalog is opened again. Rows are appended in the order of UIDs, the highest one
+ * tells where the next run continues.
+ */
+
+#ifndef CATALOG_HPP
+#define CATALOG_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define CATALOG_MAGIC 0x31544143434d49ULL   // "IMCCAT1"
+#define CATALOG_BLOCK_MAGIC 0x4b4c4231U     // "1BLK"
+#define CATALOG_VERSION 1
+#define CATALOG_BLOCK_ROWS 1000             // rows received before a block is written
+#define CATALOG_FIELDS "FROM TO SUBJECT DATE MESSAGE-ID"
+
+#define CATALOG_SEEN 1
+#define CATALOG_ANSWERED 2
+#define CATALOG_FLAGGED 4
+#define CATALOG_DELETED 8
+#define CATALOG_DRAFT 16
+
+
+/**
+ * @brief Metadata of one message
+ */
+struct CatalogRow {
+    uint64_t uid;
+    uint64_t size;          // RFC822.SIZE
+    int64_t internaldate;   // seconds since the epoch, UTC
+    uint32_t flags;         // CATALOG_SEEN and the others
+    std::string from;       // header fields unfolded, without decoding of encoded words
+    std::string to;
+    std::string subject;
+    std::string date;
+    std::string message_id;
+};
+
+
+/**
+ * @brief Conditions of a query, every given one has to match
+ */
+struct CatalogFilter {
+    std::string from;       // case insensitive substrings, empty matches everything
+    std::string to;
+    std::string subject;
+    int64_t since{0};       // INTERNALDATE at or after, 0 for no limit
+    int64_t before{0};      // INTERNALDATE before, 0 for no limit
+    uint64_t larger{0};     // size above, 0 for no limit
+    uint64_t smaller{0};    // size below, 0 for no limit
+    uint32_t flagged{0};    // flags the message has
+    uint32_t unflagged{0};  // flags the message does not have
+};
+
+
+class Catalog {
+public:
+    /**
+     * @brief Opens or creates the catalog and cuts off a torn last block
+     *
+     * @param dir output directory
+     * @param name mailbox and server part of the file name
+     *
+     * @throw std::runtime_error if the file cannot be opened or is not a catalog
+     */
+    Catalog(const std::string &dir, const std::string &name);
+
+
+    /**
+     * @brief Flushes the appended blocks to the disk and closes the file
+     */
+    ~Catalog();
+
+    Catalog(const Catalog &) = delete;
+    Catalog &operator=(const Catalog &) = delete;
+
+
+    /**
+     * @brief Checks UIDVALIDITY of the mailbox, the catalog starts over when it differs
+     *
+     * @return true when the stored rows are still valid
+     */
+    bool validate(uint64_t uidvalidity);
+
+
+    /**
+     * @brief UID following the highest one in the catalog
+     */
+    uint64_t uidnext() const;
+
+
+    /**
+     * @brief Appends the rows as one block and flushes it to the disk
+     *
+     * @throw std::runtime_error if the block cannot be written
+     */
+    void append(const std::vector<CatalogRow> &rows);
+
+
+    /**
+     * @brief Writes the rows matching the filter to the stream, one tab separated line each
+     *
+     * Maps the file read only, so nothing is created when the catalog does not exist.
+     *
+     * @return number of matching rows
+     *
+     * @throw std::runtime_error if the catalog cannot be read
+     */
+    static unsigned long query(const std::string &dir, const std::string &name, const CatalogFilter &filter, std::ostream &os);
+
+
+    /**
+     * @brief Fills the text columns of the row from a HEADER.FIELDS block
+     */
+    static void parseHeader(std::string_view header, CatalogRow &row);
+
+
+    /**
+     * @brief System flags of a FLAGS list
+     */
+    static uint32_t parseFlags(std::string_view list);
+
+
+    /**
+     * @brief Seconds since the epoch of an INTERNALDATE, 0 when it cannot be parsed
+     */
+    static int64_t parseInternalDate(std::string_view value);
+
+
+    /**
+     * @brief Flag bit of a name as given on the command line, e.g. seen
+     *
+     * @throw std::invalid_argument if the name is not a system flag
+     */
+    static uint32_t flagBit(const std::string &name);
+
+
+    /**
+     * @brief Midnight UTC of a date in YYYY-MM-DD format
+     *
+     * @throw std::invalid_argument if the date is malformed
+     */
+    static int64_t parseDay(const std::string &day);
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t uidvalidity;
+    };
+
+    struct Block {
+        uint32_t magic;
+        uint32_t rows;
+        uint64_t bytes;     // size of the columns following the block header
+        uint64_t last_uid;  // highest UID of the block
+        uint32_t checksum;  // CRC-32 of the columns
+        uint32_t reserved;
+    };
+
+    mutable std::mutex mutex;
+    std::string filename;
+    int fd;
+    uint64_t size;          // end of the last complete block
+    uint64_t next_uid;
+    uint64_t stored_uidvalidity;
+
+
+    /**
+     * @brief Lays out the columns of a block
+     */
+    static std::string encode(const std::vector<CatalogRow> &rows);
+};
+
+#endif
@@ -10,6 +10,9 @@
 #define CONFIG_HPP
 
 #include <string>
+#include <vector>
+
+#include "catalog.hpp"
 
 struct Config {
     std::string server;
@@ -23,6 +26,34 @@ struct Config {
     bool only_new;
     bool only_headers;
     bool secured;
+    int pipeline_depth;
+    int fetch_batch;
+    int jobs;
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    std::string batch_file;
+    int threads;
+    int max_sessions;
+    std::string tls_cache;
+    bool no_tls_cache;
+    bool no_compress;
+    bool idle;
+    bool pack_store;
+    unsigned long segment_size;
+    std::string dedup_dir;
+    int writers;
+    unsigned long write_queue;
+    unsigned long chunk_size;
+    int retries;
+    bool reconcile;
+    bool catalog;
+    bool fulltext;
+    std::string stats_file;
+    std::string stats_format;
+    std::string command;
+    unsigned long uid;
+    CatalogFilter filter;
+    std::vector<std::string> query;
 };
 
 #endif
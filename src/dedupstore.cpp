@@ -0,0 +1,114 @@
+/**
+ * @file dedupstore.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of DedupStore class
+ */
+
+#include "dedupstore.hpp"
+
+#include <cerrno>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+
+Sha256::Sha256() :
+    ctx{EVP_MD_CTX_new()}
+{
+    if (this->ctx == nullptr) {
+        throw std::runtime_error("Cannot create digest context.");
+    }
+}
+
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(this->ctx);
+}
+
+
+void Sha256::reset() {
+    EVP_DigestInit_ex(this->ctx, EVP_sha256(), nullptr);
+}
+
+
+void Sha256::update(const char *data, std::size_t len) {
+    EVP_DigestUpdate(this->ctx, data, len);
+}
+
+
+std::string Sha256::hex() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(this->ctx, md, &len);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned int i = 0; i < len; i++) {
+        out += digits[md[i] >> 4];
+        out += digits[md[i] & 0xf];
+    }
+    return out;
+}
+
+
+DedupStore::DedupStore(const std::string &dir) :
+    dir{dir}
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec) {
+        throw std::runtime_error("Cannot create deduplication directory.");
+    }
+}
+
+
+void DedupStore::store(const std::string &tmpname, const std::string &filename, const std::string &digest, uint64_t size) {
+    std::string subdir = this->dir + "/" + digest.substr(0, 2);
+    std::string object = subdir + "/" + digest.substr(2);
+    std::error_code ec;
+    std::filesystem::create_directory(subdir, ec);
+
+    this->messages++;
+    this->bytes += size;
+
+    // the first copy becomes the object, link() fails when another connection was faster
+    if (link(tmpname.c_str(), object.c_str()) != 0 && errno == EEXIST) {
+        std::string linkname = tmpname + ".link";
+        unlink(linkname.c_str());
+
+        // the link is renamed over the message file, so the file never goes missing
+        if (link(object.c_str(), linkname.c_str()) == 0) {
+            std::filesystem::rename(linkname, filename, ec);
+            if (!ec) {
+                unlink(tmpname.c_str());
+                this->duplicates++;
+                this->saved += size;
+                return;
+            }
+            unlink(linkname.c_str());
+        }
+    }
+
+    std::filesystem::rename(tmpname, filename, ec);
+    if (ec) {
+        throw std::runtime_error("Cannot move a downloaded mail into place.");
+    }
+}
+
+
+void DedupStore::print(std::ostream &os) const {
+    if (this->messages == 0) {
+        return;
+    }
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1)
+         << "Deduplication: " << this->duplicates << " of " << this->messages << " messages already stored, "
+         << this->saved << " of " << this->bytes << " bytes saved ("
+         << (this->bytes ? 100.0 * this->saved / this->bytes : 0.0) << "%).\n";
+    os << line.str() << std::flush;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file dedupstore.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for DedupStore class
+ *
+ * Keeps one copy of every distinct message in a directory of objects named by the SHA-256
+ * of the message, <dir>/<first two hex digits>/<rest of the digest>. Message files in the
+ * output directories are hard links to the objects, so a message present in several
+ * mailboxes or accounts takes the space only once.
+ *
+ * The digest is computed while the message is written, a downloaded copy of a message
+ * already stored is replaced by a link. When a link cannot be made (another file system,
+ * too many links) the downloaded copy is kept as it is.
+ */
+
+#ifndef DEDUPSTORE_HPP
+#define DEDUPSTORE_HPP
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+#include "openssl/evp.h"
+
+
+/**
+ * @brief SHA-256 digest computed incrementally
+ */
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+
+    Sha256(const Sha256 &) = delete;
+    Sha256 &operator=(const Sha256 &) = delete;
+
+
+    /**
+     * @brief Starts a new digest
+     */
+    void reset();
+
+
+    /**
+     * @brief Adds data to the digest
+     */
+    void update(const char *data, std::size_t len);
+
+
+    /**
+     * @brief Finishes the digest
+     *
+     * @return digest as lower case hex
+     */
+    std::string hex();
+
+private:
+    EVP_MD_CTX *ctx;
+};
+
+
+class DedupStore {
+public:
+    /**
+     * @brief Uses the directory for the objects, creating it if needed
+     *
+     * @throw std::runtime_error if the directory cannot be created
+     */
+    explicit DedupStore(const std::string &dir);
+
+
+    /**
+     * @brief Default destructor
+     */
+    ~DedupStore() = default;
+
+    DedupStore(const DedupStore &) = delete;
+    DedupStore &operator=(const DedupStore &) = delete;
+
+
+    /**
+     * @brief Moves a downloaded message to its final name, sharing the data with an equal stored message
+     *
+     * Safe to call from several threads at once.
+     *
+     * @param tmpname file the message was downloaded to, it does not exist afterwards
+     * @param filename final name of the message file
+     * @param digest hex SHA-256 of the message
+     * @param size size of the message in bytes
+     *
+     * @throw std::runtime_error if the message cannot be moved to its final name
+     */
+    void store(const std::string &tmpname, const std::string &filename, const std::string &digest, uint64_t size);
+
+
+    /**
+     * @brief Prints the number of duplicates and the share of bytes saved, nothing when no message was stored
+     */
+    void print(std::ostream &os) const;
+
+private:
+    std::string dir;
+    std::atomic<unsigned long long> messages{0};    // messages passed to store()
+    std::atomic<unsigned long long> duplicates{0};  // messages replaced by a link to a stored object
+    std::atomic<unsigned long long> bytes{0};       // size of all messages
+    std::atomic<unsigned long long> saved{0};       // size of the duplicates
+};
+
+#endif
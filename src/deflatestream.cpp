@@ -0,0 +1,101 @@
+/**
+ * @file deflatestream.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of DeflateStream class
+ */
+
+#include "deflatestream.hpp"
+
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+
+void TransferStats::print(std::ostream &os) const {
+    if (this->received == 0) {
+        return;
+    }
+
+    auto ratio = [](unsigned long long plain, unsigned long long compressed) {
+        return compressed ? static_cast<double>(plain) / compressed : 1.0;
+    };
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(2)
+         << "Compression: received " << this->received << " bytes (" << this->inflated << " uncompressed, "
+         << ratio(this->inflated, this->received) << "x), sent " << this->sent << " bytes ("
+         << this->deflated << " uncompressed, " << ratio(this->deflated, this->sent) << "x).\n";
+    os << line.str() << std::flush;
+}
+
+
+DeflateStream::DeflateStream(std::shared_ptr<TransferStats> stats) :
+    in{},
+    out{},
+    stats{stats}
+{
+    // negative window bits select raw deflate without zlib header and checksum
+    if (inflateInit2(&this->in, -MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("Cannot initialize decompression.");
+    }
+
+    if (deflateInit2(&this->out, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        inflateEnd(&this->in);
+        throw std::runtime_error("Cannot initialize compression.");
+    }
+}
+
+
+DeflateStream::~DeflateStream() {
+    inflateEnd(&this->in);
+    deflateEnd(&this->out);
+}
+
+
+void DeflateStream::inflate(const char *data, std::size_t len, InputBuffer &buff) {
+    this->in.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    this->in.avail_in = len;
+    std::size_t produced = 0;
+
+    // a small block can expand a lot, so inflate until zlib has nothing more to give
+    do {
+        this->in.next_out = reinterpret_cast<Bytef *>(buff.prepare(INFLATE_CHUNK));
+        this->in.avail_out = INFLATE_CHUNK;
+
+        int ret = ::inflate(&this->in, Z_SYNC_FLUSH);
+        buff.commit(INFLATE_CHUNK - this->in.avail_out);
+        produced += INFLATE_CHUNK - this->in.avail_out;
+
+        if (ret == Z_BUF_ERROR) {
+            break; // no progress possible, everything is consumed
+        }
+        if (ret != Z_OK) {
+            throw std::runtime_error("Cannot decompress data from the server.");
+        }
+    } while (this->in.avail_in > 0 || this->in.avail_out == 0);
+
+    this->stats->received += len;
+    this->stats->inflated += produced;
+}
+
+
+void DeflateStream::deflate(const std::string &data, std::string &buff) {
+    this->out.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    this->out.avail_in = data.size();
+    std::size_t start = buff.size();
+
+    do {
+        std::size_t used = buff.size();
+        std::size_t chunk = deflateBound(&this->out, this->out.avail_in) + 16;
+        buff.resize(used + chunk);
+        this->out.next_out = reinterpret_cast<Bytef *>(buff.data() + used);
+        this->out.avail_out = chunk;
+
+        ::deflate(&this->out, Z_SYNC_FLUSH);
+        buff.resize(used + chunk - this->out.avail_out);
+    } while (this->out.avail_out == 0);
+
+    this->stats->sent += buff.size() - start;
+    this->stats->deflated += data.size();
+}
@@ -0,0 +1,83 @@
+/**
+ * @file deflatestream.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for DeflateStream class
+ *
+ * Implements the transport compression of IMAP COMPRESS=DEFLATE (RFC 4978). Both directions
+ * are raw deflate streams without zlib headers, every command sent is ended by a sync flush,
+ * so the server can process it without waiting for more data.
+ */
+
+#ifndef DEFLATESTREAM_HPP
+#define DEFLATESTREAM_HPP
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include <zlib.h>
+
+#include "inputbuffer.hpp"
+
+#define INFLATE_CHUNK 16384     // free space requested from the input buffer for one inflate call
+
+
+/**
+ * @brief Byte counts of compressed connections, shared by all connections of one run
+ */
+struct TransferStats {
+    std::atomic<unsigned long long> received{0};    // compressed bytes read from the socket
+    std::atomic<unsigned long long> inflated{0};    // bytes after decompression
+    std::atomic<unsigned long long> sent{0};        // compressed bytes written to the socket
+    std::atomic<unsigned long long> deflated{0};    // bytes before compression
+
+    /**
+     * @brief Prints compressed and uncompressed byte counts, nothing when no connection was compressed
+     */
+    void print(std::ostream &os) const;
+};
+
+
+class DeflateStream {
+public:
+    /**
+     * @brief Initializes both directions of the stream
+     *
+     * @param stats counters updated with every block of data
+     *
+     * @throw std::runtime_error if zlib cannot be initialized
+     */
+    explicit DeflateStream(std::shared_ptr<TransferStats> stats);
+
+
+    /**
+     * @brief Frees zlib state
+     */
+    ~DeflateStream();
+
+    DeflateStream(const DeflateStream &) = delete;
+    DeflateStream &operator=(const DeflateStream &) = delete;
+
+
+    /**
+     * @brief Decompresses data read from the socket and appends them to the buffer
+     *
+     * @throw std::runtime_error if the data are not a valid deflate stream
+     */
+    void inflate(const char *data, std::size_t len, InputBuffer &out);
+
+
+    /**
+     * @brief Compresses data and appends them to out, flushed so the peer can decompress all of it
+     */
+    void deflate(const std::string &data, std::string &out);
+
+private:
+    z_stream in;        // state of the server to client direction
+    z_stream out;       // state of the client to server direction
+    std::shared_ptr<TransferStats> stats;
+};
+
+#endif
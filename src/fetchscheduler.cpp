@@ -0,0 +1,166 @@
+/**
+ * @file fetchscheduler.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of FetchScheduler class
+ */
+
+#include "fetchscheduler.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include "uidset.hpp"
+
+FetchScheduler::FetchScheduler(const std::vector<std::pair<unsigned long, uint64_t>> &sizes, unsigned int connections,
+                               unsigned long max_uids) :
+    queues(std::max(connections, 1U)),
+    started{std::chrono::steady_clock::now()}
+{
+    // consecutive small messages go to one batch, in turns to the connections so they advance through the UIDs together
+    std::vector<std::pair<unsigned long, uint64_t>> large_messages;
+
+    // a few small messages are still split so that every connection gets some
+    unsigned long nsmall = std::count_if(sizes.begin(), sizes.end(), [](const auto &entry) { return entry.second < SCHEDULE_LARGE; });
+    unsigned long share = (nsmall + this->queues.size() - 1) / this->queues.size();
+    if (max_uids == 0 || share < max_uids) {
+        max_uids = std::max(share, 1UL);
+    }
+
+    UidSet batch;
+    Item item{"", 0, 0};
+    std::size_t turn = 0;
+    auto deal = [&]() {
+        if (item.messages == 0) {
+            return;
+        }
+        item.set = batch.toString();
+        Queue &q = this->queues[turn++ % this->queues.size()];
+        q.bytes += item.bytes;
+        q.items.push_back(std::move(item));
+        this->nbatches++;
+        batch.clear();
+        item = Item{"", 0, 0};
+    };
+
+    for (const auto &[uid, size] : sizes) {
+        this->total += size;
+        if (size >= SCHEDULE_LARGE) {
+            large_messages.emplace_back(uid, size);
+            continue;
+        }
+        batch.add(uid);
+        item.messages++;
+        item.bytes += size;
+        this->small++;
+        if ((max_uids != 0 && item.messages >= max_uids) || item.bytes >= SCHEDULE_BATCH_BYTES) {
+            deal();
+        }
+    }
+    deal();
+
+    // the largest first, each to the queue with the fewest bytes, then every queue gets its share from the smallest
+    std::sort(large_messages.begin(), large_messages.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    std::vector<std::vector<Item>> shares(this->queues.size());
+    std::vector<uint64_t> load(this->queues.size());
+    for (std::size_t i = 0; i < this->queues.size(); i++) {
+        load[i] = this->queues[i].bytes;
+    }
+    for (const auto &[uid, size] : large_messages) {
+        std::size_t i = std::min_element(load.begin(), load.end()) - load.begin();
+        load[i] += size;
+        shares[i].push_back(Item{std::to_string(uid), 1, size});
+    }
+    for (std::size_t i = 0; i < this->queues.size(); i++) {
+        for (auto it = shares[i].rbegin(); it != shares[i].rend(); it++) {
+            this->queues[i].bytes += it->bytes;
+            this->queues[i].items.push_back(std::move(*it));
+        }
+    }
+    this->large = large_messages.size();
+}
+
+
+bool FetchScheduler::next(unsigned int connection, bool busy, std::string &set) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Queue &own = this->queues[connection];
+
+    if (!own.items.empty()) {
+        Item &item = own.items.front();
+        if (busy && item.bytes >= SCHEDULE_LARGE) {
+            return false;
+        }
+        set = std::move(item.set);
+        own.bytes -= item.bytes;
+        own.fetched += item.bytes;
+        own.items.pop_front();
+        return true;
+    }
+
+    // an idle connection takes over the last item of the connection with the most work left
+    Queue *victim = nullptr;
+    for (Queue &q : this->queues) {
+        if (!q.items.empty() && (victim == nullptr || q.bytes > victim->bytes)) {
+            victim = &q;
+        }
+    }
+    if (victim == nullptr || (busy && victim->items.back().bytes >= SCHEDULE_LARGE)) {
+        return false;
+    }
+
+    Item &item = victim->items.back();
+    set = std::move(item.set);
+    victim->bytes -= item.bytes;
+    own.fetched += item.bytes;
+    this->stolen++;
+    this->stolen_bytes += item.bytes;
+    victim->items.pop_back();
+    return true;
+}
+
+
+void FetchScheduler::delivered() {
+    if (!this->first.exchange(true)) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->first_stored = std::chrono::steady_clock::now();
+    }
+}
+
+
+void FetchScheduler::finished(unsigned int connection) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->queues[connection].done = std::chrono::steady_clock::now();
+}
+
+
+void FetchScheduler::print(std::ostream &os) const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    using ms = std::chrono::duration<double, std::milli>;
+
+    // connections which failed never finish, the spread is over those which did
+    auto earliest = std::chrono::steady_clock::time_point::max();
+    auto latest = this->started;
+    for (const Queue &q : this->queues) {
+        if (q.done != std::chrono::steady_clock::time_point{}) {
+            earliest = std::min(earliest, q.done);
+            latest = std::max(latest, q.done);
+        }
+    }
+    double secs = std::chrono::duration<double>(latest - this->started).count();
+
+    std::ostringstream line;
+    line.precision(1);
+    line << std::fixed << "Scheduling: " << this->small << " small messages in " << this->nbatches << " batches, "
+         << this->large << " large fetched alone on " << this->queues.size() << " connections, " << this->stolen
+         << " taken over by idle connections (" << this->stolen_bytes << " bytes)";
+    if (this->first) {
+        line << ", first message stored after " << ms(this->first_stored - this->started).count() << " ms";
+    }
+    if (earliest <= latest) {
+        line << ", connections finished within " << ms(latest - earliest).count() << " ms of each other";
+    }
+    if (secs > 0) {
+        line << ", " << this->total / secs / (1024 * 1024) << " MB/s";
+    }
+    os << line.str() << ".\n" << std::flush;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file fetchscheduler.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for FetchScheduler class
+ *
+ * Shares the messages of a parallel download among the connections by their sizes. Small
+ * messages are requested in batches of consecutive UIDs limited by count and bytes, large
+ * ones each by a FETCH of its own, so a small message never waits behind a large one in
+ * the same response.
+ *
+ * Every connection has a queue of its own: the batches of small messages dealt out in
+ * turns and then the large messages, each given to the queue with the fewest bytes. A
+ * connection takes from the front of its queue, so the small messages come first. A
+ * connection with an empty queue takes the last item of the queue with the most bytes
+ * left, so all connections stay busy until the end and finish at about the same time.
+ */
+
+#ifndef FETCHSCHEDULER_HPP
+#define FETCHSCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define SCHEDULE_LARGE (1024 * 1024)            // messages of this size and larger are fetched alone
+#define SCHEDULE_BATCH_BYTES (8 * 1024 * 1024)  // bytes of small messages requested by one FETCH
+#define SCHEDULE_SIZE_BATCH 10000               // UIDs of one FETCH of RFC822.SIZE
+
+
+class FetchScheduler {
+public:
+    /**
+     * @brief Splits the messages into batches and large ones and deals them out
+     *
+     * @param sizes UIDs in ascending order with their RFC822.SIZE
+     * @param connections number of connections taking the work
+     * @param max_uids maximal number of small messages in one batch
+     */
+    FetchScheduler(const std::vector<std::pair<unsigned long, uint64_t>> &sizes, unsigned int connections, unsigned long max_uids);
+
+    FetchScheduler(const FetchScheduler &) = delete;
+    FetchScheduler &operator=(const FetchScheduler &) = delete;
+
+
+    /**
+     * @brief Gives the sequence-set of the next FETCH of the connection
+     *
+     * Takes from the front of the queue of the connection, or from the back of the fullest
+     * queue when its own is empty. A large message is given only to a connection without
+     * commands in flight, one queued behind others could not be taken by an idle connection.
+     *
+     * @param connection index of the connection
+     * @param busy the connection has commands in flight
+     * @param set filled with the sequence-set
+     *
+     * @return false when there is nothing for the connection now
+     */
+    bool next(unsigned int connection, bool busy, std::string &set);
+
+
+    /**
+     * @brief Notes that a message was stored, the first one is reported
+     */
+    void delivered();
+
+
+    /**
+     * @brief Notes that the connection received all the messages it took
+     */
+    void finished(unsigned int connection);
+
+
+    /**
+     * @brief Writes the batches, the work taken over and the timing as a line of the run summary
+     */
+    void print(std::ostream &os) const;
+
+private:
+    struct Item {
+        std::string set;        // sequence-set of the FETCH
+        unsigned long messages;
+        uint64_t bytes;
+    };
+
+    struct Queue {
+        std::deque<Item> items;
+        uint64_t bytes{0};      // bytes of the items left
+        uint64_t fetched{0};    // bytes of the items taken by the connection
+        std::chrono::steady_clock::time_point done; // when the connection received its last message
+    };
+
+    mutable std::mutex mutex;
+    std::vector<Queue> queues;
+    std::chrono::steady_clock::time_point started;
+    std::atomic<bool> first{false};
+    std::chrono::steady_clock::time_point first_stored;
+    unsigned long small{0};     // messages fetched in batches
+    unsigned long nbatches{0};
+    unsigned long large{0};     // messages fetched alone
+    unsigned long stolen{0};    // items taken from the queue of another connection
+    uint64_t stolen_bytes{0};
+    uint64_t total{0};          // bytes of all messages
+};
+
+#endif
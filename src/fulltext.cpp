@@ -0,0 +1,958 @@
+/**
+ * @file fulltext.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of FullTextIndex class
+ */
+
+#include "fulltext.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define FULLTEXT_MAX_DEPTH 8    // nesting of multipart bodies and attached messages that is looked into
+
+
+struct SegmentHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t uidvalidity;
+    uint64_t nranges;       // covered UID ranges following the header, first and last UID each
+    uint64_t nterms;
+    uint64_t dictionary;    // offset of the dictionary, the terms follow it
+    uint64_t strings;       // size of the terms
+};
+
+struct TermEntry {
+    uint64_t postings;      // offset of the posting list in the file
+    uint32_t term;          // offset of the term from the start of the terms
+    uint32_t term_len;
+    uint32_t length;        // size of the posting list in bytes
+    uint32_t docs;          // number of messages in the posting list
+};
+
+
+static void putVarint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+
+static uint64_t getVarint(const char *&p, const char *end) {
+    uint64_t value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+
+static std::string lower(std::string_view s) {
+    std::string out{s};
+    for (char &c : out) {
+        c = std::tolower(static_cast<unsigned char>(c));
+    }
+    return out;
+}
+
+
+/**
+ * @brief Segment file mapped read only
+ */
+struct SegmentView {
+    const char *base{nullptr};
+    std::size_t size{0};
+    const SegmentHeader *header{nullptr};
+    const uint64_t *ranges{nullptr};
+    const TermEntry *dictionary{nullptr};
+    const char *strings{nullptr};
+
+    SegmentView(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("Cannot open full-text segment " + filename + ".");
+        }
+        this->size = st.st_size;
+        void *mapping = this->size > 0 ? mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Cannot map full-text segment " + filename + ".");
+        }
+        this->base = static_cast<const char *>(mapping);
+
+        this->header = reinterpret_cast<const SegmentHeader *>(this->base);
+        const SegmentHeader &h = *this->header;
+        if (this->size < sizeof(SegmentHeader) || h.magic != FULLTEXT_MAGIC || h.version != FULLTEXT_VERSION
+            || sizeof(SegmentHeader) + h.nranges * 2 * sizeof(uint64_t) > this->size || h.dictionary > this->size
+            || h.nterms > (this->size - h.dictionary) / sizeof(TermEntry)
+            || h.dictionary + h.nterms * sizeof(TermEntry) + h.strings > this->size) {
+            munmap(const_cast<char *>(this->base), this->size);
+            throw std::runtime_error("Full-text segment " + filename + " is damaged or of another version.");
+        }
+        this->ranges = reinterpret_cast<const uint64_t *>(this->base + sizeof(SegmentHeader));
+        this->dictionary = reinterpret_cast<const TermEntry *>(this->base + h.dictionary);
+        this->strings = this->base + h.dictionary + h.nterms * sizeof(TermEntry);
+    }
+
+    ~SegmentView() {
+        munmap(const_cast<char *>(this->base), this->size);
+    }
+
+    SegmentView(const SegmentView &) = delete;
+    SegmentView &operator=(const SegmentView &) = delete;
+
+    std::string_view term(const TermEntry &entry) const {
+        return std::string_view(this->strings + entry.term, entry.term_len);
+    }
+
+    std::string_view postings(const TermEntry &entry) const {
+        if (entry.postings + entry.length > this->size) {
+            return std::string_view();
+        }
+        return std::string_view(this->base + entry.postings, entry.length);
+    }
+
+    const TermEntry *find(std::string_view word) const {
+        const TermEntry *end = this->dictionary + this->header->nterms;
+        const TermEntry *it = std::lower_bound(this->dictionary, end, word, [this](const TermEntry &entry, std::string_view w) {
+            return this->term(entry) < w;
+        });
+        return (it != end && this->term(*it) == word) ? it : nullptr;
+    }
+};
+
+
+/**
+ * @brief Message of a posting list, positions still encoded
+ */
+struct DocPositions {
+    uint64_t uid;
+    std::string_view positions;
+};
+
+
+static std::vector<DocPositions> decodeList(std::string_view list) {
+    std::vector<DocPositions> docs;
+    const char *p = list.data();
+    const char *end = list.data() + list.size();
+    uint64_t uid = 0;
+    while (p < end) {
+        uid += getVarint(p, end);
+        const char *start = p;
+        uint64_t count = getVarint(p, end);
+        for (uint64_t i = 0; i < count && p < end; i++) {
+            getVarint(p, end);
+        }
+        docs.push_back(DocPositions{uid, std::string_view(start, p - start)});
+    }
+    return docs;
+}
+
+
+static std::vector<uint32_t> decodePositions(std::string_view encoded) {
+    const char *p = encoded.data();
+    const char *end = encoded.data() + encoded.size();
+    uint64_t count = getVarint(p, end);
+    std::vector<uint32_t> positions;
+    uint32_t position = 0;
+    for (uint64_t i = 0; i < count && p < end; i++) {
+        position += getVarint(p, end);
+        positions.push_back(position);
+    }
+    return positions;
+}
+
+
+/**
+ * @brief Writes a file through a temporary one, in large blocks
+ */
+class SegmentFile {
+public:
+    explicit SegmentFile(const std::string &filename) :
+        filename{filename},
+        tmpname{filename + ".tmp"},
+        fd{open(this->tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)},
+        written{0}
+    {
+        if (this->fd < 0) {
+            throw std::runtime_error("Cannot create full-text segment " + filename + ".");
+        }
+    }
+
+    ~SegmentFile() {
+        if (this->fd >= 0) {
+            close(this->fd);
+            unlink(this->tmpname.c_str());
+        }
+    }
+
+    uint64_t offset() const { return this->written + this->out.size(); }
+
+    void append(std::string_view data) {
+        this->out.append(data);
+        if (this->out.size() >= 1024 * 1024) {
+            this->drain();
+        }
+    }
+
+    void pad() {
+        this->out.append(7 - (this->offset() + 7) % 8, '\0');
+    }
+
+    // writes the header over the placeholder and moves the file into place
+    uint64_t commit(const SegmentHeader &header) {
+        this->drain();
+        uint64_t size = this->written;
+        if (pwrite(this->fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(this->fd) != 0 || close(this->fd) != 0) {
+            throw std::runtime_error("Cannot write full-text segment " + this->filename + ".");
+        }
+        this->fd = -1;
+        if (rename(this->tmpname.c_str(), this->filename.c_str()) != 0) {
+            unlink(this->tmpname.c_str());
+            throw std::runtime_error("Cannot write full-text segment " + this->filename + ".");
+        }
+        return size;
+    }
+
+private:
+    std::string filename;
+    std::string tmpname;
+    int fd;
+    uint64_t written;
+    std::string out;
+
+    void drain() {
+        const char *data = this->out.data();
+        std::size_t len = this->out.size();
+        while (len > 0) {
+            ssize_t n = ::write(this->fd, data, len);
+            if (n < 0) {
+                throw std::runtime_error("Cannot write full-text segment " + this->filename + ".");
+            }
+            data += n;
+            len -= n;
+        }
+        this->written += this->out.size();
+        this->out.clear();
+    }
+};
+
+
+/**
+ * @brief Lays out the ranges, posting lists and dictionary of a segment
+ *
+ * Terms have to be added in sorted order, each with its complete posting list.
+ */
+class SegmentBuilder {
+public:
+    SegmentBuilder(const std::string &filename, const UidSet &uids, uint64_t uidvalidity) :
+        file{filename},
+        header{FULLTEXT_MAGIC, FULLTEXT_VERSION, 0, uidvalidity, uids.ranges().size(), 0, 0, 0}
+    {
+        this->file.append(std::string(sizeof(SegmentHeader), '\0'));
+        for (const UidSet::Interval &range : uids.ranges()) {
+            uint64_t bounds[2] = {range.first, range.second};
+            this->file.append(std::string_view(reinterpret_cast<const char *>(bounds), sizeof(bounds)));
+        }
+    }
+
+    void add(std::string_view term, std::string_view postings, uint32_t docs) {
+        this->dictionary.push_back(TermEntry{this->file.offset(), static_cast<uint32_t>(this->strings.size()),
+                                             static_cast<uint32_t>(term.size()), static_cast<uint32_t>(postings.size()), docs});
+        this->strings.append(term);
+        this->file.append(postings);
+    }
+
+    uint64_t commit() {
+        this->file.pad();
+        this->header.nterms = this->dictionary.size();
+        this->header.dictionary = this->file.offset();
+        this->header.strings = this->strings.size();
+        this->file.append(std::string_view(reinterpret_cast<const char *>(this->dictionary.data()),
+                                           this->dictionary.size() * sizeof(TermEntry)));
+        this->file.append(this->strings);
+        return this->file.commit(this->header);
+    }
+
+private:
+    SegmentFile file;
+    SegmentHeader header;
+    std::vector<TermEntry> dictionary;
+    std::string strings;
+};
+
+
+/* Text of a message */
+
+/**
+ * @brief Collects the positions of the words of one message
+ */
+struct Collector {
+    uint32_t position{0};
+    std::unordered_map<std::string, std::vector<uint32_t>> terms;
+
+    // the gap keeps phrases from spanning two fields
+    void text(std::string_view text) {
+        std::string word;
+        auto emit = [this, &word]() {
+            if (!word.empty() && word.size() <= FULLTEXT_MAX_TOKEN) {
+                this->terms[word].push_back(this->position++);
+            }
+            word.clear();
+        };
+        for (char c : text) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (std::isalnum(u) || u >= 0x80) {
+                word += std::tolower(u);
+            }
+            else {
+                emit();
+            }
+        }
+        emit();
+        this->position++;
+    }
+};
+
+
+static std::string decodeBase64(std::string_view data) {
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    uint32_t bits = 0;
+    int nbits = 0;
+    for (char c : data) {
+        std::size_t value = alphabet.find(c);
+        if (c == '=') {
+            break;
+        }
+        if (value == std::string::npos) {
+            continue;
+        }
+        bits = (bits << 6) | value;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out += static_cast<char>((bits >> nbits) & 0xff);
+        }
+    }
+    return out;
+}
+
+
+static std::string decodeQuotedPrintable(std::string_view data, bool underscore) {
+    std::string out;
+    for (std::size_t i = 0; i < data.size(); i++) {
+        if (data[i] == '=' && i + 2 < data.size() && std::isxdigit(static_cast<unsigned char>(data[i + 1]))
+            && std::isxdigit(static_cast<unsigned char>(data[i + 2]))) {
+            out += static_cast<char>(std::stoi(std::string(data.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        }
+        // soft line break
+        else if (data[i] == '=' && i + 1 < data.size() && (data[i + 1] == '\r' || data[i + 1] == '\n')) {
+            i += (data[i + 1] == '\r' && i + 2 < data.size() && data[i + 2] == '\n') ? 2 : 1;
+        }
+        else {
+            out += (underscore && data[i] == '_') ? ' ' : data[i];
+        }
+    }
+    return out;
+}
+
+
+// =?charset?B?...?= and =?charset?Q?...?= of RFC 2047, the charset is not converted
+static std::string decodeWords(std::string_view value) {
+    std::string out;
+    std::size_t pos = 0;
+    while (pos < value.size()) {
+        std::size_t start = value.find("=?", pos);
+        if (start == std::string_view::npos) {
+            break;
+        }
+        std::size_t q1 = value.find('?', start + 2);
+        std::size_t q2 = q1 == std::string_view::npos ? q1 : value.find('?', q1 + 1);
+        std::size_t stop = q2 == std::string_view::npos ? q2 : value.find("?=", q2 + 1);
+        if (stop == std::string_view::npos || q2 != q1 + 2) {
+            break;
+        }
+        out.append(value.substr(pos, start - pos));
+        std::string_view text = value.substr(q2 + 1, stop - q2 - 1);
+        char encoding = std::toupper(static_cast<unsigned char>(value[q1 + 1]));
+        out += encoding == 'B' ? decodeBase64(text) : decodeQuotedPrintable(text, true);
+        pos = stop + 2;
+    }
+    out.append(value.substr(std::min(pos, value.size())));
+    return out;
+}
+
+
+static std::string stripHtml(std::string_view html) {
+    std::string out;
+    std::size_t pos = 0;
+    while (pos < html.size()) {
+        std::size_t open = html.find('<', pos);
+        out.append(html.substr(pos, open - pos));
+        if (open == std::string_view::npos) {
+            break;
+        }
+        out += ' ';
+
+        // content of style and script elements is not text
+        std::string tag = lower(html.substr(open + 1, 7));
+        std::string_view closing = tag.starts_with("style") ? "</style" : tag.starts_with("script") ? "</script" : "";
+        std::size_t close = html.find('>', open);
+        if (!closing.empty()) {
+            std::string rest = lower(html.substr(open));
+            std::size_t end = rest.find(closing);
+            close = end == std::string::npos ? std::string_view::npos : html.find('>', open + end);
+        }
+        pos = close == std::string_view::npos ? html.size() : close + 1;
+    }
+    return out;
+}
+
+
+// value of a parameter of a Content-Type field, e.g. boundary
+static std::string parameter(std::string_view field, std::string_view name) {
+    std::string lowered = lower(field);
+    std::size_t pos = 0;
+    while ((pos = lowered.find(name, pos)) != std::string::npos) {
+        std::size_t eq = pos + name.size();
+        bool starts = pos > 0 && (lowered[pos - 1] == ';' || lowered[pos - 1] == ' ' || lowered[pos - 1] == '\t');
+        if (starts && eq < lowered.size() && lowered[eq] == '=') {
+            std::string_view value = field.substr(eq + 1);
+            if (value.starts_with('"')) {
+                return std::string(value.substr(1, value.find('"', 1) - 1));
+            }
+            return std::string(value.substr(0, value.find_first_of("; \t")));
+        }
+        pos = eq;
+    }
+    return "";
+}
+
+
+static void collectEntity(std::string_view entity, int depth, bool message, Collector &collector);
+
+
+static void collectBody(std::string_view body, const std::string &type, const std::string &encoding, int depth, Collector &collector) {
+    std::string media = lower(type.substr(0, type.find(';')));
+    media.erase(std::remove_if(media.begin(), media.end(), [](unsigned char c) { return std::isspace(c); }), media.end());
+
+    if (media.starts_with("multipart/")) {
+        std::string boundary = parameter(type, "boundary");
+        if (boundary.empty()) {
+            return;
+        }
+
+        // parts lie between lines starting with --boundary, the last one ends with --boundary--
+        std::string delimiter = "--" + boundary;
+        std::size_t pos = body.find(delimiter);
+        while (pos != std::string_view::npos) {
+            std::size_t start = body.find('\n', pos);
+            if (start == std::string_view::npos || body.substr(pos + delimiter.size()).starts_with("--")) {
+                break;
+            }
+            std::size_t next = body.find("\n" + delimiter, start);
+            collectEntity(body.substr(start + 1, next == std::string_view::npos ? std::string_view::npos : next - start), depth + 1, false, collector);
+            pos = next == std::string_view::npos ? next : next + 1;
+        }
+        return;
+    }
+
+    std::string encoded = lower(encoding);
+    std::string decoded = encoded.find("base64") != std::string::npos ? decodeBase64(body)
+                          : encoded.find("quoted-printable") != std::string::npos ? decodeQuotedPrintable(body, false)
+                          : std::string(body);
+
+    if (media == "message/rfc822") {
+        collectEntity(decoded, depth + 1, true, collector);
+    }
+    else if (media == "text/html") {
+        collector.text(stripHtml(decoded));
+    }
+    else if (media.empty() || media.starts_with("text/")) {
+        collector.text(decoded);
+    }
+}
+
+
+// header and body of a message, or of a body part when message is false
+static void collectEntity(std::string_view entity, int depth, bool message, Collector &collector) {
+    if (depth > FULLTEXT_MAX_DEPTH) {
+        return;
+    }
+
+    std::string type;
+    std::string encoding;
+    std::string *field = nullptr;
+    std::string value;
+    bool indexed = false;
+    auto finish = [&]() {
+        if (indexed) {
+            collector.text(decodeWords(value));
+        }
+        indexed = false;
+        value.clear();
+    };
+
+    std::size_t pos = 0;
+    while (pos < entity.size()) {
+        std::size_t eol = entity.find('\n', pos);
+        std::string_view line = entity.substr(pos, eol == std::string_view::npos ? std::string_view::npos : eol - pos);
+        pos = eol == std::string_view::npos ? entity.size() : eol + 1;
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+
+        // empty line ends the header
+        if (line.empty()) {
+            break;
+        }
+        if (line[0] == ' ' || line[0] == '\t') {
+            if (field != nullptr) *field += line;
+            if (indexed) value += line;
+            continue;
+        }
+
+        finish();
+        field = nullptr;
+        std::size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        std::string name = lower(line.substr(0, colon));
+        std::string_view rest = line.substr(colon + 1);
+        if (name == "content-type") {
+            field = &type;
+            type.assign(rest);
+        }
+        else if (name == "content-transfer-encoding") {
+            field = &encoding;
+            encoding.assign(rest);
+        }
+        else if (message && (name == "from" || name == "to" || name == "cc" || name == "subject")) {
+            indexed = true;
+            value.assign(rest);
+        }
+    }
+    finish();
+
+    collectBody(entity.substr(std::min(pos, entity.size())), type, encoding, depth, collector);
+}
+
+
+/* FullTextIndex */
+
+FullTextIndex::FullTextIndex(const std::string &dir, const std::string &name) :
+    prefix{dir + "/" + name},
+    uidvalidity{0},
+    segments{},
+    indexed{},
+    pending{},
+    buffer{},
+    buffered{0}
+{
+    std::string start = name + ".fts.";
+    std::error_code ec;
+    for (const auto &file : std::filesystem::directory_iterator(dir, ec)) {
+        std::string filename = file.path().filename().string();
+        std::string number = filename.substr(std::min(start.size(), filename.size()));
+        if (filename.starts_with(start) && !number.empty() && number.size() <= 9
+            && number.find_first_not_of("0123456789") == std::string::npos) {
+            this->segments.push_back(Segment{static_cast<uint32_t>(std::stoul(number)), 0});
+        }
+    }
+    std::sort(this->segments.begin(), this->segments.end(), [](const Segment &a, const Segment &b) {
+        return a.number < b.number;
+    });
+
+    for (Segment &segment : this->segments) {
+        SegmentView view(segmentName(this->prefix, segment.number));
+        segment.size = view.size;
+        for (uint64_t i = 0; i < view.header->nranges; i++) {
+            this->indexed.add(view.ranges[2 * i], view.ranges[2 * i + 1]);
+        }
+
+        // segments of different UIDVALIDITY are all removed by validate()
+        if (segment.number == this->segments.front().number) {
+            this->uidvalidity = view.header->uidvalidity;
+        }
+        else if (this->uidvalidity != view.header->uidvalidity) {
+            this->uidvalidity = 0;
+        }
+    }
+}
+
+
+FullTextIndex::~FullTextIndex() {
+    try {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->flushLocked();
+    }
+    catch (std::runtime_error &e) {
+        std::cerr << std::string("Full-text index: ") + e.what() + "\n";
+    }
+}
+
+
+std::string FullTextIndex::segmentName(const std::string &prefix, uint32_t number) {
+    char num[16];
+    std::snprintf(num, sizeof(num), ".fts.%06u", number);
+    return prefix + num;
+}
+
+
+void FullTextIndex::validate(uint64_t uidvalidity) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->uidvalidity == uidvalidity) {
+        return;
+    }
+
+    // words of another UIDVALIDITY belong to other messages
+    for (const Segment &segment : this->segments) {
+        unlink(segmentName(this->prefix, segment.number).c_str());
+    }
+    this->segments.clear();
+    this->indexed.clear();
+    this->pending.clear();
+    this->buffer.clear();
+    this->buffered = 0;
+    this->uidvalidity = uidvalidity;
+}
+
+
+UidSet FullTextIndex::covered() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->indexed;
+}
+
+
+void FullTextIndex::add(uint64_t uid, std::string_view message) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->indexed.contains(uid)) {
+            return;
+        }
+    }
+
+    // tokenizing is left outside of the lock, writers of several connections index at once
+    Collector collector;
+    collectEntity(message.substr(0, FULLTEXT_MESSAGE_LIMIT), 0, true, collector);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->indexed.contains(uid)) {
+        return;
+    }
+    this->indexed.add(uid);
+    this->pending.add(uid);
+
+    for (auto &[term, positions] : collector.terms) {
+        Posting posting{uid, ""};
+        putVarint(posting.positions, positions.size());
+        uint32_t previous = 0;
+        for (uint32_t position : positions) {
+            putVarint(posting.positions, position - previous);
+            previous = position;
+        }
+        this->buffered += term.size() + posting.positions.size() + sizeof(Posting);
+        this->buffer[term].push_back(std::move(posting));
+    }
+
+    if (this->buffered >= FULLTEXT_BUFFER) {
+        this->flushLocked();
+    }
+}
+
+
+void FullTextIndex::addFile(uint64_t uid, const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        // expunged meanwhile
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    std::string message(std::min<uint64_t>(st.st_size, FULLTEXT_MESSAGE_LIMIT), '\0');
+    ssize_t n = pread(fd, message.data(), message.size(), 0);
+    close(fd);
+    if (n > 0) {
+        message.resize(n);
+        this->add(uid, message);
+    }
+}
+
+
+void FullTextIndex::flush() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->flushLocked();
+}
+
+
+void FullTextIndex::flushLocked() {
+    if (this->pending.empty()) {
+        return;
+    }
+
+    Terms terms;
+    terms.reserve(this->buffer.size());
+    for (auto &entry : this->buffer) {
+        terms.emplace_back(entry.first, std::move(entry.second));
+    }
+    UidSet uids = std::move(this->pending);
+    this->buffer.clear();
+    this->pending.clear();
+    this->buffered = 0;
+
+    std::sort(terms.begin(), terms.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (auto &entry : terms) {
+        std::sort(entry.second.begin(), entry.second.end(), [](const Posting &a, const Posting &b) { return a.uid < b.uid; });
+    }
+
+    uint32_t number = this->segments.empty() ? 1 : this->segments.back().number + 1;
+    try {
+        this->segments.push_back(Segment{number, this->writeSegment(number, terms, uids)});
+    }
+    catch (std::runtime_error &) {
+        // the messages are indexed from their files by the next run
+        this->indexed.remove(uids);
+        throw;
+    }
+    this->merge();
+}
+
+
+uint64_t FullTextIndex::writeSegment(uint32_t number, const Terms &terms, const UidSet &uids) const {
+    SegmentBuilder builder(segmentName(this->prefix, number), uids, this->uidvalidity);
+    std::string list;
+    for (const auto &[term, postings] : terms) {
+        list.clear();
+        uint64_t previous = 0;
+        for (const Posting &posting : postings) {
+            putVarint(list, posting.uid - previous);
+            list += posting.positions;
+            previous = posting.uid;
+        }
+        builder.add(term, list, postings.size());
+    }
+    return builder.commit();
+}
+
+
+uint64_t FullTextIndex::mergeSegments(const Segment &older, const Segment &newer) const {
+    SegmentView a(segmentName(this->prefix, older.number));
+    SegmentView b(segmentName(this->prefix, newer.number));
+
+    UidSet uids;
+    for (const SegmentView *view : {&a, &b}) {
+        for (uint64_t i = 0; i < view->header->nranges; i++) {
+            uids.add(view->ranges[2 * i], view->ranges[2 * i + 1]);
+        }
+    }
+
+    SegmentBuilder builder(segmentName(this->prefix, older.number), uids, this->uidvalidity);
+    const TermEntry *i = a.dictionary, *a_end = a.dictionary + a.header->nterms;
+    const TermEntry *j = b.dictionary, *b_end = b.dictionary + b.header->nterms;
+    std::string list;
+
+    // a posting list starts from UID 0, so a term of one segment only is copied as it is
+    while (i < a_end || j < b_end) {
+        if (j == b_end || (i < a_end && a.term(*i) < b.term(*j))) {
+            builder.add(a.term(*i), a.postings(*i), i->docs);
+            i++;
+            continue;
+        }
+        if (i == a_end || b.term(*j) < a.term(*i)) {
+            builder.add(b.term(*j), b.postings(*j), j->docs);
+            j++;
+            continue;
+        }
+
+        std::vector<DocPositions> first = decodeList(a.postings(*i));
+        std::vector<DocPositions> second = decodeList(b.postings(*j));
+        std::vector<DocPositions> docs;
+        docs.reserve(first.size() + second.size());
+        std::merge(first.begin(), first.end(), second.begin(), second.end(), std::back_inserter(docs),
+                   [](const DocPositions &x, const DocPositions &y) { return x.uid < y.uid; });
+
+        // a message indexed twice, e.g. after a crash between merge and removal, is kept once
+        list.clear();
+        uint64_t previous = 0;
+        uint32_t count = 0;
+        for (std::size_t k = 0; k < docs.size(); k++) {
+            if (k > 0 && docs[k].uid == docs[k - 1].uid) {
+                continue;
+            }
+            putVarint(list, docs[k].uid - previous);
+            list += docs[k].positions;
+            previous = docs[k].uid;
+            count++;
+        }
+        builder.add(a.term(*i), list, count);
+        i++;
+        j++;
+    }
+    return builder.commit();
+}
+
+
+void FullTextIndex::merge() {
+    while (this->segments.size() >= 2 && this->segments.back().size * 2 >= this->segments[this->segments.size() - 2].size) {
+        Segment newer = this->segments.back();
+        Segment &older = this->segments[this->segments.size() - 2];
+
+        // the merged segment replaces the older one, so a crash before the removal only leaves a duplicate
+        older.size = this->mergeSegments(older, newer);
+        unlink(segmentName(this->prefix, newer.number).c_str());
+        this->segments.pop_back();
+    }
+}
+
+
+std::vector<std::string> FullTextIndex::tokens(std::string_view text) {
+    Collector collector;
+    collector.text(text);
+    std::vector<std::pair<uint32_t, std::string>> words;
+    for (const auto &[term, positions] : collector.terms) {
+        for (uint32_t position : positions) {
+            words.emplace_back(position, term);
+        }
+    }
+    std::sort(words.begin(), words.end());
+
+    std::vector<std::string> out;
+    for (auto &word : words) {
+        out.push_back(std::move(word.second));
+    }
+    return out;
+}
+
+
+// UIDs of the segment matching every term and phrase
+static std::vector<uint64_t> searchSegment(const SegmentView &view, const std::vector<std::vector<std::string>> &query) {
+    std::map<std::string, std::vector<DocPositions>> lists;
+    for (const std::vector<std::string> &words : query) {
+        for (const std::string &word : words) {
+            if (lists.count(word) == 0) {
+                const TermEntry *entry = view.find(word);
+                if (entry == nullptr) {
+                    return {};
+                }
+                lists[word] = decodeList(view.postings(*entry));
+            }
+        }
+    }
+
+    // the shortest list is intersected with the others
+    auto shortest = std::min_element(lists.begin(), lists.end(), [](const auto &a, const auto &b) {
+        return a.second.size() < b.second.size();
+    });
+    std::vector<uint64_t> uids;
+    for (const DocPositions &doc : shortest->second) {
+        uids.push_back(doc.uid);
+    }
+    auto byUid = [](const DocPositions &doc, uint64_t uid) { return doc.uid < uid; };
+    for (const auto &[word, docs] : lists) {
+        std::vector<uint64_t> kept;
+        for (uint64_t uid : uids) {
+            auto it = std::lower_bound(docs.begin(), docs.end(), uid, byUid);
+            if (it != docs.end() && it->uid == uid) {
+                kept.push_back(uid);
+            }
+        }
+        uids = std::move(kept);
+    }
+
+    // words of a phrase follow each other
+    std::vector<uint64_t> matched;
+    for (uint64_t uid : uids) {
+        bool match = true;
+        for (const std::vector<std::string> &words : query) {
+            if (words.size() < 2) {
+                continue;
+            }
+            std::vector<std::vector<uint32_t>> positions;
+            for (const std::string &word : words) {
+                const std::vector<DocPositions> &docs = lists[word];
+                positions.push_back(decodePositions(std::lower_bound(docs.begin(), docs.end(), uid, byUid)->positions));
+            }
+
+            bool found = false;
+            for (uint32_t start : positions[0]) {
+                found = true;
+                for (std::size_t k = 1; k < positions.size() && found; k++) {
+                    found = std::binary_search(positions[k].begin(), positions[k].end(), start + k);
+                }
+                if (found) break;
+            }
+            if (!found) {
+                match = false;
+                break;
+            }
+        }
+        if (match) {
+            matched.push_back(uid);
+        }
+    }
+    return matched;
+}
+
+
+std::vector<uint64_t> FullTextIndex::search(const std::string &dir, const std::string &name, const std::vector<std::string> &query) {
+    std::vector<std::vector<std::string>> words;
+    for (const std::string &text : query) {
+        std::vector<std::string> phrase = tokens(text);
+        if (!phrase.empty()) {
+            words.push_back(std::move(phrase));
+        }
+    }
+
+    std::string start = name + ".fts.";
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (const auto &file : std::filesystem::directory_iterator(dir, ec)) {
+        std::string filename = file.path().filename().string();
+        std::string number = filename.substr(std::min(start.size(), filename.size()));
+        if (filename.starts_with(start) && !number.empty() && number.find_first_not_of("0123456789") == std::string::npos) {
+            files.push_back(file.path().string());
+        }
+    }
+    if (files.empty()) {
+        throw std::runtime_error("There is no full-text index of " + name + " in " + dir + ".");
+    }
+
+    std::vector<uint64_t> uids;
+    if (words.empty()) {
+        return uids;
+    }
+    for (const std::string &file : files) {
+        SegmentView view(file);
+        std::vector<uint64_t> found = searchSegment(view, words);
+        uids.insert(uids.end(), found.begin(), found.end());
+    }
+    std::sort(uids.begin(), uids.end());
+    uids.erase(std::unique(uids.begin(), uids.end()), uids.end());
+    return uids;
+}
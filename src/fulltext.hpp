@@ -0,0 +1,178 @@
+/**
+ * @file fulltext.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for FullTextIndex class
+ *
+ * Inverted index of the words of the downloaded messages of one mailbox: From, To, Cc and
+ * Subject with encoded words decoded, and the text parts of the body after decoding base64
+ * or quoted-printable, HTML without its tags. Words are runs of letters and digits, ASCII
+ * is lower cased and other UTF-8 is kept as it is.
+ *
+ * Messages are tokenized on the writer lanes as they are stored and their postings are
+ * collected in memory. A flush writes them as a new immutable segment file
+ * <mailbox>.<server>.fts.<number>: a header, the UID ranges the segment covers, the posting
+ * lists, a dictionary of fixed size entries sorted by term and the terms. A posting list
+ * holds for every message the UID difference to the previous one, the number of positions
+ * and the position differences, all as variable length integers.
+ *
+ * Whenever the newest segment has grown to half of the one before it, the two are merged
+ * into one, so a mailbox has a logarithmic number of segments. A query maps the segments
+ * read only and looks its terms up by binary search in each of them.
+ */
+
+#ifndef FULLTEXT_HPP
+#define FULLTEXT_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "uidset.hpp"
+
+#define FULLTEXT_MAGIC 0x31535446434d49ULL  // "IMCFTS1"
+#define FULLTEXT_VERSION 1
+#define FULLTEXT_MESSAGE_LIMIT (4 * 1024 * 1024)   // bytes of a message looked at, the rest are attachments
+#define FULLTEXT_BUFFER (64 * 1024 * 1024)        // bytes of postings collected before a segment is written
+#define FULLTEXT_MAX_TOKEN 64                     // longer words are not indexed
+#define FULLTEXT_CATCHUP 256                      // stored messages indexed by one writer task
+
+
+class FullTextIndex {
+public:
+    /**
+     * @brief Finds the segments of the mailbox and the UIDs they cover
+     *
+     * @param dir output directory
+     * @param name mailbox and server part of the file names
+     *
+     * @throw std::runtime_error if a segment cannot be read
+     */
+    FullTextIndex(const std::string &dir, const std::string &name);
+
+
+    /**
+     * @brief Writes the collected postings, errors are only reported
+     */
+    ~FullTextIndex();
+
+    FullTextIndex(const FullTextIndex &) = delete;
+    FullTextIndex &operator=(const FullTextIndex &) = delete;
+
+
+    /**
+     * @brief Checks UIDVALIDITY of the mailbox, segments of another one are removed
+     */
+    void validate(uint64_t uidvalidity);
+
+
+    /**
+     * @brief UIDs in the segments or collected for the next one
+     */
+    UidSet covered() const;
+
+
+    /**
+     * @brief Tokenizes the message and collects its postings, a covered UID is skipped
+     *
+     * Safe to call from several threads at once, the segment is written by the call which
+     * fills the buffer.
+     *
+     * @throw std::runtime_error if a full buffer cannot be written
+     */
+    void add(uint64_t uid, std::string_view message);
+
+
+    /**
+     * @brief Reads the beginning of a stored message file and adds it
+     */
+    void addFile(uint64_t uid, const std::string &filename);
+
+
+    /**
+     * @brief Writes the collected postings as a new segment and merges segments
+     *
+     * @throw std::runtime_error if the segment cannot be written
+     */
+    void flush();
+
+
+    /**
+     * @brief UIDs of the messages containing all terms and phrases of the query
+     *
+     * Every argument with more than one word is a phrase, its words have to follow each
+     * other. Maps the segments read only, nothing is created.
+     *
+     * @return sorted UIDs
+     *
+     * @throw std::runtime_error if there is no index or a segment cannot be read
+     */
+    static std::vector<uint64_t> search(const std::string &dir, const std::string &name, const std::vector<std::string> &query);
+
+
+    /**
+     * @brief Words of the text as they are indexed
+     */
+    static std::vector<std::string> tokens(std::string_view text);
+
+private:
+    // positions of a term in one message, count and differences as variable length integers
+    struct Posting {
+        uint64_t uid;
+        std::string positions;
+    };
+
+    using Postings = std::unordered_map<std::string, std::vector<Posting>>;
+
+    struct Segment {
+        uint32_t number;
+        uint64_t size;      // file size, decides the merges
+    };
+
+    using Terms = std::vector<std::pair<std::string, std::vector<Posting>>>;
+
+    mutable std::mutex mutex;
+    std::string prefix;     // output directory and name the file names start with
+    uint64_t uidvalidity;
+    std::vector<Segment> segments; // by number, oldest first
+    UidSet indexed;         // UIDs in the segments and in the buffer
+    UidSet pending;         // UIDs in the buffer
+    Postings buffer;        // postings not written yet
+    std::size_t buffered;   // estimated memory of the buffer
+
+
+    static std::string segmentName(const std::string &prefix, uint32_t number);
+
+
+    /**
+     * @brief Writes postings sorted by term and UID as a segment file, through a temporary file
+     *
+     * @return size of the file
+     */
+    uint64_t writeSegment(uint32_t number, const Terms &terms, const UidSet &uids) const;
+
+
+    /**
+     * @brief Merges the newest segment into the one before it, the result replaces the older one
+     *
+     * @return size of the merged file
+     */
+    uint64_t mergeSegments(const Segment &older, const Segment &newer) const;
+
+
+    /**
+     * @brief Merges the two newest segments while the newest is at least half of the other
+     */
+    void merge();
+
+
+    /**
+     * @brief Writes the buffer, the mutex is held
+     */
+    void flushLocked();
+};
+
+#endif
@@ -10,6 +10,192 @@
 #include <fstream>
 #include <sstream>
 #include <filesystem>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "uidtracker.hpp"
+#include "tlscache.hpp"
+
+
+// set by SIGINT and SIGTERM in the IDLE mode
+static volatile sig_atomic_t stop_requested = 0;
+
+static void requestStop(int) {
+    stop_requested = 1;
+}
+
+
+// case-insensitive comparison of a response keyword
+static bool keywordIs(std::string_view word, std::string_view keyword) {
+    if (word.size() != keyword.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < word.size(); i++) {
+        if (std::toupper(static_cast<unsigned char>(word[i])) != keyword[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief Message written on a writer lane, removed again unless it is stored completely
+ */
+struct PendingMail {
+    std::string filename;   // final name of the message file
+    std::string tmpname;    // name of the file the literal is written to until it is complete
+    int fd{-1};
+    std::shared_ptr<PackStore> pack;    // pack store instead of the file, nullptr for a file per message
+    PackSegment *segment{nullptr};
+    std::shared_ptr<DedupStore> dedup;
+    std::unique_ptr<Sha256> digest;     // digest of the message for the deduplicating store
+    bool stored{false};
+    bool resumable{false};  // the resume journal refers to the file, it is kept when the message is not finished
+    std::shared_ptr<FullTextIndex> fulltext; // index the words of the message go to, nullptr when disabled
+    std::string text;       // beginning of the message for the full-text index
+    bool text_complete{true}; // text starts with the message, not with a part resumed from the journal
+
+    ~PendingMail() {
+        if (this->stored) {
+            return;
+        }
+        if (this->segment != nullptr) {
+            this->pack->abort(this->segment);
+        }
+        if (this->fd >= 0) {
+            close(this->fd);
+            if (!this->resumable) {
+                unlink(this->tmpname.c_str());
+            }
+        }
+    }
+
+    void open(uint64_t uid, uint64_t size) {
+        if (this->pack != nullptr) {
+            this->segment = this->pack->begin(uid, size);
+            return;
+        }
+
+        this->fd = ::open(this->tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (this->fd < 0) {
+            throw std::runtime_error("Cannot create file for a downloaded mail.");
+        }
+        // blocks for the whole message are reserved at once, the file size still grows with the writes
+        fallocate(this->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+
+        if (this->dedup != nullptr) {
+            this->digest = std::make_unique<Sha256>();
+            this->digest->reset();
+        }
+    }
+
+    // opens the file left by an interrupted run, data after offset is dropped
+    void resume(uint64_t offset, uint64_t size) {
+        this->fd = ::open(this->tmpname.c_str(), O_RDWR | O_CREAT, 0644);
+        if (this->fd < 0 || ftruncate(this->fd, offset) != 0 || lseek(this->fd, offset, SEEK_SET) < 0) {
+            throw std::runtime_error("Cannot open file of a partly downloaded mail.");
+        }
+        this->resumable = true;
+        this->text_complete = offset == 0;
+        fallocate(this->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+
+        // digest has to cover the data written by the previous run
+        if (this->dedup != nullptr) {
+            this->digest = std::make_unique<Sha256>();
+            this->digest->reset();
+            char block[65536];
+            for (uint64_t pos = 0; pos < offset; ) {
+                ssize_t n = pread(this->fd, block, std::min<uint64_t>(sizeof(block), offset - pos), pos);
+                if (n <= 0) {
+                    throw std::runtime_error("Cannot read file of a partly downloaded mail.");
+                }
+                this->digest->update(block, n);
+                pos += n;
+            }
+        }
+    }
+
+    // makes the written data durable before the journal refers to it
+    void sync() {
+        if (this->fd >= 0 && fdatasync(this->fd) != 0) {
+            throw std::runtime_error("Cannot write a downloaded mail.");
+        }
+    }
+
+    void write(const char *data, std::size_t len) {
+        if (this->fulltext != nullptr && this->text.size() < FULLTEXT_MESSAGE_LIMIT) {
+            this->text.append(data, std::min<std::size_t>(len, FULLTEXT_MESSAGE_LIMIT - this->text.size()));
+        }
+        if (this->segment != nullptr) {
+            this->pack->write(this->segment, data, len);
+            return;
+        }
+
+        if (this->digest != nullptr) {
+            this->digest->update(data, len);
+        }
+        while (len > 0) {
+            ssize_t n = ::write(this->fd, data, len);
+            if (n < 0) {
+                throw std::runtime_error("Cannot write a downloaded mail.");
+            }
+            data += n;
+            len -= n;
+        }
+    }
+
+    // returns offset of the message in its file
+    uint64_t store(uint64_t size) {
+        uint64_t offset = 0;
+        if (this->pack != nullptr) {
+            // commit releases the segment even when it fails
+            PackSegment *segment = this->segment;
+            this->segment = nullptr;
+            offset = this->pack->commit(segment);
+        }
+        else {
+            // the file is flushed before it is moved into place, the index refers to it afterwards
+            int fd = this->fd;
+            this->fd = -1;
+            bool synced = fdatasync(fd) == 0;
+            if (close(fd) != 0 || !synced) {
+                unlink(this->tmpname.c_str());
+                throw std::runtime_error("Cannot write a downloaded mail.");
+            }
+
+            if (this->dedup != nullptr) {
+                this->dedup->store(this->tmpname, this->filename, this->digest->hex(), size);
+            }
+            else if (rename(this->tmpname.c_str(), this->filename.c_str()) != 0) {
+                unlink(this->tmpname.c_str());
+                throw std::runtime_error("Cannot move a downloaded mail into place.");
+            }
+        }
+        this->stored = true;
+        return offset;
+    }
+
+    // adds the stored message to the full-text index, a resumed one is read from its file
+    void indexText(uint64_t uid) {
+        if (this->text_complete) {
+            this->fulltext->add(uid, this->text);
+        }
+        else {
+            this->fulltext->addFile(uid, this->filename);
+        }
+        std::string().swap(this->text);
+    }
+};
 
 
 IMAPClient::IMAPClient(std::string &server, std::string &auth_file, std::string &out_dir, int port, std::string mailbox, 
@@ -24,18 +210,61 @@ IMAPClient::IMAPClient(std::string &server, std::string &auth_file, std::string
     only_new{only_new},
     only_headers{only_headers},
     secured{secured},
+    pipeline_depth{4},
+    fetch_batch{100},
+    jobs{1},
+    compress{true},
+    idle_mode{false},
+    pack_store{false},
+    segment_size{PACK_SEGMENT_SIZE * 1024UL * 1024UL},
+    writers{0},
+    write_queue{WRITE_QUEUE_SIZE * 1024UL * 1024UL},
+    chunk_size{FETCH_CHUNK_SIZE * 1024UL * 1024UL},
+    retries{RECONNECT_RETRIES},
+    reconcile_mode{false},
+    catalog_mode{false},
+    fulltext_mode{false},
     
     tag{1},
     state{State::DISCONNECTED},
     complete{false},
     uidvalidity{false},
+    synced{false},
+    worker{false},
     uidnext{"1"},
+    scheduler_queue{0},
+    write_lane{0},
     buff{},
+    accepted{false},
+    qresync{false},
+    tracking{false},
+    flags_changed{false},
+    new_mail{false},
+    idle_from{1},
+    reply{Reply::OTHER},
+    reply_tag{0},
+    fetch_uid{0},
+    has_flags{false},
+    fetch_size{0},
+    mail_size{0},
+    mail_uid{0},
+    catalog_next{1},
+    completed{0},
+    completed_at_loss{0},
+    failures{0},
+    nonblocking{false},
+    step{Step::CONNECTING},
+    next_batch{0},
+    want_write{false},
+    throttled{false},
     bio{nullptr},
     ctx{nullptr},
+    transfer{std::make_shared<TransferStats>()},
+    stats{std::make_shared<SyncStats>()},
+    phase{Phase::CONNECT},
+    timing{false},
     nmails{0}
 {
-    memset(this->buffer_in, 0, sizeof(this->buffer_in));
     SSL_load_error_strings();
     OpenSSL_add_all_algorithms();
 }
@@ -45,7 +274,29 @@ IMAPClient::IMAPClient(struct Config &config) :
     IMAPClient(config.server, config.auth_file, config.out_dir, config.port, 
                config.mailbox, config.certfile, config.certaddr, 
                config.only_new, config.only_headers, config.secured)
-{ /* empty body */ }
+{
+    this->pipeline_depth = config.pipeline_depth;
+    this->fetch_batch = config.fetch_batch;
+    this->jobs = config.jobs;
+    this->include = config.include;
+    this->exclude = config.exclude;
+    this->compress = !config.no_compress;
+    this->idle_mode = config.idle;
+    this->pack_store = config.pack_store;
+    this->segment_size = config.segment_size;
+    this->dedup_dir = config.dedup_dir;
+    this->writers = config.writers;
+    this->write_queue = config.write_queue;
+    this->chunk_size = config.chunk_size;
+    this->retries = config.retries;
+    this->reconcile_mode = config.reconcile;
+    this->catalog_mode = config.catalog;
+    this->fulltext_mode = config.fulltext;
+
+    if (!config.no_tls_cache) {
+        this->tls_cache_file = config.tls_cache.empty() ? this->out_dir + "/.tlscache" : config.tls_cache;
+    }
+}
 
 
 IMAPClient::~IMAPClient() {
@@ -54,386 +305,2386 @@ IMAPClient::~IMAPClient() {
 
 
 void IMAPClient::start() {
-    this->connectToHost();
-    this->login();
-    this->selectMailbox();
-    if (this->synced) {
-        std::cout << "All emails from server are already downloaded." << std::endl;
-        return;
+    if (this->secured && !this->tls_cache_file.empty() && this->session_cache == nullptr) {
+        this->session_cache = std::make_shared<TlsSessionCache>(this->tls_cache_file);
+    }
+    if (!this->dedup_dir.empty() && this->dedup == nullptr) {
+        this->dedup = std::make_shared<DedupStore>(this->dedup_dir);
+    }
+    if (this->writer == nullptr) {
+        this->setWriter(std::make_shared<AsyncWriter>(this->writers ? this->writers : this->jobs, this->write_queue));
     }
-    this->fetchMails();
-}
-
-
-void IMAPClient::connectToHost() {
-    this->state = State::DISCONNECTED;
 
-    std::string address = this->server + ":" + std::to_string(this->port);
+    this->connectToHost();
+    this->login();
 
-    if (this->secured) { // use secured connection
-        // create SSL context
-        this->ctx = SSL_CTX_new(TLS_client_method());
-        if (ctx == nullptr) {
-            throw std::runtime_error("Error creating SSL context.");
+    // a lost connection is restored and the download continues where it stopped
+    while (true) {
+        try {
+            this->synchronize();
+            break;
         }
-
-        // load certificates
-        if (!this->certaddr.empty()) {
-            if(!SSL_CTX_load_verify_locations(ctx, nullptr, this->certaddr.c_str())) {
-                throw std::runtime_error("Cannot load certificates from folder.");
+        catch (TransportError &e) {
+            std::string reason = e.what();
+            if (!this->recover(reason)) {
+                throw std::runtime_error(reason);
             }
         }
+    }
 
-        else if (!this->certfile.empty()) {
-            if(!SSL_CTX_load_verify_locations(ctx, this->certfile.c_str(), NULL)) {
-                throw std::runtime_error("Cannot load certificate.");
-            }
-        }
-        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    this->transfer->print(std::cout);
+    if (this->dedup != nullptr) {
+        this->dedup->print(std::cout);
+    }
+    this->writer->print(std::cout);
+    this->stats->printOutages(std::cout, this->retries);
+}
 
 
-        SSL *ssl = SSL_new(ctx);
-        // initialize BIO object for secured connection
-        this->bio = BIO_new_ssl_connect(this->ctx);
-        if(bio == nullptr) {
-            throw std::runtime_error("Cannot initialize BIO object for connection.");
-        }
+void IMAPClient::synchronize() {
+    if (!this->include.empty()) {
+        this->syncMailboxes();
+        return;
+    }
 
-        BIO_get_ssl(this->bio, ssl);
-        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
-        BIO_set_conn_hostname(bio, address.c_str());
+    // UIDVALIDITY of the index before the connection was lost, 0 on the first call
+    uint64_t validity = this->index != nullptr ? this->index->uidvalidity() : 0;
+    unsigned long downloaded = this->nmails;
+    this->resetMailboxState();
+    this->nmails = downloaded;
+    this->selectMailbox();
+    if (validity != 0 && this->index != nullptr && this->index->uidvalidity() != validity) {
+        std::cout << "UIDVALIDITY changed while reconnecting, the mailbox is downloaded again." << std::endl;
+    }
 
-        if(BIO_do_connect(bio) <= 0) {
-            throw std::runtime_error("Cannot estabilish secured connection.");
-        }
+    if (this->reconcile_mode) {
+        this->reconcile(this->jobs > 1);
+    }
+    else if (this->upToDate()) {
+        std::cout << "All emails from server are already downloaded." << std::endl;
+    }
+    // metadata come in a single FETCH, there is nothing to share among connections
+    else if (this->jobs > 1 && !this->catalog_mode) {
+        this->fetchParallel();
+    }
+    else {
+        this->fetchMails();
+    }
 
-        if(SSL_get_verify_result(ssl) != X509_V_OK) {
-            throw std::runtime_error("Cannot verify the certificate.");
-        }
-        SSL_free(ssl);
+    if (this->idle_mode) {
+        this->idleLoop();
     }
+}
 
-    else {
-        this->bio = BIO_new_connect(address.c_str());
 
-        if(bio == nullptr) {
-            throw std::runtime_error("Cannot initialize BIO object for connection.");
+bool IMAPClient::recover(std::string &reason) {
+    auto lost = std::chrono::steady_clock::now();
+    this->disconnect();
+
+    // a connection which made progress since it was last lost gets all its attempts again
+    if (this->completed != this->completed_at_loss) {
+        this->failures = 0;
+        this->completed_at_loss = this->completed;
+    }
+
+    std::string prefix = this->label.empty() ? "" : this->label + ": ";
+    unsigned int attempts = 0;
+    while (this->failures < this->retries) {
+        unsigned int backoff = std::min(RECONNECT_BACKOFF_MIN << std::min(this->failures, 16U), RECONNECT_BACKOFF_MAX);
+        this->failures++;
+        attempts++;
+        std::cerr << prefix + "Connection lost: " + reason + " Reconnecting in " + std::to_string(backoff) + " s, attempt "
+                     + std::to_string(this->failures) + " of " + std::to_string(this->retries) + ".\n";
+        sleep(backoff);
+
+        try {
+            this->connectToHost();
+            this->login();
+            this->stats->addOutage(std::chrono::steady_clock::now() - lost, attempts, true);
+            return true;
+        }
+        catch (TransportError &e) {
+            reason = e.what();
+            this->disconnect();
         }
 
-        if(BIO_do_connect(bio) <= 0) {
-            throw std::runtime_error("Cannot connect to the server.");
+        // refused login or certificate does not get better by waiting
+        catch (std::runtime_error &e) {
+            reason = e.what();
+            this->disconnect();
+            break;
         }
     }
-    // Check for welcome message
-    this->checkResponse();
-}
 
+    this->stats->addOutage(std::chrono::steady_clock::now() - lost, attempts, false);
+    return false;
+}
 
-void IMAPClient::login() {
-    std::ifstream file(this->auth_file);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open auth file.");
-    }
 
-    std::string username, password;
-    
-    // Get username and password from auth file
-    if ((std::getline(file, username) && std::getline(file, password)) == false) {
-        file.close();
-        throw std::runtime_error("Wrong auth file format.");
+void IMAPClient::idleLoop() {
+    if (!this->hasCapability("IDLE")) {
+        throw std::runtime_error("Server does not support IDLE.");
     }
 
-    file.close();
-    this->sendCommand("LOGIN " + username + " " + password);
-}
+    // blocking calls are interrupted by the signals instead of being restarted
+    struct sigaction sa{};
+    sa.sa_handler = requestStop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    this->idle_from = std::max(this->idle_from, std::stoul(this->uidnext));
+    unsigned int backoff = IDLE_BACKOFF_MIN;
+
+    while (!stop_requested) {
+        try {
+            if (this->bio == nullptr) {
+                this->reconnect();
+                backoff = IDLE_BACKOFF_MIN;
+            }
 
+            // the store stays open, so its appended index entries are merged here instead of on the next run
+            if (this->pack != nullptr) {
+                this->pack->checkpoint();
+            }
 
-void IMAPClient::logout() {
-    this->state = State::LOGOUT;
-    this->sendCommand("LOGOUT");
+            if (this->idle()) {
+                this->fetchNew();
+            }
+        }
+        // a refused login, full disk or damaged index does not get better by waiting, it ends the client
+        catch (TransportError &e) {
+            this->disconnect();
+            if (stop_requested) {
+                break;
+            }
+            std::cerr << "Connection lost: " << e.what() << " Reconnecting in " << backoff << " s." << std::endl;
+            sleep(backoff);
+            backoff = std::min(backoff * 2, static_cast<unsigned int>(IDLE_BACKOFF_MAX));
+        }
+    }
 }
 
-void IMAPClient::sendCommand(const std::string &cmd) {
-    // Construct an outgoing command
-    std::string outstr = "A" + std::to_string(this->tag) + " " + cmd + " \r\n";
 
-    if(BIO_write(this->bio, outstr.c_str(), outstr.length()) < 0) {
-        throw std::runtime_error("Failed to send a command");
+bool IMAPClient::idle() {
+    // mail announced while the previous messages were downloaded is fetched without waiting
+    if (this->new_mail) {
+        return true;
     }
 
-    this->checkResponse();
-    
-    // Increment tag for the next command
-    this->tag++;
-}
+    this->enterPhase(Phase::IDLE);
+    this->state = State::IDLING;
+    this->queueCommand("IDLE");
 
-void IMAPClient::selectMailbox() {
-    this->sendCommand("SELECT " + this->mailbox);
-}
+    // IDLE is restarted before the server ends it for inactivity
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(IDLE_RENEW);
+    this->processResponse();
+    while (!this->new_mail && !this->complete && !stop_requested && this->waitReadable(deadline)) {
+        if (this->receive() <= 0) {
+            throw TransportError("Server closed the connection.");
+        }
+        this->processResponse();
+    }
 
-void IMAPClient::fetchMails() {
-    std::string content{" (BODY[])"};
-    if (this->only_headers) {
-        content = " (BODY[HEADER])";
+    if (!this->complete) {
+        this->sendLine("DONE\r\n");
+        this->checkResponse();
     }
+    this->complete = false;
+    return this->new_mail;
+}
 
-    if (this->only_new){
-        this->state = State::SEARCHING;
-        this->sendCommand("UID SEARCH NEW");
 
-        for (std::string& uid : this->newuids) {
-            this->state = State::FETCHING;
-            sendCommand("UID FETCH " + uid + content);
+void IMAPClient::fetchNew() {
+    // EXISTS arriving from now on announces mail the search may not find
+    this->new_mail = false;
+    this->nmails = 0;
+    this->newuids.clear();
+    this->enterPhase(Phase::SEARCH);
+    this->state = State::SEARCHING;
+    std::string range = std::to_string(this->idle_from) + ":*";
+    this->sendCommand(this->only_new ? "UID SEARCH NEW UID " + range : "UID SEARCH UID " + range);
+
+    // '*' stands for the highest UID even when it is lower than idle_from
+    UidSet uids;
+    for (const UidSet::Interval &i : this->newuids.ranges()) {
+        if (i.second >= this->idle_from) {
+            uids.add(std::max(i.first, this->idle_from), i.second);
         }
-        std::cout << "Downloaded " << this->nmails << " new mails." << std::endl;
-        return;
     }
 
-    this->state = State::FETCHING;
-    if(!this->uidvalidity){
-            this->sendCommand("UID FETCH 1:*" + content);
+    if (!uids.empty() || !this->partial.empty()) {
+        this->fetchBatches(uids.batches(this->fetch_batch));
+        this->printDownloaded(this->nmails);
     }
+}
 
-    else {
-        this->sendCommand("UID FETCH " + this->uidnext + ":*" + content); 
+
+void IMAPClient::reconnect() {
+    this->resetMailboxState();
+    this->connectToHost();
+    this->login();
+    this->selectMailbox();
+
+    // UIDs of the previous UIDVALIDITY mean nothing, the mailbox is downloaded again
+    if (this->index != nullptr && !this->uidvalidity && !this->only_headers) {
+        this->idle_from = 1;
+    }
+
+    if (!this->upToDate()) {
+        this->fetchNew();
     }
 }
 
 
-void IMAPClient::checkResponse() {
-    ssize_t nrecieved;
-    while(!this->complete) {
-        // try to get data from the server
-        nrecieved = BIO_read(this->bio, this->buffer_in, BUFFER_SIZE);
-        
-        if(nrecieved == -1 || nrecieved == 0){
-            throw std::runtime_error("Server closed the connection.");
-            this->state = State::DISCONNECTED;
-        }
-        buff.append(this->buffer_in, nrecieved);
-        
-        // process recieved data
-        this->processResponse();
+void IMAPClient::disconnect() {
+    this->storeSession();
+    if (this->bio != nullptr) {
+        BIO_free_all(this->bio);
+        this->bio = nullptr;
     }
+
+    // writes queued before the failure still run, the incomplete message is removed after them
+    // unless the journal refers to it, complete catalog rows are kept
+    this->mail.reset();
+    this->mail_data.clear();
+    this->flushCatalog();
+    this->partial.clear();
+    this->continuations.clear();
+    this->writes.drain();
+
+    this->zstream.reset();
+    this->buff.clear();
+    this->outbuf.clear();
+    this->pending.clear();
+    this->capabilities.clear();
+    this->qresync = false;
+    this->parser.reset();
     this->complete = false;
+    this->state = State::DISCONNECTED;
+    this->endPhase();
 }
 
-void IMAPClient::checkTagged(const std::string response) {
-    int code = -1;
-    if (response.starts_with("A" + std::to_string(this->tag) + " OK")) {
-        code = 0;
-    }
 
-    else if (response.starts_with("A" + std::to_string(this->tag) + " NO")) {
-        code = 1;
+bool IMAPClient::waitReadable(std::chrono::steady_clock::time_point deadline) {
+    // TLS may already hold decrypted data the socket does not show
+    if (BIO_pending(this->bio) > 0) {
+        return true;
     }
 
-    else if (response.starts_with("A" + std::to_string(this->tag) + " BAD")) {
-        throw std::runtime_error("Internal error.");
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (left <= 0) {
+        return false;
     }
 
-    else return;
-
-    switch (this->state) {
-        case State::CONNECTED:
-            if (!code) this->state = State::LOGGED;
-            else if (code) throw std::runtime_error("Invalid credentials.");
-            break;
+    pollfd pfd{this->socket(), POLLIN, 0};
+    return poll(&pfd, 1, left) > 0;
+}
 
-        case State::LOGGED:
-            if (!code) this->state = State::SELECTED;
-            else if (code) throw std::runtime_error("Desired mailbox does not exist.");
-            break;
 
-        case State::FETCHING:
-            if (!code) {
-                this->state = State::SELECTED;
-                if (!this->only_new) {
-                    if (this->only_headers) {
-                        std::cout << "Downloaded " << this->nmails << " email headers." << std::endl;
-
-                    }
-                    else {
-                        std::cout << "Downloaded " << this->nmails << " emails." << std::endl;
-                    }
-                }
-            }
-            else if (code) throw std::runtime_error("Could not fetch data from the server.");
-            break;
+void IMAPClient::connectToHost() {
+    this->openConnection();
+    this->establish();
+    this->verifyCertificate();
+    this->reportHandshake();
+    this->enterPhase(Phase::LOGIN);
 
-        case State::SEARCHING:
-            if (!code) this->state = State::SELECTED;
-            else if (code) throw std::runtime_error("Could not search for new mails.");
-            break;
-        
-        default:
-            break;
-    }
-    this->complete = true;
+    // Check for welcome message
+    this->checkResponse();
 }
 
-void IMAPClient::processResponse() {
-    std::size_t idx = 0;
-    std::string response;
-    static bool getting_data = false;
 
-    while (!this->buff.empty() && !this->complete){
-        if (!getting_data) {
-            idx = buff.find("\r\n");
+void IMAPClient::openConnection() {
+    this->state = State::DISCONNECTED;
+    this->connect_start = std::chrono::steady_clock::now();
+    this->enterPhase(Phase::CONNECT);
 
-            if (idx == std::string::npos) {
-                return;
-            }
+    std::string address = this->server + ":" + std::to_string(this->port);
+    std::string target = this->address.empty() ? address : this->address;
 
-            response = this->buff.substr(0, idx + 2);
-            this->buff = this->buff.erase(0, idx + 2);
+    if (this->secured) { // use secured connection
+        // create SSL context, unless it is shared with another client
+        if (this->ctx == nullptr) {
+            this->initContext();
         }
-        
 
-        // Recieve welcome message
-        if (this->state == State::DISCONNECTED) {
-            if (response.starts_with("* OK")) {
-                this->complete = true;
-                this->state = State::CONNECTED;
-                return;
-            }
+        // initialize BIO object for secured connection
+        this->bio = BIO_new_ssl_connect(this->ctx);
+        if(bio == nullptr) {
+            throw std::runtime_error("Cannot initialize BIO object for connection.");
         }
 
-        // Selecting mailbox
-        else if (this->state == State::LOGGED) {
-            
-            // handle untagged responses
-            if (response.starts_with("* OK") && !this->only_new) {
-                std::string argline = response.substr(response.find("[")+1, response.find("]") - response.find("[")-1);
-                std::istringstream iss{argline};
-                std::string arg;
-                iss >> arg;
-
-                if (arg == "UIDVALIDITY" && !this->only_headers) {
-                    std::string old_uid, new_uid;
-                    iss >> new_uid;
-                    std::string filename = this->out_dir + "/.uidvalidity";
-
-                    // if .uidvalidity exists, try to read it
-                    if (std::filesystem::exists(filename)) {
-                        
-                        // check existing UIDVALIDITY
-                        std::ifstream uidvalid_f(filename);
-                        if (uidvalid_f.is_open()) {
-                            std::getline(uidvalid_f, old_uid); 
-
-                            // if UIDVALIDITY differs, reopen the file in write mode and rewrite
-                            if (old_uid != new_uid) {
-                                std::ofstream uidvalid_f(filename);
-                                uidvalid_f << new_uid;
-                            }
-                            else this->uidvalidity = true;
-                        }
-                        else {
-                            throw (std::runtime_error("Cannot open .uidvalidity file."));
-                        }
-                    }
-
-                    // else create .uidvalidity file
-                    else {
-                        std::ofstream uidvalid_f(filename);
-                        if (uidvalid_f.is_open()) {
-                            uidvalid_f << new_uid;
-                        }
-                        
-                        else {
-                            throw (std::runtime_error("Cannot create .uidvalidity file."));
-                        }
-                    }
-                }
-
-                else if (arg == "UIDNEXT") {
-                    std::string filename = this->out_dir + "/.uidnext";
-
-                    if (!std::filesystem::exists(filename)) {
-                        std::ofstream uidnext_f(filename);
-                        if (uidnext_f.is_open()) {
-                            uidnext_f << "1";
-                        }
-                        
-                        else {
-                            throw (std::runtime_error("Cannot create .uidnext file."));
-                        }
-                    }
-
-                    else {
-                        std::ifstream uidnext_f(filename);
-                        uidnext_f >> this->uidnext;
-                        std::string new_uidnext;
-                        iss >> new_uidnext;
-                        if(new_uidnext == this->uidnext) {
-                            this->synced = true;
-                        }
-                    }
-                }
+        SSL *ssl = nullptr;
+        BIO_get_ssl(this->bio, &ssl);
+        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_set_tlsext_host_name(ssl, this->server.c_str());
+        BIO_set_conn_hostname(bio, target.c_str());
+
+        // offer the session from the previous run for an abbreviated handshake
+        if (this->session_cache != nullptr) {
+            SSL_SESSION *session = this->session_cache->get(address);
+            if (session != nullptr) {
+                SSL_set_session(ssl, session);
+                SSL_SESSION_free(session);
             }
         }
+    }
 
-         else if (this->state == State::SEARCHING) {
-            if (response.starts_with("* SEARCH")) {
-                std::istringstream iss(response.substr(8));
-                std::string uid;
+    else {
+        this->bio = BIO_new_connect(target.c_str());
 
-                 while (iss >> uid) {
-                    this->newuids.push_back(uid);
-                }
-            }
+        if(bio == nullptr) {
+            throw std::runtime_error("Cannot initialize BIO object for connection.");
         }
+    }
 
-        else if (this->state == State::FETCHING) {
-            static unsigned long nbytes = 0;
-            static std::string filename;
-            static std::string uid;
-            if (getting_data){
+    if (this->nonblocking) {
+        BIO_set_nbio(this->bio, 1);
+    }
+}
 
-                if (this->buff.length() < nbytes) { 
-                    return; // Dont have enough data, return to checkResponse() (for readability)
-                }
 
-                else {
-                    std::string data = this->buff.substr(0, nbytes);
-                    this->buff.erase(0, nbytes + 3); // nbytes + 3 to remove ')\r\n' also
-                    std::ofstream mailfile(filename);
-                    mailfile << data;
-                    nmails++;
-
-                    // Change UIDNEXT only when downloading complete emails
-                    if(!this->only_headers && !this->only_new) {
-                        std::ofstream uidnext_f(this->out_dir + "/.uidnext");
-                        uidnext_f << std::to_string(std::stoi(uid) + 1);
-                    }
-                    
-                    getting_data = false;
-                }
+bool IMAPClient::establish() {
+    // the SSL BIO sits on top of the connect BIO, which resolves the name and connects
+    if (this->phase == Phase::CONNECT) {
+        BIO *conn = this->secured ? BIO_next(this->bio) : this->bio;
+        if (BIO_do_connect(conn) <= 0) {
+            // connect in progress waits for writability
+            if (this->nonblocking && BIO_should_retry(conn)) {
+                this->want_write = true;
+                return false;
             }
+            throw TransportError("Cannot connect to the server.");
+        }
 
-            else {
-                if (response.starts_with("*")) {
-                nbytes = stoi(response.substr(response.find("{")+1, response.find("}") - response.find("{")-1));
-                
-                std::istringstream iss{response.substr(response.find("UID"), response.length()-1)}; // MOVE into ELSE
-                iss >> uid >> uid;
-                filename = this->out_dir + "/" + uid + "." + this->mailbox + "." + this->server;
-
-                getting_data = true;
-                }
-            }
+        if (!this->secured) {
+            return true;
+        }
+        this->enterPhase(Phase::HANDSHAKE);
+    }
+
+    if (BIO_do_handshake(this->bio) <= 0) {
+        // the handshake waits for either direction
+        if (this->nonblocking && BIO_should_retry(this->bio)) {
+            this->want_write = BIO_should_write(this->bio) || BIO_should_io_special(this->bio);
+            return false;
         }
-        checkTagged(response);
+        throw TransportError("Cannot estabilish secured connection.");
     }
+    return true;
 }
 
 
-void IMAPClient::cleanup() {
-    if (this->state != State::DISCONNECTED) {
-        this->logout();
+void IMAPClient::enterPhase(Phase next) {
+    if (this->timing && this->phase == next) {
+        return;
     }
 
+    auto now = std::chrono::steady_clock::now();
+    if (this->timing) {
+        this->stats->addPhase(this->phase, now - this->phase_start);
+    }
+    this->phase = next;
+    this->phase_start = now;
+    this->timing = true;
+}
+
+
+void IMAPClient::endPhase() {
+    if (this->timing) {
+        this->stats->addPhase(this->phase, std::chrono::steady_clock::now() - this->phase_start);
+        this->timing = false;
+    }
+}
+
+
+void IMAPClient::verifyCertificate() {
+    if (!this->secured) {
+        return;
+    }
+
+    SSL *ssl = nullptr;
+    BIO_get_ssl(this->bio, &ssl);
+    if(SSL_get_verify_result(ssl) != X509_V_OK) {
+        throw std::runtime_error("Cannot verify the certificate.");
+    }
+}
+
+
+void IMAPClient::reportHandshake() {
+    if (!this->secured) {
+        return;
+    }
+
+    SSL *ssl = nullptr;
+    BIO_get_ssl(this->bio, &ssl);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->connect_start).count();
+
+    std::ostringstream line;
+    line.precision(1);
+    line << std::fixed << (this->label.empty() ? "" : this->label + ": ")
+         << (SSL_session_reused(ssl) ? "TLS session resumed" : "TLS full handshake")
+         << ", connected in " << ms << " ms.\n";
+    std::cout << line.str() << std::flush;
+}
+
+
+void IMAPClient::storeSession() {
+    if (!this->secured || this->session_cache == nullptr || this->bio == nullptr) {
+        return;
+    }
+
+    SSL *ssl = nullptr;
+    BIO_get_ssl(this->bio, &ssl);
+    if (ssl == nullptr || !SSL_is_init_finished(ssl)) {
+        return;
+    }
+
+    // TLS 1.3 tickets arrive after the handshake, so the session is taken when the connection ends
+    SSL_SESSION *session = SSL_get1_session(ssl);
+    this->session_cache->put(this->server + ":" + std::to_string(this->port), session);
+    SSL_SESSION_free(session);
+}
+
+
+void IMAPClient::setSessionCache(std::shared_ptr<TlsSessionCache> cache) {
+    this->session_cache = cache;
+}
+
+
+void IMAPClient::initContext() {
+    this->ctx = createContext(this->certfile, this->certaddr);
+}
+
+
+SSL_CTX *IMAPClient::createContext(const std::string &certfile, const std::string &certaddr) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == nullptr) {
+        throw std::runtime_error("Error creating SSL context.");
+    }
+
+    // load certificates
+    if (!certaddr.empty()) {
+        if(!SSL_CTX_load_verify_locations(ctx, nullptr, certaddr.c_str())) {
+            SSL_CTX_free(ctx);
+            throw std::runtime_error("Cannot load certificates from folder.");
+        }
+    }
+
+    else if (!certfile.empty()) {
+        if(!SSL_CTX_load_verify_locations(ctx, certfile.c_str(), NULL)) {
+            SSL_CTX_free(ctx);
+            throw std::runtime_error("Cannot load certificate.");
+        }
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+
+void IMAPClient::shareContext(SSL_CTX *ctx) {
+    if (ctx == nullptr) {
+        return;
+    }
+
+    SSL_CTX_up_ref(ctx);
+    if (this->ctx != nullptr) {
+        SSL_CTX_free(this->ctx);
+    }
+    this->ctx = ctx;
+}
+
+
+void IMAPClient::setTransferStats(std::shared_ptr<TransferStats> stats) {
+    this->transfer = stats;
+}
+
+
+void IMAPClient::setDedupStore(std::shared_ptr<DedupStore> store) {
+    this->dedup = store;
+}
+
+
+void IMAPClient::setWriter(std::shared_ptr<AsyncWriter> writer) {
+    this->writer = writer;
+    this->write_lane = writer->lane();
+}
+
+
+void IMAPClient::setSyncStats(std::shared_ptr<SyncStats> stats) {
+    this->stats = stats;
+}
+
+
+void IMAPClient::setLabel(const std::string &label) {
+    this->label = label;
+}
+
+
+void IMAPClient::login() {
+    std::ifstream file(this->auth_file);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open auth file.");
+    }
+
+    std::string username, password;
+    
+    // Get username and password from auth file
+    if ((std::getline(file, username) && std::getline(file, password)) == false) {
+        file.close();
+        throw std::runtime_error("Wrong auth file format.");
+    }
+
+    file.close();
+    this->sendCommand("LOGIN " + username + " " + password);
+
+    // in non-blocking mode the negotiation is driven by advance()
+    if (!this->nonblocking) {
+        this->step = Step::LOGIN;
+        while (this->negotiate());
+    }
+}
+
+
+bool IMAPClient::negotiate() {
+    auto send = [this](Step next, const std::string &cmd) {
+        this->step = next;
+        this->state = State::NEGOTIATING;
+        this->sendCommand(cmd);
+        return true;
+    };
+
+    // the command which just completed takes effect first
+    if (this->step == Step::COMPRESS && this->accepted) {
+        this->startCompression();
+    }
+
+    // only the connection writing the state files synchronizes flags and expunges
+    bool trackable = !this->worker && !this->only_new && !this->only_headers;
+
+    // servers usually announce capabilities in the LOGIN completion, ask only when they did not
+    if (this->step == Step::LOGIN && this->capabilities.empty() && (this->compress || trackable || this->idle_mode)) {
+        return send(Step::CAPABILITY, "CAPABILITY");
+    }
+
+    if ((this->step == Step::LOGIN || this->step == Step::CAPABILITY) && trackable && this->hasCapability("QRESYNC")) {
+        return send(Step::ENABLE, "ENABLE QRESYNC");
+    }
+
+    if (this->step != Step::COMPRESS && this->compress && this->hasCapability("COMPRESS=DEFLATE")) {
+        return send(Step::COMPRESS, "COMPRESS DEFLATE");
+    }
+    return false;
+}
+
+
+bool IMAPClient::hasCapability(const std::string &name) const {
+    return this->capabilities.find(" " + name + " ") != std::string::npos;
+}
+
+
+void IMAPClient::startCompression() {
+    this->zstream = std::make_unique<DeflateStream>(this->transfer);
+    this->rawbuf.resize(BUFFER_SIZE);
+
+    // anything the server sent after the tagged response is already compressed
+    std::string rest{this->buff.data()};
+    this->buff.clear();
+    if (!rest.empty()) {
+        this->zstream->inflate(rest.data(), rest.size(), this->buff);
+    }
+}
+
+
+int IMAPClient::receive() {
+    if (this->zstream == nullptr) {
+        int nrecieved = BIO_read(this->bio, this->buff.prepare(BUFFER_SIZE), BUFFER_SIZE);
+        if (nrecieved > 0) {
+            this->buff.commit(nrecieved);
+            this->stats->addReceived(nrecieved);
+        }
+        return nrecieved;
+    }
+
+    int nrecieved = BIO_read(this->bio, this->rawbuf.data(), this->rawbuf.size());
+    if (nrecieved > 0) {
+        this->stats->addReceived(nrecieved);
+        this->zstream->inflate(this->rawbuf.data(), nrecieved, this->buff);
+    }
+    return nrecieved;
+}
+
+
+void IMAPClient::logout() {
+    this->enterPhase(Phase::LOGOUT);
+    this->state = State::LOGOUT;
+    this->sendCommand("LOGOUT");
+}
+
+void IMAPClient::sendCommand(const std::string &cmd) {
+    this->queueCommand(cmd);
+
+    // in non-blocking mode the completion is handled by advance()
+    if (!this->nonblocking) {
+        this->checkResponse();
+    }
+}
+
+
+unsigned long IMAPClient::queueCommand(const std::string &cmd) {
+    // Construct an outgoing command
+    this->sendLine("A" + std::to_string(this->tag) + " " + cmd + " \r\n");
+    this->pending.push_back(this->tag);
+
+    // Increment tag for the next command
+    return this->tag++;
+}
+
+
+void IMAPClient::sendLine(const std::string &line) {
+    if (this->zstream != nullptr) {
+        this->zstream->deflate(line, this->outbuf);
+    }
+    else {
+        this->outbuf += line;
+    }
+    this->flushOutput();
+}
+
+
+bool IMAPClient::flushOutput() {
+    while (!this->outbuf.empty()) {
+        int nsent = BIO_write(this->bio, this->outbuf.data(), this->outbuf.length());
+        if (nsent > 0) {
+            this->outbuf.erase(0, nsent);
+            this->stats->addSent(nsent);
+            continue;
+        }
+
+        // the rest is sent when the socket becomes writable
+        if (this->nonblocking && BIO_should_retry(this->bio)) {
+            return false;
+        }
+        throw TransportError("Failed to send a command");
+    }
+    return true;
+}
+
+void IMAPClient::selectMailbox() {
+    std::string cmd = "SELECT " + quoteString(this->mailbox);
+    this->enterPhase(Phase::SELECT);
+
+    // workers of a parallel download and runs with -n leave the state to the first connection
+    if (!this->worker && !this->only_new && !this->catalog_mode) {
+        this->index = std::make_shared<StateIndex>(this->out_dir);
+    }
+    if (this->catalog_mode) {
+        this->catalog = std::make_shared<Catalog>(this->out_dir, storeName(this->mailbox, this->server));
+        this->catalog_next = this->catalog->uidnext();
+    }
+    if (!this->worker && this->fulltext_mode) {
+        this->fulltext = std::make_shared<FullTextIndex>(this->out_dir, storeName(this->mailbox, this->server));
+    }
+    if (!this->worker && this->pack_store) {
+        this->pack = std::make_shared<PackStore>(this->out_dir, storeName(this->mailbox, this->server), this->segment_size);
+        if (this->index != nullptr) {
+            this->index->setSync([pack = this->pack]() { return pack->sync(); });
+        }
+    }
+    if (!this->worker && this->chunked()) {
+        this->journal = std::make_shared<ResumeJournal>(this->out_dir);
+    }
+
+    this->tracking = !this->worker && !this->only_new && !this->only_headers && !this->catalog_mode
+                     && (this->qresync || this->hasCapability("CONDSTORE"));
+    if (this->tracking) {
+        this->loadSyncState();
+
+        // with QRESYNC the server reports expunges and flag changes since the previous run right away
+        if (this->qresync && !this->stored_modseq.empty() && !this->stored_uidvalidity.empty()) {
+            cmd += " (QRESYNC (" + this->stored_uidvalidity + " " + this->stored_modseq + "))";
+        }
+        else {
+            cmd += " (CONDSTORE)";
+        }
+    }
+
+    // UIDVALIDITY and UIDNEXT are read from the untagged responses while in LOGGED state
+    this->state = State::LOGGED;
+    this->sendCommand(cmd);
+
+    // in non-blocking mode the changes are fetched by advance()
+    if (!this->nonblocking) {
+        this->syncChanges();
+        this->resumeParts();
+        this->indexStored();
+    }
+}
+
+
+void IMAPClient::resetMailboxState() {
+    this->uidvalidity = false;
+    this->synced = false;
+    this->uidnext = "1";
+    this->newuids.clear();
+    this->nmails = 0;
+    this->tracking = false;
+    this->highestmodseq.clear();
+    this->stored_modseq.clear();
+    this->stored_uidvalidity.clear();
+    this->flags.clear();
+    this->flags_changed = false;
+    this->vanished.clear();
+    this->index.reset();
+    this->pack.reset();
+    this->journal.reset();
+    this->catalog.reset();
+    this->catalog_rows.clear();
+    this->fulltext.reset();
+    this->partial.clear();
+    this->continuations.clear();
+}
+
+
+void IMAPClient::loadSyncState() {
+    uint64_t modseq = this->index->highestModseq();
+    uint64_t uidvalidity = this->index->uidvalidity();
+    this->stored_modseq = modseq ? std::to_string(modseq) : "";
+    this->stored_uidvalidity = uidvalidity ? std::to_string(uidvalidity) : "";
+
+    // every line holds UID and the flags of the message
+    std::ifstream flags_f(this->out_dir + "/.flags");
+    std::string line;
+    while (std::getline(flags_f, line)) {
+        std::size_t space = line.find(' ');
+        unsigned long uid = 0;
+        if (std::from_chars(line.data(), line.data() + line.size(), uid).ec == std::errc()) {
+            this->flags[uid] = space == std::string::npos ? "" : line.substr(space + 1);
+        }
+    }
+}
+
+
+std::string IMAPClient::changesCommand() {
+    // UIDs of another UIDVALIDITY mean nothing, all flags are fetched again
+    if (!this->uidvalidity) {
+        this->flags.clear();
+        this->flags_changed = true;
+        this->stored_modseq.clear();
+    }
+
+    if (this->stored_modseq.empty()) {
+        return "UID FETCH 1:* (FLAGS)";
+    }
+
+    // QRESYNC reported the changes with SELECT, unchanged HIGHESTMODSEQ means there are none
+    if (this->qresync || this->stored_modseq == this->highestmodseq) {
+        return "";
+    }
+    return "UID FETCH 1:* (FLAGS) (CHANGEDSINCE " + this->stored_modseq + ")";
+}
+
+
+std::string IMAPClient::expungesCommand() const {
+    // CHANGEDSINCE reports only flag changes, without QRESYNC expunges are found by comparing the UIDs
+    if (this->qresync || this->flags.empty()) {
+        return "";
+    }
+    return this->hasCapability("ESEARCH") ? "UID SEARCH RETURN (ALL) ALL" : "UID SEARCH ALL";
+}
+
+
+void IMAPClient::findExpunged() {
+    // the flags hold every UID stored by the previous run
+    for (const auto &entry : this->flags) {
+        if (!this->newuids.contains(entry.first)) {
+            this->vanished.add(entry.first);
+        }
+    }
+    this->newuids.clear();
+}
+
+
+void IMAPClient::syncChanges() {
+    // mailbox without mod-sequences cannot be tracked
+    if (!this->tracking || this->highestmodseq.empty()) {
+        return;
+    }
+
+    std::string cmd = this->changesCommand();
+    if (!cmd.empty()) {
+        this->state = State::UPDATING;
+        this->sendCommand(cmd);
+    }
+
+    cmd = this->expungesCommand();
+    if (!cmd.empty()) {
+        this->state = State::SEARCHING;
+        this->sendCommand(cmd);
+        this->findExpunged();
+    }
+    this->saveSyncState();
+}
+
+
+void IMAPClient::saveSyncState() {
+    // the flags hold every UID of the mailbox, so only they have to be checked
+    for (auto it = this->flags.begin(); it != this->flags.end(); ) {
+        if (!this->vanished.contains(it->first)) {
+            it++;
+            continue;
+        }
+        if (this->pack != nullptr) {
+            this->pack->remove(it->first);
+        }
+        else {
+            std::error_code ec;
+            std::filesystem::remove(this->out_dir + "/" + this->messageName(std::to_string(it->first)), ec);
+        }
+        it = this->flags.erase(it);
+        this->flags_changed = true;
+    }
+
+    if (this->flags_changed) {
+        std::string filename = this->out_dir + "/.flags";
+        {
+            std::ofstream flags_f(filename + ".tmp", std::ios::trunc);
+            if (!flags_f.is_open()) {
+                throw std::runtime_error("Cannot create .flags file.");
+            }
+            for (const auto &[uid, list] : this->flags) {
+                flags_f << uid << " " << list << "\n";
+            }
+        }
+        std::filesystem::rename(filename + ".tmp", filename);
+    }
+
+    // committed last, so an interrupted run applies the same changes again, the value was checked on arrival
+    uint64_t modseq = 0;
+    std::from_chars(this->highestmodseq.data(), this->highestmodseq.data() + this->highestmodseq.size(), modseq);
+    this->index->setHighestModseq(modseq);
+    this->index->checkpoint();
+
+    this->vanished.clear();
+    this->flags_changed = false;
+}
+
+
+void IMAPClient::storeFlags(unsigned long uid, std::string_view list) {
+    std::string &stored = this->flags[uid];
+    if (stored != list) {
+        stored = list;
+        this->flags_changed = true;
+    }
+}
+
+
+std::string IMAPClient::messageName(const std::string &uid) const {
+    return uid + "." + storeName(this->mailbox, this->server);
+}
+
+
+std::string IMAPClient::storeName(const std::string &mailbox, const std::string &server) {
+    // hierarchy delimiter of the mailbox name cannot be part of the file name
+    std::string name = mailbox;
+    std::replace(name.begin(), name.end(), '/', '_');
+    return name + "." + server;
+}
+
+
+std::string IMAPClient::quoteString(const std::string &str) {
+    std::string out{"\""};
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+std::string IMAPClient::fetchContent() const {
+    if (this->catalog_mode) {
+        return " (RFC822.SIZE FLAGS INTERNALDATE BODY.PEEK[HEADER.FIELDS (" CATALOG_FIELDS ")])";
+    }
+    if (this->only_headers) {
+        return " (BODY[HEADER])";
+    }
+    if (this->chunked()) {
+        return " (RFC822.SIZE BODY[]<0." + std::to_string(this->chunk_size) + ">)";
+    }
+    return " (BODY[])";
+}
+
+
+bool IMAPClient::chunked() const {
+    return this->chunk_size > 0 && !this->pack_store && !this->only_headers && !this->catalog_mode;
+}
+
+
+std::string IMAPClient::partCommand(unsigned long uid, unsigned long offset) const {
+    return std::to_string(uid) + " (BODY.PEEK[]<" + std::to_string(offset) + "." + std::to_string(this->chunk_size) + ">)";
+}
+
+
+void IMAPClient::resumeParts() {
+    // workers of a parallel download share the journal, the first connection continues its messages
+    if (this->journal == nullptr || this->worker) {
+        return;
+    }
+
+    UidSet stored = this->index != nullptr ? this->index->uids() : UidSet();
+    for (const auto &[uid, entry] : this->journal->entries()) {
+        std::shared_ptr<PendingMail> mail = this->newMail(uid);
+
+        // the interrupted run finished the message after all
+        if (stored.contains(uid)) {
+            unlink(mail->tmpname.c_str());
+            this->journal->remove(uid);
+            continue;
+        }
+
+        // the message starts over when the file is gone or shorter than the journal says
+        uint64_t offset = entry.offset;
+        struct stat st;
+        if (stat(mail->tmpname.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) < offset) {
+            offset = 0;
+        }
+
+        uint64_t size = entry.size;
+        this->writer->submit(this->writes, this->write_lane, 0, [mail, offset, size]() { mail->resume(offset, size); });
+        this->partial[uid] = Partial{mail, offset, size};
+        this->continuations.push_back(this->partCommand(uid, offset));
+    }
+}
+
+
+void IMAPClient::indexStored() {
+    if (this->fulltext == nullptr || this->index == nullptr) {
+        return;
+    }
+    UidSet missing = this->index->uids();
+    missing.remove(this->fulltext->covered());
+    if (missing.empty()) {
+        return;
+    }
+
+    std::string prefix = this->label.empty() ? "" : this->label + ": ";
+    std::cout << prefix + "Indexing " + std::to_string(missing.count()) + " stored emails.\n" << std::flush;
+
+    // tasks of a few messages each, so downloads queued meanwhile are not held up for long
+    std::string dir = this->out_dir + "/";
+    std::string suffix = "." + storeName(this->mailbox, this->server);
+    std::vector<unsigned long> uids;
+    auto submit = [this, &uids, &dir, &suffix]() {
+        this->writer->submit(this->writes, this->write_lane, 0, [fulltext = this->fulltext, uids, dir, suffix]() {
+            for (unsigned long uid : uids) {
+                fulltext->addFile(uid, dir + std::to_string(uid) + suffix);
+            }
+        });
+        uids.clear();
+    };
+    for (const UidSet::Interval &i : missing.ranges()) {
+        for (unsigned long uid = i.first; uid <= i.second; uid++) {
+            uids.push_back(uid);
+            if (uids.size() == FULLTEXT_CATCHUP) {
+                submit();
+            }
+        }
+    }
+    if (!uids.empty()) {
+        submit();
+    }
+    this->flushFullText();
+}
+
+
+void IMAPClient::flushFullText() {
+    if (this->fulltext != nullptr) {
+        this->writer->submit(this->writes, this->write_lane, 0, [fulltext = this->fulltext]() { fulltext->flush(); });
+    }
+}
+
+
+void IMAPClient::dropParts() {
+    for (auto &[uid, part] : this->partial) {
+        this->writer->submit(this->writes, this->write_lane, 0, [mail = part.mail, journal = this->journal, uid]() {
+            mail->resumable = false;
+            if (journal != nullptr) {
+                journal->remove(uid);
+            }
+        });
+    }
+    this->partial.clear();
+}
+
+
+void IMAPClient::printDownloaded(unsigned long count) const {
+    // whole line is written at once, connections of a pool print from several threads
+    std::string line = this->label.empty() ? "" : this->label + ": ";
+    if (this->only_new) {
+        line += "Downloaded " + std::to_string(count) + " new mails.\n";
+    }
+    else if (this->only_headers) {
+        line += "Downloaded " + std::to_string(count) + " email headers.\n";
+    }
+    else if (this->catalog_mode) {
+        line += "Catalogued " + std::to_string(count) + " emails.\n";
+    }
+    else {
+        line += "Downloaded " + std::to_string(count) + " emails.\n";
+    }
+    std::cout << line << std::flush;
+}
+
+
+void IMAPClient::fetchMails() {
+    if (this->only_new){
+        this->enterPhase(Phase::SEARCH);
+        this->state = State::SEARCHING;
+        this->sendCommand("UID SEARCH NEW");
+
+        this->fetchBatches(this->newuids.batches(this->fetch_batch));
+        this->printDownloaded(this->nmails);
+        return;
+    }
+
+    // only the rest of the messages fetched in parts, when there is nothing new
+    std::vector<std::string> batches;
+    if (!this->synced) {
+        batches.push_back((this->uidvalidity ? this->uidnext : "1") + ":*");
+    }
+    this->fetchBatches(batches);
+    this->printDownloaded(this->nmails);
+}
+
+
+void IMAPClient::fetchBatches(const std::vector<std::string> &batches) {
+    this->batches = batches;
+    this->next_batch = 0;
+    this->enterPhase(Phase::FETCH);
+    this->state = State::FETCHING;
+
+    while (this->fillPipeline()) {
+        this->checkResponse();
+    }
+    if (this->scheduler != nullptr) {
+        this->scheduler->finished(this->scheduler_queue);
+    }
+    this->flushCatalog();
+    this->flushFullText();
+    this->writes.wait();
+    this->state = State::SELECTED;
+}
+
+
+bool IMAPClient::fillPipeline() {
+    std::string content = this->fetchContent();
+    std::string set;
+
+    // keep up to pipeline_depth batches in flight, send the next one whenever one completes
+    while (this->pending.size() < this->pipeline_depth) {
+        // parts of large messages go first, so their files are finished early
+        if (!this->continuations.empty()) {
+            this->queueCommand("UID FETCH " + this->continuations.front());
+            this->continuations.pop_front();
+        }
+        else if (this->next_batch < this->batches.size()) {
+            this->queueCommand("UID FETCH " + this->batches[this->next_batch] + content);
+            this->next_batch++;
+        }
+        else if (this->scheduler != nullptr && this->scheduler->next(this->scheduler_queue, !this->pending.empty(), set)) {
+            this->queueCommand("UID FETCH " + set + content);
+        }
+        else break;
+        this->state = State::FETCHING;
+    }
+
+    // all commands completed and no part was returned for the unfinished messages
+    if (this->pending.empty() && !this->partial.empty()) {
+        this->dropParts();
+    }
+    return !this->pending.empty();
+}
+
+
+std::string IMAPClient::resolve(const std::string &server, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(server.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || result == nullptr) {
+        throw TransportError("Cannot resolve the server name.");
+    }
+
+    char host[NI_MAXHOST];
+    int rc = getnameinfo(result->ai_addr, result->ai_addrlen, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+    bool ipv6 = result->ai_family == AF_INET6;
+    freeaddrinfo(result);
+    if (rc != 0) {
+        throw TransportError("Cannot resolve the server name.");
+    }
+    return (ipv6 ? "[" + std::string(host) + "]" : std::string(host)) + ":" + std::to_string(port);
+}
+
+
+void IMAPClient::setAddress(const std::string &address) {
+    this->address = address;
+}
+
+
+void IMAPClient::startAsync() {
+    if (this->writer == nullptr) {
+        this->setWriter(std::make_shared<AsyncWriter>(this->writers ? this->writers : 1, this->write_queue));
+    }
+
+    // the event loop must not wait for the disk, handleEvent() stops reading instead
+    this->writes.setBlocking(false);
+    this->nonblocking = true;
+    this->step = Step::CONNECTING;
+    this->openConnection();
+}
+
+
+int IMAPClient::socket() const {
+    int fd = -1;
+    if (this->bio != nullptr) {
+        BIO_get_fd(this->bio, &fd);
+    }
+    return fd;
+}
+
+
+bool IMAPClient::handleEvent() {
+    // time without reading counts as waiting for the disk, like a blocked submit
+    if (this->throttled) {
+        this->writer->addBlocked(std::chrono::steady_clock::now() - this->throttled_since);
+        this->throttled = false;
+    }
+    if (this->step == Step::CONNECTING) {
+        if (!this->establish()) {
+            return false;
+        }
+        this->verifyCertificate();
+        this->reportHandshake();
+        this->enterPhase(Phase::LOGIN);
+        this->step = Step::GREETING;
+    }
+
+    // the session ends once the downloaded messages are on the disk
+    if (this->step == Step::WRITING) {
+        if (!this->writes.idle()) {
+            this->throttled = true;
+            this->throttled_since = std::chrono::steady_clock::now();
+            return false;
+        }
+        this->writes.wait();
+        this->printDownloaded(this->nmails);
+        this->step = Step::LOGOUT;
+        this->logout();
+    }
+
+    this->flushOutput();
+
+    // read everything the socket has while the writer keeps up, process it and send the following commands
+    while (this->step != Step::DONE) {
+        if (this->step == Step::WRITING || this->writer->full(this->write_lane)) {
+            this->throttled = true;
+            this->throttled_since = std::chrono::steady_clock::now();
+            break;
+        }
+
+        int nrecieved = this->receive();
+        if (nrecieved > 0) {
+            this->processAsync();
+            continue;
+        }
+
+        if (BIO_should_retry(this->bio)) {
+            break;
+        }
+        throw TransportError("Server closed the connection.");
+    }
+
+    this->want_write = !this->flushOutput() || BIO_should_write(this->bio);
+    return this->step == Step::DONE;
+}
+
+
+void IMAPClient::processAsync() {
+    this->processResponse();
+    while (this->complete && this->step != Step::DONE) {
+        this->complete = false;
+        this->advance();
+        this->processResponse();
+    }
+}
+
+
+void IMAPClient::advance() {
+    switch (this->step) {
+        case Step::GREETING:
+            this->step = Step::LOGIN;
+            this->login();
+            break;
+
+        case Step::LOGIN:
+        case Step::CAPABILITY:
+        case Step::ENABLE:
+        case Step::COMPRESS:
+            if (!this->negotiate()) {
+                this->step = Step::SELECT;
+                this->selectMailbox();
+            }
+            break;
+
+        case Step::SELECT:
+            if (this->tracking && !this->highestmodseq.empty()) {
+                std::string cmd = this->changesCommand();
+                if (!cmd.empty()) {
+                    this->step = Step::CHANGES;
+                    this->state = State::UPDATING;
+                    this->sendCommand(cmd);
+                    break;
+                }
+            }
+            [[fallthrough]];
+
+        case Step::CHANGES:
+            if (this->tracking && !this->highestmodseq.empty()) {
+                std::string cmd = this->expungesCommand();
+                if (!cmd.empty()) {
+                    this->step = Step::EXPUNGES;
+                    this->state = State::SEARCHING;
+                    this->sendCommand(cmd);
+                    break;
+                }
+            }
+            [[fallthrough]];
+
+        case Step::EXPUNGES:
+            if (this->tracking && !this->highestmodseq.empty()) {
+                if (this->step == Step::EXPUNGES) {
+                    this->findExpunged();
+                }
+                this->saveSyncState();
+            }
+            this->resumeParts();
+
+            if (this->upToDate()) {
+                std::string prefix = this->label.empty() ? "" : this->label + ": ";
+                std::cout << prefix + "All emails from server are already downloaded.\n" << std::flush;
+                this->step = Step::LOGOUT;
+                this->logout();
+            }
+            else if (this->only_new) {
+                this->step = Step::SEARCH;
+                this->enterPhase(Phase::SEARCH);
+                this->state = State::SEARCHING;
+                this->sendCommand("UID SEARCH NEW");
+            }
+            else {
+                this->step = Step::FETCH;
+                this->batches.clear();
+                if (!this->synced) {
+                    this->batches.push_back((this->uidvalidity ? this->uidnext : "1") + ":*");
+                }
+                this->next_batch = 0;
+                this->enterPhase(Phase::FETCH);
+                this->state = State::FETCHING;
+                this->fillPipeline();
+            }
+            break;
+
+        case Step::SEARCH:
+            this->step = Step::FETCH;
+            this->batches = this->newuids.batches(this->fetch_batch);
+            this->next_batch = 0;
+            this->enterPhase(Phase::FETCH);
+            this->state = State::FETCHING;
+            if (!this->fillPipeline()) {
+                this->printDownloaded(this->nmails);
+                this->step = Step::LOGOUT;
+                this->logout();
+            }
+            break;
+
+        case Step::FETCH:
+            // handleEvent() logs out when the writes are finished
+            if (!this->fillPipeline()) {
+                this->step = Step::WRITING;
+            }
+            break;
+
+        case Step::LOGOUT:
+            this->step = Step::DONE;
+            this->state = State::DISCONNECTED;
+            this->endPhase();
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void IMAPClient::reconcile(bool parallel) {
+    this->newuids.clear();
+    this->enterPhase(Phase::SEARCH);
+    this->state = State::SEARCHING;
+    this->sendCommand(this->hasCapability("ESEARCH") ? "UID SEARCH RETURN (ALL) ALL" : "UID SEARCH ALL");
+
+    // unfinished messages of an interrupted run are continued with their next parts
+    UidSet stored = this->index->uids();
+    UidSet missing = this->newuids;
+    missing.remove(stored);
+    for (const auto &entry : this->partial) {
+        missing.remove(entry.first);
+    }
+
+    // messages expunged on the server stay on the disk
+    stored.remove(this->newuids);
+
+    std::string line = this->label.empty() ? "" : this->label + ": ";
+    line += std::to_string(this->newuids.count()) + " messages on the server, " + std::to_string(missing.count())
+            + " missing locally in " + std::to_string(missing.ranges().size()) + " ranges";
+    if (!stored.empty()) {
+        line += ", " + std::to_string(stored.count()) + " stored messages no longer on the server";
+    }
+    std::cout << line + ".\n" << std::flush;
+
+    if (parallel) {
+        this->fetchParallel(missing);
+        return;
+    }
+    this->fetchBatches(missing.batches(this->fetch_batch));
+    this->printDownloaded(this->nmails);
+}
+
+
+void IMAPClient::fetchParallel() {
+    // find out which messages are to be downloaded, UIDs lower than the stored UIDNEXT may be returned for '*'
+    unsigned long from = this->uidvalidity ? std::stoul(this->uidnext) : 1;
+    this->enterPhase(Phase::SEARCH);
+    this->state = State::SEARCHING;
+    if (this->only_new) {
+        this->sendCommand("UID SEARCH NEW");
+    }
+    else {
+        this->sendCommand("UID SEARCH UID " + std::to_string(from) + ":*");
+    }
+
+    UidSet uids;
+    for (const UidSet::Interval &i : this->newuids.ranges()) {
+        if (this->only_new || i.second >= from) {
+            uids.add(this->only_new ? i.first : std::max(i.first, from), i.second);
+        }
+    }
+
+    // unfinished messages of an interrupted run are continued by this connection
+    for (const auto &entry : this->partial) {
+        uids.remove(entry.first);
+    }
+
+    // UIDNEXT covers only messages without a gap below them, the others stored before a lost connection are skipped
+    if (this->index != nullptr && !this->only_headers && !this->only_new) {
+        uids.remove(this->index->uids());
+    }
+
+    this->fetchParallel(uids);
+}
+
+
+void IMAPClient::fetchParallel(const UidSet &uids) {
+    // whole messages are taken from the scheduler by their sizes, headers are alike and dealt out in turns,
+    // so all connections advance through the UID space together
+    std::vector<std::vector<std::string>> shards(this->jobs);
+    std::shared_ptr<FetchScheduler> scheduler;
+    if (!this->only_headers) {
+        scheduler = std::make_shared<FetchScheduler>(this->fetchSizes(uids), this->jobs, this->fetch_batch);
+    }
+    else {
+        std::vector<std::string> batches = uids.batches(this->fetch_batch);
+        for (std::size_t i = 0; i < batches.size(); i++) {
+            shards[i % this->jobs].push_back(batches[i]);
+        }
+    }
+
+    // UIDNEXT is changed only when downloading complete emails
+    std::unique_ptr<UidTracker> tracker;
+    std::function<void(unsigned long)> on_commit;
+    if (!this->only_headers && !this->only_new) {
+        tracker = std::make_unique<UidTracker>(uids, *this->index);
+    }
+    if (tracker != nullptr || scheduler != nullptr) {
+        on_commit = [&tracker, scheduler](unsigned long uid) {
+            if (tracker != nullptr) {
+                tracker->commit(uid);
+            }
+            if (scheduler != nullptr) {
+                scheduler->delivered();
+            }
+        };
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(this->jobs);
+    std::vector<unsigned long> counts(this->jobs, 0);
+
+    for (unsigned int i = 1; i < this->jobs; i++) {
+        threads.emplace_back([this, i, &shards, &scheduler, &errors, &counts, &on_commit]() {
+            try {
+                IMAPClient worker(this->server, this->auth_file, this->out_dir, this->port, this->mailbox,
+                                  this->certfile, this->certaddr, this->only_new, this->only_headers, this->secured);
+                worker.pipeline_depth = this->pipeline_depth;
+                worker.chunk_size = this->chunk_size;
+                worker.pack_store = this->pack_store;
+                worker.worker = true;
+                worker.on_commit = on_commit;
+                worker.index = this->index;
+                worker.pack = this->pack;
+                worker.journal = this->journal;
+                worker.fulltext = this->fulltext;
+                worker.scheduler = scheduler;
+                worker.scheduler_queue = i;
+                worker.dedup = this->dedup;
+                worker.setWriter(this->writer);
+                worker.compress = this->compress;
+                worker.transfer = this->transfer;
+                worker.stats = this->stats;
+
+                // all connections use one SSL context and session cache
+                worker.shareContext(this->ctx);
+                worker.session_cache = this->session_cache;
+                worker.label = "Connection " + std::to_string(i + 1);
+
+                worker.connectToHost();
+                worker.login();
+                worker.selectMailbox();
+                worker.fetchBatches(shards[i]);
+                counts[i] = worker.nmails;
+            }
+            catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+
+    // this connection takes the first shard
+    try {
+        this->on_commit = on_commit;
+        this->scheduler = scheduler;
+        this->scheduler_queue = 0;
+        this->fetchBatches(shards[0]);
+        counts[0] = this->nmails;
+    }
+    catch (...) {
+        errors[0] = std::current_exception();
+        // queued messages are committed through the tracker, which ends with this call
+        this->writes.drain();
+    }
+
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    // the tracker does not outlive this call
+    this->on_commit = nullptr;
+    this->scheduler = nullptr;
+
+    for (std::exception_ptr &e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+
+    unsigned long total = 0;
+    for (unsigned long count : counts) {
+        total += count;
+    }
+    this->printDownloaded(total);
+    if (scheduler != nullptr) {
+        scheduler->print(std::cout);
+    }
+}
+
+
+std::vector<std::pair<unsigned long, uint64_t>> IMAPClient::fetchSizes(const UidSet &uids) {
+    this->sizes.clear();
+    this->enterPhase(Phase::SEARCH);
+    this->state = State::SIZING;
+    for (const std::string &set : uids.batches(SCHEDULE_SIZE_BATCH)) {
+        this->queueCommand("UID FETCH " + set + " (RFC822.SIZE)");
+    }
+    while (!this->pending.empty()) {
+        this->checkResponse();
+    }
+    this->state = State::SELECTED;
+
+    // UIDs outside the set come when the server sends unsolicited FETCH responses
+    std::vector<std::pair<unsigned long, uint64_t>> result;
+    std::sort(this->sizes.begin(), this->sizes.end());
+    for (const auto &entry : this->sizes) {
+        if (uids.contains(entry.first) && (result.empty() || result.back().first != entry.first)) {
+            result.push_back(entry);
+        }
+    }
+    this->sizes.clear();
+    return result;
+}
+
+
+void IMAPClient::syncMailboxes() {
+    this->enterPhase(Phase::LIST);
+    this->state = State::LISTING;
+    this->mailboxes.clear();
+    this->sendCommand("LIST \"\" \"*\"");
+
+    std::deque<ListedMailbox> waiting;
+    for (const ListedMailbox &mailbox : this->mailboxes) {
+        if (this->matchesPatterns(mailbox.name)) {
+            waiting.push_back(mailbox);
+        }
+    }
+
+    std::mutex mutex;
+    std::function<bool(ListedMailbox &)> next = [&waiting, &mutex](ListedMailbox &mailbox) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (waiting.empty()) {
+            return false;
+        }
+        mailbox = waiting.front();
+        waiting.pop_front();
+        return true;
+    };
+
+    std::string base_dir = this->out_dir;
+    std::size_t connections = std::min<std::size_t>(this->jobs, waiting.size());
+    std::vector<std::thread> threads;
+    std::vector<unsigned long> failed(std::max<std::size_t>(connections, 1), 0);
+
+    for (std::size_t i = 1; i < connections; i++) {
+        threads.emplace_back([this, i, &next, &base_dir, &failed]() {
+            IMAPClient worker(this->server, this->auth_file, base_dir, this->port, this->mailbox,
+                              this->certfile, this->certaddr, this->only_new, this->only_headers, this->secured);
+            worker.pipeline_depth = this->pipeline_depth;
+            worker.fetch_batch = this->fetch_batch;
+            worker.compress = this->compress;
+            worker.transfer = this->transfer;
+            worker.stats = this->stats;
+            worker.pack_store = this->pack_store;
+            worker.segment_size = this->segment_size;
+            worker.chunk_size = this->chunk_size;
+            worker.retries = this->retries;
+            worker.reconcile_mode = this->reconcile_mode;
+            worker.catalog_mode = this->catalog_mode;
+            worker.fulltext_mode = this->fulltext_mode;
+            worker.dedup = this->dedup;
+            worker.setWriter(this->writer);
+
+            // all connections use one SSL context and session cache
+            worker.shareContext(this->ctx);
+            worker.session_cache = this->session_cache;
+
+            try {
+                worker.connectToHost();
+                worker.login();
+            }
+            catch (std::runtime_error &e) {
+                std::cerr << "Connection " + std::to_string(i + 1) + ": " + e.what() + "\n";
+                return;
+            }
+            failed[i] = worker.syncQueue(next, base_dir);
+        });
+    }
+
+    // this connection is part of the pool too
+    failed[0] = this->syncQueue(next, base_dir);
+
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    unsigned long nfailed = waiting.size();
+    for (unsigned long n : failed) {
+        nfailed += n;
+    }
+    if (nfailed > 0) {
+        throw std::runtime_error("Synchronization of " + std::to_string(nfailed) + " mailboxes failed.");
+    }
+}
+
+
+unsigned long IMAPClient::syncQueue(const std::function<bool(ListedMailbox &)> &next, const std::string &base_dir) {
+    ListedMailbox mailbox;
+    unsigned long nfailed = 0;
+    bool again = false;
+    while (again || next(mailbox)) {
+        again = false;
+        try {
+            this->mailbox = mailbox.name;
+            this->label = mailbox.name;
+            this->out_dir = base_dir + "/" + mailboxDirectory(mailbox);
+            std::filesystem::create_directories(this->out_dir);
+
+            this->resetMailboxState();
+            this->selectMailbox();
+            if (this->reconcile_mode) {
+                this->reconcile(false);
+                continue;
+            }
+            if (this->upToDate()) {
+                std::cout << this->label + ": All emails from server are already downloaded.\n" << std::flush;
+                continue;
+            }
+            this->fetchMails();
+        }
+
+        // the mailbox is synchronized again on the restored connection
+        catch (TransportError &e) {
+            std::string reason = e.what();
+            if (this->recover(reason)) {
+                again = true;
+                continue;
+            }
+            std::cerr << mailbox.name + ": " + reason + "\n";
+            return nfailed + 1;
+        }
+
+        // e.g. a refused SELECT, the other mailboxes are still synchronized
+        catch (std::exception &e) {
+            std::cerr << mailbox.name + ": " + e.what() + "\n";
+            nfailed++;
+
+            // a failure in the middle of a command leaves its responses unread, the next mailbox gets a new connection
+            if (!this->pending.empty()) {
+                std::string reason = e.what();
+                if (!this->recover(reason)) {
+                    return nfailed;
+                }
+            }
+        }
+    }
+    return nfailed;
+}
+
+
+bool IMAPClient::matchesPatterns(const std::string &name) const {
+    bool included = false;
+    for (const std::string &pattern : this->include) {
+        if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+            included = true;
+            break;
+        }
+    }
+
+    for (const std::string &pattern : this->exclude) {
+        if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+            return false;
+        }
+    }
+    return included;
+}
+
+
+std::string IMAPClient::mailboxDirectory(const ListedMailbox &mailbox) {
+    std::string path;
+    std::string level;
+
+    for (std::size_t i = 0; i <= mailbox.name.size(); i++) {
+        if (i < mailbox.name.size() && mailbox.name[i] != mailbox.delimiter && mailbox.name[i] != '/') {
+            level += mailbox.name[i];
+            continue;
+        }
+
+        if (level.empty() || level == "." || level == "..") {
+            level = "_";
+        }
+        path += path.empty() ? level : "/" + level;
+        level.clear();
+    }
+    return path;
+}
+
+
+void IMAPClient::parseList(std::string_view response) {
+    // * LIST (attributes) delimiter name
+    std::size_t close = response.find(')');
+    if (close == std::string_view::npos) {
+        return;
+    }
+
+    std::string_view attributes = response.substr(0, close);
+    if (attributes.find("\\Noselect") != std::string_view::npos || attributes.find("\\NonExistent") != std::string_view::npos) {
+        return;
+    }
+
+    // reads quoted string, literal or atom from the position, moves the position after it
+    std::size_t pos = close + 1;
+    auto readString = [&response, &pos]() {
+        std::string out;
+        while (pos < response.size() && response[pos] == ' ') pos++;
+
+        std::size_t size = 0;
+        std::size_t brace = response.find("}\r\n", pos);
+        if (pos < response.size() && response[pos] == '{' && brace != std::string_view::npos &&
+            std::from_chars(response.data() + pos + 1, response.data() + brace, size).ptr == response.data() + brace) {
+            out = response.substr(brace + 3, size);
+            pos = brace + 3 + size;
+        }
+        else if (pos < response.size() && response[pos] == '"') {
+            for (pos++; pos < response.size() && response[pos] != '"'; pos++) {
+                if (response[pos] == '\\') pos++;
+                if (pos < response.size()) out += response[pos];
+            }
+            pos++;
+        }
+        else {
+            while (pos < response.size() && response[pos] != ' ') {
+                out += response[pos++];
+            }
+        }
+        return out;
+    };
+
+    std::string delimiter = readString();
+    std::string name = readString();
+    if (name.empty()) {
+        return;
+    }
+
+    char delim = (delimiter.size() == 1) ? delimiter[0] : '\0';
+    this->mailboxes.push_back(ListedMailbox{name, delim});
+}
+
+
+void IMAPClient::checkResponse() {
+    ssize_t nrecieved;
+
+    // data left over from previous responses may already complete this one
+    this->processResponse();
+
+    while(!this->complete) {
+        // try to get data from the server
+        nrecieved = this->receive();
+        
+        if(nrecieved == -1 || nrecieved == 0){
+            throw TransportError("Server closed the connection.");
+            this->state = State::DISCONNECTED;
+        }
+        
+        // process recieved data
+        this->processResponse();
+    }
+    this->complete = false;
+}
+
+void IMAPClient::checkTagged(unsigned long rtag, std::string_view status) {
+    // match the tag against the commands waiting for completion
+    auto it = std::find(this->pending.begin(), this->pending.end(), rtag);
+    if (it == this->pending.end()) {
+        return;
+    }
+    this->pending.erase(it);
+
+    int code = -1;
+    if (keywordIs(status, "OK")) {
+        code = 0;
+    }
+
+    else if (keywordIs(status, "NO")) {
+        code = 1;
+    }
+
+    else if (keywordIs(status, "BAD")) {
+        throw std::runtime_error("Internal error.");
+    }
+
+    else return;
+
+    switch (this->state) {
+        case State::CONNECTED:
+            if (!code) this->state = State::LOGGED;
+            else if (code) throw std::runtime_error("Invalid credentials.");
+            break;
+
+        case State::LOGGED:
+            if (!code) this->state = State::SELECTED;
+            else if (code) throw std::runtime_error("Desired mailbox does not exist.");
+            break;
+
+        case State::FETCHING:
+            if (!code) {
+                // other pipelined FETCH commands are still running
+                if (!this->pending.empty()) break;
+
+                this->state = State::SELECTED;
+            }
+            else if (code) throw std::runtime_error("Could not fetch data from the server.");
+            break;
+
+        case State::SEARCHING:
+            if (!code) this->state = State::SELECTED;
+            else if (code) throw std::runtime_error("Could not search for new mails.");
+            break;
+
+        case State::SIZING:
+            if (code) throw std::runtime_error("Could not fetch sizes of the messages.");
+            break;
+
+        case State::LISTING:
+            if (!code) this->state = State::LOGGED;
+            else if (code) throw std::runtime_error("Could not list mailboxes.");
+            break;
+
+        case State::NEGOTIATING:
+            // refused extensions are not an error, the session continues without them
+            this->accepted = !code;
+            this->state = State::LOGGED;
+            break;
+
+        case State::UPDATING:
+            if (!code) this->state = State::SELECTED;
+            else if (code) throw std::runtime_error("Could not fetch flag changes.");
+            break;
+
+        case State::IDLING:
+            if (!code) this->state = State::SELECTED;
+            else if (code) throw std::runtime_error("IDLE was refused by the server.");
+            break;
+        
+        default:
+            break;
+    }
+    this->complete = true;
+}
+
+void IMAPClient::processResponse() {
+    while (!this->complete && this->parser.next(this->buff));
+}
+
+
+void IMAPClient::response(std::string_view tag, unsigned long number, std::string_view keyword) {
+    this->reply = Reply::OTHER;
+    this->fetch_uid = 0;
+    this->fetch_flags.clear();
+    this->has_flags = false;
+    this->fetch_size = 0;
+    if (this->catalog != nullptr) {
+        this->catalog_row = CatalogRow{};
+    }
+
+    if (tag != "*") {
+        // tagged completion is checked at the end, after its response code was applied
+        unsigned long rtag = 0;
+        const char *end = tag.data() + tag.size();
+        auto [ptr, ec] = std::from_chars(tag.data() + 1, end, rtag);
+        if (tag.starts_with('A') && ec == std::errc() && ptr == end) {
+            this->reply = Reply::TAGGED;
+            this->reply_tag = rtag;
+            this->reply_status.assign(keyword);
+        }
+        return;
+    }
+
+    bool negotiating = this->state == State::CONNECTED || this->state == State::NEGOTIATING;
+
+    if (this->state == State::DISCONNECTED) {
+        if (keywordIs(keyword, "OK")) {
+            this->reply = Reply::GREETING;
+        }
+    }
+
+    // capabilities come with the LOGIN completion or as a response to CAPABILITY
+    else if (negotiating && keywordIs(keyword, "CAPABILITY")) {
+        this->reply = Reply::CAPABILITY;
+    }
+
+    else if (negotiating && keywordIs(keyword, "ENABLED")) {
+        this->reply = Reply::ENABLED;
+    }
+
+    // UIDVALIDITY and UIDNEXT of the selected mailbox, workers of a parallel download leave the state files to the first connection
+    else if (this->state == State::LOGGED && keywordIs(keyword, "OK")) {
+        if (!this->only_new && !this->worker) {
+            this->reply = Reply::SELECTED;
+        }
+    }
+
+    // expunges since the previous run, reported by SELECT with QRESYNC
+    else if (this->state == State::LOGGED && this->tracking && keywordIs(keyword, "VANISHED")) {
+        this->reply = Reply::VANISHED;
+    }
+
+    else if (keywordIs(keyword, "FETCH")) {
+        this->reply = Reply::FETCH;
+    }
+
+    // EXISTS of SELECT gives the size of the mailbox, afterwards it announces new mail, also during a download
+    else if (this->state != State::LOGGED && keywordIs(keyword, "EXISTS")) {
+        this->new_mail = true;
+    }
+
+    else if (this->state == State::LISTING && keywordIs(keyword, "LIST")) {
+        this->reply = Reply::LIST;
+    }
+
+    else if (this->state == State::SEARCHING && keywordIs(keyword, "SEARCH")) {
+        this->reply = Reply::SEARCH;
+    }
+
+    else if (this->state == State::SEARCHING && keywordIs(keyword, "ESEARCH")) {
+        this->reply = Reply::ESEARCH;
+    }
+}
+
+
+void IMAPClient::code(std::string_view name, std::string_view args) {
+    if ((this->state == State::CONNECTED || this->state == State::NEGOTIATING) && keywordIs(name, "CAPABILITY")) {
+        this->setCapabilities(args);
+    }
+
+    if (this->reply != Reply::SELECTED) {
+        return;
+    }
+
+    // the catalog keeps UIDVALIDITY of its own, the index belongs to downloaded messages
+    if (keywordIs(name, "UIDVALIDITY") && this->catalog != nullptr) {
+        uint64_t new_uidvalidity = 0;
+        std::from_chars(args.data(), args.data() + args.size(), new_uidvalidity);
+        this->uidvalidity = this->catalog->validate(new_uidvalidity);
+        this->catalog_next = this->catalog->uidnext();
+    }
+
+    else if (keywordIs(name, "UIDVALIDITY") && !this->only_headers) {
+        uint64_t new_uidvalidity = 0;
+        std::from_chars(args.data(), args.data() + args.size(), new_uidvalidity);
+
+        if (this->fulltext != nullptr) {
+            this->fulltext->validate(new_uidvalidity);
+        }
+
+        // stored UIDs of another UIDVALIDITY mean nothing, the index starts over
+        if (this->index->uidvalidity() == new_uidvalidity) {
+            this->uidvalidity = true;
+        }
+        else {
+            this->index->reset(new_uidvalidity);
+            if (this->pack != nullptr) {
+                this->pack->clear();
+            }
+
+            // parts of messages of the previous UIDVALIDITY cannot be continued
+            if (this->journal != nullptr) {
+                for (const auto &entry : this->journal->entries()) {
+                    unlink(this->newMail(entry.first)->tmpname.c_str());
+                }
+                this->journal->clear();
+            }
+        }
+    }
+
+    // a malformed value is skipped, the mailbox is then synchronized as one without mod-sequences
+    else if (keywordIs(name, "HIGHESTMODSEQ")) {
+        uint64_t modseq = 0;
+        auto [ptr, ec] = std::from_chars(args.data(), args.data() + args.size(), modseq);
+        if (ec == std::errc() && ptr == args.data() + args.size() && modseq > 0) {
+            this->highestmodseq = std::to_string(modseq);
+        }
+    }
+
+    else if (keywordIs(name, "UIDNEXT")) {
+        this->uidnext = std::to_string(this->catalog != nullptr ? this->catalog->uidnext() : this->index->uidnext());
+        if (args == this->uidnext) {
+            this->synced = true;
+        }
+    }
+}
+
+
+void IMAPClient::text(std::string_view text) {
+    switch (this->reply) {
+        case Reply::CAPABILITY:
+            this->setCapabilities(text);
+            break;
+
+        case Reply::ENABLED:
+            while (!text.empty()) {
+                std::size_t space = text.find(' ');
+                if (keywordIs(text.substr(0, space), "QRESYNC")) {
+                    this->qresync = true;
+                }
+                text = (space == std::string_view::npos) ? std::string_view() : text.substr(space + 1);
+            }
+            break;
+
+        case Reply::VANISHED:
+            this->vanished.add(text.substr(text.rfind(' ') + 1));
+            break;
+
+        case Reply::LIST:
+            this->parseList(text);
+            break;
+
+        case Reply::SEARCH: {
+            const char *pos = text.data();
+            const char *end = text.data() + text.size();
+            while (pos < end) {
+                unsigned long uid = 0;
+                auto [next, ec] = std::from_chars(pos, end, uid);
+                if (ec == std::errc()) {
+                    this->newuids.add(uid);
+                }
+                pos = next + 1;
+            }
+            break;
+        }
+
+        // (TAG "A5") UID ALL 1:3,5:100, ALL is left out when nothing matched
+        case Reply::ESEARCH: {
+            std::size_t pos = 0;
+            while (pos < text.size()) {
+                std::size_t end = std::min(text.find(' ', pos), text.size());
+                if (keywordIs(text.substr(pos, end - pos), "ALL") && end < text.size()) {
+                    std::size_t last = std::min(text.find(' ', end + 1), text.size());
+                    this->newuids.add(text.substr(end + 1, last - end - 1));
+                    break;
+                }
+                pos = end + 1;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+void IMAPClient::fetchItem(std::string_view name, std::string_view value) {
+    if (this->reply != Reply::FETCH) {
+        return;
+    }
+
+    if (keywordIs(name, "UID")) {
+        std::from_chars(value.data(), value.data() + value.size(), this->fetch_uid);
+    }
+
+    else if (keywordIs(name, "RFC822.SIZE")) {
+        std::from_chars(value.data(), value.data() + value.size(), this->fetch_size);
+    }
+
+    // flags of SELECT with QRESYNC and of the flag changes are kept without the parentheses
+    else if (keywordIs(name, "FLAGS") && this->tracking && (this->state == State::LOGGED || this->state == State::UPDATING)) {
+        if (value.starts_with('(') && value.ends_with(')')) {
+            value = value.substr(1, value.size() - 2);
+        }
+        this->fetch_flags.assign(value);
+        this->has_flags = true;
+    }
+
+    else if (keywordIs(name, "FLAGS") && this->catalog != nullptr) {
+        this->catalog_row.flags = Catalog::parseFlags(value);
+    }
+
+    else if (keywordIs(name, "INTERNALDATE") && this->catalog != nullptr) {
+        this->catalog_row.internaldate = Catalog::parseInternalDate(value);
+    }
+
+    // a part requested past the end of a message may come as an empty quoted string instead of a literal
+    else if (name.starts_with("BODY[") && value == "\"\"") {
+        this->literalBegin(name, 0);
+    }
+}
+
+
+void IMAPClient::literalBegin(std::string_view name, std::size_t size) {
+    // only the requested message data come as literals while fetching
+    if (this->reply != Reply::FETCH || this->state != State::FETCHING) {
+        return;
+    }
+    if (this->fetch_uid == 0) {
+        throw std::runtime_error("Server did not send the UID before the message.");
+    }
+
+    // header fields of the catalog are parsed at the end of the response
+    if (this->catalog != nullptr) {
+        this->mail_data.clear();
+        return;
+    }
+
+    // partial data are named BODY[]<origin>
+    unsigned long origin = 0;
+    std::size_t open = name.rfind('<');
+    if (open != std::string_view::npos && name.ends_with('>')) {
+        std::from_chars(name.data() + open + 1, name.data() + name.size() - 1, origin);
+    }
+
+    // a part which does not continue the message is skipped, e.g. the start of a message resumed from the journal
+    auto it = this->partial.find(this->fetch_uid);
+    if (it != this->partial.end()) {
+        if (origin != it->second.offset) {
+            return;
+        }
+        this->mail = it->second.mail;
+    }
+    else if (origin != 0) {
+        return;
+    }
+
+    this->mail_uid = this->fetch_uid;
+    this->mail_size = origin + size;
+    if (this->mail == nullptr) {
+        this->beginMail();
+    }
+}
+
+
+void IMAPClient::literalData(std::string_view data) {
+    if (this->catalog != nullptr && this->reply == Reply::FETCH && this->state == State::FETCHING) {
+        this->mail_data.append(data);
+        return;
+    }
+    if (this->mail == nullptr) {
+        return;
+    }
+
+    this->mail_data.append(data);
+
+    // the disk gets larger blocks than the socket gives
+    if (this->mail_data.size() >= WRITE_CHUNK) {
+        this->queueMailData();
+    }
+}
+
+
+void IMAPClient::end() {
+    switch (this->reply) {
+        case Reply::GREETING:
+            this->complete = true;
+            this->state = State::CONNECTED;
+            break;
+
+        case Reply::FETCH:
+            if (this->has_flags && this->fetch_uid != 0) {
+                this->storeFlags(this->fetch_uid, this->fetch_flags);
+            }
+
+            // RFC822.SIZE may follow the literal, so the message is finished with the response
+            if (this->mail != nullptr) {
+                this->endLiteral();
+            }
+            else if (this->catalog != nullptr && this->state == State::FETCHING && this->fetch_uid != 0) {
+                this->catalogMail();
+            }
+            else if (this->state == State::SIZING && this->fetch_uid != 0) {
+                this->sizes.emplace_back(this->fetch_uid, this->fetch_size);
+            }
+            break;
+
+        case Reply::TAGGED:
+            this->checkTagged(this->reply_tag, this->reply_status);
+            break;
+
+        default:
+            break;
+    }
+    this->reply = Reply::OTHER;
+}
+
+
+void IMAPClient::setCapabilities(std::string_view list) {
+    this->capabilities = " ";
+    for (char c : list) {
+        this->capabilities += std::toupper(static_cast<unsigned char>(c));
+    }
+    this->capabilities += " ";
+}
+
+
+std::shared_ptr<PendingMail> IMAPClient::newMail(unsigned long uid) const {
+    std::shared_ptr<PendingMail> mail = std::make_shared<PendingMail>();
+    mail->pack = this->pack;
+    mail->dedup = this->dedup;
+    mail->fulltext = this->fulltext;
+    if (this->pack == nullptr) {
+        std::string name = this->messageName(std::to_string(uid));
+        mail->filename = this->out_dir + "/" + name;
+        mail->tmpname = this->out_dir + "/." + name + ".part";
+    }
+    return mail;
+}
+
+
+void IMAPClient::beginMail() {
+    std::shared_ptr<PendingMail> mail = this->newMail(this->mail_uid);
+
+    // the first part of a chunked message reserves space for all of it
+    uint64_t uid = this->mail_uid;
+    uint64_t size = std::max<uint64_t>(this->mail_size, this->fetch_size);
+    this->writer->submit(this->writes, this->write_lane, 0, [mail, uid, size]() { mail->open(uid, size); });
+
+    this->mail = mail;
+    this->mail_data.clear();
+}
+
+
+void IMAPClient::queueMailData() {
+    std::size_t bytes = this->mail_data.size();
+    this->writer->submit(this->writes, this->write_lane, bytes,
+                         [mail = this->mail, data = std::move(this->mail_data)]() { mail->write(data.data(), data.size()); });
+    this->mail_data.clear();
+}
+
+
+void IMAPClient::endLiteral() {
+    this->completed++;
+
+    auto it = this->partial.find(this->mail_uid);
+    bool parted = it != this->partial.end();
+    uint64_t total = parted ? it->second.size : this->fetch_size;
+    uint64_t previous = parted ? it->second.offset : 0;
+
+    // only a part shorter than requested ends the message, RFC822.SIZE may be wrong and is used for the journal only
+    if (!this->chunked() || this->mail_size - previous < this->chunk_size) {
+        if (parted) {
+            this->partial.erase(it);
+        }
+        this->finishMail(parted);
+        return;
+    }
+
+    if (!this->mail_data.empty()) {
+        this->queueMailData();
+    }
+
+    // the journal refers only to data which is on the disk
+    uint64_t uid = this->mail_uid;
+    uint64_t offset = this->mail_size;
+    total = std::max(total, offset);
+    this->writer->submit(this->writes, this->write_lane, 0, [mail = this->mail, journal = this->journal, uid, offset, total]() {
+        mail->sync();
+        if (journal != nullptr) {
+            journal->record(uid, offset, total);
+            mail->resumable = true;
+        }
+    });
+
+    this->partial[uid] = Partial{std::move(this->mail), offset, total};
+    this->continuations.push_back(this->partCommand(uid, offset));
+    this->mail.reset();
+}
+
+
+void IMAPClient::finishMail(bool parted) {
+    if (!this->mail_data.empty()) {
+        this->queueMailData();
+    }
+
+    uint64_t uid = this->mail_uid;
+    uint64_t size = this->mail_size;
+    std::shared_ptr<ResumeJournal> journal = parted ? this->journal : nullptr;
+    std::shared_ptr<StateIndex> index = this->index;
+    std::function<void(unsigned long)> on_commit = this->on_commit;
+    bool whole = !this->only_headers && !this->only_new;
+    this->stats->addMessage(size);
+
+    // the message is recorded only after it is stored, on the lane that wrote it
+    auto received = std::chrono::steady_clock::now();
+    this->writer->submit(this->writes, this->write_lane, 0, [mail = std::move(this->mail), uid, size, journal, index, on_commit,
+                                                             whole, stats = this->stats, received]() {
+        uint64_t offset = mail->store(size);
+        stats->addWrite(std::chrono::steady_clock::now() - received);
+        if (mail->fulltext != nullptr) {
+            mail->indexText(uid);
+        }
+
+        if (journal != nullptr) {
+            journal->remove(uid);
+        }
+
+        // Record only complete emails, workers of a parallel download share the index of the first connection
+        if (index != nullptr && whole) {
+            index->add(uid, size, offset);
+        }
+
+        if (on_commit) {
+            on_commit(uid);
+        }
+
+        // Change UIDNEXT only when downloading complete emails, a message finished in parts may come after later ones
+        else if (whole) {
+            index->setUidnext(std::max<uint64_t>(index->uidnext(), uid + 1));
+        }
+    });
+
+    this->nmails++;
+    this->idle_from = std::max(this->idle_from, this->mail_uid + 1);
+}
+
+
+void IMAPClient::catalogMail() {
+    if (this->fetch_uid < this->catalog_next) {
+        this->mail_data.clear();
+        return;
+    }
+
+    CatalogRow &row = this->catalog_row;
+    row.uid = this->fetch_uid;
+    row.size = this->fetch_size;
+    Catalog::parseHeader(this->mail_data, row);
+    this->stats->addMessage(this->mail_data.size());
+    this->mail_data.clear();
+
+    this->catalog_rows.push_back(std::move(row));
+    this->catalog_next = this->fetch_uid + 1;
+    this->nmails++;
+    this->completed++;
+    this->idle_from = std::max(this->idle_from, this->fetch_uid + 1);
+
+    if (this->catalog_rows.size() >= CATALOG_BLOCK_ROWS) {
+        this->flushCatalog();
+    }
+}
+
+
+void IMAPClient::flushCatalog() {
+    if (this->catalog == nullptr || this->catalog_rows.empty()) {
+        return;
+    }
+
+    std::size_t bytes = 0;
+    for (const CatalogRow &row : this->catalog_rows) {
+        bytes += sizeof(CatalogRow) + row.from.size() + row.to.size() + row.subject.size() + row.date.size() + row.message_id.size();
+    }
+    this->writer->submit(this->writes, this->write_lane, bytes, [catalog = this->catalog, rows = std::move(this->catalog_rows)]() {
+        catalog->append(rows);
+    });
+    this->catalog_rows.clear();
+}
+
+
+void IMAPClient::cleanup() {
+    // connection may already be broken, which must not escape from the destructor
+    if (this->state != State::DISCONNECTED && !this->nonblocking && this->bio != nullptr) {
+        // rest of a literal interrupted by an error is skipped until the LOGOUT response
+        this->mail.reset();
+        this->mail_data.clear();
+        try {
+            this->logout();
+        }
+        catch (std::runtime_error &) { /* nothing more to do */ }
+    }
+
+    this->storeSession();
+
+    this->mail.reset();
+    this->flushCatalog();
+    this->partial.clear();
+    this->continuations.clear();
+    this->writes.drain();
+    this->endPhase();
+
     if (this->bio != nullptr) {
         BIO_free_all(this->bio);
     }
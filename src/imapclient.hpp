@@ -9,8 +9,15 @@
 #define IMAPCLIENT_HPP
 
 // C++
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // C
@@ -29,24 +36,78 @@
 #include  "openssl/err.h"
 
 #include "config.hpp"
+#include "inputbuffer.hpp"
+#include "uidset.hpp"
+#include "tlscache.hpp"
+#include "deflatestream.hpp"
+#include "stateindex.hpp"
+#include "packstore.hpp"
+#include "dedupstore.hpp"
+#include "asyncwriter.hpp"
+#include "syncstats.hpp"
+#include "resumejournal.hpp"
+#include "catalog.hpp"
+#include "fulltext.hpp"
+#include "fetchscheduler.hpp"
+#include "responseparser.hpp"
+#include "transporterror.hpp"
+
+#define BUFFER_SIZE 10000 // Maximal number of bytes requested by a single read
+#define IDLE_RENEW 1680     // seconds after which IDLE is restarted, servers may end it after 30 minutes
+#define IDLE_BACKOFF_MIN 1  // seconds before the first reconnection attempt
+#define IDLE_BACKOFF_MAX 300 // maximal seconds between reconnection attempts
+
+struct PendingMail;
+
+
+/**
+ * @brief Mailbox returned by LIST
+ */
+struct ListedMailbox {
+    std::string name;       // mailbox name as sent by the server
+    char delimiter;         // hierarchy delimiter, '\0' when the server has none
+};
+
+
+/**
+ * @brief Progress of a session driven by an event loop
+ */
+enum class Step {
+    CONNECTING,
+    GREETING,
+    LOGIN,
+    CAPABILITY,
+    ENABLE,
+    COMPRESS,
+    SELECT,
+    CHANGES,
+    EXPUNGES,
+    SEARCH,
+    FETCH,
+    WRITING,
+    LOGOUT,
+    DONE
+};
 
-#define BUFFER_SIZE 10000
 
 enum class State {
     DISCONNECTED,
     CONNECTED,
     LOGGED,
+    NEGOTIATING,
     SELECTED,
+    UPDATING,
+    LISTING,
     SEARCHING,
+    SIZING,
     FETCHING,
+    IDLING,
     LOGOUT
 };
 
 
-class IMAPClient {
+class IMAPClient : private ResponseHandler {
 public:
-    char buffer_in[BUFFER_SIZE]; // Buffer for incoming messages
-
     /**
      * @brief Construct a new IMAPClient object with provided parameters, optional parameteres have default values
      * 
@@ -75,12 +136,141 @@ public:
     /**
      * @brief Starts the client
      * 
-     * Creates socket for communication, resolves IP from domain
+     * Creates socket for communication, resolves IP from domain. When the connection is lost
+     * during the download, the client reconnects and continues, see recover().
      */
     void start();
 
+
+    /**
+     * @brief Starts a non-blocking session for an external event loop
+     * 
+     * The session connects, logs in, selects the mailbox and downloads it like start(),
+     * but every step is driven by handleEvent() calls when the socket is ready.
+     * 
+     * @throw std::runtime_error if the connection cannot be created
+     */
+    void startAsync();
+
+
+    /**
+     * @brief Continues a non-blocking session after its socket became ready
+     * 
+     * @return true when the session is finished
+     * 
+     * @throw std::runtime_error if the session fails
+     */
+    bool handleEvent();
+
+
+    /**
+     * @brief Socket of the connection, -1 before connecting started
+     */
+    int socket() const;
+
+
+    /**
+     * @brief Whether a non-blocking session waits for the socket to become writable
+     */
+    bool wantsWrite() const { return this->want_write; }
+
+
+    /**
+     * @brief Whether a non-blocking session waits for its writer lane instead of the socket
+     * 
+     * The session reads nothing until the disk catches up, the event loop calls handleEvent()
+     * again after a while.
+     */
+    bool waitsForDisk() const { return this->throttled; }
+
+
+    /**
+     * @brief Resolves the server name to a numeric address, the lookup blocks
+     * 
+     * @return address and port, e.g. "192.0.2.1:993" or "[2001:db8::1]:993"
+     * 
+     * @throw TransportError if the name cannot be resolved
+     */
+    static std::string resolve(const std::string &server, int port);
+
+
+    /**
+     * @brief Connects to the address returned by resolve() instead of looking the server name up
+     * 
+     * The server name is still used for SNI and the TLS session cache.
+     */
+    void setAddress(const std::string &address);
+
+
+    /**
+     * @brief Creates SSL context and loads the certificates
+     * 
+     * @param certfile file with certificates, used when certaddr is empty
+     * @param certaddr directory with certificates
+     * 
+     * @throw std::runtime_error if context cannot be created or certificates cannot be loaded
+     */
+    static SSL_CTX *createContext(const std::string &certfile, const std::string &certaddr);
+
+
+    /**
+     * @brief Uses an SSL context shared with other clients instead of creating its own
+     * 
+     * @param ctx context, its reference count is increased
+     */
+    void shareContext(SSL_CTX *ctx);
+
+
+    /**
+     * @brief Uses a TLS session cache shared with other clients
+     */
+    void setSessionCache(std::shared_ptr<TlsSessionCache> cache);
+
+
+    /**
+     * @brief Counts bytes of compressed connections into stats shared with other clients
+     */
+    void setTransferStats(std::shared_ptr<TransferStats> stats);
+
+
+    /**
+     * @brief Stores messages through a deduplicating store shared with other clients
+     */
+    void setDedupStore(std::shared_ptr<DedupStore> store);
+
+
+    /**
+     * @brief Writes messages through writer lanes shared with other clients
+     */
+    void setWriter(std::shared_ptr<AsyncWriter> writer);
+
+
+    /**
+     * @brief Counts phase timings, bytes and messages into stats shared with other clients
+     */
+    void setSyncStats(std::shared_ptr<SyncStats> stats);
+
+
+    /**
+     * @brief Sets the name printed with the results, used when several clients run at once
+     */
+    void setLabel(const std::string &label);
+
+
+    /**
+     * @brief Name identifying messages of the mailbox on the server, the end of message file names
+     */
+    static std::string storeName(const std::string &mailbox, const std::string &server);
+
+
+    /**
+     * @brief Quotes a string for use as an argument of a command
+     */
+    static std::string quoteString(const std::string &str);
+
 private:
     std::string server;     // name (IP address) of server to connect to
+    std::string address;    // resolved address and port of the server, empty when the name is looked up on connect
     std::string auth_file;  // file with authentication credentials
     std::string out_dir;    // directory for storing downloaded mail
     
@@ -91,19 +281,137 @@ private:
     bool only_new;          // work only with new mail
     bool only_headers;      // work only with mail headers
     bool secured;           // use tls
+    unsigned int pipeline_depth; // maximal number of FETCH commands in flight
+    unsigned long fetch_batch;   // maximal number of UIDs requested by one FETCH
+    unsigned int jobs;      // number of connections downloading in parallel
+    std::vector<std::string> include; // patterns of mailboxes to synchronize, empty for a single mailbox
+    std::vector<std::string> exclude; // patterns of mailboxes to leave out
+    std::string tls_cache_file; // file with TLS sessions of previous runs, empty when disabled
+    bool compress;          // enable COMPRESS=DEFLATE when the server supports it
+    bool idle_mode;         // keep the session open and download new mail as it arrives
+    bool pack_store;        // messages are appended to pack segments instead of a file per message
+    unsigned long segment_size; // size in bytes after which a new pack segment is started
+    std::string dedup_dir;  // directory of the deduplicating store, empty when disabled
+    unsigned int writers;   // number of writer lanes, 0 for one per connection
+    std::size_t write_queue; // maximal number of bytes queued on a writer lane
+    unsigned long chunk_size; // size in bytes above which messages are fetched in parts, 0 for whole messages
+    unsigned int retries;   // reconnection attempts in a row without progress, 0 to fail at once
+    bool reconcile_mode;    // download every message of the server missing in the index, not only those above UIDNEXT
+    bool catalog_mode;      // only metadata of the messages are fetched into the catalog of the mailbox
+    bool fulltext_mode;     // words of the stored messages are added to the full-text index of the mailbox
 
     /* Variables for internal state */
-    int tag;                // tag number for labeling outgoing commands
+    unsigned long tag;      // tag number for labeling outgoing commands
+    std::deque<unsigned long> pending; // tags of sent commands without a tagged response
     State state;            // internal state of client
     bool complete;          // indicator of a complete response from a server for checkResponse() function
     bool uidvalidity;       // validity of mail UIDs
     bool synced;            // client - server synchronization flag
+    bool worker;            // additional connection of a parallel download, does not touch state files
+    std::function<void(unsigned long)> on_commit; // called with UID of each downloaded message instead of updating UIDNEXT
     std::string uidnext;
-    std::string buff;       // input stream buffer
-    std::vector<std::string> newuids; // vector of new message UIDs
+    std::shared_ptr<StateIndex> index; // state of the selected mailbox, shared with the workers of a parallel download
+    std::shared_ptr<PackStore> pack; // pack store of the selected mailbox, shared like the index
+    std::shared_ptr<ResumeJournal> journal; // messages fetched in parts, shared like the index, nullptr when not chunking
+    std::shared_ptr<Catalog> catalog; // metadata of the selected mailbox, nullptr when not in catalog mode
+    std::shared_ptr<FullTextIndex> fulltext; // full-text index of the selected mailbox, shared like the index
+    std::shared_ptr<FetchScheduler> scheduler; // work of a parallel download by message sizes, shared by its connections
+    unsigned int scheduler_queue; // queue of the scheduler this connection takes from
+    std::shared_ptr<DedupStore> dedup; // store sharing equal messages, shared by all connections
+    std::shared_ptr<AsyncWriter> writer; // threads writing the messages, shared by all connections
+    unsigned int write_lane; // writer lane of this connection, keeps its messages in order
+    AsyncWriter::Group writes; // queued writes of this connection
+    InputBuffer buff;       // input stream buffer
+    ResponseParser parser{*this}; // tokenizer of the responses in the buffer
+    UidSet newuids;         // UIDs of new messages
+    std::vector<std::pair<unsigned long, uint64_t>> sizes; // RFC822.SIZE of the messages to schedule
+    std::vector<ListedMailbox> mailboxes; // mailboxes returned by LIST
+    std::string label;      // mailbox name printed with results when synchronizing several mailboxes
+    std::string capabilities; // capabilities announced after login, upper case and space delimited
+    bool accepted;          // the last CAPABILITY or COMPRESS command completed with OK
+    bool qresync;           // server enabled QRESYNC for this connection
+
+    /* Variables for synchronizing flags and expunges (CONDSTORE/QRESYNC) */
+    bool tracking;          // changes of the selected mailbox are kept in the state files
+    std::string highestmodseq;  // HIGHESTMODSEQ of the selected mailbox, empty for NOMODSEQ
+    std::string stored_modseq;  // HIGHESTMODSEQ stored by the previous run
+    std::string stored_uidvalidity; // UIDVALIDITY stored by the previous run
+    std::map<unsigned long, std::string> flags; // flags of the messages by UID
+    bool flags_changed;     // flags have to be written to the .flags file
+    UidSet vanished;        // UIDs of messages expunged since the previous run
+
+    /* Variables for the IDLE mode */
+    bool new_mail;          // server reported EXISTS since the last search for new mail
+    unsigned long idle_from; // lowest UID not downloaded by this session
+
+    /* Variables for the response being parsed */
+    enum class Reply {
+        OTHER,          // response of no interest
+        GREETING,
+        TAGGED,         // completion of a command
+        SELECTED,       // untagged OK with data of the selected mailbox
+        CAPABILITY,
+        ENABLED,
+        VANISHED,
+        FETCH,
+        LIST,
+        SEARCH,
+        ESEARCH         // UID SEARCH RETURN (ALL) result as a sequence-set
+    };
+    Reply reply;            // kind of the response being parsed
+    unsigned long reply_tag; // tag number of the tagged response
+    std::string reply_status; // OK, NO or BAD of the tagged response
+    unsigned long fetch_uid; // UID item of the FETCH response, 0 until it comes
+    std::string fetch_flags; // FLAGS item of the FETCH response, without the parentheses
+    bool has_flags;         // FETCH response carried the FLAGS item
+    unsigned long fetch_size; // RFC822.SIZE item of the FETCH response, 0 when it did not come
+
+    /* Variables for the message literal being downloaded */
+    unsigned long mail_size;   // size of the message received with the literal
+    unsigned long mail_uid; // UID of the message
+    std::shared_ptr<PendingMail> mail; // message being written by the writer lane
+    std::string mail_data;  // literal data not queued for writing yet
+
+    /* Variables for messages fetched in parts */
+    struct Partial {
+        std::shared_ptr<PendingMail> mail;
+        unsigned long offset;   // end of the data received so far, start of the next part
+        unsigned long size;     // RFC822.SIZE of the message
+    };
+    std::map<unsigned long, Partial> partial; // unfinished messages by UID
+    std::deque<std::string> continuations; // FETCH arguments of the next parts, sent before other batches
+
+    /* Variables for the metadata of the catalog mode */
+    CatalogRow catalog_row; // metadata of the FETCH response being parsed
+    std::vector<CatalogRow> catalog_rows; // rows not queued for writing yet
+    uint64_t catalog_next;  // lowest UID not in the catalog or its queued rows
+
+    /* Variables for reconnecting after a lost connection */
+    unsigned long completed; // messages and parts received completely, progress which resets the count of attempts
+    unsigned long completed_at_loss; // completed when the connection was last lost
+    unsigned int failures;  // reconnection attempts since the last progress
+
+    /* Variables for the non-blocking mode */
+    bool nonblocking;       // session is driven by an event loop through handleEvent()
+    Step step;              // progress of the non-blocking session
+    std::string outbuf;     // outgoing data not written to the socket yet
+    std::vector<std::string> batches; // sequence-sets to fetch
+    std::size_t next_batch; // index of the first sequence-set not requested yet
+    bool want_write;        // socket has to become writable before the session can continue
+    bool throttled;         // writer lane is full or the last messages are being written, nothing is read
+    std::chrono::steady_clock::time_point throttled_since; // when the session stopped reading
 
     BIO *bio;               // OpenSSL BIO object for writing and reading on socket
     SSL_CTX *ctx;           // OpenSSL context structure
+    std::shared_ptr<TlsSessionCache> session_cache; // TLS sessions offered for resumption
+    std::chrono::steady_clock::time_point connect_start; // start of the connection, for the handshake report
+    std::unique_ptr<DeflateStream> zstream; // compression layer, nullptr until COMPRESS is accepted
+    std::string rawbuf;     // compressed data read from the socket
+    std::shared_ptr<TransferStats> transfer; // byte counts of compressed connections
+    std::shared_ptr<SyncStats> stats; // timing and throughput of the run
+    Phase phase;            // phase the time of the connection is counted to
+    bool timing;            // a phase is running, false before connecting and after the connection ended
+    std::chrono::steady_clock::time_point phase_start;
 
     unsigned long nmails;   // Number of downloaded mails
 
@@ -114,12 +422,167 @@ private:
     void connectToHost();
 
 
+    /**
+     * @brief Creates BIO object for the connection, without connecting yet
+     */
+    void openConnection();
+
+
+    /**
+     * @brief Moves the connection on through TCP connect and TLS handshake
+     * 
+     * Both are driven separately, so their times are counted apart.
+     * 
+     * @return false when a non-blocking connection has to wait for the socket
+     * 
+     * @throw std::runtime_error if the connection cannot be established
+     */
+    bool establish();
+
+
+    /**
+     * @brief Counts the time since the previous phase started to it and starts the given one
+     */
+    void enterPhase(Phase next);
+
+
+    /**
+     * @brief Counts the time of the running phase, the connection is not timed until the next phase
+     */
+    void endPhase();
+
+
+    /**
+     * @brief Checks the verification result of the server certificate when using TLS
+     * 
+     * @throw std::runtime_error if the certificate cannot be verified
+     */
+    void verifyCertificate();
+
+
+    /**
+     * @brief Prints whether the TLS session was resumed and how long the connection took
+     */
+    void reportHandshake();
+
+
+    /**
+     * @brief Saves the TLS session of the connection to the session cache
+     */
+    void storeSession();
+
+
+    /**
+     * @brief Creates SSL context of this client
+     * 
+     * @throw std::runtime_error if context cannot be created or certificates cannot be loaded
+     */
+    void initContext();
+
+
     /**
      * @brief Attemps to log in on the server
      */
     void login();
 
 
+    /**
+     * @brief Sends the next command enabling extensions after login
+     * 
+     * Applies the result of the command which just completed, then asks for capabilities
+     * unless the server announced them, enables QRESYNC and COMPRESS=DEFLATE when supported.
+     * 
+     * @return false when there is nothing more to negotiate
+     */
+    bool negotiate();
+
+
+    /**
+     * @brief Whether the server announced the capability
+     */
+    bool hasCapability(const std::string &name) const;
+
+
+    /**
+     * @brief Switches the connection to compressed transport after COMPRESS was accepted
+     */
+    void startCompression();
+
+
+    /**
+     * @brief Reads from the socket into the input buffer, decompressing when compression is active
+     * 
+     * @return result of BIO_read()
+     */
+    int receive();
+
+
+    /**
+     * @brief Waits for new mail with IDLE and downloads it, reconnects with backoff when the connection drops
+     * 
+     * Runs until SIGINT or SIGTERM.
+     * 
+     * @throw std::runtime_error if the server does not support IDLE
+     */
+    void idleLoop();
+
+
+    /**
+     * @brief Runs one IDLE command until new mail arrives, the renewal interval passes or a stop is requested
+     * 
+     * @return true when the server reported new mail
+     */
+    bool idle();
+
+
+    /**
+     * @brief Downloads messages with UIDs from idle_from on
+     */
+    void fetchNew();
+
+
+    /**
+     * @brief Connects again after the connection was lost, downloads mail that arrived meanwhile
+     */
+    void reconnect();
+
+
+    /**
+     * @brief Selects the mailbox and downloads it, or all the mailboxes of --all, on a logged in connection
+     *
+     * Called again after a lost connection was restored, the download continues from the messages
+     * the index already has and the parts in the resume journal.
+     */
+    void synchronize();
+
+
+    /**
+     * @brief Connects and logs in again after a lost connection, with exponential backoff between attempts
+     *
+     * Attempts are counted from the last time the connection received a message or its part,
+     * so a download which keeps making progress is never given up.
+     *
+     * @param reason error the connection was lost with, replaced by the error of the last failed attempt
+     *
+     * @return false when the retry limit was reached or the server refused the login
+     */
+    bool recover(std::string &reason);
+
+
+    /**
+     * @brief Drops the connection and all state bound to it
+     */
+    void disconnect();
+
+
+    /**
+     * @brief Waits until there are data to read
+     * 
+     * @return false when the deadline passed or the wait was interrupted by a signal
+     */
+    bool waitReadable(std::chrono::steady_clock::time_point deadline);
+
+
     /**
      * @brief Logs out the user
      * 
@@ -133,6 +596,64 @@ private:
     void selectMailbox();
 
 
+    /**
+     * @brief Resets the state kept for the selected mailbox before selecting another one
+     */
+    void resetMailboxState();
+
+
+    /**
+     * @brief Reads the stored HIGHESTMODSEQ, UIDVALIDITY and flags of the mailbox
+     */
+    void loadSyncState();
+
+
+    /**
+     * @brief Starts applying changes after SELECT, drops the stored state when UIDVALIDITY changed
+     * 
+     * @return command fetching the flag changes, empty when QRESYNC already reported them
+     */
+    std::string changesCommand();
+
+
+    /**
+     * @brief Command listing the UIDs of the mailbox, for finding expunges without QRESYNC
+     * 
+     * @return UID SEARCH of all messages, empty when QRESYNC reports expunges or nothing is stored
+     */
+    std::string expungesCommand() const;
+
+
+    /**
+     * @brief Marks stored messages missing from the search results as expunged
+     */
+    void findExpunged();
+
+
+    /**
+     * @brief Fetches flag changes when the selected mailbox is tracked and stores the new state
+     */
+    void syncChanges();
+
+
+    /**
+     * @brief Deletes vanished messages, writes the flags and the new HIGHESTMODSEQ
+     */
+    void saveSyncState();
+
+
+    /**
+     * @brief Records flags of the message reported by an untagged FETCH response
+     */
+    void storeFlags(unsigned long uid, std::string_view list);
+
+
+    /**
+     * @brief File name of the message with the UID, without the directory
+     */
+    std::string messageName(const std::string &uid) const;
+
+
     /**
      * @brief fetches mails from the server
      */
@@ -140,7 +661,180 @@ private:
 
 
     /**
-     * @brief Constructs a tagged command to be sent to the server
+     * @brief Downloads exactly the messages of the server which the index does not have
+     *
+     * All UIDs of the mailbox are listed with UID SEARCH RETURN (ALL) when the server supports
+     * ESEARCH (RFC 4731), so they come as ranges, and with a plain UID SEARCH ALL otherwise.
+     * Both are kept as intervals, the stored UIDs are subtracted and the rest is fetched in
+     * batches, so memory and the number of commands grow with the gaps and not with the mailbox.
+     *
+     * @param parallel download over jobs connections
+     */
+    void reconcile(bool parallel);
+
+
+    /**
+     * @brief Synchronizes all mailboxes matching the include and exclude patterns
+     * 
+     * Mailboxes are found by LIST and synchronized by a pool of up to jobs logged in connections,
+     * each connection takes the next waiting mailbox when it is done with the previous one.
+     * Every mailbox is stored in its own subdirectory of out_dir together with its state files.
+     * 
+     * @throw std::runtime_error if any of the mailboxes could not be synchronized
+     */
+    void syncMailboxes();
+
+
+    /**
+     * @brief Selects and downloads mailboxes until next returns false
+     * 
+     * @param next provides the next mailbox to synchronize
+     * @param base_dir directory the mailbox subdirectories are created in
+     * 
+     * @return number of mailboxes which failed, the connection is not used after it is lost
+     */
+    unsigned long syncQueue(const std::function<bool(ListedMailbox &)> &next, const std::string &base_dir);
+
+
+    /**
+     * @brief Checks the mailbox name against the include and exclude patterns
+     */
+    bool matchesPatterns(const std::string &name) const;
+
+
+    /**
+     * @brief Returns relative path of the directory used for the mailbox
+     * 
+     * Hierarchy levels become nested directories, "." and ".." levels are replaced by "_".
+     */
+    static std::string mailboxDirectory(const ListedMailbox &mailbox);
+
+
+    /**
+     * @brief Parses the text of an untagged LIST response and stores the mailbox
+     * 
+     * Mailboxes with \Noselect or \NonExistent attribute are skipped.
+     */
+    void parseList(std::string_view response);
+
+
+    /**
+     * @brief Fetches the given sequence-sets, keeping up to pipeline_depth commands in flight
+     * 
+     * @param batches sequence-sets of UIDs, each is requested by one UID FETCH command
+     */
+    void fetchBatches(const std::vector<std::string> &batches);
+
+
+    /**
+     * @brief Sends FETCH commands for the next sequence-sets until pipeline_depth commands are pending
+     * 
+     * @return false when there is no pending command left
+     */
+    bool fillPipeline();
+
+
+    /**
+     * @brief Downloads the mailbox over several connections at once
+     * 
+     * Searches for the UIDs to download on this connection, splits them between jobs connections
+     * and runs each on its own thread. Additional connections share the SSL context of this one.
+     * 
+     * @throw std::runtime_error if any of the connections fails
+     */
+    void fetchParallel();
+
+
+    /**
+     * @brief Downloads the messages over jobs connections
+     *
+     * Whole messages are shared by their sizes through a FetchScheduler, headers are dealt
+     * out to the connections in batches.
+     *
+     * @throw std::runtime_error if any of the connections fails
+     */
+    void fetchParallel(const UidSet &uids);
+
+
+    /**
+     * @brief Fetches RFC822.SIZE of the messages, with the FETCH commands pipelined
+     *
+     * @return UIDs in ascending order with their sizes, messages expunged meanwhile are left out
+     */
+    std::vector<std::pair<unsigned long, uint64_t>> fetchSizes(const UidSet &uids);
+
+
+    /**
+     * @brief Returns the FETCH data items for the configured download mode
+     *
+     * When fetching in parts, only the first part of every message is requested, with
+     * RFC822.SIZE telling whether there are more.
+     */
+    std::string fetchContent() const;
+
+
+    /**
+     * @brief Whether large messages are fetched in parts
+     *
+     * Only messages stored as files can be resumed, headers are always small.
+     */
+    bool chunked() const;
+
+
+    /**
+     * @brief FETCH arguments requesting the part of the message starting at offset
+     */
+    std::string partCommand(unsigned long uid, unsigned long offset) const;
+
+
+    /**
+     * @brief Continues messages left unfinished by an interrupted run, called after SELECT
+     *
+     * Their .part files are truncated to the offset in the journal and the rest is queued
+     * as continuations. Messages which the index already has are dropped from the journal.
+     */
+    void resumeParts();
+
+
+    /**
+     * @brief Queues indexing of stored messages the full-text index does not cover, called after SELECT
+     *
+     * Covers messages downloaded before the index was enabled or lost with a crash before
+     * their segment was written. They are read from their files on the writer lane.
+     */
+    void indexStored();
+
+
+    /**
+     * @brief Queues writing of the collected words as a segment of the full-text index
+     */
+    void flushFullText();
+
+
+    /**
+     * @brief Forgets unfinished messages the server returned no more parts of
+     *
+     * Their .part files and journal entries are removed, the messages were expunged.
+     */
+    void dropParts();
+
+
+    /**
+     * @brief Whether there are neither new messages nor unfinished ones
+     */
+    bool upToDate() const { return this->synced && this->partial.empty(); }
+
+
+    /**
+     * @brief Prints the number of downloaded messages
+     */
+    void printDownloaded(unsigned long count) const;
+
+
+    /**
+     * @brief Constructs a tagged command, sends it to the server and waits for its completion
+     * 
+     * In non-blocking mode the command is only sent, its completion is handled by advance().
      * 
      * @param cmd command to send
      */
@@ -148,7 +842,45 @@ private:
 
 
     /**
-     * @brief Checks the repsonse from the server
+     * @brief Constructs a tagged command and sends it to the server without waiting for the response
+     * 
+     * @param cmd command to send
+     * 
+     * @return tag number of the command
+     */
+    unsigned long queueCommand(const std::string &cmd);
+
+
+    /**
+     * @brief Sends a line which is not a tagged command, compressed when compression is active
+     */
+    void sendLine(const std::string &line);
+
+
+    /**
+     * @brief Writes buffered outgoing data to the socket
+     * 
+     * @return false when a non-blocking socket cannot take all of it now
+     * 
+     * @throw std::runtime_error if writing fails
+     */
+    bool flushOutput();
+
+
+    /**
+     * @brief Processes received data and moves the non-blocking session on after each completed command
+     */
+    void processAsync();
+
+
+    /**
+     * @brief Sends the command following the one which just completed in non-blocking mode
+     */
+    void advance();
+
+
+    /**
+     * @brief Reads and processes data from the server until one of the pending commands completes
      */
     void checkResponse();
 
@@ -163,11 +895,87 @@ private:
     /**
      * @brief Checks the tagged response code
      * 
-     * @return  0 when response is OK,
-     * @return  1 when response is NO,
-     * @return -1 when response is BAD 
+     * Responses with a tag of a command that is not pending are ignored.
+     * 
+     * @param rtag number of the tag
+     * @param status status of the response (OK, NO or BAD)
+     *
+     * @throw std::runtime_error if response is BAD/NO
+     */
+    void checkTagged(unsigned long rtag, std::string_view status);
+
+
+    /**
+     * @brief Stores the capability list, upper case and delimited by spaces
+     */
+    void setCapabilities(std::string_view list);
+
+
+    /* Events of the response parser, see ResponseHandler */
+    void response(std::string_view tag, unsigned long number, std::string_view keyword) override;
+    void code(std::string_view name, std::string_view args) override;
+    void text(std::string_view text) override;
+    void fetchItem(std::string_view name, std::string_view value) override;
+    void literalBegin(std::string_view name, std::size_t size) override;
+    void literalData(std::string_view data) override;
+    void end() override;
+
+
+    /**
+     * @brief Creates the message with the names of its files, nothing is opened yet
+     */
+    std::shared_ptr<PendingMail> newMail(unsigned long uid) const;
+
+
+    /**
+     * @brief Queues opening of the file or pack segment for the message whose literal starts
+     * 
+     * @throw std::runtime_error if an earlier write of the connection failed
+     */
+    void beginMail();
+
+
+    /**
+     * @brief Finishes the message at the end of its FETCH response, or queues its next part
+     *
+     * A part which ends before RFC822.SIZE is synced to the disk and recorded in the journal.
+     */
+    void endLiteral();
+
+
+    /**
+     * @brief Queues the collected literal data for writing
+     * 
+     * Waits while the writer lane is full.
+     * 
+     * @throw std::runtime_error if an earlier write of the connection failed
+     */
+    void queueMailData();
+
+
+    /**
+     * @brief Queues storing of a completely received message and its record in the index
+     * 
+     * @param parted message was fetched in parts, its journal entry is removed once it is stored
+     *
+     * @throw std::runtime_error if an earlier write of the connection failed
+     */
+    void finishMail(bool parted = false);
+
+
+    /**
+     * @brief Adds the metadata of the FETCH response to the rows of the catalog
+     *
+     * A UID the catalog already has is skipped, '*' of the fetched range stands for the
+     * highest UID even when it is lower than the start.
+     */
+    void catalogMail();
+
+
+    /**
+     * @brief Queues writing of the received rows as one block of the catalog
      */
-    void checkTagged(const std::string response);
+    void flushCatalog();
 
 
     /**
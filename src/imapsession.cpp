@@ -0,0 +1,494 @@
+/**
+ * @file imapsession.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of ImapSession class
+ */
+
+#include "imapsession.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <stdexcept>
+#include <utility>
+
+#include "imapclient.hpp"
+#include "transporterror.hpp"
+
+
+// case-insensitive comparison of a response keyword
+static bool keywordIs(std::string_view word, std::string_view keyword) {
+    if (word.size() != keyword.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < word.size(); i++) {
+        if (std::toupper(static_cast<unsigned char>(word[i])) != keyword[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+ImapSession::ImapSession(SessionOptions options) :
+    options{std::move(options)},
+    bio{nullptr},
+    ctx{nullptr},
+    want_write{false},
+    established{false},
+    finished{false},
+    tag{1},
+    reply{Reply::OTHER},
+    reply_tag{0},
+    fetch_uid{0},
+    streaming{false}
+{
+    if (this->options.ctx != nullptr) {
+        SSL_CTX_up_ref(this->options.ctx);
+        this->ctx = this->options.ctx;
+    }
+}
+
+
+ImapSession::~ImapSession() {
+    if (this->bio != nullptr) {
+        BIO_free_all(this->bio);
+    }
+    if (this->ctx != nullptr) {
+        SSL_CTX_free(this->ctx);
+    }
+}
+
+
+void ImapSession::CommandAwaiter::await_resume() const {
+    if (this->command->error) {
+        std::rethrow_exception(this->command->error);
+    }
+    // the greeting may already authenticate the session
+    if (!keywordIs(this->command->status, "OK") && !keywordIs(this->command->status, "PREAUTH")) {
+        throw std::runtime_error(this->command->name + " failed: " + this->command->text);
+    }
+}
+
+
+void ImapSession::ConnectAwaiter::await_resume() const {
+    if (this->session.failure) {
+        std::rethrow_exception(this->session.failure);
+    }
+}
+
+
+ImapTask<> ImapSession::connect() {
+    this->open();
+    while (!this->establish()) {
+        co_await ConnectAwaiter{*this};
+    }
+
+    if (this->options.secured) {
+        SSL *ssl = nullptr;
+        BIO_get_ssl(this->bio, &ssl);
+        if (SSL_get_verify_result(ssl) != X509_V_OK) {
+            throw std::runtime_error("Cannot verify the certificate.");
+        }
+    }
+    this->established = true;
+
+    // the greeting completes a command which was never sent
+    auto greeting = std::make_shared<Command>();
+    greeting->tag = 0;
+    greeting->name = "Connection";
+    this->pending.push_back(greeting);
+    co_await CommandAwaiter{greeting.get()};
+}
+
+
+ImapTask<> ImapSession::login(std::string user, std::string password) {
+    std::shared_ptr<Command> command = this->send("LOGIN " + IMAPClient::quoteString(user) + " " + IMAPClient::quoteString(password));
+    co_await CommandAwaiter{command.get()};
+}
+
+
+ImapTask<MailboxStatus> ImapSession::select(std::string mailbox) {
+    this->mailbox = MailboxStatus{};
+    std::shared_ptr<Command> command = this->send("SELECT " + IMAPClient::quoteString(mailbox));
+    co_await CommandAwaiter{command.get()};
+    co_return this->mailbox;
+}
+
+
+ImapTask<UidSet> ImapSession::search(std::string criteria) {
+    this->found.clear();
+    std::shared_ptr<Command> command = this->send("UID SEARCH " + criteria);
+    co_await CommandAwaiter{command.get()};
+    co_return std::move(this->found);
+}
+
+
+ImapTask<unsigned long> ImapSession::fetch(UidSet uids, MessageSink &sink, std::string section) {
+    std::string items = " (UID BODY.PEEK[" + section + "])";
+    std::vector<std::string> batches = uids.batches(this->options.fetch_batch);
+    std::deque<std::shared_ptr<Command>> inflight;
+    std::size_t next = 0;
+    unsigned long messages = 0;
+
+    // keep up to pipeline_depth commands in flight, the next one is sent whenever the oldest completes
+    while (next < batches.size() || !inflight.empty()) {
+        while (next < batches.size() && inflight.size() < std::max(this->options.pipeline_depth, 1U)) {
+            inflight.push_back(this->send("UID FETCH " + batches[next++] + items, &sink));
+        }
+        std::shared_ptr<Command> command = std::move(inflight.front());
+        inflight.pop_front();
+        co_await CommandAwaiter{command.get()};
+        messages += command->messages;
+    }
+    co_return messages;
+}
+
+
+ImapTask<> ImapSession::logout() {
+    std::shared_ptr<Command> command = this->send("LOGOUT");
+    co_await CommandAwaiter{command.get()};
+    this->finished = true;
+    this->want_write = false;
+}
+
+
+int ImapSession::socket() const {
+    int fd = -1;
+    if (this->bio != nullptr) {
+        BIO_get_fd(this->bio, &fd);
+    }
+    return fd;
+}
+
+
+void ImapSession::handleEvent() {
+    // connect() continues with the next step of the connection or the handshake
+    if (!this->finished && this->connecting) {
+        std::exchange(this->connecting, nullptr).resume();
+    }
+
+    if (!this->finished && this->established) {
+        try {
+            this->flushOutput();
+            this->receive();
+            this->want_write = !this->flushOutput() || BIO_should_write(this->bio);
+        }
+        catch (...) {
+            this->fail(std::current_exception());
+        }
+    }
+
+    // resumed tasks may send commands and wait again, they are resumed only after the data are processed;
+    // a command failing in a resumed task makes the other waiting tasks ready, so this runs until none is left
+    while (!this->ready.empty()) {
+        std::vector<std::coroutine_handle<>> resume;
+        resume.swap(this->ready);
+        for (std::coroutine_handle<> handle : resume) {
+            handle.resume();
+        }
+    }
+}
+
+
+std::string ImapSession::resolve(const std::string &server, int port) {
+    return IMAPClient::resolve(server, port);
+}
+
+
+void ImapSession::open() {
+    std::string address = this->options.address.empty() ? this->options.server + ":" + std::to_string(this->options.port)
+                                                        : this->options.address;
+
+    if (this->options.secured) {
+        if (this->ctx == nullptr) {
+            this->ctx = IMAPClient::createContext(this->options.certfile, this->options.certaddr);
+        }
+
+        this->bio = BIO_new_ssl_connect(this->ctx);
+        if (this->bio == nullptr) {
+            throw std::runtime_error("Cannot initialize BIO object for connection.");
+        }
+
+        SSL *ssl = nullptr;
+        BIO_get_ssl(this->bio, &ssl);
+        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_set_tlsext_host_name(ssl, this->options.server.c_str());
+
+        // the address may be anything, the certificate has to be issued for the server name or IP address
+        X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+        if (X509_VERIFY_PARAM_set1_ip_asc(param, this->options.server.c_str()) != 1
+            && SSL_set1_host(ssl, this->options.server.c_str()) != 1) {
+            throw std::runtime_error("Cannot set the server name to verify.");
+        }
+        BIO_set_conn_hostname(this->bio, address.c_str());
+    }
+
+    else {
+        this->bio = BIO_new_connect(address.c_str());
+        if (this->bio == nullptr) {
+            throw std::runtime_error("Cannot initialize BIO object for connection.");
+        }
+    }
+
+    BIO_set_nbio(this->bio, 1);
+}
+
+
+bool ImapSession::establish() {
+    // the SSL BIO sits on top of the connect BIO, which resolves the name and connects
+    BIO *conn = this->options.secured ? BIO_next(this->bio) : this->bio;
+    if (BIO_do_connect(conn) <= 0) {
+        // connect in progress waits for writability
+        if (BIO_should_retry(conn)) {
+            this->want_write = true;
+            return false;
+        }
+        throw TransportError("Cannot connect to the server.");
+    }
+
+    if (this->options.secured && BIO_do_handshake(this->bio) <= 0) {
+        // the handshake waits for either direction
+        if (BIO_should_retry(this->bio)) {
+            this->want_write = BIO_should_write(this->bio) || BIO_should_io_special(this->bio);
+            return false;
+        }
+        throw TransportError("Cannot estabilish secured connection.");
+    }
+
+    this->want_write = false;
+    return true;
+}
+
+
+std::shared_ptr<ImapSession::Command> ImapSession::send(const std::string &cmd, MessageSink *sink) {
+    if (this->failure) {
+        std::rethrow_exception(this->failure);
+    }
+    if (this->finished || !this->established) {
+        throw TransportError("The session is not connected.");
+    }
+
+    // arguments are left out of error messages, they may hold the password
+    auto command = std::make_shared<Command>();
+    command->tag = this->tag++;
+    command->name = cmd.substr(0, cmd.find(' ', cmd.starts_with("UID ") ? 4 : 0));
+    command->sink = sink;
+    this->pending.push_back(command);
+    this->outbuf += "A" + std::to_string(command->tag) + " " + cmd + "\r\n";
+
+    try {
+        this->want_write = !this->flushOutput();
+    }
+    catch (...) {
+        this->fail(std::current_exception());
+        throw;
+    }
+    return command;
+}
+
+
+bool ImapSession::flushOutput() {
+    while (!this->outbuf.empty()) {
+        int nsent = BIO_write(this->bio, this->outbuf.data(), this->outbuf.length());
+        if (nsent > 0) {
+            this->outbuf.erase(0, nsent);
+            continue;
+        }
+
+        // the rest is sent when the socket becomes writable
+        if (BIO_should_retry(this->bio)) {
+            return false;
+        }
+        throw TransportError("Failed to send a command");
+    }
+    return true;
+}
+
+
+void ImapSession::receive() {
+    while (true) {
+        int nrecieved = BIO_read(this->bio, this->buff.prepare(SESSION_READ_SIZE), SESSION_READ_SIZE);
+        if (nrecieved > 0) {
+            this->buff.commit(nrecieved);
+            while (this->parser.next(this->buff));
+            continue;
+        }
+
+        if (BIO_should_retry(this->bio)) {
+            return;
+        }
+        throw TransportError("Server closed the connection.");
+    }
+}
+
+
+void ImapSession::complete(unsigned long tag) {
+    auto it = std::find_if(this->pending.begin(), this->pending.end(), [tag](const auto &command) { return command->tag == tag; });
+    if (it == this->pending.end()) {
+        return;
+    }
+
+    std::shared_ptr<Command> command = std::move(*it);
+    this->pending.erase(it);
+    command->done = true;
+    command->status = this->reply_status;
+    command->text = this->reply_text;
+    if (command->waiter) {
+        this->ready.push_back(std::exchange(command->waiter, nullptr));
+    }
+}
+
+
+void ImapSession::fail(std::exception_ptr error) {
+    this->finished = true;
+    this->failure = error;
+    this->want_write = false;
+    for (std::shared_ptr<Command> &command : this->pending) {
+        command->done = true;
+        command->error = error;
+        if (command->waiter) {
+            this->ready.push_back(std::exchange(command->waiter, nullptr));
+        }
+    }
+    this->pending.clear();
+}
+
+
+void ImapSession::response(std::string_view tag, unsigned long number, std::string_view keyword) {
+    this->reply = Reply::OTHER;
+    this->reply_text.clear();
+    this->fetch_uid = 0;
+
+    if (tag != "*") {
+        unsigned long rtag = 0;
+        const char *end = tag.data() + tag.size();
+        auto [ptr, ec] = std::from_chars(tag.data() + 1, end, rtag);
+        if (tag.starts_with('A') && ec == std::errc() && ptr == end) {
+            this->reply = Reply::TAGGED;
+            this->reply_tag = rtag;
+            this->reply_status.assign(keyword);
+        }
+        return;
+    }
+
+    Command *command = this->current();
+    if (command != nullptr && command->tag == 0) {
+        this->reply = Reply::GREETING;
+        this->reply_status.assign(keyword);
+    }
+    else if (keywordIs(keyword, "FETCH")) {
+        this->reply = Reply::FETCH;
+    }
+    else if (keywordIs(keyword, "SEARCH")) {
+        this->reply = Reply::SEARCH;
+    }
+    else if (keywordIs(keyword, "ESEARCH")) {
+        this->reply = Reply::ESEARCH;
+    }
+    else if (keywordIs(keyword, "EXISTS")) {
+        this->mailbox.exists = number;
+    }
+}
+
+
+void ImapSession::code(std::string_view name, std::string_view args) {
+    if (keywordIs(name, "UIDVALIDITY")) {
+        std::from_chars(args.data(), args.data() + args.size(), this->mailbox.uidvalidity);
+    }
+    else if (keywordIs(name, "UIDNEXT")) {
+        std::from_chars(args.data(), args.data() + args.size(), this->mailbox.uidnext);
+    }
+}
+
+
+void ImapSession::text(std::string_view text) {
+    switch (this->reply) {
+        case Reply::GREETING:
+        case Reply::TAGGED:
+            this->reply_text.assign(text);
+            break;
+
+        case Reply::SEARCH: {
+            const char *pos = text.data();
+            const char *end = text.data() + text.size();
+            while (pos < end) {
+                unsigned long uid = 0;
+                auto [next, ec] = std::from_chars(pos, end, uid);
+                if (ec == std::errc()) {
+                    this->found.add(uid);
+                }
+                pos = next + 1;
+            }
+            break;
+        }
+
+        // (TAG "A5") UID ALL 1:3,5:100
+        case Reply::ESEARCH: {
+            std::size_t pos = 0;
+            while (pos < text.size()) {
+                std::size_t end = std::min(text.find(' ', pos), text.size());
+                if (keywordIs(text.substr(pos, end - pos), "ALL") && end < text.size()) {
+                    std::size_t last = std::min(text.find(' ', end + 1), text.size());
+                    this->found.add(text.substr(end + 1, last - end - 1));
+                    break;
+                }
+                pos = end + 1;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+void ImapSession::fetchItem(std::string_view name, std::string_view value) {
+    if (this->reply == Reply::FETCH && keywordIs(name, "UID")) {
+        std::from_chars(value.data(), value.data() + value.size(), this->fetch_uid);
+    }
+}
+
+
+void ImapSession::literalBegin(std::string_view /*name*/, std::size_t size) {
+    Command *command = this->current();
+    if (this->reply != Reply::FETCH || command == nullptr || command->sink == nullptr) {
+        return;
+    }
+    if (this->fetch_uid == 0) {
+        throw std::runtime_error("Server did not send the UID before the message.");
+    }
+    command->sink->begin(this->fetch_uid, size);
+    this->streaming = true;
+}
+
+
+void ImapSession::literalData(std::string_view data) {
+    if (this->streaming) {
+        this->current()->sink->data(data);
+    }
+}
+
+
+void ImapSession::literalEnd() {
+    if (!this->streaming) {
+        return;
+    }
+    this->streaming = false;
+    Command *command = this->current();
+    command->sink->end(this->fetch_uid);
+    command->messages++;
+}
+
+
+void ImapSession::end() {
+    if (this->reply == Reply::TAGGED) {
+        this->complete(this->reply_tag);
+    }
+    else if (this->reply == Reply::GREETING) {
+        this->complete(0);
+    }
+    this->reply = Reply::OTHER;
+}
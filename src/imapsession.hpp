@@ -0,0 +1,337 @@
+/**
+ * @file imapsession.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for ImapSession class
+ *
+ * IMAP session for embedding the client in another program. Every operation is a coroutine
+ * returning ImapTask, so a caller writes the session as straight code:
+ *
+ *      ImapTask<> download(ImapSession &session, MessageSink &sink) {
+ *          co_await session.connect();
+ *          co_await session.login(user, password);
+ *          co_await session.select("INBOX");
+ *          co_await session.fetch(co_await session.search("ALL"), sink);
+ *          co_await session.logout();
+ *      }
+ *
+ * The session never blocks. It runs on an event loop of the caller: whenever socket() is
+ * readable, or writable when wantsWrite() is true, the loop calls handleEvent(), which reads
+ * what has arrived and resumes the tasks whose commands completed. One thread can so drive
+ * any number of sessions, the session itself starts no threads. The only exception is the
+ * name lookup: without SessionOptions::address, connect() resolves the server name and waits
+ * for the answer, so a loop driving several sessions resolves the names beforehand with
+ * resolve(), e.g. on threads of its own.
+ *
+ * Message bodies are not collected in memory, they are streamed to a MessageSink in parts
+ * as they arrive. Commands are sent in the order they are issued and untagged data belong
+ * to the oldest command still running, so several tasks may use one session as long as
+ * their commands do not interleave untagged responses of the same kind.
+ */
+
+#ifndef IMAPSESSION_HPP
+#define IMAPSESSION_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "openssl/bio.h"
+#include "openssl/ssl.h"
+
+#include "imaptask.hpp"
+#include "inputbuffer.hpp"
+#include "responseparser.hpp"
+#include "uidset.hpp"
+
+#define SESSION_READ_SIZE 65536 // maximal number of bytes requested by a single read
+
+
+/**
+ * @brief Server and behaviour of a session
+ */
+struct SessionOptions {
+    std::string server;                     // name for SNI, the certificate has to be issued for it
+    int port{143};
+    std::string address;                    // address from ImapSession::resolve(), the name is looked up when empty
+    bool secured{false};
+    std::string certfile;                   // file with certificates, used when certaddr is empty
+    std::string certaddr{"/etc/ssl/certs"}; // directory with certificates
+    SSL_CTX *ctx{nullptr};                  // context shared with other sessions, created from the certificates when nullptr
+    unsigned long fetch_batch{100};         // maximal number of messages requested by one FETCH
+    unsigned int pipeline_depth{4};         // FETCH commands in flight
+};
+
+
+/**
+ * @brief Data of the selected mailbox
+ */
+struct MailboxStatus {
+    uint64_t uidvalidity{0};
+    uint64_t uidnext{0};
+    unsigned long exists{0};
+};
+
+
+/**
+ * @brief Receiver of fetched messages, called from handleEvent() as the data arrive
+ *
+ * An exception thrown by the sink fails the session and every task waiting on it.
+ */
+class MessageSink {
+public:
+    virtual ~MessageSink() = default;
+
+    /**
+     * @brief Start of a message
+     *
+     * @param size number of bytes data() is going to receive
+     */
+    virtual void begin(unsigned long uid, std::size_t size) = 0;
+
+    /**
+     * @brief Next part of the message, valid only during the call
+     */
+    virtual void data(std::string_view data) = 0;
+
+    /**
+     * @brief The message is complete
+     */
+    virtual void end(unsigned long uid) = 0;
+};
+
+
+class ImapSession : private ResponseHandler {
+public:
+    /**
+     * @brief Creates a session, nothing is connected until connect() runs
+     */
+    explicit ImapSession(SessionOptions options);
+
+
+    /**
+     * @brief Closes the connection, the session has to outlive its tasks
+     */
+    ~ImapSession();
+
+    ImapSession(const ImapSession &) = delete;
+    ImapSession &operator=(const ImapSession &) = delete;
+
+
+    /**
+     * @brief Resolves the server name to a numeric address for SessionOptions::address, the lookup blocks
+     *
+     * @return address and port, e.g. "192.0.2.1:993" or "[2001:db8::1]:993"
+     *
+     * @throw TransportError if the name cannot be resolved
+     */
+    static std::string resolve(const std::string &server, int port);
+
+
+    /**
+     * @brief Connects to the server, verifies its certificate and waits for the greeting
+     *
+     * @throw TransportError if the connection cannot be established
+     * @throw std::runtime_error if the certificate is not valid or the server refuses the session
+     */
+    ImapTask<> connect();
+
+
+    /**
+     * @throw std::runtime_error if the credentials are refused
+     */
+    ImapTask<> login(std::string user, std::string password);
+
+
+    /**
+     * @throw std::runtime_error if the mailbox cannot be selected
+     */
+    ImapTask<MailboxStatus> select(std::string mailbox);
+
+
+    /**
+     * @brief UIDs of the messages of the selected mailbox matching the criteria
+     *
+     * @param criteria search keys of UID SEARCH, e.g. "ALL" or "SINCE 1-Jan-2024"
+     */
+    ImapTask<UidSet> search(std::string criteria = "ALL");
+
+
+    /**
+     * @brief Streams the messages to the sink, keeping pipeline_depth FETCH commands in flight
+     *
+     * @param section body section, empty for the whole message, e.g. "HEADER" for the header
+     *
+     * @return number of messages received
+     */
+    ImapTask<unsigned long> fetch(UidSet uids, MessageSink &sink, std::string section = "");
+
+
+    /**
+     * @brief Ends the session, the server closes the connection
+     */
+    ImapTask<> logout();
+
+
+    /**
+     * @brief Socket of the connection, -1 before connect() started
+     */
+    int socket() const;
+
+
+    /**
+     * @brief Whether the session waits for the socket to become writable
+     */
+    bool wantsWrite() const { return this->want_write; }
+
+
+    /**
+     * @brief Continues the session after its socket became ready
+     *
+     * Reads everything the socket has, passes message data to the sinks and resumes the
+     * tasks whose commands completed. A lost connection fails the waiting tasks, it is
+     * not thrown from here.
+     */
+    void handleEvent();
+
+
+    /**
+     * @brief Whether the connection ended, after logout() or an error
+     */
+    bool closed() const { return this->finished; }
+
+private:
+    // command sent to the server, completed by its tagged response
+    struct Command {
+        unsigned long tag;
+        std::string name;       // command name for error messages
+        MessageSink *sink{nullptr}; // receiver of the message literals of a FETCH
+        unsigned long messages{0};
+        bool done{false};
+        std::string status;     // OK, NO or BAD
+        std::string text;       // text of the tagged response
+        std::exception_ptr error; // failure of the session
+        std::coroutine_handle<> waiter;
+    };
+
+    // suspends a task until its command completes, the task keeps the command alive
+    struct CommandAwaiter {
+        Command *command;
+
+        bool await_ready() const noexcept { return this->command->done; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept { this->command->waiter = handle; }
+        void await_resume() const;
+    };
+
+    // suspends connect() until the socket is ready for the next step of the connection or handshake
+    struct ConnectAwaiter {
+        ImapSession &session;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept { this->session.connecting = handle; }
+        void await_resume() const;
+    };
+
+    enum class Reply {
+        OTHER,
+        GREETING,
+        TAGGED,
+        FETCH,
+        SEARCH,
+        ESEARCH
+    };
+
+    SessionOptions options;
+    BIO *bio;
+    SSL_CTX *ctx;
+    InputBuffer buff;
+    ResponseParser parser{*this};
+    std::string outbuf;     // outgoing data not written to the socket yet
+    bool want_write;
+    bool established;       // connection and handshake finished
+    bool finished;          // connection ended, nothing is sent or read
+    unsigned long tag;
+    std::deque<std::shared_ptr<Command>> pending; // commands without a tagged response, oldest first
+    std::vector<std::coroutine_handle<>> ready;   // tasks to resume when the received data are processed
+    std::coroutine_handle<> connecting;           // task waiting for the connection, empty otherwise
+    std::exception_ptr failure; // why the session ended, nullptr after logout()
+
+    /* Data of the response being parsed */
+    Reply reply;
+    unsigned long reply_tag;
+    std::string reply_status;
+    std::string reply_text;
+    unsigned long fetch_uid;
+    bool streaming;         // a message literal goes to the sink of the current command
+    MailboxStatus mailbox;  // filled by the responses to SELECT
+    UidSet found;           // filled by the responses to UID SEARCH
+
+
+    /**
+     * @brief Creates the connection BIO, in non-blocking mode
+     */
+    void open();
+
+
+    /**
+     * @brief Advances the connection and the TLS handshake
+     *
+     * @return false when the socket has to become ready first
+     */
+    bool establish();
+
+
+    /**
+     * @brief Queues a tagged command and sends what the socket takes
+     *
+     * @throw TransportError if the session has ended
+     */
+    std::shared_ptr<Command> send(const std::string &cmd, MessageSink *sink = nullptr);
+
+
+    /**
+     * @return false when the rest waits for the socket to become writable
+     */
+    bool flushOutput();
+
+
+    /**
+     * @brief Reads and parses everything the socket has
+     */
+    void receive();
+
+
+    /**
+     * @brief Completes the command with its tagged response
+     */
+    void complete(unsigned long tag);
+
+
+    /**
+     * @brief Ends the session, every waiting task gets the error
+     */
+    void fail(std::exception_ptr error);
+
+
+    /**
+     * @brief Oldest command still running, untagged data belong to it
+     */
+    Command *current() const { return this->pending.empty() ? nullptr : this->pending.front().get(); }
+
+
+    void response(std::string_view tag, unsigned long number, std::string_view keyword) override;
+    void code(std::string_view name, std::string_view args) override;
+    void text(std::string_view text) override;
+    void fetchItem(std::string_view name, std::string_view value) override;
+    void literalBegin(std::string_view name, std::size_t size) override;
+    void literalData(std::string_view data) override;
+    void literalEnd() override;
+    void end() override;
+};
+
+#endif
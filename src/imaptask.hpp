@@ -0,0 +1,175 @@
+/**
+ * @file imaptask.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Coroutine type of the operations of ImapSession
+ *
+ * A task starts suspended and runs when it is awaited by another task, or by start() when
+ * it is the outermost one. When it finishes, the awaiting task continues right away, so a
+ * chain of tasks runs on the stack of whoever resumed the innermost one, in practice the
+ * ImapSession::handleEvent() call of the event loop.
+ *
+ * An exception thrown inside a task is kept and thrown again where the task is awaited,
+ * or by result() for the outermost task.
+ */
+
+#ifndef IMAPTASK_HPP
+#define IMAPTASK_HPP
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+
+template <typename T>
+class ImapTask;
+
+
+namespace imaptask_detail {
+
+    /**
+     * @brief Part of the promise common to tasks with and without a result
+     */
+    struct PromiseBase {
+        std::coroutine_handle<> continuation;  // task awaiting this one, empty for the outermost task
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // the awaiting task continues in place of the finished one
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() { this->error = std::current_exception(); }
+    };
+
+
+    template <typename T>
+    struct Promise : PromiseBase {
+        std::optional<T> value;
+
+        ImapTask<T> get_return_object();
+
+        void return_value(T result) { this->value = std::move(result); }
+
+        T take() {
+            if (this->error) {
+                std::rethrow_exception(this->error);
+            }
+            return std::move(*this->value);
+        }
+    };
+
+
+    template <>
+    struct Promise<void> : PromiseBase {
+        ImapTask<void> get_return_object();
+
+        void return_void() {}
+
+        void take() {
+            if (this->error) {
+                std::rethrow_exception(this->error);
+            }
+        }
+    };
+}
+
+
+template <typename T = void>
+class ImapTask {
+public:
+    using promise_type = imaptask_detail::Promise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit ImapTask(Handle handle) : handle{handle} {}
+
+    ImapTask(ImapTask &&other) noexcept : handle{std::exchange(other.handle, nullptr)} {}
+
+    ImapTask &operator=(ImapTask &&other) noexcept {
+        if (this != &other) {
+            this->destroy();
+            this->handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ImapTask(const ImapTask &) = delete;
+    ImapTask &operator=(const ImapTask &) = delete;
+
+    /**
+     * @brief Destroys the coroutine, a task still suspended is abandoned
+     */
+    ~ImapTask() { this->destroy(); }
+
+
+    /**
+     * @brief Runs the outermost task until its first suspension
+     */
+    void start() { this->handle.resume(); }
+
+
+    bool done() const { return !this->handle || this->handle.done(); }
+
+
+    /**
+     * @brief Result of a finished outermost task
+     *
+     * @throw the exception the task ended with, std::logic_error if it has not finished
+     */
+    T result() {
+        if (!this->handle || !this->handle.done()) {
+            throw std::logic_error("The task has not finished.");
+        }
+        return this->handle.promise().take();
+    }
+
+
+    // awaited by another task, which continues when this one finishes
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        this->handle.promise().continuation = awaiting;
+        return this->handle;
+    }
+
+    T await_resume() { return this->handle.promise().take(); }
+
+private:
+    Handle handle;
+
+    void destroy() {
+        if (this->handle) {
+            this->handle.destroy();
+            this->handle = nullptr;
+        }
+    }
+};
+
+
+namespace imaptask_detail {
+
+    template <typename T>
+    ImapTask<T> Promise<T>::get_return_object() {
+        return ImapTask<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+    }
+
+    inline ImapTask<void> Promise<void>::get_return_object() {
+        return ImapTask<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+    }
+}
+
+#endif
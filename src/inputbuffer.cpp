@@ -0,0 +1,104 @@
+/**
+ * @file inputbuffer.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of InputBuffer class
+ */
+
+#include "inputbuffer.hpp"
+
+#include <cstring>
+
+
+InputBuffer::InputBuffer(std::size_t capacity) :
+    buf{new char[capacity]},
+    capacity{capacity},
+    rpos{0},
+    wpos{0},
+    scanned{0}
+{ /* empty body */ }
+
+
+char *InputBuffer::prepare(std::size_t n) {
+    if (this->writable() >= n) {
+        return this->buf.get() + this->wpos;
+    }
+
+    std::size_t unread = this->size();
+
+    // grow only when the unread data and the requested space do not fit at all
+    if (unread + n > this->capacity) {
+        std::size_t new_capacity = this->capacity * 2;
+        while (new_capacity < unread + n) {
+            new_capacity *= 2;
+        }
+
+        std::unique_ptr<char[]> new_buf{new char[new_capacity]};
+        memcpy(new_buf.get(), this->buf.get() + this->rpos, unread);
+        this->buf = std::move(new_buf);
+        this->capacity = new_capacity;
+    }
+
+    // move the unread data to the front
+    else if (this->rpos > 0) {
+        memmove(this->buf.get(), this->buf.get() + this->rpos, unread);
+    }
+
+    this->rpos = 0;
+    this->wpos = unread;
+    return this->buf.get() + this->wpos;
+}
+
+
+std::string_view InputBuffer::peek(std::size_t n) const {
+    if (n > this->size()) {
+        n = this->size();
+    }
+    return std::string_view(this->buf.get() + this->rpos, n);
+}
+
+
+bool InputBuffer::getLine(std::string_view &line) {
+    const char *begin = this->buf.get() + this->rpos;
+    std::size_t len = this->size();
+
+    // CR may have been the last scanned byte, so start one byte back
+    std::size_t from = this->scanned > 0 ? this->scanned - 1 : 0;
+
+    while (from < len) {
+        const char *lf = static_cast<const char *>(memchr(begin + from, '\n', len - from));
+        if (lf == nullptr) {
+            break;
+        }
+
+        std::size_t idx = lf - begin;
+        if (idx > 0 && begin[idx - 1] == '\r') {
+            line = std::string_view(begin, idx + 1);
+            this->consume(idx + 1);
+            return true;
+        }
+        from = idx + 1;
+    }
+
+    this->scanned = len;
+    return false;
+}
+
+
+void InputBuffer::consume(std::size_t n) {
+    if (n >= this->size()) {
+        this->rpos = 0;
+        this->wpos = 0;
+    }
+    else {
+        this->rpos += n;
+    }
+    this->scanned = 0;
+}
+
+
+void InputBuffer::clear() {
+    this->rpos = 0;
+    this->wpos = 0;
+    this->scanned = 0;
+}
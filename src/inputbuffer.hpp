@@ -0,0 +1,114 @@
+/**
+ * @file inputbuffer.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for InputBuffer class
+ *
+ * Receive buffer with separate read and write cursors. Data is read from the socket
+ * directly into the free space at the end of the buffer and consumed from the front
+ * by moving the read cursor, so nothing is copied when a line or a literal is taken out.
+ * Unread data is moved to the front only when the free space runs out, which keeps
+ * the cost linear in the amount of received data.
+ */
+
+#ifndef INPUTBUFFER_HPP
+#define INPUTBUFFER_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+#define INPUT_BUFFER_SIZE 65536
+
+
+class InputBuffer {
+public:
+    /**
+     * @brief Constructs an empty buffer
+     *
+     * @param capacity initial capacity in bytes, buffer grows only when a single line does not fit
+     */
+    explicit InputBuffer(std::size_t capacity = INPUT_BUFFER_SIZE);
+
+
+    /**
+     * @brief Default destructor
+     */
+    ~InputBuffer() = default;
+
+
+    /**
+     * @brief Makes room for incoming data
+     *
+     * @param n minimal number of bytes that has to be writable
+     *
+     * @return pointer to the free space at the write cursor
+     */
+    char *prepare(std::size_t n);
+
+
+    /**
+     * @brief Number of bytes that can be written at the write cursor without moving data
+     */
+    std::size_t writable() const { return this->capacity - this->wpos; }
+
+
+    /**
+     * @brief Marks n bytes written after prepare() as readable
+     */
+    void commit(std::size_t n) { this->wpos += n; }
+
+
+    /**
+     * @brief Number of unread bytes
+     */
+    std::size_t size() const { return this->wpos - this->rpos; }
+
+
+    bool empty() const { return this->wpos == this->rpos; }
+
+
+    /**
+     * @brief View of all unread data, valid until the next call to prepare()
+     */
+    std::string_view data() const { return std::string_view(this->buf.get() + this->rpos, this->size()); }
+
+
+    /**
+     * @brief View of at most n unread bytes, valid until the next call to prepare()
+     */
+    std::string_view peek(std::size_t n) const;
+
+
+    /**
+     * @brief Extracts one CRLF terminated line
+     *
+     * @param line set to the view of the line including the CRLF, valid until the next call to prepare()
+     *
+     * @return true when a complete line was extracted, false when more data is needed
+     *
+     * Search continues from the position where the previous unsuccessful call stopped.
+     */
+    bool getLine(std::string_view &line);
+
+
+    /**
+     * @brief Moves the read cursor by n bytes
+     */
+    void consume(std::size_t n);
+
+
+    /**
+     * @brief Drops all data
+     */
+    void clear();
+
+private:
+    std::unique_ptr<char[]> buf;
+    std::size_t capacity;   // size of allocated memory
+    std::size_t rpos;       // read cursor
+    std::size_t wpos;       // write cursor
+    std::size_t scanned;    // number of unread bytes already searched for a line end
+};
+
+#endif
@@ -7,6 +7,27 @@
 
 #include "imapclient.hpp"
 #include "argparser.hpp"
+#include "batchrunner.hpp"
+#include "syncstats.hpp"
+
+#include <filesystem>
+
+
+// writes the stats file when one was requested, failure to write it does not change the result
+static int saveStats(const Config &config, const SyncStats &stats, int result) {
+    if (config.stats_file.empty()) {
+        return result;
+    }
+
+    try {
+        stats.save(config.stats_file, config.stats_format, result == 0);
+    }
+
+    catch(std::runtime_error &e) {
+        std::cerr << "Runtime error: " << e.what() << std::endl;
+    }
+    return result;
+}
 
 
 int main(int argc, char *argv[]) {
@@ -24,16 +45,86 @@ int main(int argc, char *argv[]) {
     if (args.display_help) return 0;
    
     Config config = args.getConfig();
-    IMAPClient client(config);
 
-    try {
-        client.start();
+    if (config.command == "extract") {
+        try {
+            PackStore::extract(config.out_dir, IMAPClient::storeName(config.mailbox, config.server), config.uid, std::cout);
+            std::cout.flush();
+        }
+
+        catch(std::runtime_error &e) {
+            std::cerr << "Runtime error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
     }
 
-    catch(std::runtime_error &e) {
-        std::cerr << "Runtime error: " << e.what() << std::endl;
-        return 1;
+    if (config.command == "query") {
+        try {
+            Catalog::query(config.out_dir, IMAPClient::storeName(config.mailbox, config.server), config.filter, std::cout);
+            std::cout.flush();
+        }
+
+        catch(std::runtime_error &e) {
+            std::cerr << "Runtime error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (config.command == "search") {
+        try {
+            std::string suffix = "." + IMAPClient::storeName(config.mailbox, config.server);
+            for (uint64_t uid : FullTextIndex::search(config.out_dir, IMAPClient::storeName(config.mailbox, config.server), config.query)) {
+                // words of messages expunged on the server stay in the index, only their files are gone
+                std::string filename = config.out_dir + "/" + std::to_string(uid) + suffix;
+                if (std::filesystem::exists(filename)) {
+                    std::cout << filename << "\n";
+                }
+            }
+            std::cout.flush();
+        }
+
+        catch(std::runtime_error &e) {
+            std::cerr << "Runtime error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::shared_ptr<SyncStats> stats = std::make_shared<SyncStats>();
+
+    if (!config.batch_file.empty()) {
+        try {
+            BatchRunner runner(config);
+            runner.setSyncStats(stats);
+            runner.load(config.batch_file);
+            runner.run();
+        }
+
+        catch(std::runtime_error &e) {
+            std::cerr << "Runtime error: " << e.what() << std::endl;
+            return saveStats(config, *stats, 1);
+        }
+        return saveStats(config, *stats, 0);
+    }
+
+    int result = 0;
+
+    // the client logs out when destroyed, the stats are written after that
+    {
+        IMAPClient client(config);
+        client.setSyncStats(stats);
+
+        try {
+            client.start();
+        }
+
+        catch(std::runtime_error &e) {
+            std::cerr << "Runtime error: " << e.what() << std::endl;
+            result = 1;
+        }
     }
 
-    return 0;
+    return saveStats(config, *stats, result);
 }
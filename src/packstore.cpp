@@ -0,0 +1,466 @@
+/**
+ * @file packstore.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of PackStore class
+ */
+
+#include "packstore.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// writes the whole buffer at the end of the file, write() may take only a part of it
+static bool writeAll(int fd, const char *data, std::size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+PackStore::PackStore(const std::string &dir, const std::string &name, uint64_t segment_size) :
+    prefix{dir + "/" + name},
+    segment_size{segment_size},
+    index_fd{-1},
+    index_size{0},
+    sorted{0},
+    last_segment{0},
+    idle{},
+    opened{}
+{
+    this->index_fd = open((this->prefix + ".packidx").c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->index_fd < 0) {
+        throw std::runtime_error("Cannot open pack index.");
+    }
+
+    // the header of the first version is the beginning of the current one
+    Header h{};
+    ssize_t n = pread(this->index_fd, &h, sizeof(Header), 0);
+    bool v1 = n >= 16 && h.magic == PACK_INDEX_MAGIC && h.version == 1 && h.entry_size == sizeof(EntryV1);
+    bool v2 = n == sizeof(Header) && h.magic == PACK_INDEX_MAGIC && h.version == PACK_INDEX_VERSION
+              && h.entry_size == sizeof(Entry);
+    if (n != 0 && !v1 && !v2) {
+        close(this->index_fd);
+        throw std::runtime_error("Pack index " + this->prefix + ".packidx is damaged or of another version.");
+    }
+
+    // entries appended by the previous run or an index of the first version are merged into a sorted one
+    std::map<uint64_t, Entry> entries;
+    struct stat st;
+    try {
+        if (n == 0) {
+            this->rewriteIndex(entries);
+        }
+        else if (v1) {
+            readIndexV1(this->index_fd, entries);
+            this->rewriteIndex(entries);
+        }
+        else if (fstat(this->index_fd, &st) != 0
+                 || static_cast<uint64_t>(st.st_size) != sizeof(Header) + h.sorted * sizeof(Entry)) {
+            readIndex(this->index_fd, entries);
+            this->rewriteIndex(entries);
+        }
+        else {
+            this->index_size = st.st_size;
+            this->sorted = h.sorted;
+        }
+    }
+    catch (std::runtime_error &) {
+        close(this->index_fd);
+        throw;
+    }
+
+    // segments are numbered from 1 without gaps
+    while (stat(segmentName(this->prefix, this->last_segment + 1).c_str(), &st) == 0) {
+        this->last_segment++;
+    }
+
+    // the last segment of the previous run is filled up first
+    if (this->last_segment > 0 && stat(segmentName(this->prefix, this->last_segment).c_str(), &st) == 0
+        && static_cast<uint64_t>(st.st_size) < this->segment_size) {
+        try {
+            this->idle.push_back(this->openSegment(this->last_segment));
+        }
+        catch (std::runtime_error &) {
+            close(this->index_fd);
+            throw;
+        }
+    }
+}
+
+
+PackStore::~PackStore() {
+    // data first, so a crash never leaves the index pointing past the end of a segment
+    for (PackSegment *segment : this->opened) {
+        fdatasync(segment->fd);
+        close(segment->fd);
+        delete segment;
+    }
+    this->opened.clear();
+
+    // the next lookups find everything by binary search, a failed merge is left to the next run
+    if (this->index_size > sizeof(Header) + this->sorted * sizeof(Entry)) {
+        try {
+            this->merge();
+        }
+        catch (std::runtime_error &) {
+        }
+    }
+    fdatasync(this->index_fd);
+    close(this->index_fd);
+}
+
+
+std::string PackStore::segmentName(const std::string &prefix, uint32_t number) {
+    char num[16];
+    std::snprintf(num, sizeof(num), ".%06u.pack", number);
+    return prefix + num;
+}
+
+
+void PackStore::readIndex(int fd, std::map<uint64_t, Entry> &entries) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw std::runtime_error("Cannot read pack index.");
+    }
+
+    // an entry cut off by a crash is left out
+    uint64_t count = (st.st_size - sizeof(Header)) / sizeof(Entry);
+    std::vector<Entry> chunk(4096);
+    for (uint64_t i = 0; i < count; i += chunk.size()) {
+        std::size_t want = std::min<uint64_t>(chunk.size(), count - i);
+        if (pread(fd, chunk.data(), want * sizeof(Entry), sizeof(Header) + i * sizeof(Entry))
+            != static_cast<ssize_t>(want * sizeof(Entry))) {
+            throw std::runtime_error("Cannot read pack index.");
+        }
+        for (std::size_t j = 0; j < want; j++) {
+            if (chunk[j].segment != 0) {
+                entries[chunk[j].uid] = chunk[j];
+            }
+            else {
+                entries.erase(chunk[j].uid);
+            }
+        }
+    }
+}
+
+
+void PackStore::readIndexV1(int fd, std::map<uint64_t, Entry> &entries) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw std::runtime_error("Cannot read pack index.");
+    }
+
+    // entries are at the positions of their UIDs, only the parts with data are read
+    off_t end = st.st_size;
+    off_t pos = 16;
+    while (pos < end) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            hole = end;
+        }
+
+        uint64_t first = (data - 16) / sizeof(EntryV1);
+        uint64_t last = (hole - 16) / sizeof(EntryV1);
+        for (uint64_t uid = first; uid < last; uid++) {
+            EntryV1 old{};
+            if (pread(fd, &old, sizeof(EntryV1), 16 + uid * sizeof(EntryV1)) != sizeof(EntryV1)) {
+                throw std::runtime_error("Cannot read pack index.");
+            }
+            if (old.segment != 0) {
+                entries[uid] = Entry{uid, old.segment, 0, old.offset, old.length};
+            }
+        }
+        pos = std::max<off_t>(hole, 16 + last * sizeof(EntryV1));
+    }
+}
+
+
+void PackStore::rewriteIndex(const std::map<uint64_t, Entry> &entries) {
+    std::string name = this->prefix + ".packidx";
+    int fd = open((name + ".tmp").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot write pack index.");
+    }
+
+    Header h{PACK_INDEX_MAGIC, PACK_INDEX_VERSION, sizeof(Entry), entries.size()};
+    std::vector<Entry> sorted;
+    sorted.reserve(entries.size());
+    for (const auto &[uid, entry] : entries) {
+        sorted.push_back(entry);
+    }
+
+    bool written = writeAll(fd, reinterpret_cast<const char *>(&h), sizeof(Header))
+                   && writeAll(fd, reinterpret_cast<const char *>(sorted.data()), sorted.size() * sizeof(Entry))
+                   && fdatasync(fd) == 0;
+    if (!written || rename((name + ".tmp").c_str(), name.c_str()) != 0) {
+        close(fd);
+        unlink((name + ".tmp").c_str());
+        throw std::runtime_error("Cannot write pack index.");
+    }
+
+    close(this->index_fd);
+    this->index_fd = fd;
+    this->index_size = sizeof(Header) + sorted.size() * sizeof(Entry);
+    this->sorted = sorted.size();
+}
+
+
+void PackStore::merge() {
+    // the merged index is synced, the data it refers to has to be on the disk before
+    for (PackSegment *segment : this->opened) {
+        fdatasync(segment->fd);
+    }
+
+    std::map<uint64_t, Entry> entries;
+    readIndex(this->index_fd, entries);
+    this->rewriteIndex(entries);
+}
+
+
+bool PackStore::findEntry(int fd, const Header &h, uint64_t size, uint64_t uid, Entry &entry) {
+    uint64_t count = (size - sizeof(Header)) / sizeof(Entry);
+    uint64_t sorted = std::min(h.sorted, count);
+
+    // the newest appended entry of the UID decides, they are read in blocks from the end
+    std::vector<Entry> block;
+    for (uint64_t end = count; end > sorted;) {
+        uint64_t begin = end - std::min<uint64_t>(end - sorted, PACK_INDEX_TAIL);
+        block.resize(end - begin);
+        ssize_t bytes = block.size() * sizeof(Entry);
+        if (pread(fd, block.data(), bytes, sizeof(Header) + begin * sizeof(Entry)) != bytes) {
+            return false;
+        }
+        for (auto it = block.rbegin(); it != block.rend(); it++) {
+            if (it->uid == uid) {
+                entry = *it;
+                return entry.segment != 0;
+            }
+        }
+        end = begin;
+    }
+
+    uint64_t low = 0;
+    uint64_t high = sorted;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (pread(fd, &entry, sizeof(Entry), sizeof(Header) + mid * sizeof(Entry)) != sizeof(Entry)) {
+            return false;
+        }
+        if (entry.uid == uid) {
+            return entry.segment != 0;
+        }
+        if (entry.uid < uid) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return false;
+}
+
+
+bool PackStore::appendEntry(const Entry &entry) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (pwrite(this->index_fd, &entry, sizeof(Entry), this->index_size) != sizeof(Entry)) {
+        return false;
+    }
+    this->index_size += sizeof(Entry);
+
+    // merged in proportion to the sorted part, so each entry is rewritten only a few times
+    uint64_t appended = (this->index_size - sizeof(Header)) / sizeof(Entry) - this->sorted;
+    if (appended >= std::max<uint64_t>(PACK_INDEX_TAIL, this->sorted / PACK_INDEX_TAIL_SHARE)) {
+        try {
+            this->merge();
+        }
+        catch (std::runtime_error &) {
+            // the entry is written, the merge is tried again with the next one
+        }
+    }
+    return true;
+}
+
+
+PackSegment *PackStore::openSegment(uint32_t number) {
+    int fd = open(segmentName(this->prefix, number).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("Cannot open pack segment.");
+    }
+
+    PackSegment *segment = new PackSegment{number, fd, static_cast<uint64_t>(st.st_size), 0, 0};
+    this->opened.push_back(segment);
+    return segment;
+}
+
+
+PackSegment *PackStore::begin(uint64_t uid, uint64_t length) {
+    PackSegment *segment;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->idle.empty()) {
+            segment = this->idle.back();
+            this->idle.pop_back();
+        }
+        else {
+            segment = this->openSegment(++this->last_segment);
+        }
+    }
+
+    // the segment belongs to this writer now, the rest needs no lock
+    segment->start = segment->size;
+    segment->uid = uid;
+
+    // blocks for the whole message are reserved at once, the file size still grows with the writes
+    fallocate(segment->fd, FALLOC_FL_KEEP_SIZE, segment->start, sizeof(Record) + length);
+
+    Record record{PACK_RECORD_MAGIC, 0, uid, length};
+    if (!writeAll(segment->fd, reinterpret_cast<const char *>(&record), sizeof(Record))) {
+        this->abort(segment);
+        throw std::runtime_error("Cannot write to pack segment.");
+    }
+    segment->size += sizeof(Record);
+    return segment;
+}
+
+
+void PackStore::write(PackSegment *segment, const char *data, std::size_t len) {
+    if (!writeAll(segment->fd, data, len)) {
+        throw std::runtime_error("Cannot write to pack segment.");
+    }
+    segment->size += len;
+}
+
+
+uint64_t PackStore::commit(PackSegment *segment) {
+    uint64_t offset = segment->start + sizeof(Record);
+    Entry entry{segment->uid, segment->number, 0, offset, segment->size - offset};
+
+    if (!this->appendEntry(entry)) {
+        this->abort(segment);
+        throw std::runtime_error("Cannot write pack index.");
+    }
+
+    this->release(segment);
+    return offset;
+}
+
+
+void PackStore::abort(PackSegment *segment) {
+    // nothing refers to the incomplete record, it is cut off so the next one follows the last complete message
+    if (ftruncate(segment->fd, segment->start) == 0) {
+        segment->size = segment->start;
+    }
+    this->release(segment);
+}
+
+
+void PackStore::release(PackSegment *segment) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (segment->size < this->segment_size) {
+        this->idle.push_back(segment);
+    }
+}
+
+
+void PackStore::remove(uint64_t uid) {
+    this->appendEntry(Entry{uid, 0, 0, 0, 0});
+}
+
+
+void PackStore::clear() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Header h{PACK_INDEX_MAGIC, PACK_INDEX_VERSION, sizeof(Entry), 0};
+    if (ftruncate(this->index_fd, sizeof(Header)) != 0 || pwrite(this->index_fd, &h, sizeof(Header), 0) != sizeof(Header)) {
+        throw std::runtime_error("Cannot clear pack index.");
+    }
+    this->index_size = sizeof(Header);
+    this->sorted = 0;
+}
+
+
+void PackStore::checkpoint() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->index_size - sizeof(Header) > (this->sorted + PACK_INDEX_TAIL) * sizeof(Entry)) {
+        this->merge();
+    }
+}
+
+
+bool PackStore::sync() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    bool synced = true;
+    for (PackSegment *segment : this->opened) {
+        synced = fdatasync(segment->fd) == 0 && synced;
+    }
+    return synced;
+}
+
+
+void PackStore::extract(const std::string &dir, const std::string &name, uint64_t uid, std::ostream &os) {
+    std::string prefix = dir + "/" + name;
+    int fd = open((prefix + ".packidx").c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open pack index " + prefix + ".packidx.");
+    }
+
+    Header h{};
+    Entry entry{};
+    struct stat st;
+    bool valid = pread(fd, &h, sizeof(Header), 0) == sizeof(Header) && h.magic == PACK_INDEX_MAGIC
+                 && h.version == PACK_INDEX_VERSION && h.entry_size == sizeof(Entry) && fstat(fd, &st) == 0;
+    if (!valid) {
+        close(fd);
+        throw std::runtime_error("Pack index " + prefix + ".packidx is damaged or of another version, running the client converts it.");
+    }
+    bool found = findEntry(fd, h, st.st_size, uid, entry);
+    close(fd);
+    if (!found) {
+        throw std::runtime_error("Message " + std::to_string(uid) + " is not stored.");
+    }
+
+    fd = open(segmentName(prefix, entry.segment).c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open pack segment.");
+    }
+
+    // the record header guards against an index that does not match the segments
+    Record record{};
+    if (pread(fd, &record, sizeof(Record), entry.offset - sizeof(Record)) != sizeof(Record)
+        || record.magic != PACK_RECORD_MAGIC || record.uid != uid || record.length != entry.length) {
+        close(fd);
+        throw std::runtime_error("Pack segment does not match the index.");
+    }
+
+    char chunk[65536];
+    uint64_t done = 0;
+    while (done < entry.length) {
+        std::size_t want = std::min<uint64_t>(sizeof(chunk), entry.length - done);
+        ssize_t n = pread(fd, chunk, want, entry.offset + done);
+        if (n <= 0) {
+            close(fd);
+            throw std::runtime_error("Cannot read pack segment.");
+        }
+        os.write(chunk, n);
+        done += n;
+    }
+    close(fd);
+}
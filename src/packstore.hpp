@@ -0,0 +1,248 @@
+/**
+ * @file packstore.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for PackStore class
+ *
+ * Messages of one mailbox stored in append-only segment files instead of a file per message.
+ * Segments are named <mailbox>.<server>.<number>.pack and a new one is started when the
+ * current one reaches the configured size. Each message is preceded by a record header with
+ * its UID and length, so the segments alone are enough to find every message.
+ *
+ * The index <mailbox>.<server>.packidx holds fixed size entries of the stored messages sorted
+ * by UID, so its size does not depend on how large or sparse the UIDs are. Entries of committed
+ * and removed messages are appended and merged into the sorted part once there are many of them,
+ * at a checkpoint and when the store is closed. A message is found by a binary search of the
+ * sorted part and a scan of the few appended entries, read in one block.
+ *
+ * Several connections may write at once, each one gets a segment of its own for the message
+ * it is downloading. Deleted messages only lose their index entry, the space in the segment
+ * is not reclaimed.
+ */
+
+#ifndef PACKSTORE_HPP
+#define PACKSTORE_HPP
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define PACK_INDEX_MAGIC 0x31585049434d49ULL  // "IMCIPX1"
+#define PACK_RECORD_MAGIC 0x4d534731U         // "MSG1"
+#define PACK_INDEX_VERSION 2
+#define PACK_SEGMENT_SIZE 1024              // default size in MiB a segment is rolled over at
+#define PACK_INDEX_TAIL 4096                // appended entries kept by a checkpoint, read by a lookup at once
+#define PACK_INDEX_TAIL_SHARE 8             // appended entries are merged when they reach 1/8 of the sorted ones
+
+
+/**
+ * @brief Segment reserved by one writer until the message is committed or aborted
+ */
+struct PackSegment {
+    uint32_t number;    // number in the file name
+    int fd;
+    uint64_t size;      // bytes written to the segment
+    uint64_t start;     // position of the record header of the message being written
+    uint64_t uid;       // UID of the message being written
+};
+
+
+class PackStore {
+public:
+    /**
+     * @brief Opens or creates the index and finds the segments of the mailbox
+     *
+     * Entries appended by the previous run are merged into the sorted part, an index of the
+     * first version, with entries at the positions of the UIDs, is converted.
+     *
+     * @param dir output directory
+     * @param name mailbox and server part of the file names
+     * @param segment_size size in bytes after which a new segment is started
+     *
+     * @throw std::runtime_error if the index cannot be opened
+     */
+    PackStore(const std::string &dir, const std::string &name, uint64_t segment_size);
+
+
+    /**
+     * @brief Flushes segments and then the index to the disk and closes them
+     */
+    ~PackStore();
+
+    PackStore(const PackStore &) = delete;
+    PackStore &operator=(const PackStore &) = delete;
+
+
+    /**
+     * @brief Reserves a segment and writes the record header of a new message
+     *
+     * @param uid UID of the message
+     * @param length size of the message in bytes
+     *
+     * @return segment the message data are appended to with write()
+     *
+     * @throw std::runtime_error if the segment cannot be created or written
+     */
+    PackSegment *begin(uint64_t uid, uint64_t length);
+
+
+    /**
+     * @brief Appends message data to the reserved segment
+     *
+     * @throw std::runtime_error if the data cannot be written
+     */
+    void write(PackSegment *segment, const char *data, std::size_t len);
+
+
+    /**
+     * @brief Writes the index entry of a completely written message and releases the segment
+     *
+     * @return offset of the message data in the segment
+     */
+    uint64_t commit(PackSegment *segment);
+
+
+    /**
+     * @brief Drops an incomplete message from the end of the segment and releases it
+     */
+    void abort(PackSegment *segment);
+
+
+    /**
+     * @brief Removes the message from the index
+     */
+    void remove(uint64_t uid);
+
+
+    /**
+     * @brief Removes all index entries, used when UIDVALIDITY changes
+     */
+    void clear();
+
+
+    /**
+     * @brief Merges the appended index entries into the sorted part when there are more than PACK_INDEX_TAIL
+     *
+     * @throw std::runtime_error if the index cannot be written
+     */
+    void checkpoint();
+
+
+    /**
+     * @brief Flushes the opened segments to the disk
+     *
+     * @return false if a segment cannot be flushed
+     */
+    bool sync();
+
+
+    /**
+     * @brief Writes one stored message to the stream
+     *
+     * Opens the index read only, so nothing is created when the store does not exist.
+     *
+     * @throw std::runtime_error if the message is not stored or cannot be read
+     */
+    static void extract(const std::string &dir, const std::string &name, uint64_t uid, std::ostream &os);
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t entry_size;
+        uint64_t sorted;    // entries following the header in ascending order of UIDs, the rest were appended
+    };
+
+    struct Entry {
+        uint64_t uid;
+        uint32_t segment;   // 0 when the message was removed
+        uint32_t reserved;
+        uint64_t offset;    // position of the message data in the segment
+        uint64_t length;
+    };
+
+    // entry of the first version, at the position given by the UID
+    struct EntryV1 {
+        uint32_t segment;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Record {
+        uint32_t magic;
+        uint32_t reserved;
+        uint64_t uid;
+        uint64_t length;
+    };
+
+    std::mutex mutex;
+    std::string prefix;     // output directory and name the file names start with
+    uint64_t segment_size;
+    int index_fd;
+    uint64_t index_size;    // bytes of the index, entries are appended there
+    uint64_t sorted;        // entries of the sorted part of the index
+    uint32_t last_segment;  // highest segment number in use
+    std::vector<PackSegment *> idle;    // opened segments with room that nobody writes to
+    std::vector<PackSegment *> opened;  // all opened segments, for closing
+
+
+    static std::string segmentName(const std::string &prefix, uint32_t number);
+
+
+    /**
+     * @brief Reads the entries of the index, later entries replace earlier ones of the same UID
+     */
+    static void readIndex(int fd, std::map<uint64_t, Entry> &entries);
+
+
+    /**
+     * @brief Reads the entries of an index of the first version, skipping the holes
+     */
+    static void readIndexV1(int fd, std::map<uint64_t, Entry> &entries);
+
+
+    /**
+     * @brief Replaces the index by a sorted one holding the stored messages
+     */
+    void rewriteIndex(const std::map<uint64_t, Entry> &entries);
+
+
+    /**
+     * @brief Rewrites the index with the appended entries merged, the mutex is held
+     */
+    void merge();
+
+
+    /**
+     * @brief Finds the entry of a message in the index
+     *
+     * @return false if the message is not stored
+     */
+    static bool findEntry(int fd, const Header &h, uint64_t size, uint64_t uid, Entry &entry);
+
+
+    /**
+     * @brief Appends an entry to the index
+     *
+     * @return false if it cannot be written
+     */
+    bool appendEntry(const Entry &entry);
+
+
+    /**
+     * @brief Opens a segment for appending, creating it if needed
+     */
+    PackSegment *openSegment(uint32_t number);
+
+
+    /**
+     * @brief Returns the segment to the idle ones, unless it is full
+     */
+    void release(PackSegment *segment);
+};
+
+#endif
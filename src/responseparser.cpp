@@ -0,0 +1,416 @@
+/**
+ * @file responseparser.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of ResponseParser class
+ */
+
+#include "responseparser.hpp"
+
+#include <cctype>
+#include <charconv>
+
+#include "bytescan.hpp"
+
+
+static constexpr std::size_t npos = std::string_view::npos;
+
+
+// keywords of status responses, which may carry a response code
+static bool isStatus(std::string_view keyword) {
+    auto is = [keyword](std::string_view name) {
+        if (keyword.size() != name.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < name.size(); i++) {
+            if (std::toupper(static_cast<unsigned char>(keyword[i])) != name[i]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    return is("OK") || is("NO") || is("BAD") || is("BYE") || is("PREAUTH");
+}
+
+
+// first token of the text and the text after it, the text is shortened to the rest
+static std::string_view token(std::string_view &text) {
+    std::size_t space = text.find(' ');
+    std::string_view first = text.substr(0, space);
+    text = (space == npos) ? std::string_view() : text.substr(space + 1);
+    return first;
+}
+
+
+/**
+ * @brief Checks for "* n FETCH (" at the start of data
+ *
+ * @return 1 when it is there, 0 when it is not, -1 when the data ends before it can be told
+ */
+static int fetchHead(std::string_view data, unsigned long &number, std::size_t &length) {
+    if (data.empty()) {
+        return -1;
+    }
+    if (data[0] != '*') {
+        return 0;
+    }
+    if (data.size() < 2) {
+        return -1;
+    }
+    if (data[1] != ' ') {
+        return 0;
+    }
+
+    std::size_t i = 2;
+    while (i < data.size() && std::isdigit(static_cast<unsigned char>(data[i]))) {
+        i++;
+    }
+    if (i == data.size()) {
+        return -1;
+    }
+    if (i == 2 || data[i] != ' ') {
+        return 0;
+    }
+    std::from_chars(data.data() + 2, data.data() + i, number);
+
+    static const char keyword[] = " FETCH (";
+    for (std::size_t k = 0; k < sizeof(keyword) - 1; k++, i++) {
+        if (i == data.size()) {
+            return -1;
+        }
+        if (std::toupper(static_cast<unsigned char>(data[i])) != keyword[k]) {
+            return 0;
+        }
+    }
+    length = i;
+    return 1;
+}
+
+
+ResponseParser::ResponseParser(ResponseHandler &handler) :
+    handler{handler},
+    mode{Mode::START},
+    literal_left{0},
+    line_start{0},
+    scan{0}
+{ /* empty body */ }
+
+
+void ResponseParser::reset() {
+    this->mode = Mode::START;
+    this->literal_left = 0;
+    this->line_start = 0;
+    this->scan = 0;
+}
+
+
+bool ResponseParser::next(InputBuffer &buff) {
+    while (true) {
+        switch (this->mode) {
+            case Mode::START:
+                if (!this->parseStart(buff)) {
+                    return false;
+                }
+                if (this->mode == Mode::START) {
+                    return true;
+                }
+                break;
+
+            case Mode::ITEMS:
+                if (!this->parseItem(buff)) {
+                    return false;
+                }
+                if (this->mode == Mode::START) {
+                    return true;
+                }
+                break;
+
+            case Mode::LITERAL:
+                if (this->literal_left > 0) {
+                    if (buff.empty()) {
+                        return false;
+                    }
+                    std::string_view data = buff.peek(this->literal_left);
+                    buff.consume(data.size());
+                    this->literal_left -= data.size();
+                    this->handler.literalData(data);
+                    break;
+                }
+                this->mode = Mode::ITEMS;
+                this->handler.literalEnd();
+                break;
+        }
+    }
+}
+
+
+bool ResponseParser::parseStart(InputBuffer &buff) {
+    std::string_view data = buff.data();
+
+    // FETCH responses are reported item by item, so their literals need not fit in the buffer
+    unsigned long number = 0;
+    std::size_t length = 0;
+    int fetch = fetchHead(data, number, length);
+    if (fetch < 0) {
+        return false;
+    }
+    if (fetch > 0) {
+        buff.consume(length);
+        this->mode = Mode::ITEMS;
+        this->handler.response(data.substr(0, 1), number, data.substr(length - 7, 5));
+        return true;
+    }
+
+    // anything else is reported when it is complete
+    std::size_t end = this->responseEnd(data);
+    if (end == npos) {
+        return false;
+    }
+    buff.consume(end);
+    this->line_start = 0;
+    this->scan = 0;
+
+    std::string_view rest = data.substr(0, end);
+    rest.remove_suffix(rest.ends_with("\r\n") ? 2 : 1);
+
+    std::string_view tag = token(rest);
+    std::string_view keyword;
+    number = 0;
+
+    // continuation request has only text
+    if (tag != "+") {
+        keyword = token(rest);
+        if (tag == "*" && !keyword.empty() && std::isdigit(static_cast<unsigned char>(keyword[0]))) {
+            std::from_chars(keyword.data(), keyword.data() + keyword.size(), number);
+            keyword = token(rest);
+        }
+    }
+    this->handler.response(tag, number, keyword);
+
+    if (isStatus(keyword) && rest.starts_with('[')) {
+        std::size_t close = rest.find(']');
+        if (close != npos) {
+            std::string_view args = rest.substr(1, close - 1);
+            std::string_view name = token(args);
+            rest = rest.substr(close + 1);
+            if (rest.starts_with(' ')) {
+                rest.remove_prefix(1);
+            }
+            this->handler.code(name, args);
+        }
+    }
+
+    this->handler.text(rest);
+    this->handler.end();
+    return true;
+}
+
+
+bool ResponseParser::parseItem(InputBuffer &buff) {
+    std::string_view data = buff.data();
+    std::size_t pos = 0;
+    while (pos < data.size() && data[pos] == ' ') {
+        pos++;
+    }
+    if (pos == data.size()) {
+        return false;
+    }
+
+    // end of the item list, a line ending without it ends the response as well
+    if (data[pos] == ')' || data[pos] == '\r' || data[pos] == '\n') {
+        const char *lf = ByteScan::findAny(data.data() + pos, data.data() + data.size(), "\n");
+        if (lf == data.data() + data.size()) {
+            return false;
+        }
+        buff.consume(lf - data.data() + 1);
+        this->mode = Mode::START;
+        this->handler.end();
+        return true;
+    }
+
+    // name of the item, sections like BODY[HEADER.FIELDS (FROM TO)] may contain spaces
+    std::size_t name_start = pos;
+    int depth = 0;
+    for (; pos < data.size(); pos++) {
+        pos = ByteScan::findAny(data.data() + pos, data.data() + data.size(), "[] )\r\n") - data.data();
+        if (pos == data.size()) {
+            break;
+        }
+        char c = data[pos];
+        if (c == '[') {
+            depth++;
+        }
+        else if (c == ']' && depth > 0) {
+            depth--;
+        }
+        else if (depth == 0 && c != ']') {
+            break;
+        }
+    }
+    if (pos == data.size()) {
+        return false;
+    }
+    std::string_view name = data.substr(name_start, pos - name_start);
+
+    // item without a value
+    if (data[pos] != ' ') {
+        buff.consume(pos);
+        this->handler.fetchItem(name, std::string_view());
+        return true;
+    }
+    pos++;
+    if (pos == data.size()) {
+        return false;
+    }
+
+    // literal value is streamed, literal8 is marked by a tilde
+    std::size_t size = 0;
+    std::size_t after = this->literalHeader(data, data[pos] == '~' ? pos + 1 : pos, size);
+    if (after == npos) {
+        return false;
+    }
+    if (after > 0) {
+        buff.consume(after);
+        this->mode = Mode::LITERAL;
+        this->literal_left = size;
+        this->handler.literalBegin(name, size);
+        return true;
+    }
+
+    std::size_t end = valueEnd(data, pos);
+    if (end == npos) {
+        return false;
+    }
+    buff.consume(end);
+    this->handler.fetchItem(name, data.substr(pos, end - pos));
+    return true;
+}
+
+
+std::size_t ResponseParser::responseEnd(std::string_view data) {
+    // the search continues where it stopped, so a response arriving in many parts is scanned once
+    while (this->scan < data.size()) {
+        const char *lf = ByteScan::findAny(data.data() + this->scan, data.data() + data.size(), "\n");
+        if (lf == data.data() + data.size()) {
+            this->scan = data.size();
+            return npos;
+        }
+        std::size_t eol = lf - data.data() + 1;
+
+        // line ending with a literal announcement continues after the literal
+        std::size_t size = 0;
+        if (eol >= this->line_start + 4 && data[eol - 3] == '}') {
+            std::size_t brace = data.rfind('{', eol - 3);
+            if (brace != npos && brace >= this->line_start && literalHeader(data, brace, size) == eol) {
+                this->line_start = eol + size;
+                this->scan = eol + size;
+                continue;
+            }
+        }
+        return eol;
+    }
+    return npos;
+}
+
+
+std::size_t ResponseParser::literalHeader(std::string_view data, std::size_t pos, std::size_t &size) {
+    if (pos >= data.size()) {
+        return npos;
+    }
+    if (data[pos] != '{') {
+        return 0;
+    }
+
+    std::size_t i = pos + 1;
+    while (i < data.size() && std::isdigit(static_cast<unsigned char>(data[i]))) {
+        i++;
+    }
+    if (i == data.size()) {
+        return npos;
+    }
+    if (i == pos + 1) {
+        return 0;
+    }
+    if (std::from_chars(data.data() + pos + 1, data.data() + i, size).ec != std::errc()) {
+        return 0;
+    }
+
+    // non-synchronizing literals of LITERAL+ have a plus sign
+    if (data[i] == '+') {
+        i++;
+    }
+    static const char close[] = "}\r\n";
+    for (std::size_t k = 0; k < sizeof(close) - 1; k++, i++) {
+        if (i == data.size()) {
+            return npos;
+        }
+        if (data[i] != close[k]) {
+            return 0;
+        }
+    }
+    return i;
+}
+
+
+std::size_t ResponseParser::valueEnd(std::string_view data, std::size_t pos) {
+    const char *end = data.data() + data.size();
+
+    if (data[pos] == '"') {
+        for (std::size_t i = pos + 1; i < data.size(); i += 2) {
+            i = ByteScan::findAny(data.data() + i, end, "\"\\") - data.data();
+            if (i < data.size() && data[i] == '"') {
+                return i + 1;
+            }
+        }
+        return npos;
+    }
+
+    if (data[pos] == '(') {
+        int depth = 0;
+        std::size_t i = pos;
+        while (i < data.size()) {
+            i = ByteScan::findAny(data.data() + i, end, "\"{()\r\n") - data.data();
+            if (i == data.size()) {
+                break;
+            }
+            char c = data[i];
+            if (c == '"') {
+                i = valueEnd(data, i);
+                if (i == npos) {
+                    return npos;
+                }
+                continue;
+            }
+
+            // literal inside the list is kept in place
+            if (c == '{') {
+                std::size_t size = 0;
+                std::size_t after = literalHeader(data, i, size);
+                if (after == npos || (after > 0 && after + size > data.size())) {
+                    return npos;
+                }
+                if (after > 0) {
+                    i = after + size;
+                    continue;
+                }
+            }
+
+            if (c == '(') {
+                depth++;
+            }
+            else if (c == ')' && --depth == 0) {
+                return i + 1;
+            }
+            // the line ended inside the list, the list ends with it
+            else if (c == '\r' || c == '\n') {
+                return i;
+            }
+            i++;
+        }
+        return npos;
+    }
+
+    // atom, number or NIL
+    std::size_t i = ByteScan::findAny(data.data() + pos, end, " )\r\n") - data.data();
+    return i < data.size() ? i : npos;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file responseparser.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for ResponseParser class
+ *
+ * Incremental parser of server responses. It works on the data of an InputBuffer as it
+ * arrives and reports each response as a series of events to a ResponseHandler:
+ *
+ *      * 12 FETCH (UID 40 FLAGS (\Seen) BODY[] {1234}
+ *      <1234 bytes>)
+ *
+ * becomes response("*", 12, "FETCH"), fetchItem("UID", "40"), fetchItem("FLAGS", "(\Seen)"),
+ * literalBegin("BODY[]", 1234), literalData() for every received part of the literal,
+ * literalEnd() and end(). Status responses report their response code and text separately,
+ * other responses report everything after the keyword as text.
+ *
+ * Literals may appear anywhere. A literal which is the value of a FETCH item is streamed,
+ * other literals (inside a parenthesized list or in a response other than FETCH) are kept
+ * in the buffer until the value or response is complete and are part of the reported view
+ * in their IMAP form, {size} CRLF and the data.
+ *
+ * Views passed to the handler point into the buffer and are valid only during the call.
+ * Data is consumed from the buffer before the handler is called, so a handler which throws
+ * does not get the same event again. The parser allocates no memory.
+ */
+
+#ifndef RESPONSEPARSER_HPP
+#define RESPONSEPARSER_HPP
+
+#include <cstddef>
+#include <string_view>
+
+#include "inputbuffer.hpp"
+
+
+/**
+ * @brief Receiver of parsed responses, all events are ignored by default
+ */
+class ResponseHandler {
+public:
+    virtual ~ResponseHandler() = default;
+
+    /**
+     * @brief Start of a response
+     *
+     * @param tag "*" for untagged responses, "+" for continuation requests, tag of the command otherwise
+     * @param number number before the keyword of untagged responses like EXISTS or FETCH, 0 when there is none
+     * @param keyword response name or status (OK, NO, BAD, ...), empty for continuation requests
+     */
+    virtual void response(std::string_view /*tag*/, unsigned long /*number*/, std::string_view /*keyword*/) {}
+
+    /**
+     * @brief Response code of a status response, [name args]
+     */
+    virtual void code(std::string_view /*name*/, std::string_view /*args*/) {}
+
+    /**
+     * @brief Rest of the response after the keyword or the response code, without CRLF
+     */
+    virtual void text(std::string_view /*text*/) {}
+
+    /**
+     * @brief FETCH data item whose value is not a literal, lists are passed with the parentheses
+     */
+    virtual void fetchItem(std::string_view /*name*/, std::string_view /*value*/) {}
+
+    /**
+     * @brief Start of a FETCH data item whose value is a literal
+     */
+    virtual void literalBegin(std::string_view /*name*/, std::size_t /*size*/) {}
+
+    /**
+     * @brief Part of the literal data, parts come in order and add up to the literal size
+     */
+    virtual void literalData(std::string_view /*data*/) {}
+
+    virtual void literalEnd() {}
+
+    /**
+     * @brief End of the response
+     */
+    virtual void end() {}
+};
+
+
+class ResponseParser {
+public:
+    /**
+     * @param handler receiver of the events, has to outlive the parser
+     */
+    explicit ResponseParser(ResponseHandler &handler);
+
+
+    /**
+     * @brief Default destructor
+     */
+    ~ResponseParser() = default;
+
+
+    /**
+     * @brief Parses data of the buffer until a response ends or more data is needed
+     *
+     * Complete parts of an unfinished response (FETCH items, literal data) are reported
+     * and consumed, the incomplete rest stays in the buffer.
+     *
+     * @return true when a response ended, false when the buffer does not hold more to parse
+     */
+    bool next(InputBuffer &buff);
+
+
+    /**
+     * @brief Forgets the response being parsed, used when the buffer is cleared
+     */
+    void reset();
+
+
+    /**
+     * @brief Whether the parser is inside a response, its rest has to arrive before the next one
+     */
+    bool inResponse() const { return this->mode != Mode::START; }
+
+private:
+    enum class Mode {
+        START,      // at the beginning of a response
+        ITEMS,      // between data items of a FETCH response
+        LITERAL     // in the literal value of a FETCH data item
+    };
+
+    ResponseHandler &handler;
+    Mode mode;
+    std::size_t literal_left;   // bytes of the streamed literal not reported yet
+    std::size_t line_start;     // offset of the line of an incomplete response whose end is searched for
+    std::size_t scan;           // offset where the search for the line end continues
+
+
+    /**
+     * @brief Parses a response which is not FETCH, or the start of a FETCH response
+     */
+    bool parseStart(InputBuffer &buff);
+
+
+    /**
+     * @brief Parses the next FETCH data item or the end of the item list
+     *
+     * @return false when more data is needed
+     */
+    bool parseItem(InputBuffer &buff);
+
+
+    /**
+     * @brief Offset after the CRLF ending the response at the start of data, literals included
+     *
+     * @return std::string_view::npos when the response is not complete
+     */
+    std::size_t responseEnd(std::string_view data);
+
+
+    /**
+     * @brief Parses a literal announcement {size} or {size+} followed by CRLF at pos
+     *
+     * @return offset after the CRLF, 0 when there is no announcement at pos,
+     *         std::string_view::npos when the data ends before the announcement does
+     */
+    static std::size_t literalHeader(std::string_view data, std::size_t pos, std::size_t &size);
+
+
+    /**
+     * @brief Offset after the value starting at pos, nested lists, quoted strings and literals included
+     *
+     * @return std::string_view::npos when the value is not complete
+     */
+    static std::size_t valueEnd(std::string_view data, std::size_t pos);
+};
+
+#endif
@@ -0,0 +1,86 @@
+/**
+ * @file resumejournal.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of ResumeJournal class
+ */
+
+#include "resumejournal.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+
+ResumeJournal::ResumeJournal(const std::string &dir) :
+    filename{dir + "/.resume"}
+{
+    std::ifstream file(this->filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss{line};
+        uint64_t uid = 0;
+        ResumeEntry entry{0, 0};
+
+        // a damaged line only costs downloading the message again
+        if (iss >> uid >> entry.offset >> entry.size && entry.offset <= entry.size) {
+            this->unfinished[uid] = entry;
+        }
+    }
+}
+
+
+std::map<uint64_t, ResumeEntry> ResumeJournal::entries() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->unfinished;
+}
+
+
+void ResumeJournal::record(uint64_t uid, uint64_t offset, uint64_t size) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->unfinished[uid] = ResumeEntry{offset, size};
+    this->save();
+}
+
+
+void ResumeJournal::remove(uint64_t uid) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->unfinished.erase(uid) > 0) {
+        this->save();
+    }
+}
+
+
+void ResumeJournal::clear() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->unfinished.empty()) {
+        this->unfinished.clear();
+        this->save();
+    }
+}
+
+
+void ResumeJournal::save() {
+    if (this->unfinished.empty()) {
+        std::remove(this->filename.c_str());
+        return;
+    }
+
+    std::string tmpname = this->filename + ".tmp";
+    {
+        std::ofstream file(tmpname, std::ios::trunc);
+        for (const auto &[uid, entry] : this->unfinished) {
+            file << uid << " " << entry.offset << " " << entry.size << "\n";
+        }
+        if (!file.flush()) {
+            std::remove(tmpname.c_str());
+            throw std::runtime_error("Cannot write the resume journal.");
+        }
+    }
+
+    if (std::rename(tmpname.c_str(), this->filename.c_str()) != 0) {
+        std::remove(tmpname.c_str());
+        throw std::runtime_error("Cannot write the resume journal.");
+    }
+}
@@ -0,0 +1,89 @@
+/**
+ * @file resumejournal.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for ResumeJournal class
+ *
+ * Messages larger than the chunk size are fetched in parts with BODY.PEEK[]<offset.length>.
+ * Their data is written to the .part file of the message as usual, and after every part is
+ * on the disk its end is recorded in the journal file .resume of the output directory, one
+ * line "UID OFFSET SIZE" per unfinished message. The .part file of a message in the journal
+ * is kept when the connection fails, so the next run truncates it to the recorded offset
+ * and fetches only the rest. The entry is removed once the message is moved into place.
+ *
+ * The file is small and rewritten through a temporary file on every change.
+ */
+
+#ifndef RESUMEJOURNAL_HPP
+#define RESUMEJOURNAL_HPP
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#define FETCH_CHUNK_SIZE 32     // default MiB above which a message is fetched in parts of this size
+
+
+/**
+ * @brief Unfinished message, data up to offset is stored in its .part file
+ */
+struct ResumeEntry {
+    uint64_t offset;
+    uint64_t size;      // RFC822.SIZE of the message
+};
+
+
+class ResumeJournal {
+public:
+    /**
+     * @brief Reads the journal of the output directory, a missing file is an empty journal
+     */
+    explicit ResumeJournal(const std::string &dir);
+
+    ResumeJournal(const ResumeJournal &) = delete;
+    ResumeJournal &operator=(const ResumeJournal &) = delete;
+
+
+    /**
+     * @brief Unfinished messages by UID
+     */
+    std::map<uint64_t, ResumeEntry> entries() const;
+
+
+    /**
+     * @brief Records that the message is stored up to offset
+     *
+     * Safe to call from several threads at once.
+     *
+     * @throw std::runtime_error if the journal cannot be written
+     */
+    void record(uint64_t uid, uint64_t offset, uint64_t size);
+
+
+    /**
+     * @brief Removes the entry of a finished or dropped message
+     *
+     * @throw std::runtime_error if the journal cannot be written
+     */
+    void remove(uint64_t uid);
+
+
+    /**
+     * @brief Removes all entries, used when UIDVALIDITY changes
+     */
+    void clear();
+
+private:
+    mutable std::mutex mutex;
+    std::string filename;
+    std::map<uint64_t, ResumeEntry> unfinished;
+
+
+    /**
+     * @brief Writes the entries to a temporary file and renames it over the journal, removes it when empty
+     */
+    void save();
+};
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * @file stateindex.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of StateIndex class
+ */
+
+#include "stateindex.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+StateIndex::StateIndex(const std::string &dir) :
+    filename{dir + "/.index"},
+    fd{-1},
+    map{nullptr},
+    map_size{0},
+    count{0},
+    uidnext_value{1},
+    modseq_value{0},
+    dirty{false},
+    sync{},
+    last_checkpoint{std::chrono::steady_clock::now()}
+{
+    this->fd = open(this->filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+        throw std::runtime_error("Cannot open .index file.");
+    }
+
+    // only the header is checked, a damaged or foreign file is replaced by a new index
+    struct stat st;
+    Header h{};
+    bool valid = fstat(this->fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(Header)
+                 && pread(this->fd, &h, sizeof(Header), 0) == sizeof(Header)
+                 && h.magic == STATE_INDEX_MAGIC && h.version == STATE_INDEX_VERSION
+                 && h.record_size == sizeof(IndexRecord) && h.count <= h.capacity
+                 && static_cast<std::size_t>(st.st_size) >= sizeof(Header) + h.capacity * sizeof(IndexRecord);
+
+    try {
+        if (valid) {
+            this->mapFile(h.capacity);
+        }
+        else {
+            this->create(dir);
+        }
+    }
+    catch (std::runtime_error &) {
+        if (this->map != nullptr) {
+            munmap(this->map, this->map_size);
+        }
+        close(this->fd);
+        throw;
+    }
+
+    this->count = this->header()->count;
+    this->uidnext_value = this->header()->uidnext;
+    this->modseq_value = this->header()->highestmodseq;
+}
+
+
+StateIndex::~StateIndex() {
+    this->commit();
+    munmap(this->map, this->map_size);
+    close(this->fd);
+}
+
+
+void StateIndex::mapFile(uint64_t capacity) {
+    std::size_t size = sizeof(Header) + capacity * sizeof(IndexRecord);
+
+    struct stat st;
+    if (fstat(this->fd, &st) != 0 || (static_cast<std::size_t>(st.st_size) < size && ftruncate(this->fd, size) != 0)) {
+        throw std::runtime_error("Cannot resize .index file.");
+    }
+
+    if (this->map != nullptr) {
+        munmap(this->map, this->map_size);
+        this->map = nullptr;
+    }
+
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("Cannot map .index file.");
+    }
+    this->map = static_cast<char *>(addr);
+    this->map_size = size;
+}
+
+
+void StateIndex::create(const std::string &dir) {
+    if (ftruncate(this->fd, 0) != 0) {
+        throw std::runtime_error("Cannot create .index file.");
+    }
+    this->mapFile(STATE_INDEX_CAPACITY);
+
+    Header *h = this->header();
+    *h = Header{STATE_INDEX_MAGIC, STATE_INDEX_VERSION, sizeof(IndexRecord), 0, 1, 0, 0, STATE_INDEX_CAPACITY, 0};
+
+    // state of older versions is kept, so the next run does not download everything again
+    const std::pair<const char *, uint64_t *> old_files[] = {
+        {".uidvalidity", &h->uidvalidity}, {".uidnext", &h->uidnext}, {".highestmodseq", &h->highestmodseq}
+    };
+    for (const auto &[name, value] : old_files) {
+        std::ifstream file(dir + "/" + name);
+        uint64_t stored;
+        if (file >> stored) {
+            *value = stored;
+        }
+    }
+
+    if (msync(this->map, this->map_size, MS_SYNC) != 0) {
+        throw std::runtime_error("Cannot write .index file.");
+    }
+    for (const auto &[name, value] : old_files) {
+        std::error_code ec;
+        std::filesystem::remove(dir + "/" + name, ec);
+    }
+}
+
+
+uint64_t StateIndex::uidvalidity() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->header()->uidvalidity;
+}
+
+
+uint64_t StateIndex::uidnext() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->uidnext_value;
+}
+
+
+uint64_t StateIndex::highestModseq() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->modseq_value;
+}
+
+
+UidSet StateIndex::uids() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    UidSet uids;
+    for (uint64_t i = 0; i < this->count; i++) {
+        uids.add(this->records()[i].uid);
+    }
+    return uids;
+}
+
+
+void StateIndex::reset(uint64_t uidvalidity) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    Header *h = this->header();
+    h->uidvalidity = uidvalidity;
+    h->uidnext = 1;
+    h->highestmodseq = 0;
+    h->count = 0;
+    msync(this->map, this->map_size, MS_SYNC);
+
+    this->count = 0;
+    this->uidnext_value = 1;
+    this->modseq_value = 0;
+    this->dirty = false;
+}
+
+
+void StateIndex::setUidnext(uint64_t uidnext) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->uidnext_value = uidnext;
+    this->dirty = true;
+    this->commitIfDue();
+}
+
+
+void StateIndex::setHighestModseq(uint64_t modseq) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->modseq_value = modseq;
+    this->dirty = true;
+}
+
+
+void StateIndex::add(uint64_t uid, uint64_t size, uint64_t offset) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->count == this->header()->capacity) {
+        uint64_t capacity = this->header()->capacity * 2;
+        this->mapFile(capacity);
+        this->header()->capacity = capacity;
+    }
+
+    this->records()[this->count++] = IndexRecord{uid, size, offset};
+    this->dirty = true;
+    this->commitIfDue();
+}
+
+
+void StateIndex::setSync(std::function<bool()> sync) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->sync = std::move(sync);
+}
+
+
+void StateIndex::checkpoint() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->commit();
+}
+
+
+void StateIndex::commit() {
+    if (!this->dirty) {
+        return;
+    }
+
+    // the messages have to be on the disk before the records, the records before the header that makes them valid
+    if (this->sync && !this->sync()) {
+        return;
+    }
+    msync(this->map, this->map_size, MS_SYNC);
+
+    Header *h = this->header();
+    h->count = this->count;
+    h->uidnext = this->uidnext_value;
+    h->highestmodseq = this->modseq_value;
+    msync(this->map, sizeof(Header), MS_SYNC);
+
+    this->dirty = false;
+    this->last_checkpoint = std::chrono::steady_clock::now();
+}
+
+
+void StateIndex::commitIfDue() {
+    auto now = std::chrono::steady_clock::now();
+    if (this->count - this->header()->count >= STATE_CHECKPOINT_RECORDS
+        || now - this->last_checkpoint >= std::chrono::milliseconds(STATE_CHECKPOINT_MS)) {
+        this->commit();
+    }
+}
@@ -0,0 +1,190 @@
+/**
+ * @file stateindex.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for StateIndex class
+ *
+ * Synchronization state of one mailbox in the output directory, kept in a memory-mapped
+ * binary file .index: UIDVALIDITY, UIDNEXT, HIGHESTMODSEQ and a record for every message
+ * stored locally. Opening only maps the file and checks the header, nothing is parsed.
+ *
+ * Changes are written to the mapping right away but become valid at a checkpoint, which
+ * flushes the records and then the header with the new record count. Checkpoints are made
+ * after a number of records or a time interval, so a crash loses at most the last interval
+ * and the index never refers to messages which are not stored. Message files are flushed
+ * before they are recorded, pack segments by the sync function before each checkpoint.
+ *
+ * The text files .uidvalidity, .uidnext and .highestmodseq of older versions are imported
+ * when the index is created and removed afterwards.
+ */
+
+#ifndef STATEINDEX_HPP
+#define STATEINDEX_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "uidset.hpp"
+
+#define STATE_INDEX_MAGIC 0x31584449434d49ULL  // "IMCIDX1"
+#define STATE_INDEX_VERSION 1
+#define STATE_INDEX_CAPACITY 1024       // records the file is created for, it doubles when full
+#define STATE_CHECKPOINT_RECORDS 256    // records appended before a checkpoint is forced
+#define STATE_CHECKPOINT_MS 1000        // maximal time between checkpoints of pending changes
+
+
+/**
+ * @brief Message stored in the output directory
+ */
+struct IndexRecord {
+    uint64_t uid;
+    uint64_t size;      // size of the message in bytes
+    uint64_t offset;    // position of the message in its file, 0 for a file per message
+};
+
+
+class StateIndex {
+public:
+    /**
+     * @brief Opens or creates the index of the output directory
+     *
+     * @param dir output directory of the mailbox
+     *
+     * @throw std::runtime_error if the file cannot be created or mapped
+     */
+    explicit StateIndex(const std::string &dir);
+
+
+    /**
+     * @brief Makes a checkpoint of pending changes and unmaps the file
+     */
+    ~StateIndex();
+
+    StateIndex(const StateIndex &) = delete;
+    StateIndex &operator=(const StateIndex &) = delete;
+
+
+    /**
+     * @brief Stored UIDVALIDITY, 0 when there is none
+     */
+    uint64_t uidvalidity() const;
+
+
+    /**
+     * @brief UIDNEXT, the lowest UID that may not be stored yet
+     */
+    uint64_t uidnext() const;
+
+
+    /**
+     * @brief Stored HIGHESTMODSEQ, 0 when there is none
+     */
+    uint64_t highestModseq() const;
+
+
+    /**
+     * @brief UIDs of all stored messages, including ones not checkpointed yet
+     */
+    UidSet uids() const;
+
+
+    /**
+     * @brief Drops all records and starts over with a new UIDVALIDITY, written immediately
+     */
+    void reset(uint64_t uidvalidity);
+
+
+    /**
+     * @brief Sets UIDNEXT, valid from the next checkpoint
+     */
+    void setUidnext(uint64_t uidnext);
+
+
+    /**
+     * @brief Sets the function which makes stored messages durable, called before each checkpoint
+     *
+     * A checkpoint is skipped while the function fails, so no record refers to data lost by a crash.
+     */
+    void setSync(std::function<bool()> sync);
+
+
+    /**
+     * @brief Sets HIGHESTMODSEQ, valid from the next checkpoint
+     */
+    void setHighestModseq(uint64_t modseq);
+
+
+    /**
+     * @brief Appends record of a stored message, valid from the next checkpoint
+     *
+     * Safe to call from several threads at once.
+     *
+     * @throw std::runtime_error if the file cannot be grown
+     */
+    void add(uint64_t uid, uint64_t size, uint64_t offset = 0);
+
+
+    /**
+     * @brief Flushes pending records and the header to the disk
+     */
+    void checkpoint();
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t uidvalidity;
+        uint64_t uidnext;
+        uint64_t highestmodseq;
+        uint64_t count;         // records valid since the last checkpoint
+        uint64_t capacity;      // records the file has room for
+        uint64_t reserved;
+    };
+
+    mutable std::mutex mutex;
+    std::string filename;
+    int fd;
+    char *map;              // mapping of the whole file
+    std::size_t map_size;
+
+    uint64_t count;         // records written including pending ones
+    uint64_t uidnext_value; // UIDNEXT written at the next checkpoint
+    uint64_t modseq_value;  // HIGHESTMODSEQ written at the next checkpoint
+    bool dirty;             // there are changes since the last checkpoint
+    std::function<bool()> sync; // makes the data of pending records durable, may be empty
+    std::chrono::steady_clock::time_point last_checkpoint;
+
+
+    Header *header() const { return reinterpret_cast<Header *>(this->map); }
+    IndexRecord *records() const { return reinterpret_cast<IndexRecord *>(this->map + sizeof(Header)); }
+
+
+    /**
+     * @brief Maps the file with room for the given number of records, growing the file if needed
+     */
+    void mapFile(uint64_t capacity);
+
+
+    /**
+     * @brief Writes a new empty index, importing the text state files of older versions
+     */
+    void create(const std::string &dir);
+
+
+    /**
+     * @brief Checkpoint without locking, callers hold the mutex
+     */
+    void commit();
+
+
+    /**
+     * @brief Makes a checkpoint when enough records are pending or the interval passed
+     */
+    void commitIfDue();
+};
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * @file syncstats.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of SyncStats class
+ */
+
+#include "syncstats.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+
+Histogram::Histogram(std::vector<unsigned long long> bounds) :
+    upper{std::move(bounds)},
+    counts{std::make_unique<std::atomic<unsigned long long>[]>(this->upper.size() + 1)}
+{ /* empty body */ }
+
+
+void Histogram::observe(unsigned long long value) {
+    std::size_t i = 0;
+    while (i < this->upper.size() && value > this->upper[i]) {
+        i++;
+    }
+    this->counts[i]++;
+    this->total++;
+    this->values += value;
+}
+
+
+SyncStats::SyncStats() :
+    started{std::chrono::steady_clock::now()},
+    // 1 KiB to 64 MiB by powers of four
+    sizes{{1ULL << 10, 1ULL << 12, 1ULL << 14, 1ULL << 16, 1ULL << 18, 1ULL << 20, 1ULL << 22, 1ULL << 24, 1ULL << 26}},
+    // 100 us to 10 s
+    writes{{100000ULL, 500000ULL, 1000000ULL, 5000000ULL, 10000000ULL, 50000000ULL, 100000000ULL,
+            500000000ULL, 1000000000ULL, 10000000000ULL}}
+{ /* empty body */ }
+
+
+const char *SyncStats::phaseName(int phase) {
+    static const char *names[] = {"connect", "handshake", "login", "select", "list", "search", "fetch", "idle", "logout"};
+    return names[phase];
+}
+
+
+void SyncStats::addPhase(Phase phase, std::chrono::steady_clock::duration time) {
+    int i = static_cast<int>(phase);
+    this->phase_ns[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+    this->phase_entries[i]++;
+}
+
+
+void SyncStats::addMessage(std::size_t size) {
+    this->sizes.observe(size);
+}
+
+
+void SyncStats::addWrite(std::chrono::steady_clock::duration time) {
+    this->writes.observe(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+}
+
+
+void SyncStats::addOutage(std::chrono::steady_clock::duration time, unsigned int attempts, bool recovered) {
+    this->outages++;
+    this->reconnects += recovered ? 1 : 0;
+    this->attempts += attempts;
+    this->downtime_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+
+void SyncStats::printOutages(std::ostream &os, unsigned int limit) const {
+    if (this->outages == 0) {
+        return;
+    }
+
+    std::ostringstream line;
+    line.precision(1);
+    line << std::fixed << "Reconnection: " << this->outages << " lost, " << this->reconnects << " restored in "
+         << this->attempts << " attempts (at most " << limit << " in a row), " << this->downtime_ns / 1e9
+         << " s without connection.\n";
+    os << line.str() << std::flush;
+}
+
+
+void SyncStats::save(const std::string &filename, const std::string &format, bool success) const {
+    std::string tmpname = filename + ".tmp";
+    {
+        std::ofstream file(tmpname, std::ios::trunc);
+        if (!file.is_open()) {
+            throw std::runtime_error("Cannot write the stats file.");
+        }
+
+        if (format == "prometheus") {
+            this->writePrometheus(file, success);
+        }
+        else {
+            this->writeJson(file, success);
+        }
+
+        if (!file.flush()) {
+            std::remove(tmpname.c_str());
+            throw std::runtime_error("Cannot write the stats file.");
+        }
+    }
+
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        std::remove(tmpname.c_str());
+        throw std::runtime_error("Cannot write the stats file.");
+    }
+}
+
+
+void SyncStats::writeJson(std::ostream &os, bool success) const {
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->started).count();
+
+    auto histogram = [&os](const Histogram &h, double scale) {
+        os << "{\"buckets\": [";
+        for (std::size_t i = 0; i <= h.bounds().size(); i++) {
+            os << (i ? ", " : "") << "{\"le\": ";
+            if (i < h.bounds().size()) {
+                os << h.bounds()[i] * scale;
+            }
+            else {
+                os << "null";
+            }
+            os << ", \"count\": " << h.bucket(i) << "}";
+        }
+        os << "], \"count\": " << h.count() << ", \"sum\": " << h.sum() * scale << "}";
+    };
+
+    os << std::setprecision(9)
+       << "{\n  \"success\": " << (success ? "true" : "false") << ",\n"
+       << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+       << "  \"duration_seconds\": " << duration << ",\n"
+       << "  \"phases\": {";
+    for (int i = 0; i < static_cast<int>(Phase::COUNT); i++) {
+        os << (i ? ",\n" : "\n") << "    \"" << phaseName(i) << "\": {\"seconds\": " << this->phase_ns[i] / 1e9
+           << ", \"entries\": " << this->phase_entries[i] << "}";
+    }
+    os << "\n  },\n"
+       << "  \"bytes_received\": " << this->received << ",\n"
+       << "  \"bytes_sent\": " << this->sent << ",\n"
+       << "  \"messages\": " << this->sizes.count() << ",\n"
+       << "  \"message_bytes\": " << this->sizes.sum() << ",\n"
+       << "  \"connections_lost\": " << this->outages << ",\n"
+       << "  \"reconnects\": " << this->reconnects << ",\n"
+       << "  \"reconnect_attempts\": " << this->attempts << ",\n"
+       << "  \"downtime_seconds\": " << this->downtime_ns / 1e9 << ",\n"
+       << "  \"message_size_bytes\": ";
+    histogram(this->sizes, 1);
+    os << ",\n  \"write_latency_seconds\": ";
+    histogram(this->writes, 1e-9);
+    os << "\n}\n";
+}
+
+
+void SyncStats::writePrometheus(std::ostream &os, bool success) const {
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->started).count();
+
+    auto metric = [&os](const char *name, const char *type, const char *help) {
+        os << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+
+    auto histogram = [&os](const char *name, const Histogram &h, double scale) {
+        unsigned long long cumulative = 0;
+        for (std::size_t i = 0; i <= h.bounds().size(); i++) {
+            cumulative += h.bucket(i);
+            os << name << "_bucket{le=\"";
+            if (i < h.bounds().size()) {
+                os << h.bounds()[i] * scale;
+            }
+            else {
+                os << "+Inf";
+            }
+            os << "\"} " << cumulative << "\n";
+        }
+        os << name << "_sum " << h.sum() * scale << "\n" << name << "_count " << h.count() << "\n";
+    };
+
+    os << std::setprecision(9);
+    metric("imapcl_success", "gauge", "Whether the last run finished without an error.");
+    os << "imapcl_success " << (success ? 1 : 0) << "\n";
+    metric("imapcl_last_run_timestamp_seconds", "gauge", "UNIX time the last run ended.");
+    os << "imapcl_last_run_timestamp_seconds " << std::time(nullptr) << "\n";
+    metric("imapcl_duration_seconds", "gauge", "Wall time of the last run.");
+    os << "imapcl_duration_seconds " << duration << "\n";
+
+    metric("imapcl_phase_seconds", "gauge", "Time connections spent in each phase of the session, summed over connections.");
+    for (int i = 0; i < static_cast<int>(Phase::COUNT); i++) {
+        os << "imapcl_phase_seconds{phase=\"" << phaseName(i) << "\"} " << this->phase_ns[i] / 1e9 << "\n";
+    }
+    metric("imapcl_phase_entries", "gauge", "Number of times connections went through each phase.");
+    for (int i = 0; i < static_cast<int>(Phase::COUNT); i++) {
+        os << "imapcl_phase_entries{phase=\"" << phaseName(i) << "\"} " << this->phase_entries[i] << "\n";
+    }
+
+    metric("imapcl_received_bytes", "gauge", "Bytes received from the servers, after TLS and before decompression.");
+    os << "imapcl_received_bytes " << this->received << "\n";
+    metric("imapcl_sent_bytes", "gauge", "Bytes sent to the servers, after compression and before TLS.");
+    os << "imapcl_sent_bytes " << this->sent << "\n";
+
+    metric("imapcl_connections_lost", "gauge", "Connections lost during the last run.");
+    os << "imapcl_connections_lost " << this->outages << "\n";
+    metric("imapcl_reconnects", "gauge", "Lost connections restored during the last run.");
+    os << "imapcl_reconnects " << this->reconnects << "\n";
+    metric("imapcl_reconnect_attempts", "gauge", "Reconnection attempts during the last run, successful or not.");
+    os << "imapcl_reconnect_attempts " << this->attempts << "\n";
+    metric("imapcl_downtime_seconds", "gauge", "Time from losing connections until they were restored or given up.");
+    os << "imapcl_downtime_seconds " << this->downtime_ns / 1e9 << "\n";
+
+    metric("imapcl_message_size_bytes", "histogram", "Sizes of the downloaded messages.");
+    histogram("imapcl_message_size_bytes", this->sizes, 1);
+    metric("imapcl_write_latency_seconds", "histogram", "Time from receiving a message to having it stored.");
+    histogram("imapcl_write_latency_seconds", this->writes, 1e-9);
+}
@@ -0,0 +1,159 @@
+/**
+ * @file syncstats.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for SyncStats class
+ *
+ * Collects timing and throughput of a run for monitoring: time the connections spent in
+ * each phase of the session, bytes read from and written to the sockets, sizes of the
+ * downloaded messages, time from receiving a message to having it stored on the disk, and
+ * connections lost during the run with the time it took to restore them.
+ * All connections of a run share one instance, the counters can be updated from any thread.
+ *
+ * At the end of the run the stats are written as JSON or in the Prometheus text format,
+ * the file is replaced atomically so a collector never reads it half written.
+ */
+
+#ifndef SYNCSTATS_HPP
+#define SYNCSTATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief Part of the session the time of a connection is counted to
+ */
+enum class Phase {
+    CONNECT,    // name resolution and TCP connection
+    HANDSHAKE,  // TLS handshake
+    LOGIN,      // greeting, LOGIN and negotiation of extensions
+    SELECT,     // SELECT and synchronization of flags
+    LIST,
+    SEARCH,
+    FETCH,      // FETCH commands until their messages are written
+    IDLE,
+    LOGOUT,
+    COUNT       // number of phases
+};
+
+
+/**
+ * @brief Histogram with fixed bucket bounds, observations are counted atomically
+ */
+class Histogram {
+public:
+    /**
+     * @param bounds upper bounds of the buckets in ascending order, a bucket for larger values is added
+     */
+    explicit Histogram(std::vector<unsigned long long> bounds);
+
+    void observe(unsigned long long value);
+
+    const std::vector<unsigned long long> &bounds() const { return this->upper; }
+
+    // number of observations in the bucket, the last bucket has no upper bound
+    unsigned long long bucket(std::size_t i) const { return this->counts[i]; }
+
+    unsigned long long count() const { return this->total; }
+
+    unsigned long long sum() const { return this->values; }
+
+private:
+    std::vector<unsigned long long> upper;
+    std::unique_ptr<std::atomic<unsigned long long>[]> counts;
+    std::atomic<unsigned long long> total{0};
+    std::atomic<unsigned long long> values{0};
+};
+
+
+class SyncStats {
+public:
+    /**
+     * @brief Starts the clock of the run
+     */
+    SyncStats();
+
+    SyncStats(const SyncStats &) = delete;
+    SyncStats &operator=(const SyncStats &) = delete;
+
+
+    /**
+     * @brief Adds time a connection spent in the phase
+     */
+    void addPhase(Phase phase, std::chrono::steady_clock::duration time);
+
+
+    void addReceived(std::size_t bytes) { this->received += bytes; }
+
+    void addSent(std::size_t bytes) { this->sent += bytes; }
+
+
+    /**
+     * @brief Counts a downloaded message
+     */
+    void addMessage(std::size_t size);
+
+
+    /**
+     * @brief Records time from the end of a message literal until the message was stored
+     */
+    void addWrite(std::chrono::steady_clock::duration time);
+
+
+    /**
+     * @brief Records a lost connection with the time until it was restored or given up
+     *
+     * @param attempts number of reconnection attempts
+     * @param recovered whether one of the attempts succeeded
+     */
+    void addOutage(std::chrono::steady_clock::duration time, unsigned int attempts, bool recovered);
+
+
+    /**
+     * @brief Writes lost connections, reconnection attempts and downtime as a line of the run summary
+     *
+     * Nothing is written when no connection was lost, the stats file has the zeros.
+     *
+     * @param limit maximal number of attempts in a row
+     */
+    void printOutages(std::ostream &os, unsigned int limit) const;
+
+
+    /**
+     * @brief Writes the stats to a temporary file and renames it over the given one
+     *
+     * @param format "json" or "prometheus"
+     * @param success whether the run finished without an error
+     *
+     * @throw std::runtime_error if the file cannot be written
+     */
+    void save(const std::string &filename, const std::string &format, bool success) const;
+
+
+    void writeJson(std::ostream &os, bool success) const;
+
+    void writePrometheus(std::ostream &os, bool success) const;
+
+private:
+    std::chrono::steady_clock::time_point started;
+    std::atomic<unsigned long long> phase_ns[static_cast<int>(Phase::COUNT)]{};
+    std::atomic<unsigned long long> phase_entries[static_cast<int>(Phase::COUNT)]{};
+    std::atomic<unsigned long long> received{0};    // bytes read from the connections, after TLS and before decompression
+    std::atomic<unsigned long long> sent{0};        // bytes written to the connections
+    Histogram sizes;            // message sizes in bytes
+    Histogram writes;           // write latencies in nanoseconds
+    std::atomic<unsigned long long> outages{0};     // connections lost during the run
+    std::atomic<unsigned long long> reconnects{0};  // lost connections restored
+    std::atomic<unsigned long long> attempts{0};    // reconnection attempts, successful or not
+    std::atomic<unsigned long long> downtime_ns{0}; // time from losing connections until they were restored or given up
+
+
+    static const char *phaseName(int phase);
+};
+
+#endif
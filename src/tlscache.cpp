@@ -0,0 +1,131 @@
+/**
+ * @file tlscache.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of TlsSessionCache class
+ */
+
+#include "tlscache.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+TlsSessionCache::TlsSessionCache(const std::string &filename) :
+    filename{filename}
+{
+    std::ifstream file(filename);
+    std::string line;
+    std::time_t now = std::time(nullptr);
+
+    while (std::getline(file, line)) {
+        std::istringstream iss{line};
+        std::string key, hex;
+        std::time_t expires;
+        if (!(iss >> key >> expires >> hex) || expires <= now || hex.size() % 2) {
+            continue;
+        }
+
+        // a damaged line is skipped, the session is negotiated again
+        std::string der(hex.size() / 2, '\0');
+        bool valid = true;
+        for (std::size_t i = 0; valid && i < der.size(); i++) {
+            unsigned char byte = 0;
+            auto [ptr, ec] = std::from_chars(hex.data() + 2 * i, hex.data() + 2 * i + 2, byte, 16);
+            valid = ec == std::errc() && ptr == hex.data() + 2 * i + 2;
+            der[i] = static_cast<char>(byte);
+        }
+        if (valid) {
+            this->entries[key] = Entry{expires, der};
+        }
+    }
+}
+
+
+SSL_SESSION *TlsSessionCache::get(const std::string &key) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    auto it = this->entries.find(key);
+    if (it == this->entries.end() || it->second.expires <= std::time(nullptr)) {
+        return nullptr;
+    }
+
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(it->second.der.data());
+    return d2i_SSL_SESSION(nullptr, &data, it->second.der.size());
+}
+
+
+void TlsSessionCache::put(const std::string &key, SSL_SESSION *session) {
+    if (session == nullptr || !SSL_SESSION_is_resumable(session)) {
+        return;
+    }
+
+    int len = i2d_SSL_SESSION(session, nullptr);
+    if (len <= 0) {
+        return;
+    }
+    std::string der(len, '\0');
+    unsigned char *data = reinterpret_cast<unsigned char *>(der.data());
+    i2d_SSL_SESSION(session, &data);
+
+    // lifetime is given by the server (ticket lifetime hint for TLS 1.3)
+    std::time_t expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->entries[key] = Entry{expires, der};
+    this->save();
+}
+
+
+void TlsSessionCache::save() {
+    static const char digits[] = "0123456789abcdef";
+    std::string tmpname = this->filename + ".tmp";
+    std::time_t now = std::time(nullptr);
+    std::error_code ec;
+
+    std::string out;
+    for (const auto &[key, entry] : this->entries) {
+        if (entry.expires <= now) {
+            continue;
+        }
+
+        out += key + " " + std::to_string(entry.expires) + " ";
+        for (unsigned char c : entry.der) {
+            out += digits[c >> 4];
+            out += digits[c & 0xf];
+        }
+        out += "\n";
+    }
+
+    // the file holds session secrets, it is readable only by the owner from the start
+    unlink(tmpname.c_str());
+    int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return; // cache is only an optimization, running without it is fine
+    }
+
+    std::size_t written = 0;
+    while (written < out.size()) {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+
+    if (written < out.size()) {
+        unlink(tmpname.c_str());
+        return;
+    }
+    std::filesystem::rename(tmpname, this->filename, ec);
+}
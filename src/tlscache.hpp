@@ -0,0 +1,74 @@
+/**
+ * @file tlscache.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for TlsSessionCache class
+ *
+ * Stores TLS sessions (including TLS 1.3 tickets) in a file, so the next run can offer them
+ * to the server and resume the session with an abbreviated handshake. Sessions are keyed
+ * by server and port and are dropped when their lifetime given by the server runs out.
+ *
+ * File has one session per line: key, expiry as UNIX time and hex encoded DER of the session.
+ * It contains session secrets, so it is readable by the owner only.
+ */
+
+#ifndef TLSCACHE_HPP
+#define TLSCACHE_HPP
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "openssl/ssl.h"
+
+
+class TlsSessionCache {
+public:
+    /**
+     * @brief Loads sessions from the file, a missing or unreadable file means an empty cache
+     *
+     * @param filename path of the cache file
+     */
+    explicit TlsSessionCache(const std::string &filename);
+
+
+    /**
+     * @brief Default destructor
+     */
+    ~TlsSessionCache() = default;
+
+
+    /**
+     * @brief Returns stored session for the key
+     *
+     * @return session which has to be freed by SSL_SESSION_free(), nullptr when there is no valid one
+     */
+    SSL_SESSION *get(const std::string &key);
+
+
+    /**
+     * @brief Stores session for the key and writes the cache file
+     *
+     * Sessions which cannot be resumed are ignored. Safe to call from several threads at once.
+     */
+    void put(const std::string &key, SSL_SESSION *session);
+
+private:
+    struct Entry {
+        std::time_t expires;    // time after which the session is not offered
+        std::string der;        // serialized session
+    };
+
+    std::mutex mutex;
+    std::string filename;
+    std::map<std::string, Entry> entries;
+
+
+    /**
+     * @brief Writes all valid sessions to a temporary file and renames it over the cache file
+     */
+    void save();
+};
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file transporterror.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for TransportError class
+ *
+ * Errors of the connection itself, as opposed to errors reported by the server or the
+ * disk. The session can continue on a new connection after them: the client reconnects
+ * with exponential backoff, selects the mailbox again and continues from the messages
+ * its index already has.
+ */
+
+#ifndef TRANSPORTERROR_HPP
+#define TRANSPORTERROR_HPP
+
+#include <stdexcept>
+
+#define RECONNECT_RETRIES 5     // default number of reconnection attempts without progress in between
+#define RECONNECT_BACKOFF_MIN 1 // seconds before the first reconnection attempt
+#define RECONNECT_BACKOFF_MAX 60 // maximal seconds between reconnection attempts
+
+
+class TransportError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+#endif
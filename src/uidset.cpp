@@ -0,0 +1,202 @@
+/**
+ * @file uidset.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of UidSet class
+ */
+
+#include "uidset.hpp"
+
+#include <algorithm>
+#include <charconv>
+
+
+void UidSet::add(unsigned long uid) {
+    this->add(uid, uid);
+}
+
+
+void UidSet::add(unsigned long first, unsigned long last) {
+    if (first > last) {
+        std::swap(first, last);
+    }
+
+    // fast path, extending or appending after the last interval
+    if (this->intervals.empty() || first > this->intervals.back().second) {
+        if (!this->intervals.empty() && first == this->intervals.back().second + 1) {
+            this->intervals.back().second = last;
+        }
+        else {
+            this->intervals.emplace_back(first, last);
+        }
+        return;
+    }
+
+    // find the first interval that can touch the new one and merge all overlapping ones
+    auto it = std::lower_bound(this->intervals.begin(), this->intervals.end(), first,
+                               [](const Interval &i, unsigned long uid) { return i.second + 1 < uid; });
+    auto end = it;
+    while (end != this->intervals.end() && end->first <= last + 1) {
+        first = std::min(first, end->first);
+        last = std::max(last, end->second);
+        end++;
+    }
+
+    if (it == end) {
+        this->intervals.insert(it, Interval{first, last});
+    }
+    else {
+        *it = Interval{first, last};
+        this->intervals.erase(it + 1, end);
+    }
+}
+
+
+void UidSet::add(std::string_view set) {
+    while (!set.empty()) {
+        std::string_view part = set.substr(0, set.find(','));
+        set.remove_prefix(std::min(set.size(), part.size() + 1));
+
+        unsigned long first = 0, last = 0;
+        auto [end, ec] = std::from_chars(part.data(), part.data() + part.size(), first);
+        if (ec != std::errc()) {
+            continue;
+        }
+        last = first;
+        if (end != part.data() + part.size()) {
+            if (*end != ':' || std::from_chars(end + 1, part.data() + part.size(), last).ec != std::errc()) {
+                continue;
+            }
+        }
+        this->add(first, last);
+    }
+}
+
+
+bool UidSet::contains(unsigned long uid) const {
+    auto it = std::lower_bound(this->intervals.begin(), this->intervals.end(), uid,
+                               [](const Interval &i, unsigned long uid) { return i.second < uid; });
+    return it != this->intervals.end() && it->first <= uid;
+}
+
+
+void UidSet::remove(unsigned long uid) {
+    auto it = std::lower_bound(this->intervals.begin(), this->intervals.end(), uid,
+                               [](const Interval &i, unsigned long uid) { return i.second < uid; });
+    if (it == this->intervals.end() || it->first > uid) {
+        return;
+    }
+
+    if (it->first == it->second) {
+        this->intervals.erase(it);
+    }
+    else if (it->first == uid) {
+        it->first++;
+    }
+    else if (it->second == uid) {
+        it->second--;
+    }
+    else {
+        // split the interval in two
+        Interval upper{uid + 1, it->second};
+        it->second = uid - 1;
+        this->intervals.insert(it + 1, upper);
+    }
+}
+
+
+void UidSet::remove(const UidSet &other) {
+    std::vector<Interval> rest;
+    auto o = other.intervals.begin();
+
+    for (const Interval &i : this->intervals) {
+        // intervals of the other set below this one cannot touch the following ones either
+        while (o != other.intervals.end() && o->second < i.first) {
+            o++;
+        }
+
+        unsigned long first = i.first;
+        bool covered = false;
+        for (auto p = o; p != other.intervals.end() && p->first <= i.second; p++) {
+            if (p->first > first) {
+                rest.emplace_back(first, p->first - 1);
+            }
+            if (p->second >= i.second) {
+                covered = true;
+                break;
+            }
+            first = p->second + 1;
+        }
+
+        if (!covered) {
+            rest.emplace_back(first, i.second);
+        }
+    }
+    this->intervals = std::move(rest);
+}
+
+
+unsigned long UidSet::count() const {
+    unsigned long n = 0;
+    for (const Interval &i : this->intervals) {
+        n += i.second - i.first + 1;
+    }
+    return n;
+}
+
+
+void UidSet::appendInterval(std::string &out, unsigned long first, unsigned long last) {
+    if (!out.empty()) {
+        out += ',';
+    }
+    out += std::to_string(first);
+    if (last != first) {
+        out += ':' + std::to_string(last);
+    }
+}
+
+
+std::string UidSet::toString() const {
+    std::string out;
+    for (const Interval &i : this->intervals) {
+        appendInterval(out, i.first, i.second);
+    }
+    return out;
+}
+
+
+std::vector<std::string> UidSet::batches(unsigned long max_uids) const {
+    std::vector<std::string> out;
+    std::string current;
+    unsigned long in_current = 0;
+
+    for (const Interval &i : this->intervals) {
+        unsigned long first = i.first;
+
+        while (first <= i.second) {
+            unsigned long last = i.second;
+            if (max_uids && last - first + 1 > max_uids - in_current) {
+                last = first + (max_uids - in_current) - 1;
+            }
+
+            appendInterval(current, first, last);
+            in_current += last - first + 1;
+
+            if (max_uids && in_current == max_uids) {
+                out.push_back(current);
+                current.clear();
+                in_current = 0;
+            }
+
+            if (last == i.second) {
+                break;
+            }
+            first = last + 1;
+        }
+    }
+
+    if (!current.empty()) {
+        out.push_back(current);
+    }
+    return out;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file uidset.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for UidSet class
+ *
+ * Set of message UIDs kept as a sorted list of disjoint closed intervals, so a run of
+ * consecutive UIDs takes the same memory as a single one. Can be written out as IMAP
+ * sequence-sets (RFC 3501, e.g. "3:17,20,25:40").
+ */
+
+#ifndef UIDSET_HPP
+#define UIDSET_HPP
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+class UidSet {
+public:
+    using Interval = std::pair<unsigned long, unsigned long>; // first and last UID, both included
+
+    UidSet() = default;
+    ~UidSet() = default;
+
+
+    /**
+     * @brief Adds a single UID, adding UIDs in ascending order is the fast path
+     */
+    void add(unsigned long uid);
+
+
+    /**
+     * @brief Adds all UIDs from first to last, both included
+     */
+    void add(unsigned long first, unsigned long last);
+
+
+    /**
+     * @brief Removes a single UID
+     */
+    void remove(unsigned long uid);
+
+
+    /**
+     * @brief Removes all UIDs of the other set, in time linear in the number of intervals of both
+     */
+    void remove(const UidSet &other);
+
+
+    /**
+     * @brief Adds all UIDs of a sequence-set, '*' and malformed parts are skipped
+     */
+    void add(std::string_view set);
+
+
+    /**
+     * @brief Whether the UID is in the set
+     */
+    bool contains(unsigned long uid) const;
+
+
+    /**
+     * @brief Removes all UIDs
+     */
+    void clear() { this->intervals.clear(); }
+
+
+    bool empty() const { return this->intervals.empty(); }
+
+
+    /**
+     * @brief Lowest UID of a non-empty set
+     */
+    unsigned long front() const { return this->intervals.front().first; }
+
+
+    /**
+     * @brief Highest UID of a non-empty set
+     */
+    unsigned long back() const { return this->intervals.back().second; }
+
+
+    /**
+     * @brief Number of UIDs in the set
+     */
+    unsigned long count() const;
+
+
+    /**
+     * @brief Compacted intervals in ascending order
+     */
+    const std::vector<Interval> &ranges() const { return this->intervals; }
+
+
+    /**
+     * @brief Whole set as one sequence-set
+     */
+    std::string toString() const;
+
+
+    /**
+     * @brief Splits the set into sequence-sets, each covering at most max_uids UIDs
+     *
+     * @param max_uids maximal number of UIDs in one sequence-set, 0 means no limit
+     */
+    std::vector<std::string> batches(unsigned long max_uids) const;
+
+private:
+    std::vector<Interval> intervals;
+
+
+    /**
+     * @brief Appends interval to a sequence-set being built
+     */
+    static void appendInterval(std::string &out, unsigned long first, unsigned long last);
+};
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * @file uidtracker.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Definition of UidTracker class
+ */
+
+#include "uidtracker.hpp"
+
+#include <algorithm>
+
+UidTracker::UidTracker(const UidSet &uids, StateIndex &index) :
+    outstanding{uids},
+    last{uids.empty() ? 0 : uids.back()},
+    // UIDs missing below the stored UIDNEXT fill gaps, they never move it back
+    uidnext{uids.empty() ? 1 : std::max<unsigned long>(uids.front(), index.uidnext())},
+    index{index}
+{ /* empty body */ }
+
+
+void UidTracker::commit(unsigned long uid) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->outstanding.remove(uid);
+    unsigned long lowest = this->outstanding.empty() ? this->last + 1 : this->outstanding.front();
+    if (lowest <= this->uidnext) {
+        return;
+    }
+
+    this->index.setUidnext(lowest);
+    this->uidnext = lowest;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file uidtracker.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Header file for UidTracker class
+ *
+ * Keeps UIDNEXT of the state index consistent when messages are downloaded out of order by
+ * several connections. The stored value is advanced only up to the lowest UID that is still
+ * not downloaded, so no message is skipped by the next run if this one is interrupted.
+ * It is never moved back, UIDs below it are gaps filled by a reconciling run.
+ */
+
+#ifndef UIDTRACKER_HPP
+#define UIDTRACKER_HPP
+
+#include <mutex>
+
+#include "uidset.hpp"
+#include "stateindex.hpp"
+
+
+class UidTracker {
+public:
+    /**
+     * @brief Constructs tracker of the given UIDs
+     *
+     * @param uids UIDs that are going to be downloaded
+     * @param index state index of the mailbox
+     */
+    UidTracker(const UidSet &uids, StateIndex &index);
+
+
+    /**
+     * @brief Default destructor
+     */
+    ~UidTracker() = default;
+
+
+    /**
+     * @brief Marks UID as downloaded, updates UIDNEXT of the index if the lowest missing UID moved
+     *
+     * Safe to call from several threads at once.
+     */
+    void commit(unsigned long uid);
+
+private:
+    std::mutex mutex;
+    UidSet outstanding;     // UIDs not downloaded yet
+    unsigned long last;     // highest tracked UID
+    unsigned long uidnext;  // value last written to the index
+    StateIndex &index;      // state index of the mailbox
+};
+
+#endif
@@ -0,0 +1,69 @@
+/**
+ * @file bytescan_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of ByteScan class
+ */
+
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "../src/bytescan.hpp"
+
+
+// every implementation the CPU supports finds the same byte as the scalar one
+TEST(ByteScan, AgreesWithScalar) {
+    std::mt19937 rng(42);
+    const std::string alphabet = "abc \r\n{}()\"\\[]~+0123456789";
+
+    for (int round = 0; round < 20000; round++) {
+        // random length around the vector widths, so all tails are covered
+        std::size_t len = rng() % 200;
+        std::string data(len + 64, 'x');
+        for (char &c : data) {
+            c = (rng() % 4 == 0) ? alphabet[rng() % alphabet.size()] : 'a' + rng() % 26;
+        }
+        std::size_t offset = rng() % 64;
+
+        std::string set;
+        std::size_t n = 1 + rng() % BYTESCAN_MAX_SET;
+        for (std::size_t i = 0; i < n; i++) {
+            set += alphabet[rng() % alphabet.size()];
+        }
+
+        const char *begin = data.data() + offset;
+        const char *end = begin + len;
+        const char *expected = ByteScan::findAny(ByteScan::Level::SCALAR, begin, end, set);
+
+        for (auto level : {ByteScan::Level::SSE2, ByteScan::Level::AVX2}) {
+            if (level > ByteScan::supported()) {
+                continue;
+            }
+            const char *found = ByteScan::findAny(level, begin, end, set);
+            ASSERT_EQ(found - begin, expected - begin) << ByteScan::levelName(level) << ": length " << len
+                                                       << ", offset " << offset << ", set \"" << set << "\"";
+        }
+    }
+}
+
+
+TEST(ByteScan, ReportsActiveLevel) {
+    std::string data = "abc\r\n";
+
+    // the first search picks the best implementation
+    EXPECT_EQ(ByteScan::findAny(data.data(), data.data() + data.size(), "\n"), data.data() + 4);
+    EXPECT_EQ(ByteScan::level(), ByteScan::supported());
+
+    ByteScan::setLevel(ByteScan::Level::SCALAR);
+    EXPECT_EQ(ByteScan::level(), ByteScan::Level::SCALAR);
+    EXPECT_EQ(ByteScan::findAny(data.data(), data.data() + data.size(), "\r\n"), data.data() + 3);
+
+    if (ByteScan::supported() < ByteScan::Level::AVX2) {
+        EXPECT_THROW(ByteScan::setLevel(ByteScan::Level::AVX2), std::invalid_argument);
+    }
+    ByteScan::setLevel(ByteScan::supported());
+    EXPECT_EQ(ByteScan::level(), ByteScan::supported());
+}
@@ -0,0 +1,91 @@
+/**
+ * @file catalog_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of Catalog class
+ */
+
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/catalog.hpp"
+#include "tempdir.hpp"
+
+
+static CatalogRow row(uint64_t uid, uint64_t size, uint32_t flags, const std::string &from, const std::string &subject) {
+    CatalogRow r{uid, size, 1704103200 + static_cast<int64_t>(uid) * 86400, flags, from, "dest@example.com", subject, "", ""};
+    r.message_id = "<" + std::to_string(uid) + "@example.com>";
+    return r;
+}
+
+
+static unsigned long query(const std::string &dir, const CatalogFilter &filter, std::string *out = nullptr) {
+    std::ostringstream os;
+    unsigned long n = Catalog::query(dir, "INBOX.test", filter, os);
+    if (out != nullptr) {
+        *out = os.str();
+    }
+    return n;
+}
+
+
+TEST(Catalog, FiltersRows) {
+    TempDir dir;
+    {
+        Catalog catalog(dir.path(), "INBOX.test");
+        EXPECT_FALSE(catalog.validate(777));
+        catalog.append({row(1, 100, CATALOG_SEEN, "Alice <alice@example.com>", "Report"),
+                        row(2, 5000, CATALOG_FLAGGED, "Bob <bob@example.com>", "Lunch")});
+        catalog.append({row(5, 20000, CATALOG_SEEN | CATALOG_FLAGGED, "alice@example.com", "Weekly report")});
+        EXPECT_EQ(catalog.uidnext(), 6UL);
+    }
+
+    std::string out;
+    EXPECT_EQ(query(dir.path(), CatalogFilter{}), 3UL);
+
+    CatalogFilter filter;
+    filter.from = "ALICE";
+    filter.subject = "report";
+    EXPECT_EQ(query(dir.path(), filter), 2UL);
+
+    filter = CatalogFilter{};
+    filter.larger = 1000;
+    filter.unflagged = CATALOG_SEEN;
+    ASSERT_EQ(query(dir.path(), filter, &out), 1UL);
+    EXPECT_EQ(out, "2\t2024-01-03T10:00:00Z\t5000\t\\Flagged\tBob <bob@example.com>\tdest@example.com\tLunch\t<2@example.com>\n");
+
+    filter = CatalogFilter{};
+    filter.since = Catalog::parseDay("2024-01-03");
+    filter.before = Catalog::parseDay("2024-01-05");
+    EXPECT_EQ(query(dir.path(), filter), 1UL);
+}
+
+
+TEST(Catalog, StartsOverOnUidvalidityChange) {
+    TempDir dir;
+    Catalog catalog(dir.path(), "INBOX.test");
+    catalog.validate(1);
+    catalog.append({row(1, 100, 0, "a", "b")});
+    EXPECT_TRUE(catalog.validate(1));
+    EXPECT_FALSE(catalog.validate(2));
+    EXPECT_EQ(catalog.uidnext(), 1UL);
+    EXPECT_EQ(query(dir.path(), CatalogFilter{}), 0UL);
+}
+
+
+TEST(Catalog, ParsesFetchedValues) {
+    CatalogRow r{};
+    Catalog::parseHeader("From: Alice\r\n <alice@example.com>\r\nSubject: Hi\r\nsubject: again\r\nX-Other: x\r\n\r\n", r);
+    EXPECT_EQ(r.from, "Alice <alice@example.com>");
+    EXPECT_EQ(r.subject, "Hi");
+
+    EXPECT_EQ(Catalog::parseFlags("(\\Seen \\Draft $Junk)"), static_cast<uint32_t>(CATALOG_SEEN | CATALOG_DRAFT));
+    EXPECT_EQ(Catalog::parseInternalDate("\" 1-Jan-2024 12:00:00 +0200\""), 1704103200);
+    EXPECT_EQ(Catalog::parseInternalDate("garbage"), 0);
+    EXPECT_EQ(Catalog::flagBit("flagged"), static_cast<uint32_t>(CATALOG_FLAGGED));
+    EXPECT_THROW(Catalog::flagBit("junk"), std::invalid_argument);
+    EXPECT_THROW(Catalog::parseDay("2024-13-01"), std::invalid_argument);
+}
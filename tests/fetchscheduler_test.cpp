@@ -0,0 +1,70 @@
+/**
+ * @file fetchscheduler_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of FetchScheduler class
+ */
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/fetchscheduler.hpp"
+#include "../src/uidset.hpp"
+
+
+using Sizes = std::vector<std::pair<unsigned long, uint64_t>>;
+
+
+TEST(FetchScheduler, BatchesSmallAndIsolatesLarge) {
+    Sizes sizes;
+    for (unsigned long uid = 1; uid <= 10; uid++) {
+        sizes.emplace_back(uid, uid == 4 ? 5 * SCHEDULE_LARGE : 1000);
+    }
+    FetchScheduler scheduler(sizes, 1, 100);
+
+    std::string set;
+    ASSERT_TRUE(scheduler.next(0, false, set));
+    EXPECT_EQ(set, "1:3,5:10");
+
+    // the large message waits until the connection has nothing in flight
+    EXPECT_FALSE(scheduler.next(0, true, set));
+    ASSERT_TRUE(scheduler.next(0, false, set));
+    EXPECT_EQ(set, "4");
+    EXPECT_FALSE(scheduler.next(0, false, set));
+}
+
+
+TEST(FetchScheduler, SharesWorkAmongConnections) {
+    Sizes sizes;
+    for (unsigned long uid = 1; uid <= 100; uid++) {
+        sizes.emplace_back(uid, 1000);
+    }
+    FetchScheduler scheduler(sizes, 4, 10);
+
+    // every connection gets work, an idle one takes over from the others and nothing is given twice
+    UidSet taken;
+    unsigned long items = 0;
+    unsigned long messages = 0;
+    std::string set;
+    for (unsigned int connection = 0; connection < 4; connection++) {
+        ASSERT_TRUE(scheduler.next(connection, false, set));
+        taken.add(set);
+        UidSet batch;
+        batch.add(set);
+        messages += batch.count();
+        items++;
+    }
+    while (scheduler.next(0, false, set)) {
+        taken.add(set);
+        UidSet batch;
+        batch.add(set);
+        messages += batch.count();
+        items++;
+    }
+    EXPECT_EQ(items, 10UL);
+    EXPECT_EQ(messages, 100UL);
+    EXPECT_EQ(taken.toString(), "1:100");
+}
@@ -0,0 +1,84 @@
+/**
+ * @file fulltext_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of FullTextIndex class
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/fulltext.hpp"
+#include "tempdir.hpp"
+
+
+using Uids = std::vector<uint64_t>;
+
+
+static Uids search(const std::string &dir, const std::vector<std::string> &query) {
+    return FullTextIndex::search(dir, "INBOX.test", query);
+}
+
+
+TEST(FullTextIndex, Tokenizes) {
+    std::vector<std::string> expected{"hello", "world", "42", "příliš", "x"};
+    EXPECT_EQ(FullTextIndex::tokens("Hello, WORLD-42 příliš x"), expected);
+    EXPECT_TRUE(FullTextIndex::tokens(std::string(FULLTEXT_MAX_TOKEN + 1, 'a')).empty());
+}
+
+
+TEST(FullTextIndex, FindsTermsAndPhrases) {
+    TempDir dir;
+    {
+        FullTextIndex index(dir.path(), "INBOX.test");
+        index.validate(777);
+        index.add(1, "Subject: quarterly report\r\n\r\nThe budget is ready.\r\n");
+        index.add(2, "Subject: lunch\r\n\r\nIs the report ready for the budget?\r\n");
+        index.add(3, "Subject: =?UTF-8?Q?Caf=C3=A9?=\r\nContent-Type: text/html\r\n\r\n<p>cafe <b>menu</b></p>\r\n");
+    }
+
+    EXPECT_EQ(search(dir.path(), {"report"}), (Uids{1, 2}));
+    EXPECT_EQ(search(dir.path(), {"budget", "ready"}), (Uids{1, 2}));
+    EXPECT_EQ(search(dir.path(), {"budget is ready"}), (Uids{1}));
+    EXPECT_EQ(search(dir.path(), {"café"}), (Uids{3}));
+    EXPECT_EQ(search(dir.path(), {"menu"}), (Uids{3}));
+    EXPECT_TRUE(search(dir.path(), {"p"}).empty());
+    EXPECT_TRUE(search(dir.path(), {"missing"}).empty());
+}
+
+
+TEST(FullTextIndex, MergesSegments) {
+    TempDir dir;
+    for (uint64_t uid = 1; uid <= 8; uid++) {
+        FullTextIndex index(dir.path(), "INBOX.test");
+        index.validate(1);
+        index.add(uid, "Subject: word" + std::to_string(uid) + "\r\n\r\ncommon text\r\n");
+    }
+
+    FullTextIndex index(dir.path(), "INBOX.test");
+    index.validate(1);
+    EXPECT_EQ(index.covered().toString(), "1:8");
+    EXPECT_EQ(search(dir.path(), {"common"}).size(), 8UL);
+    EXPECT_EQ(search(dir.path(), {"word5"}), (Uids{5}));
+
+    // a covered message is not indexed again
+    index.add(5, "Subject: other\r\n\r\n");
+    index.flush();
+    EXPECT_TRUE(search(dir.path(), {"other"}).empty());
+}
+
+
+TEST(FullTextIndex, DropsSegmentsOfOtherUidvalidity) {
+    TempDir dir;
+    {
+        FullTextIndex index(dir.path(), "INBOX.test");
+        index.validate(1);
+        index.add(1, "Subject: old\r\n\r\n");
+    }
+
+    FullTextIndex index(dir.path(), "INBOX.test");
+    index.validate(2);
+    EXPECT_TRUE(index.covered().empty());
+}
@@ -0,0 +1,286 @@
+/**
+ * @file imapsession_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of ImapSession class against a scripted server, also an example of the event loop
+ */
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "../src/imapsession.hpp"
+#include "../src/transporterror.hpp"
+
+
+static std::string message(unsigned long uid) {
+    return "Subject: message " + std::to_string(uid) + "\r\n\r\nbody {5}\r\n)" + std::string(uid * 1000, 'x') + "\r\n";
+}
+
+
+/**
+ * @brief Server on 127.0.0.1 answering one connection with messages 1, 2, 3, 5 and 8 in INBOX
+ *
+ * UID SEARCH UNSEEN is never answered, it keeps its task waiting.
+ */
+class ScriptedServer {
+public:
+    ScriptedServer() {
+        this->listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(this->listener, reinterpret_cast<sockaddr *>(&addr), len) != 0 || listen(this->listener, 1) != 0
+            || getsockname(this->listener, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+            throw std::runtime_error("Cannot start the server.");
+        }
+        this->port = ntohs(addr.sin_port);
+        this->thread = std::thread([this]() { this->serve(); });
+    }
+
+    ~ScriptedServer() {
+        shutdown(this->listener, SHUT_RDWR);
+        this->thread.join();
+        close(this->listener);
+    }
+
+    int port;
+
+private:
+    int listener;
+    std::thread thread;
+
+    void serve() {
+        int fd = accept(this->listener, nullptr, nullptr);
+        if (fd < 0) {
+            return;
+        }
+
+        std::string in;
+        auto reply = [fd](const std::string &data) { return ::send(fd, data.data(), data.size(), MSG_NOSIGNAL) >= 0; };
+        reply("* OK scripted server ready\r\n");
+
+        while (true) {
+            std::size_t eol;
+            while ((eol = in.find("\r\n")) == std::string::npos) {
+                char chunk[4096];
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) {
+                    close(fd);
+                    return;
+                }
+                in.append(chunk, n);
+            }
+            std::string line = in.substr(0, eol);
+            in.erase(0, eol + 2);
+
+            std::string tag = line.substr(0, line.find(' '));
+            std::string cmd = line.substr(tag.size() + 1);
+            std::string out;
+            if (cmd.starts_with("LOGIN")) {
+                out = tag + (cmd == "LOGIN \"user\" \"secret\"" ? " OK logged in\r\n" : " NO wrong password\r\n");
+            }
+            else if (cmd.starts_with("SELECT")) {
+                out = "* 5 EXISTS\r\n* OK [UIDVALIDITY 42] ok\r\n* OK [UIDNEXT 9] ok\r\n" + tag + " OK [READ-WRITE] selected\r\n";
+            }
+            else if (cmd == "UID SEARCH UNSEEN") {
+                continue;
+            }
+            else if (cmd.starts_with("UID SEARCH")) {
+                out = "* SEARCH 1 2 3 5 8\r\n" + tag + " OK search\r\n";
+            }
+            else if (cmd.starts_with("UID FETCH")) {
+                UidSet uids;
+                uids.add(std::string_view(cmd).substr(10, cmd.find(' ', 10) - 10));
+                unsigned long seq = 0;
+                for (unsigned long uid : {1UL, 2UL, 3UL, 5UL, 8UL}) {
+                    seq++;
+                    if (uids.contains(uid)) {
+                        std::string msg = message(uid);
+                        out += "* " + std::to_string(seq) + " FETCH (UID " + std::to_string(uid) + " BODY[] {"
+                               + std::to_string(msg.size()) + "}\r\n" + msg + ")\r\n";
+                    }
+                }
+                out += tag + " OK fetch\r\n";
+            }
+            else if (cmd == "LOGOUT") {
+                reply("* BYE\r\n" + tag + " OK bye\r\n");
+                close(fd);
+                return;
+            }
+            else {
+                out = tag + " BAD unknown command\r\n";
+            }
+            if (!reply(out)) {
+                close(fd);
+                return;
+            }
+        }
+    }
+};
+
+
+/**
+ * @brief Collects the messages
+ */
+class Collector : public MessageSink {
+public:
+    std::map<unsigned long, std::string> messages;
+    std::string current;
+
+    void begin(unsigned long /*uid*/, std::size_t size) override {
+        this->current.clear();
+        this->current.reserve(size);
+    }
+    void data(std::string_view data) override {
+        this->current += data;
+    }
+    void end(unsigned long uid) override {
+        this->messages[uid] = std::move(this->current);
+    }
+};
+
+
+// drives the session until the task finishes, as the event loop of an embedding program would
+template <typename T>
+static T run(ImapSession &session, ImapTask<T> task) {
+    task.start();
+    while (!task.done()) {
+        pollfd pfd{session.socket(), static_cast<short>(POLLIN | (session.wantsWrite() ? POLLOUT : 0)), 0};
+        if (poll(&pfd, 1, 5000) <= 0) {
+            throw std::runtime_error("The session does not progress.");
+        }
+        session.handleEvent();
+    }
+    return task.result();
+}
+
+
+static ImapTask<unsigned long> download(ImapSession &session, MessageSink &sink, std::string password) {
+    co_await session.connect();
+    co_await session.login("user", password);
+    MailboxStatus status = co_await session.select("INBOX");
+    EXPECT_EQ(status.uidvalidity, 42UL);
+    EXPECT_EQ(status.uidnext, 9UL);
+    EXPECT_EQ(status.exists, 5UL);
+
+    unsigned long n = co_await session.fetch(co_await session.search("ALL"), sink);
+    co_await session.logout();
+    co_return n;
+}
+
+
+class ImapSessionTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        signal(SIGPIPE, SIG_IGN);
+    }
+};
+
+
+TEST_F(ImapSessionTest, FetchesWithPipelinedCommands) {
+    ScriptedServer server;
+    SessionOptions options;
+    options.server = "localhost";
+    options.port = server.port;
+    options.address = ImapSession::resolve("127.0.0.1", server.port);
+    options.fetch_batch = 2;
+    ImapSession session(options);
+    Collector sink;
+
+    EXPECT_EQ(run(session, download(session, sink, "secret")), 5UL);
+    EXPECT_TRUE(session.closed());
+    ASSERT_EQ(sink.messages.size(), 5UL);
+    for (const auto &[uid, data] : sink.messages) {
+        EXPECT_EQ(data, message(uid)) << "UID " << uid;
+    }
+}
+
+
+// the name is never looked up when the address is given
+TEST_F(ImapSessionTest, ConnectsToGivenAddress) {
+    ScriptedServer server;
+    SessionOptions options;
+    options.server = "imap.invalid";
+    options.port = server.port;
+    options.address = "127.0.0.1:" + std::to_string(server.port);
+    ImapSession session(options);
+    Collector sink;
+
+    EXPECT_EQ(run(session, download(session, sink, "secret")), 5UL);
+    EXPECT_THROW(ImapSession::resolve("imap.invalid", 143), TransportError);
+}
+
+
+static ImapTask<> open(ImapSession &session) {
+    co_await session.connect();
+    co_await session.login("user", "secret");
+    co_await session.select("INBOX");
+}
+
+
+// the connection breaks when the first task sends its second command
+static ImapTask<> searchTwice(ImapSession &session) {
+    co_await session.search("ALL");
+    shutdown(session.socket(), SHUT_WR);
+    co_await session.search("ALL");
+}
+
+
+static ImapTask<> searchUnseen(ImapSession &session) {
+    co_await session.search("UNSEEN");
+}
+
+
+TEST_F(ImapSessionTest, FailsAllTasksOfBrokenSession) {
+    ScriptedServer server;
+    SessionOptions options;
+    options.server = "localhost";
+    options.port = server.port;
+    options.address = "127.0.0.1:" + std::to_string(server.port);
+    ImapSession session(options);
+    run(session, open(session));
+
+    ImapTask<> waiting = searchUnseen(session);
+    ImapTask<> failing = searchTwice(session);
+    waiting.start();
+    failing.start();
+
+    // a task left waiting would keep the loop going until the limit
+    for (int i = 0; i < 100 && !(waiting.done() && failing.done()); i++) {
+        pollfd pfd{session.socket(), POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        session.handleEvent();
+    }
+
+    ASSERT_TRUE(failing.done());
+    ASSERT_TRUE(waiting.done());
+    EXPECT_THROW(failing.result(), TransportError);
+    EXPECT_THROW(waiting.result(), TransportError);
+    EXPECT_TRUE(session.closed());
+}
+
+
+TEST_F(ImapSessionTest, ReportsRefusedLogin) {
+    ScriptedServer server;
+    SessionOptions options;
+    options.server = "localhost";
+    options.port = server.port;
+    options.address = "127.0.0.1:" + std::to_string(server.port);
+    ImapSession session(options);
+    Collector sink;
+
+    EXPECT_THROW(run(session, download(session, sink, "wrong")), std::runtime_error);
+    EXPECT_TRUE(sink.messages.empty());
+}
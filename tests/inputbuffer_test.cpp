@@ -0,0 +1,66 @@
+/**
+ * @file inputbuffer_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of InputBuffer class
+ */
+
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "../src/inputbuffer.hpp"
+
+
+// writes the data as if received from the socket
+static void receive(InputBuffer &buff, const std::string &data) {
+    std::memcpy(buff.prepare(data.size()), data.data(), data.size());
+    buff.commit(data.size());
+}
+
+
+TEST(InputBuffer, ExtractsLinesWithCrlf) {
+    InputBuffer buff(16);
+    std::string_view line;
+
+    receive(buff, "A1 OK done\r\n* 3 EX");
+    ASSERT_TRUE(buff.getLine(line));
+    EXPECT_EQ(line, "A1 OK done\r\n");
+    EXPECT_FALSE(buff.getLine(line));
+
+    // the rest of the line arrives later, the lone LF is not a line end
+    receive(buff, "ISTS\n more\r\n");
+    ASSERT_TRUE(buff.getLine(line));
+    EXPECT_EQ(line, "* 3 EXISTS\n more\r\n");
+    EXPECT_TRUE(buff.empty());
+}
+
+
+TEST(InputBuffer, GrowsForLongLines) {
+    InputBuffer buff(8);
+    std::string long_line(1000, 'x');
+    long_line += "\r\n";
+
+    for (std::size_t i = 0; i < long_line.size(); i += 7) {
+        receive(buff, long_line.substr(i, 7));
+    }
+
+    std::string_view line;
+    ASSERT_TRUE(buff.getLine(line));
+    EXPECT_EQ(line, long_line);
+}
+
+
+TEST(InputBuffer, ConsumesLiterals) {
+    InputBuffer buff(32);
+    receive(buff, "0123456789tail\r\n");
+
+    EXPECT_EQ(buff.peek(4), "0123");
+    buff.consume(10);
+    EXPECT_EQ(buff.size(), 6UL);
+    EXPECT_EQ(buff.peek(100), "tail\r\n");
+
+    buff.clear();
+    EXPECT_TRUE(buff.empty());
+}
@@ -0,0 +1,146 @@
+/**
+ * @file packstore_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of PackStore class
+ */
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "../src/packstore.hpp"
+#include "tempdir.hpp"
+
+
+static std::string message(uint64_t uid) {
+    return "Subject: message " + std::to_string(uid) + "\r\n\r\n" + std::string(uid * 10, 'x');
+}
+
+
+static void store(PackStore &pack, uint64_t uid) {
+    std::string data = message(uid);
+    PackSegment *segment = pack.begin(uid, data.size());
+    pack.write(segment, data.data(), data.size());
+    pack.commit(segment);
+}
+
+
+static std::string extract(const std::string &dir, uint64_t uid) {
+    std::ostringstream os;
+    PackStore::extract(dir, "INBOX.test", uid, os);
+    return os.str();
+}
+
+
+TEST(PackStore, ExtractsStoredMessages) {
+    TempDir dir;
+    {
+        PackStore pack(dir.path(), "INBOX.test", 1024);
+        for (uint64_t uid : {5, 1, 1000000, 3}) {
+            store(pack, uid);
+        }
+    }
+
+    // messages appended in any order are found, also after the store was opened again
+    for (int run = 0; run < 2; run++) {
+        for (uint64_t uid : {1, 3, 5, 1000000}) {
+            EXPECT_EQ(extract(dir.path(), uid), message(uid)) << "UID " << uid;
+        }
+        PackStore reopened(dir.path(), "INBOX.test", 1024);
+        store(reopened, 7);
+    }
+    EXPECT_EQ(extract(dir.path(), 7), message(7));
+    EXPECT_THROW(extract(dir.path(), 2), std::runtime_error);
+}
+
+
+// entries in the sorted part of the index, the counter follows magic, version and entry size
+static uint64_t sortedEntries(const std::string &dir) {
+    std::ifstream index(dir + "/INBOX.test.packidx", std::ios::binary);
+    uint64_t sorted = 0;
+    index.seekg(16);
+    index.read(reinterpret_cast<char *>(&sorted), sizeof(sorted));
+    return sorted;
+}
+
+
+TEST(PackStore, MergesIndexOfStoreNeverReopened) {
+    TempDir dir;
+    const uint64_t count = 3 * PACK_INDEX_TAIL;
+    {
+        PackStore pack(dir.path(), "INBOX.test", 1024 * 1024 * 1024);
+        for (uint64_t uid = 1; uid <= count; uid++) {
+            std::string data = std::to_string(uid);
+            PackSegment *segment = pack.begin(uid, data.size());
+            pack.write(segment, data.data(), data.size());
+            pack.commit(segment);
+        }
+        pack.remove(7);
+
+        // while the store is open a lookup reads at most one block of appended entries
+        EXPECT_GE(sortedEntries(dir.path()), count - PACK_INDEX_TAIL);
+        EXPECT_EQ(extract(dir.path(), count), std::to_string(count));
+        EXPECT_EQ(extract(dir.path(), 1), "1");
+    }
+
+    // closing merged the rest, the index is sorted without reopening the store
+    EXPECT_EQ(sortedEntries(dir.path()), count - 1);
+    EXPECT_EQ(std::filesystem::file_size(dir.path() + "/INBOX.test.packidx"), 24 + (count - 1) * 32);
+    EXPECT_EQ(extract(dir.path(), 8), "8");
+    EXPECT_THROW(extract(dir.path(), 7), std::runtime_error);
+}
+
+
+TEST(PackStore, RemovesAndAborts) {
+    TempDir dir;
+    {
+        PackStore pack(dir.path(), "INBOX.test", 1024);
+        store(pack, 1);
+        store(pack, 2);
+        pack.remove(1);
+
+        std::string data = message(3);
+        PackSegment *segment = pack.begin(3, data.size());
+        pack.write(segment, data.data(), 5);
+        pack.abort(segment);
+    }
+
+    EXPECT_THROW(extract(dir.path(), 1), std::runtime_error);
+    EXPECT_THROW(extract(dir.path(), 3), std::runtime_error);
+    EXPECT_EQ(extract(dir.path(), 2), message(2));
+}
+
+
+TEST(PackStore, ClearDropsEverything) {
+    TempDir dir;
+    {
+        PackStore pack(dir.path(), "INBOX.test", 1024);
+        store(pack, 1);
+        pack.clear();
+        store(pack, 2);
+    }
+
+    EXPECT_THROW(extract(dir.path(), 1), std::runtime_error);
+    EXPECT_EQ(extract(dir.path(), 2), message(2));
+}
+
+
+TEST(PackStore, RollsSegmentsOver) {
+    TempDir dir;
+    {
+        PackStore pack(dir.path(), "INBOX.test", 300);
+        for (uint64_t uid = 1; uid <= 20; uid++) {
+            store(pack, uid);
+        }
+    }
+
+    EXPECT_TRUE(std::filesystem::exists(dir.path() + "/INBOX.test.000002.pack"));
+    for (uint64_t uid = 1; uid <= 20; uid++) {
+        EXPECT_EQ(extract(dir.path(), uid), message(uid)) << "UID " << uid;
+    }
+}
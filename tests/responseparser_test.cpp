@@ -0,0 +1,124 @@
+/**
+ * @file responseparser_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of ResponseParser class
+ */
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../src/responseparser.hpp"
+
+
+/**
+ * @brief Writes every event as one line
+ */
+class Recorder : public ResponseHandler {
+public:
+    std::vector<std::string> events;
+    std::string literal;
+
+    void response(std::string_view tag, unsigned long number, std::string_view keyword) override {
+        this->events.push_back("response " + std::string(tag) + " " + std::to_string(number) + " " + std::string(keyword));
+    }
+    void code(std::string_view name, std::string_view args) override {
+        this->events.push_back("code " + std::string(name) + " " + std::string(args));
+    }
+    void text(std::string_view text) override {
+        this->events.push_back("text " + std::string(text));
+    }
+    void fetchItem(std::string_view name, std::string_view value) override {
+        this->events.push_back("item " + std::string(name) + " " + std::string(value));
+    }
+    void literalBegin(std::string_view name, std::size_t size) override {
+        this->events.push_back("literal " + std::string(name) + " " + std::to_string(size));
+    }
+    void literalData(std::string_view data) override {
+        this->literal += data;
+    }
+    void literalEnd() override {
+        this->events.push_back("literal end");
+    }
+    void end() override {
+        this->events.push_back("end");
+    }
+};
+
+
+static void receive(InputBuffer &buff, const std::string &data) {
+    std::memcpy(buff.prepare(data.size()), data.data(), data.size());
+    buff.commit(data.size());
+}
+
+
+// feeds the data in parts of the given size and parses after each one
+static Recorder parse(const std::string &data, std::size_t part) {
+    Recorder recorder;
+    ResponseParser parser(recorder);
+    InputBuffer buff(16);
+
+    for (std::size_t i = 0; i < data.size(); i += part) {
+        receive(buff, data.substr(i, part));
+        while (parser.next(buff)) {
+        }
+    }
+    EXPECT_FALSE(parser.inResponse());
+    return recorder;
+}
+
+
+TEST(ResponseParser, StatusResponses) {
+    Recorder r = parse("* OK [UIDVALIDITY 777] ok\r\nA1 NO [ALERT] denied\r\n+ idling\r\n", 1000);
+
+    std::vector<std::string> expected{
+        "response * 0 OK", "code UIDVALIDITY 777", "text ok", "end",
+        "response A1 0 NO", "code ALERT ", "text denied", "end",
+        "response + 0 ", "text idling", "end",
+    };
+    EXPECT_EQ(r.events, expected);
+}
+
+
+TEST(ResponseParser, UntaggedData) {
+    Recorder r = parse("* 12 EXISTS\r\n* SEARCH 1 2 3\r\n", 1000);
+
+    std::vector<std::string> expected{
+        "response * 12 EXISTS", "text ", "end",
+        "response * 0 SEARCH", "text 1 2 3", "end",
+    };
+    EXPECT_EQ(r.events, expected);
+}
+
+
+TEST(ResponseParser, StreamsFetchLiteral) {
+    std::string message = "Subject: test\r\n\r\nbody with ) and {5}\r\n";
+    std::string data = "* 3 FETCH (UID 40 FLAGS (\\Seen $Junk) BODY[] {" + std::to_string(message.size()) + "}\r\n"
+                       + message + " RFC822.SIZE 55)\r\nA2 OK fetch\r\n";
+
+    std::vector<std::string> expected{
+        "response * 3 FETCH", "item UID 40", "item FLAGS (\\Seen $Junk)",
+        "literal BODY[] " + std::to_string(message.size()), "literal end", "item RFC822.SIZE 55", "end",
+        "response A2 0 OK", "text fetch", "end",
+    };
+
+    // the result does not depend on how the data arrives
+    for (std::size_t part : {1UL, 3UL, 7UL, data.size()}) {
+        Recorder r = parse(data, part);
+        EXPECT_EQ(r.events, expected) << "parts of " << part;
+        EXPECT_EQ(r.literal, message) << "parts of " << part;
+    }
+}
+
+
+TEST(ResponseParser, KeepsNestedLiteral) {
+    Recorder r = parse("* 1 FETCH (ENVELOPE (\"date\" {4}\r\nsubj NIL) UID 7)\r\n", 5);
+
+    std::vector<std::string> expected{
+        "response * 1 FETCH", "item ENVELOPE (\"date\" {4}\r\nsubj NIL)", "item UID 7", "end",
+    };
+    EXPECT_EQ(r.events, expected);
+}
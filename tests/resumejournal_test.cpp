@@ -0,0 +1,45 @@
+/**
+ * @file resumejournal_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of ResumeJournal class
+ */
+
+#include <filesystem>
+
+#include <gtest/gtest.h>
+
+#include "../src/resumejournal.hpp"
+#include "tempdir.hpp"
+
+
+TEST(ResumeJournal, KeepsLatestOffsets) {
+    TempDir dir;
+    {
+        ResumeJournal journal(dir.path());
+        journal.record(3, 1000, 5000);
+        journal.record(3, 2000, 5000);
+        journal.record(8, 64, 100);
+    }
+
+    ResumeJournal journal(dir.path());
+    auto entries = journal.entries();
+    ASSERT_EQ(entries.size(), 2UL);
+    EXPECT_EQ(entries[3].offset, 2000UL);
+    EXPECT_EQ(entries[3].size, 5000UL);
+    EXPECT_EQ(entries[8].offset, 64UL);
+}
+
+
+TEST(ResumeJournal, RemovesFileWhenEmpty) {
+    TempDir dir;
+    ResumeJournal journal(dir.path());
+    journal.record(1, 10, 20);
+    journal.record(2, 10, 20);
+    journal.remove(1);
+    EXPECT_EQ(ResumeJournal(dir.path()).entries().size(), 1UL);
+
+    journal.clear();
+    EXPECT_TRUE(ResumeJournal(dir.path()).entries().empty());
+    EXPECT_FALSE(std::filesystem::exists(dir.path() + "/.resume"));
+}
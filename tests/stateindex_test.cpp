@@ -0,0 +1,105 @@
+/**
+ * @file stateindex_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of StateIndex class
+ */
+
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "../src/stateindex.hpp"
+#include "tempdir.hpp"
+
+
+TEST(StateIndex, StartsEmpty) {
+    TempDir dir;
+    StateIndex index(dir.path());
+
+    EXPECT_EQ(index.uidvalidity(), 0UL);
+    EXPECT_EQ(index.highestModseq(), 0UL);
+    EXPECT_TRUE(index.uids().empty());
+}
+
+
+TEST(StateIndex, KeepsCheckpointedState) {
+    TempDir dir;
+    {
+        StateIndex index(dir.path());
+        index.reset(777);
+        index.add(1, 100);
+        index.add(2, 200);
+        index.add(5, 500, 4096);
+        index.setUidnext(6);
+        index.setHighestModseq(1234);
+    }
+
+    StateIndex index(dir.path());
+    EXPECT_EQ(index.uidvalidity(), 777UL);
+    EXPECT_EQ(index.uidnext(), 6UL);
+    EXPECT_EQ(index.highestModseq(), 1234UL);
+    EXPECT_EQ(index.uids().toString(), "1:2,5");
+}
+
+
+TEST(StateIndex, GrowsBeyondCapacity) {
+    TempDir dir;
+    {
+        StateIndex index(dir.path());
+        index.reset(1);
+        for (uint64_t uid = 1; uid <= 3 * STATE_INDEX_CAPACITY; uid++) {
+            index.add(uid, uid);
+        }
+    }
+
+    StateIndex index(dir.path());
+    EXPECT_EQ(index.uids().count(), 3UL * STATE_INDEX_CAPACITY);
+}
+
+
+TEST(StateIndex, ResetDropsRecords) {
+    TempDir dir;
+    StateIndex index(dir.path());
+    index.reset(1);
+    index.add(1, 10);
+    index.checkpoint();
+    index.reset(2);
+
+    EXPECT_EQ(index.uidvalidity(), 2UL);
+    EXPECT_TRUE(index.uids().empty());
+}
+
+
+TEST(StateIndex, SkipsCheckpointWhenSyncFails) {
+    TempDir dir;
+    int syncs = 0;
+    {
+        StateIndex index(dir.path());
+        index.reset(1);
+        index.setSync([&syncs]() { return ++syncs == 1; });
+        index.add(1, 10);
+        index.checkpoint();
+        index.add(2, 20);
+        index.checkpoint();
+        EXPECT_EQ(index.uids().toString(), "1:2");
+    }
+
+    // the record of the message which was not flushed is lost like after a crash
+    StateIndex index(dir.path());
+    EXPECT_GE(syncs, 2);
+    EXPECT_EQ(index.uids().toString(), "1");
+}
+
+
+TEST(StateIndex, ImportsOldStateFiles) {
+    TempDir dir;
+    std::ofstream(dir.path() + "/.uidvalidity") << "42\n";
+    std::ofstream(dir.path() + "/.uidnext") << "17\n";
+    std::ofstream(dir.path() + "/.highestmodseq") << "99\n";
+
+    StateIndex index(dir.path());
+    EXPECT_EQ(index.uidvalidity(), 42UL);
+    EXPECT_EQ(index.uidnext(), 17UL);
+    EXPECT_EQ(index.highestModseq(), 99UL);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file tempdir.hpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Temporary output directory of the tests
+ */
+
+#ifndef TEMPDIR_HPP
+#define TEMPDIR_HPP
+
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+
+/**
+ * @brief Directory created for one test and removed with its content afterwards
+ */
+class TempDir {
+public:
+    TempDir() {
+        std::string pattern = (std::filesystem::temp_directory_path() / "imapcl-test-XXXXXX").string();
+        if (mkdtemp(pattern.data()) == nullptr) {
+            throw std::runtime_error("Cannot create temporary directory.");
+        }
+        this->dir = pattern;
+    }
+
+    ~TempDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(this->dir, ec);
+    }
+
+    TempDir(const TempDir &) = delete;
+    TempDir &operator=(const TempDir &) = delete;
+
+    const std::string &path() const { return this->dir; }
+
+private:
+    std::string dir;
+};
+
+#endif
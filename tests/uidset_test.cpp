@@ -0,0 +1,72 @@
+/**
+ * @file uidset_test.cpp
+ * @author Vojtěch Adámek
+ *
+ * @brief Tests of UidSet class
+ */
+
+#include <gtest/gtest.h>
+
+#include "../src/uidset.hpp"
+
+
+TEST(UidSet, MergesAdjacentAndOverlapping) {
+    UidSet set;
+    set.add(5);
+    set.add(1, 3);
+    set.add(4);
+    set.add(10, 12);
+    set.add(7, 11);
+
+    EXPECT_EQ(set.toString(), "1:5,7:12");
+    EXPECT_EQ(set.count(), 11UL);
+    EXPECT_EQ(set.front(), 1UL);
+    EXPECT_EQ(set.back(), 12UL);
+}
+
+
+TEST(UidSet, ParsesSequenceSets) {
+    UidSet set;
+    set.add("3:1,7,x,9:*,10:12");
+
+    EXPECT_EQ(set.toString(), "1:3,7,10:12");
+    EXPECT_TRUE(set.contains(2));
+    EXPECT_FALSE(set.contains(8));
+    EXPECT_FALSE(set.contains(13));
+}
+
+
+TEST(UidSet, RemovesSingleUids) {
+    UidSet set;
+    set.add(1, 10);
+    set.remove(1);
+    set.remove(5);
+    set.remove(10);
+    set.remove(20);
+
+    EXPECT_EQ(set.toString(), "2:4,6:9");
+}
+
+
+TEST(UidSet, RemovesOtherSet) {
+    UidSet set;
+    set.add("1:10,20:30,40");
+    UidSet other;
+    other.add("3:4,9:21,25,40:50");
+    set.remove(other);
+
+    EXPECT_EQ(set.toString(), "1:2,5:8,22:24,26:30");
+}
+
+
+TEST(UidSet, SplitsIntoBatches) {
+    UidSet set;
+    set.add(1, 5);
+    set.add(8);
+    set.add(10, 14);
+
+    std::vector<std::string> expected{"1:4", "5,8,10:11", "12:14"};
+    EXPECT_EQ(set.batches(4), expected);
+    EXPECT_EQ(set.batches(0), std::vector<std::string>{"1:5,8,10:14"});
+    EXPECT_TRUE(UidSet().batches(4).empty());
+}